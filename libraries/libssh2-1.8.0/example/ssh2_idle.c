@@ -0,0 +1,241 @@
+/*
+ * Sample showing how much memory libssh2 keeps for sessions that sit idle,
+ * as when a program pools authenticated connections for later use.
+ *
+ * Every session gets counting allocation callbacks; each one is set up,
+ * authenticated and has a command run on it, and is then left alone. The
+ * bytes libssh2 still holds are reported, along with how the first
+ * session's packet buffer pool did. Allocations made inside the
+ * crypto backend (cipher and hash contexts and such) don't go through
+ * these callbacks and aren't included.
+ *
+ * Run it like this:
+ *
+ * $ ./ssh2_idle 127.0.0.1 user password 100
+ *
+ */
+
+#include "libssh2_config.h"
+#include <libssh2.h>
+
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+# ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <stdio.h>
+
+/* each block is prefixed with its size, padded to keep the rest aligned */
+union block_header {
+    size_t size;
+    double align_d;
+    void *align_p;
+};
+
+static size_t bytes_live;   /* bytes currently allocated */
+static size_t bytes_peak;   /* most ever allocated at once */
+
+static void *count_alloc(size_t count, void **abstract)
+{
+    union block_header *h = malloc(sizeof(*h) + count);
+    (void)abstract;
+
+    if (!h)
+        return NULL;
+    h->size = count;
+    bytes_live += count;
+    if (bytes_live > bytes_peak)
+        bytes_peak = bytes_live;
+    return h + 1;
+}
+
+static void count_free(void *ptr, void **abstract)
+{
+    union block_header *h;
+    (void)abstract;
+
+    if (!ptr)
+        return;
+    h = (union block_header *)ptr - 1;
+    bytes_live -= h->size;
+    free(h);
+}
+
+static void *count_realloc(void *ptr, size_t count, void **abstract)
+{
+    union block_header *h;
+    size_t old;
+
+    if (!ptr)
+        return count_alloc(count, abstract);
+    h = (union block_header *)ptr - 1;
+    old = h->size;
+    h = realloc(h, sizeof(*h) + count);
+    if (!h)
+        return NULL;
+    h->size = count;
+    bytes_live = bytes_live - old + count;
+    if (bytes_live > bytes_peak)
+        bytes_peak = bytes_live;
+    return h + 1;
+}
+
+static int run_command(LIBSSH2_SESSION *session, const char *commandline)
+{
+    LIBSSH2_CHANNEL *channel;
+    char buffer[0x4000];
+    ssize_t rc;
+
+    channel = libssh2_channel_open_session(session);
+    if (!channel)
+        return -1;
+    if (libssh2_channel_exec(channel, commandline)) {
+        libssh2_channel_free(channel);
+        return -1;
+    }
+    do {
+        rc = libssh2_channel_read(channel, buffer, sizeof(buffer));
+    } while (rc > 0);
+    libssh2_channel_close(channel);
+    libssh2_channel_free(channel);
+    return (int)rc;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *hostname = "127.0.0.1";
+    const char *commandline = "uptime";
+    const char *username    = "user";
+    const char *password    = "password";
+    int count = 10;
+    unsigned long hostaddr;
+    struct sockaddr_in sin;
+    LIBSSH2_SESSION **sessions;
+    int *socks;
+    size_t before;
+    unsigned long pool_allocs;
+    unsigned long pool_reused;
+    size_t pool_peak;
+    int rc;
+    int i;
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int err;
+
+    err = WSAStartup(MAKEWORD(2,0), &wsadata);
+    if (err != 0) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+        return 1;
+    }
+#endif
+
+    if (argc > 1)
+        /* must be ip address only */
+        hostname = argv[1];
+
+    if (argc > 2) {
+        username = argv[2];
+    }
+    if (argc > 3) {
+        password = argv[3];
+    }
+    if (argc > 4) {
+        count = atoi(argv[4]);
+        if (count < 1)
+            count = 1;
+    }
+
+    rc = libssh2_init (0);
+    if (rc != 0) {
+        fprintf (stderr, "libssh2 initialization failed (%d)\n", rc);
+        return 1;
+    }
+
+    hostaddr = inet_addr(hostname);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(22);
+    sin.sin_addr.s_addr = hostaddr;
+
+    sessions = calloc(count, sizeof(*sessions));
+    socks = calloc(count, sizeof(*socks));
+    if (!sessions || !socks) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(socks[i], (struct sockaddr*)(&sin),
+                    sizeof(struct sockaddr_in)) != 0) {
+            fprintf(stderr, "failed to connect!\n");
+            return 1;
+        }
+
+        sessions[i] = libssh2_session_init_ex(count_alloc, count_free,
+                                              count_realloc, NULL);
+        if (!sessions[i])
+            return 1;
+
+        before = bytes_live;
+        if (libssh2_session_handshake(sessions[i], socks[i])) {
+            fprintf(stderr, "Failure establishing SSH session\n");
+            return 1;
+        }
+        if (i == 0)
+            printf("after handshake:      %lu bytes\n",
+                   (unsigned long)(bytes_live - before));
+
+        if (libssh2_userauth_password(sessions[i], username, password)) {
+            fprintf(stderr, "Authentication by password failed.\n");
+            return 1;
+        }
+        if (run_command(sessions[i], commandline) < 0) {
+            fprintf(stderr, "Failed to run the command\n");
+            return 1;
+        }
+        if (i == 0) {
+            libssh2_session_packet_pool_stats(sessions[i], &pool_allocs,
+                                              &pool_reused, NULL, &pool_peak);
+            printf("packet pool:          %lu of %lu buffers reused, "
+                   "%lu bytes held at most\n", pool_reused, pool_allocs,
+                   (unsigned long)pool_peak);
+        }
+    }
+
+    printf("%d idle sessions:     %lu bytes, %lu per session\n", count,
+           (unsigned long)bytes_live, (unsigned long)(bytes_live / count));
+    printf("peak while working:   %lu bytes\n", (unsigned long)bytes_peak);
+
+    for (i = 0; i < count; i++) {
+        libssh2_session_disconnect(sessions[i], "Normal Shutdown");
+        libssh2_session_free(sessions[i]);
+#ifdef WIN32
+        closesocket(socks[i]);
+#else
+        close(socks[i]);
+#endif
+    }
+    free(sessions);
+    free(socks);
+
+    printf("after freeing:        %lu bytes\n", (unsigned long)bytes_live);
+
+    libssh2_exit();
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Sample comparing the throughput of the MAC algorithms: the same amount of
+ * data is downloaded once per MAC, each time over a new session that only
+ * offers that MAC. The cipher is pinned to aes128-ctr so that the MAC is
+ * the only thing changing between runs; a MAC the server doesn't support
+ * is reported and skipped.
+ *
+ * Besides the elapsed time, the CPU time this program spent is reported:
+ * it is what the client side costs, however fast or slow the server is at
+ * producing the MACs.
+ *
+ * The data is produced with "head -c" on the server, so it needs a
+ * POSIX shell there. Run it like this:
+ *
+ * $ ./ssh2_macbench 127.0.0.1 user password 64
+ *
+ * to move 64 MiB per MAC.
+ */
+
+#include "libssh2_config.h"
+#include <libssh2.h>
+
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+# ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <stdio.h>
+#include <time.h>
+
+static const char *macs[] = {
+    "hmac-sha2-256",
+    "hmac-sha2-256-etm@openssh.com",
+    "umac-64@openssh.com",
+    "umac-64-etm@openssh.com",
+    "umac-128@openssh.com",
+    "umac-128-etm@openssh.com",
+    NULL
+};
+
+#ifdef HAVE_GETTIMEOFDAY
+static long tvdiff(struct timeval newer, struct timeval older)
+{
+  return (newer.tv_sec-older.tv_sec)*1000+
+      (newer.tv_usec-older.tv_usec)/1000;
+}
+#endif
+
+/* Downloads size bytes with only the given MAC offered; returns the bytes
+   received, or -1 when the session could not be set up */
+static long download(struct sockaddr_in *sin, const char *mac,
+                     const char *username, const char *password,
+                     long size)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    char commandline[64];
+    char buffer[0x8000];
+    long total = 0;
+    ssize_t rc;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*)sin,
+                sizeof(struct sockaddr_in)) != 0) {
+        fprintf(stderr, "failed to connect!\n");
+        return -1;
+    }
+
+    session = libssh2_session_init();
+    if (!session)
+        return -1;
+
+    libssh2_session_method_pref(session, LIBSSH2_METHOD_CRYPT_CS,
+                                "aes128-ctr");
+    libssh2_session_method_pref(session, LIBSSH2_METHOD_CRYPT_SC,
+                                "aes128-ctr");
+    if (libssh2_session_method_pref(session, LIBSSH2_METHOD_MAC_CS, mac) ||
+        libssh2_session_method_pref(session, LIBSSH2_METHOD_MAC_SC, mac) ||
+        libssh2_session_handshake(session, sock)) {
+        total = -1;
+        goto shutdown;
+    }
+
+    if (libssh2_userauth_password(session, username, password)) {
+        fprintf(stderr, "Authentication by password failed.\n");
+        total = -1;
+        goto shutdown;
+    }
+
+    channel = libssh2_channel_open_session(session);
+    if (!channel) {
+        total = -1;
+        goto shutdown;
+    }
+    snprintf(commandline, sizeof(commandline), "head -c %ld /dev/zero",
+             size);
+    if (libssh2_channel_exec(channel, commandline) == 0) {
+        while ((rc = libssh2_channel_read(channel, buffer,
+                                          sizeof(buffer))) > 0)
+            total += (long)rc;
+    }
+    libssh2_channel_close(channel);
+    libssh2_channel_free(channel);
+
+shutdown:
+    libssh2_session_disconnect(session, "Normal Shutdown");
+    libssh2_session_free(session);
+#ifdef WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *hostname = "127.0.0.1";
+    const char *username    = "user";
+    const char *password    = "password";
+    long size = 64L * 1024 * 1024;
+    unsigned long hostaddr;
+    struct sockaddr_in sin;
+    long total;
+    clock_t cpu_start;
+    double cpu_seconds;
+    int rc;
+    int i;
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval start;
+    struct timeval end;
+    long time_ms;
+#endif
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int err;
+
+    err = WSAStartup(MAKEWORD(2,0), &wsadata);
+    if (err != 0) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+        return 1;
+    }
+#endif
+
+    if (argc > 1)
+        /* must be ip address only */
+        hostname = argv[1];
+
+    if (argc > 2) {
+        username = argv[2];
+    }
+    if (argc > 3) {
+        password = argv[3];
+    }
+    if (argc > 4) {
+        size = atol(argv[4]) * 1024 * 1024;
+        if (size < 1)
+            size = 1024 * 1024;
+    }
+
+    rc = libssh2_init (0);
+    if (rc != 0) {
+        fprintf (stderr, "libssh2 initialization failed (%d)\n", rc);
+        return 1;
+    }
+
+    hostaddr = inet_addr(hostname);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(22);
+    sin.sin_addr.s_addr = hostaddr;
+
+    for (i = 0; macs[i]; i++) {
+#ifdef HAVE_GETTIMEOFDAY
+        gettimeofday(&start, NULL);
+#endif
+        cpu_start = clock();
+        total = download(&sin, macs[i], username, password, size);
+        if (total < 0) {
+            printf("%-30s not supported\n", macs[i]);
+            continue;
+        }
+        cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+        if (cpu_seconds <= 0)
+            cpu_seconds = 1.0 / CLOCKS_PER_SEC;
+#ifdef HAVE_GETTIMEOFDAY
+        gettimeofday(&end, NULL);
+        time_ms = tvdiff(end, start);
+        if (time_ms < 1)
+            time_ms = 1;
+        printf("%-30s %ld bytes in %ld ms = %.1f MiB/sec", macs[i],
+               total, time_ms, total / (time_ms / 1000.0) / (1024 * 1024));
+#else
+        printf("%-30s %ld bytes", macs[i], total);
+#endif
+        printf(", client CPU %.2f s = %.1f MiB/sec\n", cpu_seconds,
+               total / cpu_seconds / (1024 * 1024));
+    }
+
+    libssh2_exit();
+
+    return 0;
+}
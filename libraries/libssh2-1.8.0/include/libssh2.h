@@ -408,6 +408,10 @@ typedef struct _LIBSSH2_POLLFD {
 #define LIBSSH2_HOSTKEY_TYPE_UNKNOWN			    0
 #define LIBSSH2_HOSTKEY_TYPE_RSA			    1
 #define LIBSSH2_HOSTKEY_TYPE_DSS			    2
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_256			    3
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_384			    4
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_521			    5
+#define LIBSSH2_HOSTKEY_TYPE_ED25519			    6
 
 /* Disconnect Codes (defined by SSH protocol) */
 #define SSH_DISCONNECT_HOST_NOT_ALLOWED_TO_CONNECT          1
@@ -585,6 +589,12 @@ LIBSSH2_API int libssh2_session_block_directions(LIBSSH2_SESSION *session);
 LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag,
                                      int value);
 LIBSSH2_API const char *libssh2_session_banner_get(LIBSSH2_SESSION *session);
+LIBSSH2_API void libssh2_session_packet_pool_stats(LIBSSH2_SESSION *session,
+                                                   unsigned long *allocs,
+                                                   unsigned long *reused,
+                                                   unsigned long *dropped,
+                                                   size_t *peak);
+LIBSSH2_API void libssh2_session_packet_pool_clear(LIBSSH2_SESSION *session);
 
 /* Userauth API */
 LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session,
@@ -56,34 +56,67 @@
 /*
  *  _libssh2_channel_nextid
  *
- * Determine the next channel ID we can use at our end
+ * Determine the next channel ID we can use at our end and make sure the
+ * channel table has a slot for it. IDs given back with reuse allowed are
+ * handed out again before new ones are minted, so the table stays as small
+ * as the largest number of channels open at once.
+ *
+ * Returns 0 and stores the ID in *id, or LIBSSH2_ERROR_ALLOC.
  */
-uint32_t
-_libssh2_channel_nextid(LIBSSH2_SESSION * session)
+int
+_libssh2_channel_nextid(LIBSSH2_SESSION * session, uint32_t *id)
 {
-    uint32_t id = session->next_channel;
-    LIBSSH2_CHANNEL *channel;
-
-    channel = _libssh2_list_first(&session->channels);
-
-    while (channel) {
-        if (channel->local.id > id) {
-            id = channel->local.id;
+    if (session->channel_free_count) {
+        *id = session->channel_free_ids[--session->channel_free_count];
+    }
+    else {
+        if (session->next_channel == session->channel_slots_size) {
+            uint32_t size = session->channel_slots_size ?
+                session->channel_slots_size * 2 : 8;
+            LIBSSH2_CHANNEL **slots;
+            uint32_t *free_ids;
+
+            slots = LIBSSH2_REALLOC(session, session->channel_slots,
+                                    size * sizeof(*slots));
+            if (!slots)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to grow the channel table");
+            session->channel_slots = slots;
+
+            free_ids = LIBSSH2_REALLOC(session, session->channel_free_ids,
+                                       size * sizeof(*free_ids));
+            if (!free_ids)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to grow the channel table");
+            session->channel_free_ids = free_ids;
+
+            memset(slots + session->channel_slots_size, 0,
+                   (size - session->channel_slots_size) * sizeof(*slots));
+            session->channel_slots_size = size;
         }
-        channel = _libssh2_list_next(&channel->node);
+        *id = session->next_channel++;
     }
 
-    /* This is a shortcut to avoid waiting for close packets on channels we've
-     * forgotten about, This *could* be a problem if we request and close 4
-     * billion or so channels in too rapid succession for the remote end to
-     * respond, but the worst case scenario is that some data meant for
-     * another channel Gets picked up by the new one.... Pretty unlikely all
-     * told...
-     */
-    session->next_channel = id + 1;
     _libssh2_debug(session, LIBSSH2_TRACE_CONN, "Allocated new channel ID#%lu",
-                   id);
-    return id;
+                   *id);
+    return 0;
+}
+
+/*
+ *  _libssh2_channel_releaseid
+ *
+ * Drop a local channel ID from the channel table. Only pass reuse when the
+ * remote end can no longer send anything addressed to it: the open was
+ * never sent or was refused, or its SSH_MSG_CHANNEL_CLOSE has arrived.
+ * Otherwise the ID is retired, so that late packets meant for the old
+ * channel can't be picked up by a new one.
+ */
+void
+_libssh2_channel_releaseid(LIBSSH2_SESSION * session, uint32_t id, int reuse)
+{
+    session->channel_slots[id] = NULL;
+    if (reuse)
+        session->channel_free_ids[session->channel_free_count++] = id;
 }
 
 /*
@@ -94,32 +127,30 @@ _libssh2_channel_nextid(LIBSSH2_SESSION * session)
 LIBSSH2_CHANNEL *
 _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
 {
-    LIBSSH2_CHANNEL *channel;
-    LIBSSH2_LISTENER *l;
-
-    for(channel = _libssh2_list_first(&session->channels);
-        channel;
-        channel = _libssh2_list_next(&channel->node)) {
-        if (channel->local.id == channel_id)
-            return channel;
-    }
-
-    /* We didn't find the channel in the session, let's then check its
-       listeners since each listener may have its own set of pending channels
-    */
-    for(l = _libssh2_list_first(&session->listeners); l;
-        l = _libssh2_list_next(&l->node)) {
-        for(channel = _libssh2_list_first(&l->queue);
-            channel;
-            channel = _libssh2_list_next(&channel->node)) {
-            if (channel->local.id == channel_id)
-                return channel;
-        }
-    }
+    if (channel_id < session->channel_slots_size)
+        return session->channel_slots[channel_id];
 
     return NULL;
 }
 
+/*
+ * channel_free_packets
+ *
+ * Discard the data packets still queued on a channel
+ */
+static void
+channel_free_packets(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_PACKET *packet;
+
+    while ((packet = _libssh2_list_first(&channel->data_queue)) ||
+           (packet = _libssh2_list_first(&channel->ext_data_queue))) {
+        _libssh2_list_remove(&packet->node);
+        _libssh2_packet_free(session, packet);
+    }
+}
+
 /*
  * _libssh2_channel_open
  *
@@ -140,6 +171,7 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
     };
     unsigned char *s;
     int rc;
+    int refused = 0;
 
     if (session->open_state == libssh2_NB_state_idle) {
         session->open_channel = NULL;
@@ -148,7 +180,8 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         /* 17 = packet_type(1) + channel_type_len(4) + sender_channel(4) +
          * window_size(4) + packet_size(4) */
         session->open_packet_len = channel_type_len + 17;
-        session->open_local_channel = _libssh2_channel_nextid(session);
+        if (_libssh2_channel_nextid(session, &session->open_local_channel))
+            return NULL;
 
         /* Zero the whole thing out */
         memset(&session->open_packet_requirev_state, 0,
@@ -162,6 +195,8 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         if (!session->open_channel) {
             _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                            "Unable to allocate space for channel data");
+            _libssh2_channel_releaseid(session, session->open_local_channel,
+                                       1);
             return NULL;
         }
         session->open_channel->channel_type_len = channel_type_len;
@@ -172,6 +207,8 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
                            "Failed allocating memory for channel type name");
             LIBSSH2_FREE(session, session->open_channel);
             session->open_channel = NULL;
+            _libssh2_channel_releaseid(session, session->open_local_channel,
+                                       1);
             return NULL;
         }
         memcpy(session->open_channel->channel_type, channel_type,
@@ -186,6 +223,8 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
 
         _libssh2_list_add(&session->channels,
                           &session->open_channel->node);
+        session->channel_slots[session->open_local_channel] =
+            session->open_channel;
 
         s = session->open_packet =
             LIBSSH2_ALLOC(session, session->open_packet_len);
@@ -267,6 +306,7 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
 
         if (session->open_data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE) {
             unsigned int reason_code = _libssh2_ntohu32(session->open_data + 5);
+            refused = 1;
             switch (reason_code) {
             case SSH_OPEN_ADMINISTRATIVELY_PROHIBITED:
                 _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
@@ -302,25 +342,18 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         session->open_packet = NULL;
     }
     if (session->open_channel) {
-        unsigned char channel_id[4];
         LIBSSH2_FREE(session, session->open_channel->channel_type);
 
         _libssh2_list_remove(&session->open_channel->node);
 
+        /* The ID can be used again if the server never heard of it or
+           refused it */
+        _libssh2_channel_releaseid(session, session->open_local_channel,
+                                   session->open_state ==
+                                   libssh2_NB_state_idle || refused);
+
         /* Clear out packets meant for this channel */
-        _libssh2_htonu32(channel_id, session->open_channel->local.id);
-        while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)
-               ||
-               (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)) {
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
-        }
+        channel_free_packets(session->open_channel);
 
         LIBSSH2_FREE(session, session->open_channel);
         session->open_channel = NULL;
@@ -770,6 +803,44 @@ libssh2_channel_forward_accept(LIBSSH2_LISTENER *listener)
 
 }
 
+/*
+ * channel_request_alloc
+ *
+ * Get the scratch space for a channel request about to be started or
+ * continued
+ */
+static int
+channel_request_alloc(LIBSSH2_CHANNEL *channel,
+                      struct channel_request_data **req)
+{
+    if (!*req) {
+        *req = LIBSSH2_CALLOC(channel->session,
+                              sizeof(struct channel_request_data));
+        if (!*req)
+            return _libssh2_error(channel->session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "channel request");
+    }
+    return 0;
+}
+
+/*
+ * channel_request_free
+ *
+ * Let go of a channel request's scratch space once it is done with
+ */
+static void
+channel_request_free(LIBSSH2_CHANNEL *channel,
+                     struct channel_request_data **req)
+{
+    if (*req) {
+        if ((*req)->packet)
+            LIBSSH2_FREE(channel->session, (*req)->packet);
+        LIBSSH2_FREE(channel->session, *req);
+        *req = NULL;
+    }
+}
+
 /*
  * channel_setenv
  *
@@ -789,20 +860,20 @@ static int channel_setenv(LIBSSH2_CHANNEL *channel,
     if (channel->setenv_state == libssh2_NB_state_idle) {
         /* 21 = packet_type(1) + channel_id(4) + request_len(4) +
          * request(3)"env" + want_reply(1) + varname_len(4) + value_len(4) */
-        channel->setenv_packet_len = varname_len + value_len + 21;
+        channel->setenv->packet_len = varname_len + value_len + 21;
 
         /* Zero the whole thing out */
-        memset(&channel->setenv_packet_requirev_state, 0,
-               sizeof(channel->setenv_packet_requirev_state));
+        memset(&channel->setenv->packet_requirev_state, 0,
+               sizeof(channel->setenv->packet_requirev_state));
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "Setting remote environment variable: %s=%s on "
                        "channel %lu/%lu",
                        varname, value, channel->local.id, channel->remote.id);
 
-        s = channel->setenv_packet =
-            LIBSSH2_ALLOC(session, channel->setenv_packet_len);
-        if (!channel->setenv_packet) {
+        s = channel->setenv->packet =
+            LIBSSH2_ALLOC(session, channel->setenv->packet_len);
+        if (!channel->setenv->packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                   "Unable to allocate memory "
                                   "for setenv packet");
@@ -820,34 +891,33 @@ static int channel_setenv(LIBSSH2_CHANNEL *channel,
 
     if (channel->setenv_state == libssh2_NB_state_created) {
         rc = _libssh2_transport_send(session,
-                                     channel->setenv_packet,
-                                     channel->setenv_packet_len,
+                                     channel->setenv->packet,
+                                     channel->setenv->packet_len,
                                      NULL, 0);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
                            "Would block sending setenv request");
             return rc;
         } else if (rc) {
-            LIBSSH2_FREE(session, channel->setenv_packet);
-            channel->setenv_packet = NULL;
+            LIBSSH2_FREE(session, channel->setenv->packet);
+            channel->setenv->packet = NULL;
             channel->setenv_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                   "Unable to send channel-request packet for "
                                   "setenv request");
         }
-        LIBSSH2_FREE(session, channel->setenv_packet);
-        channel->setenv_packet = NULL;
+        LIBSSH2_FREE(session, channel->setenv->packet);
+        channel->setenv->packet = NULL;
 
-        _libssh2_htonu32(channel->setenv_local_channel, channel->local.id);
+        _libssh2_htonu32(channel->setenv->local_channel, channel->local.id);
 
         channel->setenv_state = libssh2_NB_state_sent;
     }
 
     if (channel->setenv_state == libssh2_NB_state_sent) {
         rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
-                                      1, channel->setenv_local_channel, 4,
-                                      &channel->
-                                      setenv_packet_requirev_state);
+                                      1, channel->setenv->local_channel, 4,
+                                      &channel->setenv->packet_requirev_state);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         }
@@ -885,9 +955,16 @@ libssh2_channel_setenv_ex(LIBSSH2_CHANNEL *channel,
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
+    rc = channel_request_alloc(channel, &channel->setenv);
+    if (rc)
+        return rc;
+
     BLOCK_ADJUST(rc, channel->session,
                  channel_setenv(channel, varname, varname_len,
                                 value, value_len));
+
+    if (channel->setenv_state == libssh2_NB_state_idle)
+        channel_request_free(channel, &channel->setenv);
     return rc;
 }
 
@@ -916,17 +993,22 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
                                   "term + mode lengths too large");
         }
 
-        channel->reqPTY_packet_len = term_len + modes_len + 41;
+        channel->reqPTY->packet_len = term_len + modes_len + 41;
 
         /* Zero the whole thing out */
-        memset(&channel->reqPTY_packet_requirev_state, 0,
-               sizeof(channel->reqPTY_packet_requirev_state));
+        memset(&channel->reqPTY->packet_requirev_state, 0,
+               sizeof(channel->reqPTY->packet_requirev_state));
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "Allocating tty on channel %lu/%lu", channel->local.id,
                        channel->remote.id);
 
-        s = channel->reqPTY_packet;
+        s = channel->reqPTY->packet =
+            LIBSSH2_ALLOC(session, channel->reqPTY->packet_len);
+        if (!channel->reqPTY->packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for pty-request");
+        }
 
         *(s++) = SSH_MSG_CHANNEL_REQUEST;
         _libssh2_store_u32(&s, channel->remote.id);
@@ -945,8 +1027,8 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
     }
 
     if (channel->reqPTY_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session, channel->reqPTY_packet,
-                                     channel->reqPTY_packet_len,
+        rc = _libssh2_transport_send(session, channel->reqPTY->packet,
+                                     channel->reqPTY->packet_len,
                                      NULL, 0);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
@@ -957,7 +1039,7 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
             return _libssh2_error(session, rc,
                                   "Unable to send pty-request packet");
         }
-        _libssh2_htonu32(channel->reqPTY_local_channel, channel->local.id);
+        _libssh2_htonu32(channel->reqPTY->local_channel, channel->local.id);
 
         channel->reqPTY_state = libssh2_NB_state_sent;
     }
@@ -967,8 +1049,8 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
         size_t data_len;
         unsigned char code;
         rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
-                                      1, channel->reqPTY_local_channel, 4,
-                                      &channel->reqPTY_packet_requirev_state);
+                                      1, channel->reqPTY->local_channel, 4,
+                                      &channel->reqPTY->packet_requirev_state);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         } else if (rc) {
@@ -1005,10 +1087,17 @@ libssh2_channel_request_pty_ex(LIBSSH2_CHANNEL *channel, const char *term,
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
+    rc = channel_request_alloc(channel, &channel->reqPTY);
+    if (rc)
+        return rc;
+
     BLOCK_ADJUST(rc, channel->session,
                  channel_request_pty(channel, term, term_len, modes,
                                      modes_len, width, height,
                                      width_px, height_px));
+
+    if (channel->reqPTY_state == libssh2_NB_state_idle)
+        channel_request_free(channel, &channel->reqPTY);
     return rc;
 }
 
@@ -1022,18 +1111,24 @@ channel_request_pty_size(LIBSSH2_CHANNEL * channel, int width,
     int retcode = LIBSSH2_ERROR_PROTO;
 
     if (channel->reqPTY_state == libssh2_NB_state_idle) {
-        channel->reqPTY_packet_len = 39;
+        channel->reqPTY->packet_len = 39;
 
         /* Zero the whole thing out */
-        memset(&channel->reqPTY_packet_requirev_state, 0,
-               sizeof(channel->reqPTY_packet_requirev_state));
+        memset(&channel->reqPTY->packet_requirev_state, 0,
+               sizeof(channel->reqPTY->packet_requirev_state));
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
             "changing tty size on channel %lu/%lu",
             channel->local.id,
             channel->remote.id);
 
-        s = channel->reqPTY_packet;
+        s = channel->reqPTY->packet =
+            LIBSSH2_ALLOC(session, channel->reqPTY->packet_len);
+        if (!channel->reqPTY->packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "window-change request");
+        }
 
         *(s++) = SSH_MSG_CHANNEL_REQUEST;
         _libssh2_store_u32(&s, channel->remote.id);
@@ -1049,8 +1144,8 @@ channel_request_pty_size(LIBSSH2_CHANNEL * channel, int width,
     }
 
     if (channel->reqPTY_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session, channel->reqPTY_packet,
-                                     channel->reqPTY_packet_len,
+        rc = _libssh2_transport_send(session, channel->reqPTY->packet,
+                                     channel->reqPTY->packet_len,
                                      NULL, 0);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
@@ -1061,7 +1156,7 @@ channel_request_pty_size(LIBSSH2_CHANNEL * channel, int width,
             return _libssh2_error(session, rc,
                                   "Unable to send window-change packet");
         }
-        _libssh2_htonu32(channel->reqPTY_local_channel, channel->local.id);
+        _libssh2_htonu32(channel->reqPTY->local_channel, channel->local.id);
         retcode = LIBSSH2_ERROR_NONE;
     }
 
@@ -1078,9 +1173,16 @@ libssh2_channel_request_pty_size_ex(LIBSSH2_CHANNEL *channel, int width,
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
+    rc = channel_request_alloc(channel, &channel->reqPTY);
+    if (rc)
+        return rc;
+
     BLOCK_ADJUST(rc, channel->session,
                  channel_request_pty_size(channel, width, height, width_px,
                                           height_px));
+
+    if (channel->reqPTY_state == libssh2_NB_state_idle)
+        channel_request_free(channel, &channel->reqPTY);
     return rc;
 }
 
@@ -1110,11 +1212,11 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
         /* 30 = packet_type(1) + channel(4) + x11_req_len(4) + "x11-req"(7) +
          * want_reply(1) + single_cnx(1) + proto_len(4) + cookie_len(4) +
          * screen_num(4) */
-        channel->reqX11_packet_len = proto_len + cookie_len + 30;
+        channel->reqX11->packet_len = proto_len + cookie_len + 30;
 
         /* Zero the whole thing out */
-        memset(&channel->reqX11_packet_requirev_state, 0,
-               sizeof(channel->reqX11_packet_requirev_state));
+        memset(&channel->reqX11->packet_requirev_state, 0,
+               sizeof(channel->reqX11->packet_requirev_state));
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "Requesting x11-req for channel %lu/%lu: single=%d "
@@ -1124,9 +1226,9 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
                        auth_proto ? auth_proto : "MIT-MAGIC-COOKIE-1",
                        auth_cookie ? auth_cookie : "<random>", screen_number);
 
-        s = channel->reqX11_packet =
-            LIBSSH2_ALLOC(session, channel->reqX11_packet_len);
-        if (!channel->reqX11_packet) {
+        s = channel->reqX11->packet =
+            LIBSSH2_ALLOC(session, channel->reqX11->packet_len);
+        if (!channel->reqX11->packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                   "Unable to allocate memory for pty-request");
         }
@@ -1164,8 +1266,8 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
     }
 
     if (channel->reqX11_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session, channel->reqX11_packet,
-                                     channel->reqX11_packet_len,
+        rc = _libssh2_transport_send(session, channel->reqX11->packet,
+                                     channel->reqX11->packet_len,
                                      NULL, 0);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
@@ -1173,16 +1275,16 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
             return rc;
         }
         if (rc) {
-            LIBSSH2_FREE(session, channel->reqX11_packet);
-            channel->reqX11_packet = NULL;
+            LIBSSH2_FREE(session, channel->reqX11->packet);
+            channel->reqX11->packet = NULL;
             channel->reqX11_state = libssh2_NB_state_idle;
             return _libssh2_error(session, rc,
                                   "Unable to send x11-req packet");
         }
-        LIBSSH2_FREE(session, channel->reqX11_packet);
-        channel->reqX11_packet = NULL;
+        LIBSSH2_FREE(session, channel->reqX11->packet);
+        channel->reqX11->packet = NULL;
 
-        _libssh2_htonu32(channel->reqX11_local_channel, channel->local.id);
+        _libssh2_htonu32(channel->reqX11->local_channel, channel->local.id);
 
         channel->reqX11_state = libssh2_NB_state_sent;
     }
@@ -1193,8 +1295,8 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
         unsigned char code;
 
         rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
-                                      1, channel->reqX11_local_channel, 4,
-                                      &channel->reqX11_packet_requirev_state);
+                                      1, channel->reqX11->local_channel, 4,
+                                      &channel->reqX11->packet_requirev_state);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         } else if (rc) {
@@ -1229,22 +1331,29 @@ libssh2_channel_x11_req_ex(LIBSSH2_CHANNEL *channel, int single_connection,
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
+    rc = channel_request_alloc(channel, &channel->reqX11);
+    if (rc)
+        return rc;
+
     BLOCK_ADJUST(rc, channel->session,
                  channel_x11_req(channel, single_connection, auth_proto,
                                  auth_cookie, screen_number));
+
+    if (channel->reqX11_state == libssh2_NB_state_idle)
+        channel_request_free(channel, &channel->reqX11);
     return rc;
 }
 
 
 /*
- * _libssh2_channel_process_startup
+ * channel_process_startup
  *
  * Primitive for libssh2_channel_(shell|exec|subsystem)
  */
-int
-_libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
-                                 const char *request, size_t request_len,
-                                 const char *message, size_t message_len)
+static int
+channel_process_startup(LIBSSH2_CHANNEL *channel,
+                        const char *request, size_t request_len,
+                        const char *message, size_t message_len)
 {
     LIBSSH2_SESSION *session = channel->session;
     unsigned char *s;
@@ -1259,22 +1368,22 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
 
     if (channel->process_state == libssh2_NB_state_idle) {
         /* 10 = packet_type(1) + channel(4) + request_len(4) + want_reply(1) */
-        channel->process_packet_len = request_len + 10;
+        channel->process->packet_len = request_len + 10;
 
         /* Zero the whole thing out */
-        memset(&channel->process_packet_requirev_state, 0,
-               sizeof(channel->process_packet_requirev_state));
+        memset(&channel->process->packet_requirev_state, 0,
+               sizeof(channel->process->packet_requirev_state));
 
         if (message)
-            channel->process_packet_len += + 4;
+            channel->process->packet_len += + 4;
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "starting request(%s) on channel %lu/%lu, message=%s",
                        request, channel->local.id, channel->remote.id,
                        message?message:"<null>");
-        s = channel->process_packet =
-            LIBSSH2_ALLOC(session, channel->process_packet_len);
-        if (!channel->process_packet)
+        s = channel->process->packet =
+            LIBSSH2_ALLOC(session, channel->process->packet_len);
+        if (!channel->process->packet)
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                   "Unable to allocate memory "
                                   "for channel-process request");
@@ -1292,8 +1401,8 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
 
     if (channel->process_state == libssh2_NB_state_created) {
         rc = _libssh2_transport_send(session,
-                                     channel->process_packet,
-                                     channel->process_packet_len,
+                                     channel->process->packet,
+                                     channel->process->packet_len,
                                      (unsigned char *)message, message_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
@@ -1301,16 +1410,16 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
             return rc;
         }
         else if (rc) {
-            LIBSSH2_FREE(session, channel->process_packet);
-            channel->process_packet = NULL;
+            LIBSSH2_FREE(session, channel->process->packet);
+            channel->process->packet = NULL;
             channel->process_state = libssh2_NB_state_end;
             return _libssh2_error(session, rc,
                                   "Unable to send channel request");
         }
-        LIBSSH2_FREE(session, channel->process_packet);
-        channel->process_packet = NULL;
+        LIBSSH2_FREE(session, channel->process->packet);
+        channel->process->packet = NULL;
 
-        _libssh2_htonu32(channel->process_local_channel, channel->local.id);
+        _libssh2_htonu32(channel->process->local_channel, channel->local.id);
 
         channel->process_state = libssh2_NB_state_sent;
     }
@@ -1320,8 +1429,9 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
         size_t data_len;
         unsigned char code;
         rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
-                                      1, channel->process_local_channel, 4,
-                                      &channel->process_packet_requirev_state);
+                                      1, channel->process->local_channel, 4,
+                                      &channel->process->
+                                      packet_requirev_state);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         } else if (rc) {
@@ -1343,6 +1453,31 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
                           "channel-process-startup");
 }
 
+/*
+ * _libssh2_channel_process_startup
+ *
+ * Run channel_process_startup() with its scratch space allocated for as long
+ * as the request is in flight
+ */
+int
+_libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
+                                 const char *request, size_t request_len,
+                                 const char *message, size_t message_len)
+{
+    int rc = channel_request_alloc(channel, &channel->process);
+
+    if (rc)
+        return rc;
+
+    rc = channel_process_startup(channel, request, request_len,
+                                 message, message_len);
+
+    if (channel->process_state != libssh2_NB_state_created &&
+        channel->process_state != libssh2_NB_state_sent)
+        channel_request_free(channel, &channel->process);
+    return rc;
+}
+
 /*
  * libssh2_channel_process_startup
  *
@@ -1388,19 +1523,20 @@ int
 _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
 {
     if (channel->flush_state == libssh2_NB_state_idle) {
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
+        struct list_head *queues[2];
+        LIBSSH2_PACKET *packet;
+        int i;
+
+        queues[0] = &channel->data_queue;
+        queues[1] = &channel->ext_data_queue;
         channel->flush_refund_bytes = 0;
         channel->flush_flush_bytes = 0;
 
-        while (packet) {
-            LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
-            unsigned char packet_type = packet->data[0];
-
-            if (((packet_type == SSH_MSG_CHANNEL_DATA)
-                 || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-                && (_libssh2_ntohu32(packet->data + 1) == channel->local.id)) {
-                /* It's our channel at least */
+        for(i = 0; i < 2; i++) {
+            packet = _libssh2_list_first(queues[i]);
+            while (packet) {
+                LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+                unsigned char packet_type = packet->data[0];
                 long packet_stream_id =
                     (packet_type == SSH_MSG_CHANNEL_DATA) ? 0 :
                     _libssh2_ntohu32(packet->data + 5);
@@ -1422,14 +1558,12 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
                     channel->flush_refund_bytes += packet->data_len - 13;
                     channel->flush_flush_bytes += bytes_to_flush;
 
-                    LIBSSH2_FREE(channel->session, packet->data);
-
-                    /* remove this packet from the parent's list */
+                    /* remove this packet from the channel's queue */
                     _libssh2_list_remove(&packet->node);
-                    LIBSSH2_FREE(channel->session, packet);
+                    _libssh2_packet_free(channel->session, packet);
                 }
+                packet = next;
             }
-            packet = next;
         }
 
         channel->flush_state = libssh2_NB_state_created;
@@ -1695,6 +1829,41 @@ _libssh2_channel_extended_data(LIBSSH2_CHANNEL *channel, int ignore_mode)
                        channel->local.id, channel->remote.id, ignore_mode);
         channel->remote.extended_data_ignore_mode = (char)ignore_mode;
 
+        if (ignore_mode == LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE) {
+            /* from now on the extended data is read as part of the
+               standard stream, including what is already queued. The
+               two queues are merged in the order the packets arrived. */
+            struct list_head data_packets;
+            LIBSSH2_PACKET *data;
+            LIBSSH2_PACKET *ext;
+            LIBSSH2_PACKET *packet;
+
+            _libssh2_list_init(&data_packets);
+            while ((packet = _libssh2_list_first(&channel->data_queue))) {
+                _libssh2_list_remove(&packet->node);
+                _libssh2_list_add(&data_packets, &packet->node);
+            }
+
+            for (;;) {
+                data = _libssh2_list_first(&data_packets);
+                ext = _libssh2_list_first(&channel->ext_data_queue);
+
+                if (data && ext)
+                    /* sequence numbers wrap, compare the distance */
+                    packet = (int32_t)(ext->seqno - data->seqno) < 0 ?
+                        ext : data;
+                else if (data)
+                    packet = data;
+                else if (ext)
+                    packet = ext;
+                else
+                    break;
+
+                _libssh2_list_remove(&packet->node);
+                _libssh2_list_add(&channel->data_queue, &packet->node);
+            }
+        }
+
         channel->extData2_state = libssh2_NB_state_created;
     }
 
@@ -1806,7 +1975,10 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
         return _libssh2_error(session, rc, "transport read");
 
-    read_packet = _libssh2_list_first(&session->packets);
+    /* The standard stream's queue already holds the extended data too if
+       it is to be merged; the extended streams share the other queue */
+    read_packet = _libssh2_list_first(stream_id ? &channel->ext_data_queue :
+                                      &channel->data_queue);
     while (read_packet && (bytes_read < (int) buflen)) {
         /* previously this loop condition also checked for
            !channel->remote.close but we cannot let it do this:
@@ -1821,27 +1993,12 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
         /* In case packet gets destroyed during this iteration */
         read_next = _libssh2_list_next(&readpkt->node);
 
-        channel->read_local_id =
-            _libssh2_ntohu32(readpkt->data + 1);
-
         /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
+         * Either we asked for the standard stream, or for a specific
+         * extended data stream and this is one of its packets
          */
-        if ((stream_id
-             && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == channel->read_local_id)
-             && (stream_id == (int) _libssh2_ntohu32(readpkt->data + 5)))
-            || (!stream_id && (readpkt->data[0] == SSH_MSG_CHANNEL_DATA)
-                && (channel->local.id == channel->read_local_id))
-            || (!stream_id
-                && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                && (channel->local.id == channel->read_local_id)
-                && (channel->remote.extended_data_ignore_mode ==
-                    LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
+        if (!stream_id
+            || (stream_id == (int) _libssh2_ntohu32(readpkt->data + 5))) {
 
             /* figure out much more data we want to read */
             bytes_want = buflen - bytes_read;
@@ -1870,11 +2027,10 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
 
             /* if drained, remove from list */
             if (unlink_packet) {
-                /* detach readpkt from session->packets list */
+                /* detach readpkt from the channel's queue */
                 _libssh2_list_remove(&readpkt->node);
 
-                LIBSSH2_FREE(session, readpkt->data);
-                LIBSSH2_FREE(session, readpkt);
+                _libssh2_packet_free(session, readpkt);
             }
         }
 
@@ -1948,38 +2104,18 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
 size_t
 _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
 {
-    LIBSSH2_SESSION *session = channel->session;
     LIBSSH2_PACKET *read_packet;
-    uint32_t read_local_id;
 
-    read_packet = _libssh2_list_first(&session->packets);
-    if (read_packet == NULL)
-        return 0;
+    read_packet = _libssh2_list_first(stream_id ? &channel->ext_data_queue :
+                                      &channel->data_queue);
 
     while (read_packet) {
-        read_local_id = _libssh2_ntohu32(read_packet->data + 1);
-
         /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
+         * Either we asked for the standard stream, or for a specific
+         * extended data stream and this is one of its packets
          */
-        if ((stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (stream_id == (int) _libssh2_ntohu32(read_packet->data + 5)))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             && (channel->local.id == read_local_id))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (channel->remote.extended_data_ignore_mode
-                 == LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE)))
+        if (!stream_id
+            || (stream_id == (int) _libssh2_ntohu32(read_packet->data + 5)))
         {
             return (read_packet->data_len - read_packet->data_head);
         }
@@ -2208,23 +2344,13 @@ libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int
 libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while (packet) {
-        if (((packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA))
-            && (channel->local.id == _libssh2_ntohu32(packet->data + 1))) {
-            /* There's data waiting to be read yet, mask the EOF status */
-            return 0;
-        }
-        packet = _libssh2_list_next(&packet->node);
+    if (_libssh2_list_first(&channel->data_queue) ||
+        _libssh2_list_first(&channel->ext_data_queue)) {
+        /* There's data waiting to be read yet, mask the EOF status */
+        return 0;
     }
 
     return channel->remote.eof;
@@ -2458,9 +2584,6 @@ libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 {
     LIBSSH2_SESSION *session = channel->session;
-    unsigned char channel_id[4];
-    unsigned char *data;
-    size_t data_len;
     int rc;
 
     assert(session);
@@ -2498,14 +2621,7 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
      */
 
     /* Clear out packets meant for this channel */
-    _libssh2_htonu32(channel_id, channel->local.id);
-    while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)
-           ||
-           (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)) {
-        LIBSSH2_FREE(session, data);
-    }
+    channel_free_packets(channel);
 
     /* free "channel_type" */
     if (channel->channel_type) {
@@ -2514,19 +2630,16 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 
     /* Unlink from channel list */
     _libssh2_list_remove(&channel->node);
+    _libssh2_channel_releaseid(session, channel->local.id,
+                               channel->remote.close);
 
     /*
      * Make sure all memory used in the state variables are free
      */
-    if (channel->setenv_packet) {
-        LIBSSH2_FREE(session, channel->setenv_packet);
-    }
-    if (channel->reqX11_packet) {
-        LIBSSH2_FREE(session, channel->reqX11_packet);
-    }
-    if (channel->process_packet) {
-        LIBSSH2_FREE(session, channel->process_packet);
-    }
+    channel_request_free(channel, &channel->setenv);
+    channel_request_free(channel, &channel->reqPTY);
+    channel_request_free(channel, &channel->reqX11);
+    channel_request_free(channel, &channel->process);
 
     LIBSSH2_FREE(session, channel);
 
@@ -2575,20 +2688,15 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
 
     if (read_avail) {
         size_t bytes_queued = 0;
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
+        LIBSSH2_PACKET *packet;
 
-        while (packet) {
-            unsigned char packet_type = packet->data[0];
+        for(packet = _libssh2_list_first(&channel->data_queue); packet;
+            packet = _libssh2_list_next(&packet->node))
+            bytes_queued += packet->data_len - packet->data_head;
 
-            if (((packet_type == SSH_MSG_CHANNEL_DATA)
-                 || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-                && (_libssh2_ntohu32(packet->data + 1) == channel->local.id)) {
-                bytes_queued += packet->data_len - packet->data_head;
-            }
-
-            packet = _libssh2_list_next(&packet->node);
-        }
+        for(packet = _libssh2_list_first(&channel->ext_data_queue); packet;
+            packet = _libssh2_list_next(&packet->node))
+            bytes_queued += packet->data_len - packet->data_head;
 
         *read_avail = bytes_queued;
     }
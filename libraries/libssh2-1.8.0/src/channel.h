@@ -117,7 +117,10 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
 ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
                               char *buf, size_t buflen);
 
-uint32_t _libssh2_channel_nextid(LIBSSH2_SESSION * session);
+int _libssh2_channel_nextid(LIBSSH2_SESSION * session, uint32_t *id);
+
+void _libssh2_channel_releaseid(LIBSSH2_SESSION * session, uint32_t id,
+                                int reuse);
 
 LIBSSH2_CHANNEL *_libssh2_channel_locate(LIBSSH2_SESSION * session,
                                          uint32_t channel_id);
@@ -42,6 +42,7 @@
 #endif
 
 #include "comp.h"
+#include "packet.h"
 
 /* ********
  * none *
@@ -79,6 +80,7 @@ static int
 comp_method_none_decomp(LIBSSH2_SESSION * session,
                         unsigned char **dest,
                         size_t *dest_len,
+                        size_t *dest_size,
                         size_t payload_limit,
                         const unsigned char *src,
                         size_t src_len, void **abstract)
@@ -88,6 +90,7 @@ comp_method_none_decomp(LIBSSH2_SESSION * session,
     (void) abstract;
     *dest = (unsigned char *) src;
     *dest_len = src_len;
+    *dest_size = src_len;
     return 0;
 }
 
@@ -210,12 +213,14 @@ comp_method_zlib_comp(LIBSSH2_SESSION *session,
 /*
  * libssh2_comp_method_zlib_decomp
  *
- * Decompresses source to destination. Allocates the output memory.
+ * Decompresses source to destination. Allocates the output memory from the
+ * packet pool, *dest_size being set to the size allocated.
  */
 static int
 comp_method_zlib_decomp(LIBSSH2_SESSION * session,
                         unsigned char **dest,
                         size_t *dest_len,
+                        size_t *dest_size,
                         size_t payload_limit,
                         const unsigned char *src,
                         size_t src_len, void **abstract)
@@ -224,7 +229,7 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
     /* A short-term alloc of a full data chunk is better than a series of
        reallocs */
     char *out;
-    int out_maxlen = 4 * src_len;
+    size_t out_maxlen = 4 * src_len;
 
     /* If strm is null, then we have not yet been initialized. */
     if (strm == NULL)
@@ -235,12 +240,13 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
     if (out_maxlen < 25)
         out_maxlen = 25;
 
-    if (out_maxlen > (int) payload_limit)
+    if (out_maxlen > payload_limit)
         out_maxlen = payload_limit;
 
     strm->next_in = (unsigned char *) src;
     strm->avail_in = src_len;
-    strm->next_out = (unsigned char *) LIBSSH2_ALLOC(session, out_maxlen);
+    /* the pool may hand out a bit more than asked for, use all of it */
+    strm->next_out = _libssh2_packet_pool_alloc(session, &out_maxlen);
     out = (char *) strm->next_out;
     strm->avail_out = out_maxlen;
     if (!strm->next_out)
@@ -251,6 +257,7 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
     for (;;) {
         int status;
         size_t out_ofs;
+        size_t newlen;
         char *newout;
 
         status = inflate(strm, Z_PARTIAL_FLUSH);
@@ -264,35 +271,39 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
             break;
         } else {
             /* error state */
-            LIBSSH2_FREE(session, out);
+            _libssh2_packet_pool_free(session, out, out_maxlen);
             _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                            "unhandled zlib error %d", status);
             return _libssh2_error(session, LIBSSH2_ERROR_ZLIB,
                                   "decompression failure");
         }
 
-        if (out_maxlen >= (int) payload_limit) {
-            LIBSSH2_FREE(session, out);
+        if (out_maxlen >= payload_limit) {
+            _libssh2_packet_pool_free(session, out, out_maxlen);
             return _libssh2_error(session, LIBSSH2_ERROR_ZLIB,
                                   "Excessive growth in decompression phase");
         }
 
         /* If we get here we need to grow the output buffer and try again */
         out_ofs = out_maxlen - strm->avail_out;
-        out_maxlen *= 2;
-        newout = LIBSSH2_REALLOC(session, out, out_maxlen);
+        newlen = out_maxlen * 2;
+        newout = _libssh2_packet_pool_alloc(session, &newlen);
         if (!newout) {
-            LIBSSH2_FREE(session, out);
+            _libssh2_packet_pool_free(session, out, out_maxlen);
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                   "Unable to expand decompression buffer");
         }
+        memcpy(newout, out, out_ofs);
+        _libssh2_packet_pool_free(session, out, out_maxlen);
         out = newout;
+        out_maxlen = newlen;
         strm->next_out = (unsigned char *) out + out_ofs;
         strm->avail_out = out_maxlen - out_ofs;
     }
 
     *dest = (unsigned char *) out;
     *dest_len = out_maxlen - strm->avail_out;
+    *dest_size = out_maxlen;
 
     return 0;
 }
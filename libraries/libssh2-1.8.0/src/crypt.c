@@ -45,7 +45,7 @@
  */
 static int
 crypt_none_crypt(LIBSSH2_SESSION * session, unsigned char *buf,
-                         void **abstract)
+                 size_t len, void **abstract)
 {
     /* Do nothing to the data! */
     return 0;
@@ -94,14 +94,17 @@ crypt_init(LIBSSH2_SESSION * session,
     return 0;
 }
 
+/* crypt_encrypt
+ * Encrypts or decrypts a span of whole blocks with a single backend call
+ */
 static int
-crypt_encrypt(LIBSSH2_SESSION * session, unsigned char *block,
-              size_t blocksize, void **abstract)
+crypt_encrypt(LIBSSH2_SESSION * session, unsigned char *buf,
+              size_t len, void **abstract)
 {
     struct crypt_ctx *cctx = *(struct crypt_ctx **) abstract;
     (void) session;
-    return _libssh2_cipher_crypt(&cctx->h, cctx->algo, cctx->encrypt, block,
-                                 blocksize);
+    return _libssh2_cipher_crypt(&cctx->h, cctx->algo, cctx->encrypt, buf,
+                                 len);
 }
 
 static int
@@ -126,6 +129,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_ctr = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes128ctr
 };
 
@@ -138,6 +142,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_ctr = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes192ctr
 };
 
@@ -150,10 +155,365 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_ctr = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes256ctr
 };
 #endif
 
+#if LIBSSH2_AES_GCM
+#define AES_GCM_TAG_LEN 16
+
+/* crypt_encrypt_aead
+ * Encrypts or decrypts one whole packet body and writes or checks the tag
+ * that follows it; the packet_length field is the additional data
+ */
+static int
+crypt_encrypt_aead(LIBSSH2_SESSION * session, unsigned char *buf,
+                   size_t len, void **abstract)
+{
+    struct crypt_ctx *cctx = *(struct crypt_ctx **) abstract;
+    unsigned char aad[4];
+    (void) session;
+
+    _libssh2_htonu32(aad, (uint32_t) len);
+    return _libssh2_cipher_crypt_aead(&cctx->h, cctx->encrypt, aad, 4,
+                                      buf, len, buf + len, AES_GCM_TAG_LEN);
+}
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_gcm = {
+    "aes128-gcm@openssh.com",
+    16,                         /* blocksize */
+    12,                         /* initial value length */
+    16,                         /* secret length -- 16*8 == 128bit */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC,
+    &crypt_init,
+    &crypt_encrypt_aead,
+    &crypt_dtor,
+    NULL,                       /* get_len */
+    _libssh2_cipher_aes128gcm
+};
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_gcm = {
+    "aes256-gcm@openssh.com",
+    16,                         /* blocksize */
+    12,                         /* initial value length */
+    32,                         /* secret length -- 32*8 == 256bit */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC,
+    &crypt_init,
+    &crypt_encrypt_aead,
+    &crypt_dtor,
+    NULL,                       /* get_len */
+    _libssh2_cipher_aes256gcm
+};
+#endif /* LIBSSH2_AES_GCM */
+
+#if LIBSSH2_CHACHA20_POLY1305
+#define CHACHAPOLY_TAG_LEN 16
+
+#define U8TO32_LE(p) \
+    ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | \
+     ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define U32TO8_LE(p, v)                          \
+    do {                                         \
+        (p)[0] = (unsigned char)(v);             \
+        (p)[1] = (unsigned char)((v) >> 8);      \
+        (p)[2] = (unsigned char)((v) >> 16);     \
+        (p)[3] = (unsigned char)((v) >> 24);     \
+    } while(0)
+
+/* poly1305_auth
+ * One-shot Poly1305 (after poly1305-donna, 26 bit limbs): writes the 16 byte
+ * tag of (m, len) under the one-time 32 byte key
+ */
+static void
+poly1305_auth(unsigned char *out, const unsigned char *m, size_t len,
+              const unsigned char *key)
+{
+    uint32_t r0, r1, r2, r3, r4;
+    uint32_t s1, s2, s3, s4;
+    uint32_t h0 = 0, h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t t0, t1, t2, t3;
+    uint32_t b, nb, hibit;
+    uint64_t d0, d1, d2, d3, d4;
+    uint64_t f0, f1, f2, f3;
+    unsigned char last[16];
+    const unsigned char *block;
+    size_t i;
+
+    /* r &= 0xffffffc0ffffffc0ffffffc0fffffff, split into 26 bit limbs */
+    t0 = U8TO32_LE(key + 0);
+    t1 = U8TO32_LE(key + 4);
+    t2 = U8TO32_LE(key + 8);
+    t3 = U8TO32_LE(key + 12);
+    r0 = t0 & 0x3ffffff;
+    r1 = ((t0 >> 26) | (t1 << 6)) & 0x3ffff03;
+    r2 = ((t1 >> 20) | (t2 << 12)) & 0x3ffc0ff;
+    r3 = ((t2 >> 14) | (t3 << 18)) & 0x3f03fff;
+    r4 = (t3 >> 8) & 0x00fffff;
+
+    s1 = r1 * 5;
+    s2 = r2 * 5;
+    s3 = r3 * 5;
+    s4 = r4 * 5;
+
+    while (len) {
+        if (len >= 16) {
+            block = m;
+            hibit = 1 << 24;
+            m += 16;
+            len -= 16;
+        }
+        else {
+            /* a short final block gets a 1 byte appended instead */
+            for (i = 0; i < len; i++)
+                last[i] = m[i];
+            last[i++] = 1;
+            for (; i < 16; i++)
+                last[i] = 0;
+            block = last;
+            hibit = 0;
+            len = 0;
+        }
+
+        /* h += m */
+        t0 = U8TO32_LE(block + 0);
+        t1 = U8TO32_LE(block + 4);
+        t2 = U8TO32_LE(block + 8);
+        t3 = U8TO32_LE(block + 12);
+        h0 += t0 & 0x3ffffff;
+        h1 += ((t0 >> 26) | (t1 << 6)) & 0x3ffffff;
+        h2 += ((t1 >> 20) | (t2 << 12)) & 0x3ffffff;
+        h3 += ((t2 >> 14) | (t3 << 18)) & 0x3ffffff;
+        h4 += (t3 >> 8) | hibit;
+
+        /* h *= r (mod 2^130 - 5) */
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+            (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+            (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+            (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+            (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+            (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        /* partial carry */
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += d0 >> 26;
+        h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += d1 >> 26;
+        h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += d2 >> 26;
+        h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += d3 >> 26;
+        h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += (uint32_t)(d4 >> 26) * 5;
+        h1 += h0 >> 26;
+        h0 &= 0x3ffffff;
+    }
+
+    /* full carry */
+    b = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += b; b = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += b; b = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += b; b = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += b * 5; b = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += b;
+
+    /* g = h - p, chosen over h in constant time when h >= p */
+    g0 = h0 + 5; b = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + b; b = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + b; b = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + b; b = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + b - (1 << 26);
+
+    b = (g4 >> 31) - 1;
+    nb = ~b;
+    h0 = (h0 & nb) | (g0 & b);
+    h1 = (h1 & nb) | (g1 & b);
+    h2 = (h2 & nb) | (g2 & b);
+    h3 = (h3 & nb) | (g3 & b);
+    h4 = (h4 & nb) | (g4 & b);
+
+    /* tag = (h + s) mod 2^128 */
+    f0 = (uint32_t)(h0 | (h1 << 26)) + (uint64_t)U8TO32_LE(key + 16);
+    f1 = (uint32_t)((h1 >> 6) | (h2 << 20)) + (uint64_t)U8TO32_LE(key + 20);
+    f2 = (uint32_t)((h2 >> 12) | (h3 << 14)) + (uint64_t)U8TO32_LE(key + 24);
+    f3 = (uint32_t)((h3 >> 18) | (h4 << 8)) + (uint64_t)U8TO32_LE(key + 28);
+
+    U32TO8_LE(out + 0, f0);
+    f1 += f0 >> 32;
+    U32TO8_LE(out + 4, f1);
+    f2 += f1 >> 32;
+    U32TO8_LE(out + 8, f2);
+    f3 += f2 >> 32;
+    U32TO8_LE(out + 12, f3);
+}
+
+/* chacha20-poly1305@openssh.com keeps two ChaCha20 instances: one keyed
+ * with the second half of the key material only ever encrypts the 4 byte
+ * packet_length field, the other encrypts the body and, at block counter
+ * 0, yields the Poly1305 key. The sequence number is the nonce.
+ */
+struct chachapoly_ctx
+{
+    int encrypt;
+    unsigned char main_key[32];
+    unsigned char header_key[32];
+    _libssh2_cipher_ctx main_ctx;
+    _libssh2_cipher_ctx header_ctx;
+};
+
+static int
+crypt_init_chachapoly(LIBSSH2_SESSION * session,
+                      const LIBSSH2_CRYPT_METHOD * method,
+                      unsigned char *iv, int *free_iv,
+                      unsigned char *secret, int *free_secret,
+                      int encrypt, void **abstract)
+{
+    unsigned char zero_iv[16];
+    struct chachapoly_ctx *ctx = LIBSSH2_ALLOC(session,
+                                               sizeof(struct chachapoly_ctx));
+    (void) method;
+    (void) iv;
+
+    if (!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    memset(zero_iv, 0, sizeof(zero_iv));
+    ctx->encrypt = encrypt;
+    memcpy(ctx->main_key, secret, 32);
+    memcpy(ctx->header_key, secret + 32, 32);
+    if (_libssh2_cipher_init(&ctx->main_ctx, _libssh2_cipher_chacha20,
+                             zero_iv, secret, encrypt)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    if (_libssh2_cipher_init(&ctx->header_ctx, _libssh2_cipher_chacha20,
+                             zero_iv, secret + 32, encrypt)) {
+        _libssh2_cipher_dtor(&ctx->main_ctx);
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    *abstract = ctx;
+    *free_iv = 1;
+    *free_secret = 1;
+    return 0;
+}
+
+/* chachapoly_iv
+ * ChaCha20 IV as used by OpenSSH: 64 bit little endian block counter
+ * followed by the 64 bit big endian sequence number
+ */
+static void
+chachapoly_iv(unsigned char *iv, uint32_t seqno, unsigned char counter)
+{
+    memset(iv, 0, 12);
+    iv[0] = counter;
+    _libssh2_htonu32(iv + 12, seqno);
+}
+
+/* crypt_chachapoly
+ * Seals or opens one packet; see the crypt() member of LIBSSH2_CRYPT_METHOD
+ * for the layout
+ */
+static int
+crypt_chachapoly(LIBSSH2_SESSION * session, unsigned char *buf,
+                 size_t len, void **abstract)
+{
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    unsigned char iv[16];
+    unsigned char poly_key[32];
+    unsigned char expected[CHACHAPOLY_TAG_LEN];
+    unsigned char *length_field = buf - 4;
+    unsigned char diff = 0;
+    uint32_t seqno = ctx->encrypt ? session->local.seqno :
+        session->remote.seqno;
+    int i;
+    int rc = 0;
+
+    memset(poly_key, 0, sizeof(poly_key));
+    chachapoly_iv(iv, seqno, 0);
+    if (_libssh2_cipher_crypt_iv(&ctx->main_ctx, ctx->main_key, iv,
+                                 poly_key, sizeof(poly_key)))
+        return -1;
+
+    if (ctx->encrypt) {
+        if (_libssh2_cipher_crypt_iv(&ctx->header_ctx, ctx->header_key, iv,
+                                     length_field, 4))
+            rc = -1;
+    }
+    else {
+        /* authenticate before decrypting anything but the length */
+        poly1305_auth(expected, length_field, len + 4, poly_key);
+        for (i = 0; i < CHACHAPOLY_TAG_LEN; i++)
+            diff |= expected[i] ^ buf[len + i];
+        if (diff)
+            rc = -1;
+    }
+
+    if (!rc) {
+        chachapoly_iv(iv, seqno, 1);
+        if (_libssh2_cipher_crypt_iv(&ctx->main_ctx, ctx->main_key, iv,
+                                     buf, len))
+            rc = -1;
+    }
+
+    if (!rc && ctx->encrypt)
+        poly1305_auth(buf + len, length_field, len + 4, poly_key);
+
+    memset(poly_key, 0, sizeof(poly_key));
+    return rc;
+}
+
+static int
+crypt_get_len_chachapoly(LIBSSH2_SESSION * session, uint32_t *len,
+                         const unsigned char *buf, void **abstract)
+{
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    unsigned char iv[16];
+    unsigned char length_field[4];
+
+    memcpy(length_field, buf, 4);
+    chachapoly_iv(iv, session->remote.seqno, 0);
+    if (_libssh2_cipher_crypt_iv(&ctx->header_ctx, ctx->header_key, iv,
+                                 length_field, 4))
+        return -1;
+    *len = _libssh2_ntohu32(length_field);
+    return 0;
+}
+
+static int
+crypt_dtor_chachapoly(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct chachapoly_ctx **ctx = (struct chachapoly_ctx **) abstract;
+    if (ctx && *ctx) {
+        _libssh2_cipher_dtor(&(*ctx)->main_ctx);
+        _libssh2_cipher_dtor(&(*ctx)->header_ctx);
+        memset(*ctx, 0, sizeof(struct chachapoly_ctx));
+        LIBSSH2_FREE(session, *ctx);
+        *abstract = NULL;
+    }
+    return 0;
+}
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_chacha20_poly1305 = {
+    "chacha20-poly1305@openssh.com",
+    8,                          /* blocksize */
+    0,                          /* initial value length */
+    64,                         /* secret length -- two 256bit keys */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC,
+    &crypt_init_chachapoly,
+    &crypt_chachapoly,
+    &crypt_dtor_chachapoly,
+    &crypt_get_len_chachapoly,
+    _libssh2_cipher_chacha20
+};
+#endif /* LIBSSH2_CHACHA20_POLY1305 */
+
 #if LIBSSH2_AES
 static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_cbc = {
     "aes128-cbc",
@@ -164,6 +524,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes128
 };
 
@@ -176,6 +537,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes192
 };
 
@@ -188,6 +550,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes256
 };
 
@@ -202,6 +565,7 @@ static const LIBSSH2_CRYPT_METHOD
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_aes256
 };
 #endif /* LIBSSH2_AES */
@@ -216,6 +580,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_blowfish_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_blowfish
 };
 #endif /* LIBSSH2_BLOWFISH */
@@ -230,6 +595,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_arcfour
 };
 
@@ -265,6 +631,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour128 = {
     &crypt_init_arcfour128,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_arcfour
 };
 #endif /* LIBSSH2_RC4 */
@@ -279,6 +646,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_cast128_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_cast5
 };
 #endif /* LIBSSH2_CAST */
@@ -293,11 +661,19 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_3des_cbc = {
     &crypt_init,
     &crypt_encrypt,
     &crypt_dtor,
+    NULL,                       /* get_len */
     _libssh2_cipher_3des
 };
 #endif
 
 static const LIBSSH2_CRYPT_METHOD *_libssh2_crypt_methods[] = {
+#if LIBSSH2_AES_GCM
+  &libssh2_crypt_method_aes128_gcm,
+  &libssh2_crypt_method_aes256_gcm,
+#endif /* LIBSSH2_AES_GCM */
+#if LIBSSH2_CHACHA20_POLY1305
+  &libssh2_crypt_method_chacha20_poly1305,
+#endif /* LIBSSH2_CHACHA20_POLY1305 */
 #if LIBSSH2_AES_CTR
   &libssh2_crypt_method_aes128_ctr,
   &libssh2_crypt_method_aes192_ctr,
@@ -58,6 +58,15 @@
 #include "mbedtls.h"
 #endif
 
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519 || LIBSSH2_ECDSA
+typedef enum {
+    LIBSSH2_EC_CURVE_NISTP256,
+    LIBSSH2_EC_CURVE_NISTP384,
+    LIBSSH2_EC_CURVE_NISTP521,
+    LIBSSH2_EC_CURVE_25519
+} libssh2_curve_type;
+#endif
+
 int _libssh2_rsa_new(libssh2_rsa_ctx ** rsa,
                      const unsigned char *edata,
                      unsigned long elen,
@@ -129,6 +138,94 @@ int _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                           _libssh2_cipher_type(algo),
                           int encrypt, unsigned char *block, size_t blocksize);
 
+#if LIBSSH2_ECDSA
+/* 'point' is the public key in uncompressed form (RFC 5656 Q) */
+int _libssh2_ecdsa_new_public(libssh2_ecdsa_ctx ** ecdsactx,
+                              libssh2_curve_type curve,
+                              const unsigned char *point,
+                              size_t point_len);
+int _libssh2_ecdsa_new_private(libssh2_ecdsa_ctx ** ecdsactx,
+                               LIBSSH2_SESSION * session,
+                               const char *filename,
+                               unsigned const char *passphrase);
+int _libssh2_ecdsa_new_private_frommemory(libssh2_ecdsa_ctx ** ecdsactx,
+                                          LIBSSH2_SESSION * session,
+                                          const char *filedata,
+                                          size_t filedata_len,
+                                          unsigned const char *passphrase);
+int _libssh2_ecdsa_get_curve_type(libssh2_ecdsa_ctx * ecdsactx,
+                                  libssh2_curve_type *curve);
+/* r and s are the mpint contents of the signature blob */
+int _libssh2_ecdsa_verify(libssh2_ecdsa_ctx * ecdsactx,
+                          const unsigned char *r, size_t r_len,
+                          const unsigned char *s, size_t s_len,
+                          const unsigned char *hash, size_t hash_len);
+/* Returns the signature blob, mpint r followed by mpint s */
+int _libssh2_ecdsa_sign(LIBSSH2_SESSION * session,
+                        libssh2_ecdsa_ctx * ecdsactx,
+                        const unsigned char *hash, size_t hash_len,
+                        unsigned char **signature, size_t *signature_len);
+#endif
+
+#if LIBSSH2_ED25519
+int _libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519ctx,
+                                const unsigned char *key, size_t key_len);
+int _libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519ctx,
+                                 LIBSSH2_SESSION * session,
+                                 const char *filename,
+                                 unsigned const char *passphrase);
+int _libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519ctx,
+                                            LIBSSH2_SESSION * session,
+                                            const char *filedata,
+                                            size_t filedata_len,
+                                            unsigned const char *passphrase);
+int _libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519ctx,
+                            const unsigned char *s, size_t s_len,
+                            const unsigned char *m, size_t m_len);
+int _libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                          libssh2_ed25519_ctx * ed25519ctx,
+                          const unsigned char *m, size_t m_len,
+                          unsigned char **signature, size_t *signature_len);
+#endif
+
+#if LIBSSH2_AES_GCM
+/* Authenticated encryption of one packet: 'aad' is authenticated but left
+   untouched, 'buf' is transformed in place and 'tag' is written (encrypt) or
+   verified (decrypt). Returns non-zero on failure, including a bad tag. */
+int _libssh2_cipher_crypt_aead(_libssh2_cipher_ctx * ctx,
+                               int encrypt,
+                               const unsigned char *aad, size_t aad_len,
+                               unsigned char *buf, size_t len,
+                               unsigned char *tag, size_t tag_len);
+#endif
+
+#if LIBSSH2_CHACHA20_POLY1305
+/* Restarts a stream cipher context at (key, iv) and transforms (buf, len)
+   in place. Returns non-zero on failure. */
+int _libssh2_cipher_crypt_iv(_libssh2_cipher_ctx * ctx,
+                             const unsigned char *key,
+                             const unsigned char *iv,
+                             unsigned char *buf, size_t len);
+#endif
+
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519
+
+/* Generates an ephemeral key on 'curve' and returns its public value in
+   wire form: an uncompressed point for the NIST curves (RFC 5656), the 32
+   byte u-coordinate for curve25519. *public_key is LIBSSH2_ALLOC'ed. */
+int _libssh2_ecdh_new(LIBSSH2_SESSION * session,
+                      libssh2_curve_type curve,
+                      _libssh2_ecdh_key ** key,
+                      unsigned char **public_key,
+                      size_t *public_key_len);
+/* Derives the shared secret with the peer's public value into 'k'. Fails
+   on a point not on the curve and on an all-zero X25519 result. */
+int _libssh2_ecdh_gen_k(_libssh2_bn * k,
+                        _libssh2_ecdh_key * key,
+                        const unsigned char *peer_public_key,
+                        size_t peer_public_key_len);
+#endif
+
 int _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
                               unsigned char **method,
                               size_t *method_len,
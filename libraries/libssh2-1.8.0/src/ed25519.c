@@ -0,0 +1,746 @@
+/*
+ * Ed25519 signatures (RFC 8032) in portable C.
+ *
+ * This is what ssh-ed25519 keys use when the crypto backend has no Ed25519
+ * of its own, as with OpenSSL before 1.1.1. Only SHA-512 comes from the
+ * backend.
+ *
+ * The field and group arithmetic follow the public domain ref10 code by
+ * Daniel J. Bernstein, Niels Duif, Tanja Lange, Peter Schwabe and Bo-Yin
+ * Yang, without its precomputed base point tables. The reduction modulo the
+ * group order is the one from TweetNaCl.
+ *
+ * Signing and public key derivation run in constant time. Verification
+ * only handles public data, so it does not.
+ */
+
+#include "libssh2_priv.h"
+
+#if LIBSSH2_ED25519 && !LIBSSH2_ED25519_EVP
+
+#include "ed25519.h"
+
+/*
+ * An element of GF(2^255 - 19), as ten signed limbs of alternately 26 and
+ * 25 bits: f[0] + 2^26 f[1] + 2^51 f[2] + ... + 2^230 f[9].
+ */
+typedef int32_t fe[10];
+
+#define FE_LIMB_BITS(i) (26 - ((i) & 1))
+
+/* A point in extended coordinates: x = X/Z, y = Y/Z, x * y = T/Z */
+typedef struct
+{
+    fe X;
+    fe Y;
+    fe Z;
+    fe T;
+} ge;
+
+/* d = -121665/121666 */
+static const unsigned char ed25519_d[32] = {
+    0xa3, 0x78, 0x59, 0x13, 0xca, 0x4d, 0xeb, 0x75,
+    0xab, 0xd8, 0x41, 0x41, 0x4d, 0x0a, 0x70, 0x00,
+    0x98, 0xe8, 0x79, 0x77, 0x79, 0x40, 0xc7, 0x8c,
+    0x73, 0xfe, 0x6f, 0x2b, 0xee, 0x6c, 0x03, 0x52
+};
+
+/* sqrt(-1) = 2^((p - 1) / 4) */
+static const unsigned char ed25519_sqrtm1[32] = {
+    0xb0, 0xa0, 0x0e, 0x4a, 0x27, 0x1b, 0xee, 0xc4,
+    0x78, 0xe4, 0x2f, 0xad, 0x06, 0x18, 0x43, 0x2f,
+    0xa7, 0xd7, 0xfb, 0x3d, 0x99, 0x00, 0x4d, 0x2b,
+    0x0b, 0xdf, 0xc1, 0x4f, 0x80, 0x24, 0x83, 0x2b
+};
+
+/* The encoded base point, y = 4/5 with even x */
+static const unsigned char ed25519_base[32] = {
+    0x58, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+    0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+    0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+    0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66
+};
+
+/* The group order L = 2^252 + 27742317777372353535851937790883648493 */
+static const int64_t ed25519_l[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x10
+};
+
+static void
+fe_0(fe h)
+{
+    memset(h, 0, sizeof(fe));
+}
+
+static void
+fe_1(fe h)
+{
+    fe_0(h);
+    h[0] = 1;
+}
+
+/* Sums and differences are not carried; fe_mul copes with a few of them */
+static void
+fe_add(fe h, const fe f, const fe g)
+{
+    int i;
+
+    for (i = 0; i < 10; i++)
+        h[i] = f[i] + g[i];
+}
+
+static void
+fe_sub(fe h, const fe f, const fe g)
+{
+    int i;
+
+    for (i = 0; i < 10; i++)
+        h[i] = f[i] - g[i];
+}
+
+static void
+fe_neg(fe h, const fe f)
+{
+    int i;
+
+    for (i = 0; i < 10; i++)
+        h[i] = -f[i];
+}
+
+/* Swap f and g when b is 1, without branching on b */
+static void
+fe_cswap(fe f, fe g, unsigned int b)
+{
+    int32_t mask = -(int32_t) b;
+    int32_t x;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        x = mask & (f[i] ^ g[i]);
+        f[i] ^= x;
+        g[i] ^= x;
+    }
+}
+
+/*
+ * Carry 64 bit limbs back into range, leaving each within half a limb of
+ * zero. What carries out of the top limb wraps around times 19, since
+ * 2^255 = 19 mod p.
+ */
+static void
+fe_carry(fe h, int64_t *t)
+{
+    int64_t carry;
+    int i, bits;
+
+    for (i = 0; i < 10; i++) {
+        bits = FE_LIMB_BITS(i);
+        carry = (t[i] + ((int64_t) 1 << (bits - 1))) >> bits;
+        t[i] -= carry * ((int64_t) 1 << bits);
+        if (i == 9)
+            t[0] += carry * 19;
+        else
+            t[i + 1] += carry;
+    }
+    carry = (t[0] + ((int64_t) 1 << 25)) >> 26;
+    t[0] -= carry * ((int64_t) 1 << 26);
+    t[1] += carry;
+
+    for (i = 0; i < 10; i++)
+        h[i] = (int32_t) t[i];
+}
+
+static void
+fe_mul(fe h, const fe f, const fe g)
+{
+    int64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+    int64_t f5 = f[5], f6 = f[6], f7 = f[7], f8 = f[8], f9 = f[9];
+    int64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+    int64_t g5 = g[5], g6 = g[6], g7 = g[7], g8 = g[8], g9 = g[9];
+    /* odd limbs sit half a bit high, so odd times odd counts twice */
+    int64_t f1_2 = 2 * f1, f3_2 = 2 * f3, f5_2 = 2 * f5;
+    int64_t f7_2 = 2 * f7, f9_2 = 2 * f9;
+    /* what wraps past 2^255 comes back times 19 */
+    int64_t g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3;
+    int64_t g4_19 = 19 * g4, g5_19 = 19 * g5, g6_19 = 19 * g6;
+    int64_t g7_19 = 19 * g7, g8_19 = 19 * g8, g9_19 = 19 * g9;
+    int64_t t[10];
+
+    t[0] = f0 * g0 + f1_2 * g9_19 + f2 * g8_19 + f3_2 * g7_19 +
+           f4 * g6_19 + f5_2 * g5_19 + f6 * g4_19 + f7_2 * g3_19 +
+           f8 * g2_19 + f9_2 * g1_19;
+    t[1] = f0 * g1 + f1 * g0 + f2 * g9_19 + f3 * g8_19 +
+           f4 * g7_19 + f5 * g6_19 + f6 * g5_19 + f7 * g4_19 +
+           f8 * g3_19 + f9 * g2_19;
+    t[2] = f0 * g2 + f1_2 * g1 + f2 * g0 + f3_2 * g9_19 +
+           f4 * g8_19 + f5_2 * g7_19 + f6 * g6_19 + f7_2 * g5_19 +
+           f8 * g4_19 + f9_2 * g3_19;
+    t[3] = f0 * g3 + f1 * g2 + f2 * g1 + f3 * g0 +
+           f4 * g9_19 + f5 * g8_19 + f6 * g7_19 + f7 * g6_19 +
+           f8 * g5_19 + f9 * g4_19;
+    t[4] = f0 * g4 + f1_2 * g3 + f2 * g2 + f3_2 * g1 +
+           f4 * g0 + f5_2 * g9_19 + f6 * g8_19 + f7_2 * g7_19 +
+           f8 * g6_19 + f9_2 * g5_19;
+    t[5] = f0 * g5 + f1 * g4 + f2 * g3 + f3 * g2 +
+           f4 * g1 + f5 * g0 + f6 * g9_19 + f7 * g8_19 +
+           f8 * g7_19 + f9 * g6_19;
+    t[6] = f0 * g6 + f1_2 * g5 + f2 * g4 + f3_2 * g3 +
+           f4 * g2 + f5_2 * g1 + f6 * g0 + f7_2 * g9_19 +
+           f8 * g8_19 + f9_2 * g7_19;
+    t[7] = f0 * g7 + f1 * g6 + f2 * g5 + f3 * g4 +
+           f4 * g3 + f5 * g2 + f6 * g1 + f7 * g0 +
+           f8 * g9_19 + f9 * g8_19;
+    t[8] = f0 * g8 + f1_2 * g7 + f2 * g6 + f3_2 * g5 +
+           f4 * g4 + f5_2 * g3 + f6 * g2 + f7_2 * g1 +
+           f8 * g0 + f9_2 * g9_19;
+    t[9] = f0 * g9 + f1 * g8 + f2 * g7 + f3 * g6 +
+           f4 * g5 + f5 * g4 + f6 * g3 + f7 * g2 +
+           f8 * g1 + f9 * g0;
+
+    fe_carry(h, t);
+}
+
+static void
+fe_sq(fe h, const fe f)
+{
+    fe_mul(h, f, f);
+}
+
+/* h = f^(2^n) */
+static void
+fe_sqn(fe h, const fe f, int n)
+{
+    fe_sq(h, f);
+    while (--n > 0)
+        fe_sq(h, h);
+}
+
+/* Bit 255 of s is ignored; values up to 2^255 - 1 are accepted as is */
+static void
+fe_frombytes(fe h, const unsigned char *s)
+{
+    int64_t t[10];
+    uint64_t w;
+    int i, k, bits, pos = 0;
+
+    for (i = 0; i < 10; i++) {
+        bits = FE_LIMB_BITS(i);
+        w = 0;
+        for (k = 0; k < 5 && pos / 8 + k < 32; k++)
+            w |= (uint64_t) s[pos / 8 + k] << (8 * k);
+        t[i] = (int64_t) ((w >> (pos % 8)) & (((uint64_t) 1 << bits) - 1));
+        pos += bits;
+    }
+
+    fe_carry(h, t);
+}
+
+/* Fully reduces f mod p and stores it little endian */
+static void
+fe_tobytes(unsigned char *s, const fe f)
+{
+    int64_t t[10];
+    int32_t h[10];
+    int32_t q;
+    uint64_t acc = 0;
+    int i, bits, acc_bits = 0, n = 0;
+
+    /* sums and differences get carried first */
+    for (i = 0; i < 10; i++)
+        t[i] = f[i];
+    fe_carry(h, t);
+
+    /* q is 1 when h >= p, and adding 19q then carries out of bit 255 */
+    q = (19 * h[9] + (1 << 24)) >> 25;
+    for (i = 0; i < 10; i++)
+        q = (h[i] + q) >> FE_LIMB_BITS(i);
+    h[0] += 19 * q;
+
+    for (i = 0; i < 9; i++) {
+        bits = FE_LIMB_BITS(i);
+        h[i + 1] += h[i] >> bits;
+        h[i] &= (1 << bits) - 1;
+    }
+    h[9] &= (1 << 25) - 1;
+
+    for (i = 0; i < 10; i++) {
+        acc |= (uint64_t) h[i] << acc_bits;
+        acc_bits += FE_LIMB_BITS(i);
+        while (acc_bits >= 8) {
+            s[n++] = (unsigned char) acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    s[n] = (unsigned char) acc;
+}
+
+static int
+fe_isnegative(const fe f)
+{
+    unsigned char s[32];
+
+    fe_tobytes(s, f);
+    return s[0] & 1;
+}
+
+static int
+fe_isnonzero(const fe f)
+{
+    unsigned char s[32];
+    unsigned char r = 0;
+    int i;
+
+    fe_tobytes(s, f);
+    for (i = 0; i < 32; i++)
+        r |= s[i];
+    return r != 0;
+}
+
+/* Sets t1 = z^(2^250 - 1) and z11 = z^11, the start of both chains below */
+static void
+fe_pow2250(fe t1, fe z11, const fe z)
+{
+    fe t0, t2, t3;
+
+    fe_sq(t0, z);                   /* 2 */
+    fe_sqn(t1, t0, 2);              /* 8 */
+    fe_mul(t1, z, t1);              /* 9 */
+    fe_mul(z11, t0, t1);            /* 11 */
+    fe_sq(t0, z11);                 /* 22 */
+    fe_mul(t1, t1, t0);             /* 2^5 - 1 */
+    fe_sqn(t2, t1, 5);
+    fe_mul(t1, t2, t1);             /* 2^10 - 1 */
+    fe_sqn(t2, t1, 10);
+    fe_mul(t2, t2, t1);             /* 2^20 - 1 */
+    fe_sqn(t3, t2, 20);
+    fe_mul(t2, t3, t2);             /* 2^40 - 1 */
+    fe_sqn(t2, t2, 10);
+    fe_mul(t1, t2, t1);             /* 2^50 - 1 */
+    fe_sqn(t2, t1, 50);
+    fe_mul(t2, t2, t1);             /* 2^100 - 1 */
+    fe_sqn(t3, t2, 100);
+    fe_mul(t2, t3, t2);             /* 2^200 - 1 */
+    fe_sqn(t2, t2, 50);
+    fe_mul(t1, t2, t1);             /* 2^250 - 1 */
+}
+
+/* h = 1/z = z^(p - 2) = z^(2^255 - 21) */
+static void
+fe_invert(fe h, const fe z)
+{
+    fe t1, z11;
+
+    fe_pow2250(t1, z11, z);
+    fe_sqn(t1, t1, 5);
+    fe_mul(h, t1, z11);
+}
+
+/* h = z^((p - 5) / 8) = z^(2^252 - 3), for square roots */
+static void
+fe_pow22523(fe h, const fe z)
+{
+    fe t1, z11;
+
+    fe_pow2250(t1, z11, z);
+    fe_sqn(t1, t1, 2);
+    fe_mul(h, t1, z);
+}
+
+static void
+ge_identity(ge *h)
+{
+    fe_0(h->X);
+    fe_1(h->Y);
+    fe_1(h->Z);
+    fe_0(h->T);
+}
+
+static void
+ge_cswap(ge *p, ge *q, unsigned int b)
+{
+    fe_cswap(p->X, q->X, b);
+    fe_cswap(p->Y, q->Y, b);
+    fe_cswap(p->Z, q->Z, b);
+    fe_cswap(p->T, q->T, b);
+}
+
+/* r = p + q, with d2 = 2d; "add-2008-hwcd-3" for a = -1 */
+static void
+ge_add(ge *r, const ge *p, const ge *q, const fe d2)
+{
+    fe a, b, c, d, e, f, g, h, t;
+
+    fe_sub(a, p->Y, p->X);
+    fe_sub(t, q->Y, q->X);
+    fe_mul(a, a, t);
+    fe_add(b, p->Y, p->X);
+    fe_add(t, q->Y, q->X);
+    fe_mul(b, b, t);
+    fe_mul(c, p->T, q->T);
+    fe_mul(c, c, d2);
+    fe_mul(d, p->Z, q->Z);
+    fe_add(d, d, d);
+
+    fe_sub(e, b, a);
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+    fe_add(h, b, a);
+
+    fe_mul(r->X, e, f);
+    fe_mul(r->Y, g, h);
+    fe_mul(r->T, e, h);
+    fe_mul(r->Z, f, g);
+}
+
+/* r = 2p; "dbl-2008-hwcd" for a = -1 */
+static void
+ge_dbl(ge *r, const ge *p)
+{
+    fe a, b, c, e, f, g, h;
+
+    fe_sq(a, p->X);
+    fe_sq(b, p->Y);
+    fe_sq(c, p->Z);
+    fe_add(c, c, c);
+    fe_add(e, p->X, p->Y);
+    fe_sq(e, e);
+    fe_sub(e, e, a);
+    fe_sub(e, e, b);
+    fe_sub(g, b, a);
+    fe_sub(f, g, c);
+    fe_add(h, a, b);
+    fe_neg(h, h);
+
+    fe_mul(r->X, e, f);
+    fe_mul(r->Y, g, h);
+    fe_mul(r->T, e, h);
+    fe_mul(r->Z, f, g);
+}
+
+static void
+ge_tobytes(unsigned char *s, const ge *h)
+{
+    fe recip, x, y;
+
+    fe_invert(recip, h->Z);
+    fe_mul(x, h->X, recip);
+    fe_mul(y, h->Y, recip);
+    fe_tobytes(s, y);
+    s[31] ^= (unsigned char) (fe_isnegative(x) << 7);
+}
+
+/*
+ * Decodes a point, recovering x from y as x^2 = (y^2 - 1) / (d y^2 + 1).
+ * Returns -1 when s is not the canonical encoding of a curve point.
+ */
+static int
+ge_frombytes(ge *h, const unsigned char *s)
+{
+    fe u, v, v3, vxx, check, d;
+    unsigned char y[32];
+
+    fe_frombytes(h->Y, s);
+    fe_tobytes(y, h->Y);
+    y[31] |= s[31] & 0x80;
+    if (memcmp(y, s, 32)) {
+        return -1;              /* y >= p */
+    }
+
+    fe_frombytes(d, ed25519_d);
+    fe_1(h->Z);
+    fe_sq(u, h->Y);
+    fe_mul(v, u, d);
+    fe_sub(u, u, h->Z);         /* u = y^2 - 1 */
+    fe_add(v, v, h->Z);         /* v = d y^2 + 1 */
+
+    /* x = u v^3 (u v^7)^((p - 5) / 8) */
+    fe_sq(v3, v);
+    fe_mul(v3, v3, v);
+    fe_sq(h->X, v3);
+    fe_mul(h->X, h->X, v);
+    fe_mul(h->X, h->X, u);
+    fe_pow22523(h->X, h->X);
+    fe_mul(h->X, h->X, v3);
+    fe_mul(h->X, h->X, u);
+
+    fe_sq(vxx, h->X);
+    fe_mul(vxx, vxx, v);
+    fe_sub(check, vxx, u);
+    if (fe_isnonzero(check)) {
+        fe_add(check, vxx, u);
+        if (fe_isnonzero(check)) {
+            return -1;          /* not on the curve */
+        }
+        fe_frombytes(check, ed25519_sqrtm1);
+        fe_mul(h->X, h->X, check);
+    }
+
+    if (fe_isnegative(h->X) != (s[31] >> 7)) {
+        if (!fe_isnonzero(h->X)) {
+            return -1;          /* -0 */
+        }
+        fe_neg(h->X, h->X);
+    }
+
+    fe_mul(h->T, h->X, h->Y);
+    return 0;
+}
+
+/* Loads the base point and 2d, which every operation needs */
+static void
+ge_setup(ge *base, fe d2)
+{
+    fe d;
+
+    ge_frombytes(base, ed25519_base);
+    fe_frombytes(d, ed25519_d);
+    fe_add(d2, d, d);
+}
+
+/* r = a * p for a secret 256 bit a, in constant time */
+static void
+ge_scalarmult(ge *r, const unsigned char *a, const ge *p, const fe d2)
+{
+    ge r1;
+    unsigned int bit;
+    int i;
+
+    ge_identity(r);
+    r1 = *p;
+
+    /* r1 - r stays p throughout */
+    for (i = 255; i >= 0; i--) {
+        bit = (a[i >> 3] >> (i & 7)) & 1;
+        ge_cswap(r, &r1, bit);
+        ge_add(&r1, r, &r1, d2);
+        ge_dbl(r, r);
+        ge_cswap(r, &r1, bit);
+    }
+}
+
+/* r = a * p + b * q for public a and b */
+static void
+ge_double_scalarmult_vartime(ge *r, const unsigned char *a, const ge *p,
+                             const unsigned char *b, const ge *q,
+                             const fe d2)
+{
+    int i;
+
+    ge_identity(r);
+
+    for (i = 255; i >= 0; i--) {
+        ge_dbl(r, r);
+        if ((a[i >> 3] >> (i & 7)) & 1)
+            ge_add(r, r, p, d2);
+        if ((b[i >> 3] >> (i & 7)) & 1)
+            ge_add(r, r, q, d2);
+    }
+}
+
+/* Stores x mod L in r, where x holds 64 byte sized signed limbs */
+static void
+sc_modl(unsigned char *r, int64_t *x)
+{
+    int64_t carry;
+    int i, j;
+
+    for (i = 63; i >= 32; i--) {
+        carry = 0;
+        for (j = i - 32; j < i - 12; j++) {
+            x[j] += carry - 16 * x[i] * ed25519_l[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+
+    carry = 0;
+    for (j = 0; j < 32; j++) {
+        x[j] += carry - (x[31] >> 4) * ed25519_l[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for (j = 0; j < 32; j++)
+        x[j] -= carry * ed25519_l[j];
+
+    for (i = 0; i < 32; i++) {
+        x[i + 1] += x[i] >> 8;
+        r[i] = (unsigned char) (x[i] & 255);
+    }
+}
+
+/* Reduces the 64 byte s mod L, leaving the result in its first 32 bytes */
+static void
+sc_reduce(unsigned char *s)
+{
+    int64_t x[64];
+    int i;
+
+    for (i = 0; i < 64; i++)
+        x[i] = s[i];
+    sc_modl(s, x);
+}
+
+/* s = (a * b + c) mod L */
+static void
+sc_muladd(unsigned char *s, const unsigned char *a, const unsigned char *b,
+          const unsigned char *c)
+{
+    int64_t x[64] = { 0 };
+    int i, j;
+
+    for (i = 0; i < 32; i++)
+        x[i] = c[i];
+    for (i = 0; i < 32; i++)
+        for (j = 0; j < 32; j++)
+            x[i + j] += (int64_t) a[i] * b[j];
+    sc_modl(s, x);
+}
+
+/* Whether s < L, as RFC 8032 requires of the S half of a signature */
+static int
+sc_is_canonical(const unsigned char *s)
+{
+    int i;
+
+    for (i = 31; i >= 0; i--) {
+        if (s[i] < ed25519_l[i])
+            return 1;
+        if (s[i] > ed25519_l[i])
+            return 0;
+    }
+    return 0;
+}
+
+/* out = SHA-512(a || b || c) */
+static int
+ed25519_hash(unsigned char *out,
+             const unsigned char *a, size_t a_len,
+             const unsigned char *b, size_t b_len,
+             const unsigned char *c, size_t c_len)
+{
+    libssh2_sha512_ctx ctx;
+
+    if (!libssh2_sha512_init(&ctx)) {
+        return -1;
+    }
+    libssh2_sha512_update(ctx, a, a_len);
+    if (b_len) {
+        libssh2_sha512_update(ctx, b, b_len);
+    }
+    if (c_len) {
+        libssh2_sha512_update(ctx, c, c_len);
+    }
+    libssh2_sha512_final(ctx, out);
+    return 0;
+}
+
+/* The secret scalar is the clamped first half of SHA-512(seed) */
+static int
+ed25519_expand_seed(unsigned char *az, const unsigned char *seed)
+{
+    if (ed25519_hash(az, seed, LIBSSH2_ED25519_KEY_LEN, NULL, 0, NULL, 0)) {
+        return -1;
+    }
+    az[0] &= 248;
+    az[31] &= 127;
+    az[31] |= 64;
+    return 0;
+}
+
+int
+_libssh2_ed25519_ref_publickey(unsigned char *public_key,
+                               const unsigned char *seed)
+{
+    unsigned char az[64];
+    ge base, a;
+    fe d2;
+
+    if (ed25519_expand_seed(az, seed)) {
+        return -1;
+    }
+
+    ge_setup(&base, d2);
+    ge_scalarmult(&a, az, &base, d2);
+    ge_tobytes(public_key, &a);
+
+    memset(az, 0, sizeof(az));
+    return 0;
+}
+
+int
+_libssh2_ed25519_ref_sign(unsigned char *signature,
+                          const unsigned char *m, size_t m_len,
+                          const unsigned char *seed,
+                          const unsigned char *public_key)
+{
+    unsigned char az[64], r[64], k[64];
+    ge base, rp;
+    fe d2;
+    int ret = -1;
+
+    if (ed25519_expand_seed(az, seed)) {
+        return -1;
+    }
+
+    /* r = SHA-512(prefix || m), the per message secret */
+    if (ed25519_hash(r, az + 32, 32, m, m_len, NULL, 0)) {
+        goto clean_exit;
+    }
+    sc_reduce(r);
+
+    ge_setup(&base, d2);
+    ge_scalarmult(&rp, r, &base, d2);
+    ge_tobytes(signature, &rp);
+
+    /* S = (r + SHA-512(R || A || m) * a) mod L */
+    if (ed25519_hash(k, signature, 32, public_key, LIBSSH2_ED25519_KEY_LEN,
+                     m, m_len)) {
+        goto clean_exit;
+    }
+    sc_reduce(k);
+    sc_muladd(signature + 32, k, az, r);
+    ret = 0;
+
+  clean_exit:
+    memset(az, 0, sizeof(az));
+    memset(r, 0, sizeof(r));
+    return ret;
+}
+
+int
+_libssh2_ed25519_ref_verify(const unsigned char *signature,
+                            const unsigned char *m, size_t m_len,
+                            const unsigned char *public_key)
+{
+    unsigned char k[64], check[32];
+    ge base, a, rp;
+    fe d2;
+
+    if (!sc_is_canonical(signature + 32) ||
+        ge_frombytes(&a, public_key)) {
+        return -1;
+    }
+
+    if (ed25519_hash(k, signature, 32, public_key, LIBSSH2_ED25519_KEY_LEN,
+                     m, m_len)) {
+        return -1;
+    }
+    sc_reduce(k);
+
+    /* R must equal S * B - k * A */
+    fe_neg(a.X, a.X);
+    fe_neg(a.T, a.T);
+    ge_setup(&base, d2);
+    ge_double_scalarmult_vartime(&rp, k, &a, signature + 32, &base, d2);
+    ge_tobytes(check, &rp);
+
+    return memcmp(check, signature, 32) ? -1 : 0;
+}
+
+#endif /* LIBSSH2_ED25519 && !LIBSSH2_ED25519_EVP */
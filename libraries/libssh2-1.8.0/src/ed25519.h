@@ -0,0 +1,31 @@
+#ifndef __LIBSSH2_ED25519_H
+#define __LIBSSH2_ED25519_H
+
+/*
+ * Portable Ed25519 (RFC 8032) for crypto backends whose library has none of
+ * its own, such as OpenSSL before 1.1.1. Only SHA-512 is taken from the
+ * backend. See ed25519.c.
+ */
+
+#define LIBSSH2_ED25519_KEY_LEN 32
+#define LIBSSH2_ED25519_SIG_LEN 64
+
+struct _libssh2_ed25519_key
+{
+    unsigned char public_key[LIBSSH2_ED25519_KEY_LEN];
+    /* the 32 byte private seed, valid when has_private is set */
+    unsigned char seed[LIBSSH2_ED25519_KEY_LEN];
+    int has_private;
+};
+
+int _libssh2_ed25519_ref_publickey(unsigned char *public_key,
+                                   const unsigned char *seed);
+int _libssh2_ed25519_ref_sign(unsigned char *signature,
+                              const unsigned char *m, size_t m_len,
+                              const unsigned char *seed,
+                              const unsigned char *public_key);
+int _libssh2_ed25519_ref_verify(const unsigned char *signature,
+                                const unsigned char *m, size_t m_len,
+                                const unsigned char *public_key);
+
+#endif /* __LIBSSH2_ED25519_H */
@@ -483,7 +483,564 @@ static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ssh_dss = {
 };
 #endif /* LIBSSH2_DSA */
 
+#if LIBSSH2_ECDSA
+/* *********************
+ * ecdsa-sha2-nistpNNN *
+ ********************* */
+
+static int hostkey_method_ssh_ecdsa_dtor(LIBSSH2_SESSION * session,
+                                         void **abstract);
+
+/*
+ * hostkey_method_ssh_ecdsa_curve
+ *
+ * Map "ecdsa-sha2-nistpNNN" to its curve
+ */
+static int
+hostkey_method_ssh_ecdsa_curve(const unsigned char *name, size_t name_len,
+                               libssh2_curve_type *curve)
+{
+    if (name_len != 19 || memcmp(name, "ecdsa-sha2-nistp", 16) != 0) {
+        return -1;
+    }
+    if (memcmp(name + 16, "256", 3) == 0)
+        *curve = LIBSSH2_EC_CURVE_NISTP256;
+    else if (memcmp(name + 16, "384", 3) == 0)
+        *curve = LIBSSH2_EC_CURVE_NISTP384;
+    else if (memcmp(name + 16, "521", 3) == 0)
+        *curve = LIBSSH2_EC_CURVE_NISTP521;
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_hash
+ *
+ * Hash the vectors with the SHA-2 variant RFC 5656 pairs with the curve
+ */
+static int
+hostkey_method_ssh_ecdsa_hash(libssh2_curve_type curve, int veccount,
+                              const struct iovec datavec[],
+                              unsigned char *hash, size_t *hash_len)
+{
+    int i;
+
+    switch (curve) {
+    case LIBSSH2_EC_CURVE_NISTP256: {
+        libssh2_sha256_ctx ctx;
+
+        if (!libssh2_sha256_init(&ctx)) {
+            return -1;
+        }
+        for(i = 0; i < veccount; i++) {
+            libssh2_sha256_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha256_final(ctx, hash);
+        *hash_len = SHA256_DIGEST_LENGTH;
+        return 0;
+    }
+    case LIBSSH2_EC_CURVE_NISTP384: {
+        libssh2_sha384_ctx ctx;
+
+        if (!libssh2_sha384_init(&ctx)) {
+            return -1;
+        }
+        for(i = 0; i < veccount; i++) {
+            libssh2_sha384_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha384_final(ctx, hash);
+        *hash_len = SHA384_DIGEST_LENGTH;
+        return 0;
+    }
+    case LIBSSH2_EC_CURVE_NISTP521: {
+        libssh2_sha512_ctx ctx;
+
+        if (!libssh2_sha512_init(&ctx)) {
+            return -1;
+        }
+        for(i = 0; i < veccount; i++) {
+            libssh2_sha512_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha512_final(ctx, hash);
+        *hash_len = SHA512_DIGEST_LENGTH;
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_init
+ *
+ * Initialize the server hostkey working area with the curve and point Q
+ */
+static int
+hostkey_method_ssh_ecdsa_init(LIBSSH2_SESSION * session,
+                              const unsigned char *hostkey_data,
+                              size_t hostkey_data_len,
+                              void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    libssh2_curve_type curve;
+    const unsigned char *s, *end, *name, *curve_name, *q;
+    size_t name_len, curve_name_len, q_len;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    s = hostkey_data;
+    end = hostkey_data + hostkey_data_len;
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        hostkey_method_ssh_ecdsa_curve(name, name_len, &curve)) {
+        return -1;
+    }
+
+    /* The curve identifier repeats the "nistpNNN" tail of the name */
+    if (_libssh2_get_string(&s, end, &curve_name, &curve_name_len) ||
+        curve_name_len != 8 || memcmp(curve_name, name + 11, 8) != 0) {
+        return -1;
+    }
+
+    if (_libssh2_get_string(&s, end, &q, &q_len)) {
+        return -1;
+    }
+
+    if (_libssh2_ecdsa_new_public(&ecdsactx, curve, q, q_len)) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_initPEM
+ *
+ * Load a Private Key from a PEM file
+ */
+static int
+hostkey_method_ssh_ecdsa_initPEM(LIBSSH2_SESSION * session,
+                                 const char *privkeyfile,
+                                 unsigned const char *passphrase,
+                                 void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    ret = _libssh2_ecdsa_new_private(&ecdsactx, session, privkeyfile,
+                                     passphrase);
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_initPEMFromMemory
+ *
+ * Load a Private Key from memory
+ */
+static int
+hostkey_method_ssh_ecdsa_initPEMFromMemory(LIBSSH2_SESSION * session,
+                                           const char *privkeyfiledata,
+                                           size_t privkeyfiledata_len,
+                                           unsigned const char *passphrase,
+                                           void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    ret = _libssh2_ecdsa_new_private_frommemory(&ecdsactx, session,
+                                                privkeyfiledata,
+                                                privkeyfiledata_len,
+                                                passphrase);
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_sig_verify
+ *
+ * Verify signature created by remote
+ */
+static int
+hostkey_method_ssh_ecdsa_sig_verify(LIBSSH2_SESSION * session,
+                                    const unsigned char *sig,
+                                    size_t sig_len,
+                                    const unsigned char *m,
+                                    size_t m_len, void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    libssh2_curve_type key_curve, sig_curve;
+    const unsigned char *s, *end, *name, *blob, *r_bn, *s_bn;
+    size_t name_len, blob_len, r_len, s_len, hash_len;
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    struct iovec datavec;
+
+    /* string "ecdsa-sha2-nistpNNN" + string (mpint r + mpint s) */
+    s = sig;
+    end = sig + sig_len;
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        hostkey_method_ssh_ecdsa_curve(name, name_len, &sig_curve) ||
+        _libssh2_ecdsa_get_curve_type(ecdsactx, &key_curve) ||
+        sig_curve != key_curve) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ECDSA signature type");
+    }
+
+    if (_libssh2_get_string(&s, end, &blob, &blob_len)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ECDSA signature length");
+    }
+
+    s = blob;
+    end = blob + blob_len;
+    if (_libssh2_get_string(&s, end, &r_bn, &r_len) ||
+        _libssh2_get_string(&s, end, &s_bn, &s_len)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ECDSA signature length");
+    }
+
+    datavec.iov_base = (void *) m;
+    datavec.iov_len = m_len;
+    if (hostkey_method_ssh_ecdsa_hash(key_curve, 1, &datavec,
+                                      hash, &hash_len)) {
+        return -1;
+    }
+
+    return _libssh2_ecdsa_verify(ecdsactx, r_bn, r_len, s_bn, s_len,
+                                 hash, hash_len);
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_signv
+ *
+ * Construct a signature from an array of vectors
+ */
+static int
+hostkey_method_ssh_ecdsa_signv(LIBSSH2_SESSION * session,
+                               unsigned char **signature,
+                               size_t *signature_len,
+                               int veccount,
+                               const struct iovec datavec[],
+                               void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    libssh2_curve_type curve;
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    size_t hash_len;
+
+    if (_libssh2_ecdsa_get_curve_type(ecdsactx, &curve) ||
+        hostkey_method_ssh_ecdsa_hash(curve, veccount, datavec,
+                                      hash, &hash_len)) {
+        return -1;
+    }
+
+    return _libssh2_ecdsa_sign(session, ecdsactx, hash, hash_len,
+                               signature, signature_len);
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_dtor
+ *
+ * Shutdown the hostkey method
+ */
+static int
+hostkey_method_ssh_ecdsa_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    (void) session;
+
+    _libssh2_ecdsa_free(ecdsactx);
+
+    *abstract = NULL;
+
+    return 0;
+}
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp256 = {
+    "ecdsa-sha2-nistp256",
+    SHA256_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp384 = {
+    "ecdsa-sha2-nistp384",
+    SHA384_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp521 = {
+    "ecdsa-sha2-nistp521",
+    SHA512_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+/* ***************
+ * ssh-ed25519 *
+ *************** */
+
+static int hostkey_method_ssh_ed25519_dtor(LIBSSH2_SESSION * session,
+                                           void **abstract);
+
+/*
+ * hostkey_method_ssh_ed25519_init
+ *
+ * Initialize the server hostkey working area with the 32 byte public key
+ */
+static int
+hostkey_method_ssh_ed25519_init(LIBSSH2_SESSION * session,
+                                const unsigned char *hostkey_data,
+                                size_t hostkey_data_len,
+                                void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    const unsigned char *s, *end, *name, *key;
+    size_t name_len, key_len;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    s = hostkey_data;
+    end = hostkey_data + hostkey_data_len;
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        name_len != 11 || memcmp(name, "ssh-ed25519", 11) != 0) {
+        return -1;
+    }
+
+    if (_libssh2_get_string(&s, end, &key, &key_len)) {
+        return -1;
+    }
+
+    if (_libssh2_ed25519_new_public(&ed25519ctx, key, key_len)) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_initPEM
+ *
+ * Load a Private Key from a PEM file
+ */
+static int
+hostkey_method_ssh_ed25519_initPEM(LIBSSH2_SESSION * session,
+                                   const char *privkeyfile,
+                                   unsigned const char *passphrase,
+                                   void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    ret = _libssh2_ed25519_new_private(&ed25519ctx, session, privkeyfile,
+                                       passphrase);
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_initPEMFromMemory
+ *
+ * Load a Private Key from memory
+ */
+static int
+hostkey_method_ssh_ed25519_initPEMFromMemory(LIBSSH2_SESSION * session,
+                                             const char *privkeyfiledata,
+                                             size_t privkeyfiledata_len,
+                                             unsigned const char *passphrase,
+                                             void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    ret = _libssh2_ed25519_new_private_frommemory(&ed25519ctx, session,
+                                                  privkeyfiledata,
+                                                  privkeyfiledata_len,
+                                                  passphrase);
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_sig_verify
+ *
+ * Verify signature created by remote
+ */
+static int
+hostkey_method_ssh_ed25519_sig_verify(LIBSSH2_SESSION * session,
+                                      const unsigned char *sig,
+                                      size_t sig_len,
+                                      const unsigned char *m,
+                                      size_t m_len, void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    const unsigned char *s, *end, *name, *blob;
+    size_t name_len, blob_len;
+
+    /* string "ssh-ed25519" + string signature(64) */
+    s = sig;
+    end = sig + sig_len;
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        name_len != 11 || memcmp(name, "ssh-ed25519", 11) != 0 ||
+        _libssh2_get_string(&s, end, &blob, &blob_len) || blob_len != 64) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ED25519 signature length");
+    }
+
+    return _libssh2_ed25519_verify(ed25519ctx, blob, blob_len, m, m_len);
+}
+
+/*
+ * hostkey_method_ssh_ed25519_signv
+ *
+ * Construct a signature from an array of vectors
+ */
+static int
+hostkey_method_ssh_ed25519_signv(LIBSSH2_SESSION * session,
+                                 unsigned char **signature,
+                                 size_t *signature_len,
+                                 int veccount,
+                                 const struct iovec datavec[],
+                                 void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    unsigned char *m, *p;
+    size_t m_len = 0;
+    int i, ret;
+
+    /* Ed25519 signs the message itself rather than a digest of it, so the
+       vectors have to be joined first */
+    for(i = 0; i < veccount; i++) {
+        m_len += datavec[i].iov_len;
+    }
+    m = LIBSSH2_ALLOC(session, m_len ? m_len : 1);
+    if (!m) {
+        return -1;
+    }
+    for(p = m, i = 0; i < veccount; i++) {
+        memcpy(p, datavec[i].iov_base, datavec[i].iov_len);
+        p += datavec[i].iov_len;
+    }
+
+    ret = _libssh2_ed25519_sign(session, ed25519ctx, m, m_len,
+                                signature, signature_len);
+    LIBSSH2_FREE(session, m);
+
+    return ret;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_dtor
+ *
+ * Shutdown the hostkey method
+ */
+static int
+hostkey_method_ssh_ed25519_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    (void) session;
+
+    _libssh2_ed25519_free(ed25519ctx);
+
+    *abstract = NULL;
+
+    return 0;
+}
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ssh_ed25519 = {
+    "ssh-ed25519",
+    SHA256_DIGEST_LENGTH,
+    hostkey_method_ssh_ed25519_init,
+    hostkey_method_ssh_ed25519_initPEM,
+    hostkey_method_ssh_ed25519_initPEMFromMemory,
+    hostkey_method_ssh_ed25519_sig_verify,
+    hostkey_method_ssh_ed25519_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ed25519_dtor,
+};
+#endif /* LIBSSH2_ED25519 */
+
 static const LIBSSH2_HOSTKEY_METHOD *hostkey_methods[] = {
+#if LIBSSH2_ED25519
+    &hostkey_method_ssh_ed25519,
+#endif /* LIBSSH2_ED25519 */
+#if LIBSSH2_ECDSA
+    &hostkey_method_ecdsa_ssh_nistp256,
+    &hostkey_method_ecdsa_ssh_nistp384,
+    &hostkey_method_ecdsa_ssh_nistp521,
+#endif /* LIBSSH2_ECDSA */
 #if LIBSSH2_RSA
     &hostkey_method_ssh_rsa,
 #endif /* LIBSSH2_RSA */
@@ -536,6 +1093,21 @@ static int hostkey_type(const unsigned char *hostkey, size_t len)
     const unsigned char dss[] = {
         0, 0, 0, 0x07, 's', 's', 'h', '-', 'd', 's', 's'
     };
+    const unsigned char ed25519[] = {
+        0, 0, 0, 0x0b, 's', 's', 'h', '-', 'e', 'd', '2', '5', '5', '1', '9'
+    };
+    const unsigned char ecdsa_256[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '2', '5', '6'
+    };
+    const unsigned char ecdsa_384[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '3', '8', '4'
+    };
+    const unsigned char ecdsa_521[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '5', '2', '1'
+    };
 
     if (len < 11)
         return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
@@ -546,6 +1118,24 @@ static int hostkey_type(const unsigned char *hostkey, size_t len)
     if (!memcmp(dss, hostkey, 11))
         return LIBSSH2_HOSTKEY_TYPE_DSS;
 
+    if (len < 15)
+        return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
+
+    if (!memcmp(ed25519, hostkey, 15))
+        return LIBSSH2_HOSTKEY_TYPE_ED25519;
+
+    if (len < 23)
+        return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
+
+    if (!memcmp(ecdsa_256, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_256;
+
+    if (!memcmp(ecdsa_384, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_384;
+
+    if (!memcmp(ecdsa_521, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_521;
+
     return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
 }
 
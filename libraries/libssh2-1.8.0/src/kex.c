@@ -614,13 +614,17 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->local.mac->init(session, key, &free_key,
-                                     &session->local.mac_abstract);
+            rc = session->local.mac->init(session, key, &free_key,
+                                          &session->local.mac_abstract);
 
             if (free_key) {
                 memset(key, 0, session->local.mac->key_len);
                 LIBSSH2_FREE(session, key);
             }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
         }
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Client to Server HMAC Key calculated");
@@ -640,13 +644,17 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->remote.mac->init(session, key, &free_key,
-                                      &session->remote.mac_abstract);
+            rc = session->remote.mac->init(session, key, &free_key,
+                                           &session->remote.mac_abstract);
 
             if (free_key) {
                 memset(key, 0, session->remote.mac->key_len);
                 LIBSSH2_FREE(session, key);
             }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
         }
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Server to Client HMAC Key calculated");
@@ -1236,13 +1244,17 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->local.mac->init(session, key, &free_key,
-                                     &session->local.mac_abstract);
+            rc = session->local.mac->init(session, key, &free_key,
+                                          &session->local.mac_abstract);
 
             if (free_key) {
                 memset(key, 0, session->local.mac->key_len);
                 LIBSSH2_FREE(session, key);
             }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
         }
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Client to Server HMAC Key calculated");
@@ -1262,13 +1274,17 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->remote.mac->init(session, key, &free_key,
-                                      &session->remote.mac_abstract);
+            rc = session->remote.mac->init(session, key, &free_key,
+                                           &session->remote.mac_abstract);
 
             if (free_key) {
                 memset(key, 0, session->remote.mac->key_len);
                 LIBSSH2_FREE(session, key);
             }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
         }
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Server to Client HMAC Key calculated");
@@ -1678,180 +1694,986 @@ kex_method_diffie_hellman_group_exchange_sha256_key_exchange
 }
 
 
-#define LIBSSH2_KEX_METHOD_FLAG_REQ_ENC_HOSTKEY     0x0001
-#define LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY    0x0002
-
-static const LIBSSH2_KEX_METHOD kex_method_diffie_helman_group1_sha1 = {
-    "diffie-hellman-group1-sha1",
-    kex_method_diffie_hellman_group1_sha1_key_exchange,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
-};
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519
 
-static const LIBSSH2_KEX_METHOD kex_method_diffie_helman_group14_sha1 = {
-    "diffie-hellman-group14-sha1",
-    kex_method_diffie_hellman_group14_sha1_key_exchange,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
-};
+/* SHA-2 hash of the curve based key exchanges, sized by their curve */
+typedef union
+{
+    libssh2_sha256_ctx sha256;
+#if LIBSSH2_ECDH
+    libssh2_sha384_ctx sha384;
+    libssh2_sha512_ctx sha512;
+#endif
+} kex_sha2_ctx;
 
-static const LIBSSH2_KEX_METHOD
-kex_method_diffie_helman_group_exchange_sha1 = {
-    "diffie-hellman-group-exchange-sha1",
-    kex_method_diffie_hellman_group_exchange_sha1_key_exchange,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
-};
+static int
+kex_sha2_init(kex_sha2_ctx *ctx, size_t digest_len)
+{
+    switch (digest_len) {
+#if LIBSSH2_ECDH
+    case SHA384_DIGEST_LENGTH:
+        return libssh2_sha384_init(&ctx->sha384);
+    case SHA512_DIGEST_LENGTH:
+        return libssh2_sha512_init(&ctx->sha512);
+#endif
+    default:
+        return libssh2_sha256_init(&ctx->sha256);
+    }
+}
 
-static const LIBSSH2_KEX_METHOD
-kex_method_diffie_helman_group_exchange_sha256 = {
-    "diffie-hellman-group-exchange-sha256",
-    kex_method_diffie_hellman_group_exchange_sha256_key_exchange,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
-};
+static void
+kex_sha2_update(kex_sha2_ctx *ctx, size_t digest_len,
+                const void *data, size_t len)
+{
+    switch (digest_len) {
+#if LIBSSH2_ECDH
+    case SHA384_DIGEST_LENGTH:
+        libssh2_sha384_update(ctx->sha384, data, len);
+        break;
+    case SHA512_DIGEST_LENGTH:
+        libssh2_sha512_update(ctx->sha512, data, len);
+        break;
+#endif
+    default:
+        libssh2_sha256_update(ctx->sha256, data, len);
+        break;
+    }
+}
 
-static const LIBSSH2_KEX_METHOD *libssh2_kex_methods[] = {
-    &kex_method_diffie_helman_group_exchange_sha256,
-    &kex_method_diffie_helman_group_exchange_sha1,
-    &kex_method_diffie_helman_group14_sha1,
-    &kex_method_diffie_helman_group1_sha1,
-    NULL
-};
+static void
+kex_sha2_final(kex_sha2_ctx *ctx, size_t digest_len, unsigned char *out)
+{
+    switch (digest_len) {
+#if LIBSSH2_ECDH
+    case SHA384_DIGEST_LENGTH:
+        libssh2_sha384_final(ctx->sha384, out);
+        break;
+    case SHA512_DIGEST_LENGTH:
+        libssh2_sha512_final(ctx->sha512, out);
+        break;
+#endif
+    default:
+        libssh2_sha256_final(ctx->sha256, out);
+        break;
+    }
+}
 
-typedef struct _LIBSSH2_COMMON_METHOD
+/* Hashes (data, len) as an SSH string: uint32 length, then the bytes */
+static void
+kex_sha2_update_string(kex_sha2_ctx *ctx, size_t digest_len,
+                       const void *data, size_t len)
 {
-    const char *name;
-} LIBSSH2_COMMON_METHOD;
+    unsigned char len_buf[4];
 
-/* kex_method_strlen
- * Calculate the length of a particular method list's resulting string
- * Includes SUM(strlen() of each individual method plus 1 (for coma)) - 1 (because the last coma isn't used)
- * Another sign of bad coding practices gone mad.  Pretend you don't see this.
+    _libssh2_htonu32(len_buf, len);
+    kex_sha2_update(ctx, digest_len, len_buf, 4);
+    kex_sha2_update(ctx, digest_len, data, len);
+}
+
+/*
+ * kex_sha2_derive
+ *
+ * RFC 4253 section 7.2 key derivation, HASH(K || H || version || session_id)
+ * extended with HASH(K || H || K1 || ...) until reqlen bytes are available.
+ * Returns a LIBSSH2_ALLOC'ed buffer or NULL.
  */
-static size_t
-kex_method_strlen(LIBSSH2_COMMON_METHOD ** method)
+static unsigned char *
+kex_sha2_derive(LIBSSH2_SESSION *session,
+                kmdhgGPshakex_state_t *exchange_state, size_t digest_len,
+                size_t reqlen, const char *version)
 {
+    kex_sha2_ctx hash;
+    unsigned char *value;
     size_t len = 0;
 
-    if (!method || !*method) {
-        return 0;
-    }
+    value = LIBSSH2_ALLOC(session, reqlen + digest_len);
+    if (!value)
+        return NULL;
 
-    while (*method && (*method)->name) {
-        len += strlen((*method)->name) + 1;
-        method++;
+    while (len < reqlen) {
+        if (!kex_sha2_init(&hash, digest_len)) {
+            LIBSSH2_FREE(session, value);
+            return NULL;
+        }
+        kex_sha2_update(&hash, digest_len, exchange_state->k_value,
+                        exchange_state->k_value_len);
+        kex_sha2_update(&hash, digest_len, exchange_state->h_sig_comp,
+                        digest_len);
+        if (len > 0) {
+            kex_sha2_update(&hash, digest_len, value, len);
+        } else {
+            kex_sha2_update(&hash, digest_len, version, 1);
+            kex_sha2_update(&hash, digest_len, session->session_id,
+                            session->session_id_len);
+        }
+        kex_sha2_final(&hash, digest_len, value + len);
+        len += digest_len;
     }
 
-    return len - 1;
+    return value;
 }
 
-
-
-/* kex_method_list
- * Generate formatted preference list in buf
+/*
+ * ecdh_sha2
+ *
+ * Elliptic Curve Diffie Hellman Key Exchange, Curve Agnostic (RFC 5656,
+ * RFC 8731). The exchange hash is SHA-2 of digest_len bytes.
  */
-static size_t
-kex_method_list(unsigned char *buf, size_t list_strlen,
-                LIBSSH2_COMMON_METHOD ** method)
+static int ecdh_sha2(LIBSSH2_SESSION *session,
+                     libssh2_curve_type curve,
+                     size_t digest_len,
+                     kmdhgGPshakex_state_t *exchange_state)
 {
-    _libssh2_htonu32(buf, list_strlen);
-    buf += 4;
+    int ret = 0;
+    int rc;
+    kex_sha2_ctx exchange_hash_ctx;
 
-    if (!method || !*method) {
-        return 4;
-    }
+    if (exchange_state->state == libssh2_NB_state_idle) {
+        unsigned char *q_c = NULL;
+        size_t q_c_len = 0;
 
-    while (*method && (*method)->name) {
-        int mlen = strlen((*method)->name);
-        memcpy(buf, (*method)->name, mlen);
-        buf += mlen;
-        *(buf++) = ',';
-        method++;
-    }
+        /* Setup initial values */
+        exchange_state->e_packet = NULL;
+        exchange_state->s_packet = NULL;
+        exchange_state->k_value = NULL;
+        exchange_state->ecdh_key = NULL;
+        exchange_state->k = _libssh2_bn_init(); /* The shared secret */
 
-    return list_strlen + 4;
-}
+        /* Zero the whole thing out */
+        memset(&exchange_state->req_state, 0, sizeof(packet_require_state_t));
 
+        /* Generate our ephemeral key pair */
+        if (_libssh2_ecdh_new(session, curve, &exchange_state->ecdh_key,
+                              &q_c, &q_c_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to create ephemeral ECDH key");
+            goto clean_exit;
+        }
 
+        /* Send KEX init */
+        /* packet_type(1) + String Length(4) + Q_C */
+        exchange_state->e_packet_len = q_c_len + 5;
+        exchange_state->e_packet =
+            LIBSSH2_ALLOC(session, exchange_state->e_packet_len);
+        if (!exchange_state->e_packet) {
+            LIBSSH2_FREE(session, q_c);
+            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                 "Out of memory error");
+            goto clean_exit;
+        }
+        exchange_state->e_packet[0] = SSH_MSG_KEX_ECDH_INIT;
+        _libssh2_htonu32(exchange_state->e_packet + 1, q_c_len);
+        memcpy(exchange_state->e_packet + 5, q_c, q_c_len);
+        LIBSSH2_FREE(session, q_c);
 
-#define LIBSSH2_METHOD_PREFS_LEN(prefvar, defaultvar)           \
-    ((prefvar) ? strlen(prefvar) :                              \
-     kex_method_strlen((LIBSSH2_COMMON_METHOD**)(defaultvar)))
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Sending KEX packet %d",
+                       (int) SSH_MSG_KEX_ECDH_INIT);
+        exchange_state->state = libssh2_NB_state_created;
+    }
 
-#define LIBSSH2_METHOD_PREFS_STR(buf, prefvarlen, prefvar, defaultvar)  \
-    if (prefvar) {                                                      \
-        _libssh2_htonu32((buf), (prefvarlen));                          \
-        buf += 4;                                                       \
-        memcpy((buf), (prefvar), (prefvarlen));                         \
-        buf += (prefvarlen);                                            \
-    } else {                                                            \
-        buf += kex_method_list((buf), (prefvarlen),                     \
-                               (LIBSSH2_COMMON_METHOD**)(defaultvar));  \
+    if (exchange_state->state == libssh2_NB_state_created) {
+        rc = _libssh2_transport_send(session, exchange_state->e_packet,
+                                     exchange_state->e_packet_len,
+                                     NULL, 0);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc,
+                                 "Unable to send KEX init message");
+            goto clean_exit;
+        }
+        exchange_state->state = libssh2_NB_state_sent;
     }
 
-/* kexinit
- * Send SSH_MSG_KEXINIT packet
- */
-static int kexinit(LIBSSH2_SESSION * session)
-{
-    /* 62 = packet_type(1) + cookie(16) + first_packet_follows(1) +
-       reserved(4) + length longs(40) */
-    size_t data_len = 62;
-    size_t kex_len, hostkey_len = 0;
-    size_t crypt_cs_len, crypt_sc_len;
-    size_t comp_cs_len, comp_sc_len;
-    size_t mac_cs_len, mac_sc_len;
-    size_t lang_cs_len, lang_sc_len;
-    unsigned char *data, *s;
-    int rc;
+    if (exchange_state->state == libssh2_NB_state_sent) {
+        if (session->burn_optimistic_kexinit) {
+            /* The first KEX packet to come along will be the guess initially
+             * sent by the server.  That guess turned out to be wrong so we
+             * need to silently ignore it */
+            int burn_type;
 
-    if (session->kexinit_state == libssh2_NB_state_idle) {
-        kex_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->kex_prefs, libssh2_kex_methods);
-        hostkey_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->hostkey_prefs,
-                                     libssh2_hostkey_methods());
-        crypt_cs_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->local.crypt_prefs,
-                                     libssh2_crypt_methods());
-        crypt_sc_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->remote.crypt_prefs,
-                                     libssh2_crypt_methods());
-        mac_cs_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->local.mac_prefs,
-                                     _libssh2_mac_methods());
-        mac_sc_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->remote.mac_prefs,
-                                     _libssh2_mac_methods());
-        comp_cs_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->local.comp_prefs,
-                                     _libssh2_comp_methods(session));
-        comp_sc_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->remote.comp_prefs,
-                                     _libssh2_comp_methods(session));
-        lang_cs_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->local.lang_prefs, NULL);
-        lang_sc_len =
-            LIBSSH2_METHOD_PREFS_LEN(session->remote.lang_prefs, NULL);
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Waiting for badly guessed KEX packet (to be ignored)");
+            burn_type =
+                _libssh2_packet_burn(session, &exchange_state->burn_state);
+            if (burn_type == LIBSSH2_ERROR_EAGAIN) {
+                return burn_type;
+            } else if (burn_type <= 0) {
+                /* Failed to receive a packet */
+                ret = burn_type;
+                goto clean_exit;
+            }
+            session->burn_optimistic_kexinit = 0;
 
-        data_len += kex_len + hostkey_len + crypt_cs_len + crypt_sc_len +
-            comp_cs_len + comp_sc_len + mac_cs_len + mac_sc_len +
-            lang_cs_len + lang_sc_len;
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Burnt packet of type: %02x",
+                           (unsigned int) burn_type);
+        }
 
-        s = data = LIBSSH2_ALLOC(session, data_len);
-        if (!data) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory");
+        exchange_state->state = libssh2_NB_state_sent1;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent1) {
+        const unsigned char *s, *end, *hostkey, *q_s, *h_sig;
+        size_t hostkey_len;
+
+        /* Wait for KEX reply */
+        rc = _libssh2_packet_require(session, SSH_MSG_KEX_ECDH_REPLY,
+                                     &exchange_state->s_packet,
+                                     &exchange_state->s_packet_len, 0, NULL,
+                                     0, &exchange_state->req_state);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+        if (rc) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_TIMEOUT,
+                                 "Timed out waiting for KEX reply");
+            goto clean_exit;
         }
 
-        *(s++) = SSH_MSG_KEXINIT;
+        /* Parse KEX_ECDH_REPLY: string K_S, string Q_S, string signature */
+        s = exchange_state->s_packet + 1;
+        end = exchange_state->s_packet + exchange_state->s_packet_len;
 
-        _libssh2_random(s, 16);
-        s += 16;
+        if (_libssh2_get_string(&s, end, &hostkey, &hostkey_len) ||
+            _libssh2_get_string(&s, end, &q_s,
+                                &exchange_state->f_value_len) ||
+            _libssh2_get_string(&s, end, &h_sig,
+                                &exchange_state->h_sig_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                                 "Malformed KEX ECDH reply");
+            goto clean_exit;
+        }
+        /* both point into s_packet, which lives until clean_exit */
+        exchange_state->f_value = (unsigned char *) q_s;
+        exchange_state->h_sig = (unsigned char *) h_sig;
 
-        /* Ennumerating through these lists twice is probably (certainly?)
-           inefficient from a CPU standpoint, but it saves multiple
-           malloc/realloc calls */
-        LIBSSH2_METHOD_PREFS_STR(s, kex_len, session->kex_prefs,
-                                 libssh2_kex_methods);
-        LIBSSH2_METHOD_PREFS_STR(s, hostkey_len, session->hostkey_prefs,
+        if (session->server_hostkey)
+            LIBSSH2_FREE(session, session->server_hostkey);
+
+        session->server_hostkey_len = hostkey_len;
+        session->server_hostkey =
+            LIBSSH2_ALLOC(session, session->server_hostkey_len);
+        if (!session->server_hostkey) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                 "Unable to allocate memory for a copy "
+                                 "of the host key");
+            goto clean_exit;
+        }
+        memcpy(session->server_hostkey, hostkey,
+               session->server_hostkey_len);
+
+#if LIBSSH2_MD5
+        {
+            libssh2_md5_ctx fingerprint_ctx;
+
+            if (libssh2_md5_init(&fingerprint_ctx)) {
+                libssh2_md5_update(fingerprint_ctx, session->server_hostkey,
+                                   session->server_hostkey_len);
+                libssh2_md5_final(fingerprint_ctx,
+                                  session->server_hostkey_md5);
+                session->server_hostkey_md5_valid = TRUE;
+            }
+            else {
+                session->server_hostkey_md5_valid = FALSE;
+            }
+        }
+#ifdef LIBSSH2DEBUG
+        {
+            char fingerprint[50], *fprint = fingerprint;
+            int i;
+            for(i = 0; i < 16; i++, fprint += 3) {
+                snprintf(fprint, 4, "%02x:", session->server_hostkey_md5[i]);
+            }
+            *(--fprint) = '\0';
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Server's MD5 Fingerprint: %s", fingerprint);
+        }
+#endif /* LIBSSH2DEBUG */
+#endif /* ! LIBSSH2_MD5 */
+
+        {
+            libssh2_sha1_ctx fingerprint_ctx;
+
+            if (libssh2_sha1_init(&fingerprint_ctx)) {
+                libssh2_sha1_update(fingerprint_ctx, session->server_hostkey,
+                                    session->server_hostkey_len);
+                libssh2_sha1_final(fingerprint_ctx,
+                                   session->server_hostkey_sha1);
+                session->server_hostkey_sha1_valid = TRUE;
+            }
+            else {
+                session->server_hostkey_sha1_valid = FALSE;
+            }
+        }
+#ifdef LIBSSH2DEBUG
+        {
+            char fingerprint[64], *fprint = fingerprint;
+            int i;
+
+            for(i = 0; i < 20; i++, fprint += 3) {
+                snprintf(fprint, 4, "%02x:", session->server_hostkey_sha1[i]);
+            }
+            *(--fprint) = '\0';
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Server's SHA1 Fingerprint: %s", fingerprint);
+        }
+#endif /* LIBSSH2DEBUG */
+
+        if (session->hostkey->init(session, session->server_hostkey,
+                                   session->server_hostkey_len,
+                                   &session->server_hostkey_abstract)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_INIT,
+                                 "Unable to initialize hostkey importer");
+            goto clean_exit;
+        }
+
+        /* Compute the shared secret from Q_S */
+        if (_libssh2_ecdh_gen_k(exchange_state->k, exchange_state->ecdh_key,
+                                exchange_state->f_value,
+                                exchange_state->f_value_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to compute the ECDH shared secret");
+            goto clean_exit;
+        }
+        exchange_state->k_value_len = _libssh2_bn_bytes(exchange_state->k) + 5;
+        if (_libssh2_bn_bits(exchange_state->k) % 8) {
+            /* don't need leading 00 */
+            exchange_state->k_value_len--;
+        }
+        exchange_state->k_value =
+            LIBSSH2_ALLOC(session, exchange_state->k_value_len);
+        if (!exchange_state->k_value) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                 "Unable to allocate buffer for K");
+            goto clean_exit;
+        }
+        _libssh2_htonu32(exchange_state->k_value,
+                         exchange_state->k_value_len - 4);
+        if (_libssh2_bn_bits(exchange_state->k) % 8) {
+            _libssh2_bn_to_bin(exchange_state->k, exchange_state->k_value + 4);
+        } else {
+            exchange_state->k_value[4] = 0;
+            _libssh2_bn_to_bin(exchange_state->k, exchange_state->k_value + 5);
+        }
+
+        /* H = HASH(V_C || V_S || I_C || I_S || K_S || Q_C || Q_S || K) */
+        exchange_state->exchange_hash = (void*)&exchange_hash_ctx;
+        if (!kex_sha2_init(&exchange_hash_ctx, digest_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to initialize the exchange hash");
+            goto clean_exit;
+        }
+
+        if (session->local.banner) {
+            kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                                   session->local.banner,
+                                   strlen((char *) session->local.banner)
+                                   - 2);
+        } else {
+            kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                                   LIBSSH2_SSH_DEFAULT_BANNER,
+                                   sizeof(LIBSSH2_SSH_DEFAULT_BANNER) - 1);
+        }
+        kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                               session->remote.banner,
+                               strlen((char *) session->remote.banner));
+        kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                               session->local.kexinit,
+                               session->local.kexinit_len);
+        kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                               session->remote.kexinit,
+                               session->remote.kexinit_len);
+        kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                               session->server_hostkey,
+                               session->server_hostkey_len);
+        /* Q_C, already in string form in the init packet */
+        kex_sha2_update(&exchange_hash_ctx, digest_len,
+                        exchange_state->e_packet + 1,
+                        exchange_state->e_packet_len - 1);
+        kex_sha2_update_string(&exchange_hash_ctx, digest_len,
+                               exchange_state->f_value,
+                               exchange_state->f_value_len);
+        kex_sha2_update(&exchange_hash_ctx, digest_len,
+                        exchange_state->k_value,
+                        exchange_state->k_value_len);
+
+        kex_sha2_final(&exchange_hash_ctx, digest_len,
+                       exchange_state->h_sig_comp);
+
+        if (session->hostkey->
+            sig_verify(session, exchange_state->h_sig,
+                       exchange_state->h_sig_len, exchange_state->h_sig_comp,
+                       digest_len, &session->server_hostkey_abstract)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_SIGN,
+                                 "Unable to verify hostkey signature");
+            goto clean_exit;
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Sending NEWKEYS message");
+        exchange_state->c = SSH_MSG_NEWKEYS;
+
+        exchange_state->state = libssh2_NB_state_sent2;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent2) {
+        rc = _libssh2_transport_send(session, &exchange_state->c, 1, NULL, 0);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc, "Unable to send NEWKEYS message");
+            goto clean_exit;
+        }
+
+        exchange_state->state = libssh2_NB_state_sent3;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent3) {
+        rc = _libssh2_packet_require(session, SSH_MSG_NEWKEYS,
+                                     &exchange_state->tmp,
+                                     &exchange_state->tmp_len, 0, NULL, 0,
+                                     &exchange_state->req_state);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc, "Timed out waiting for NEWKEYS");
+            goto clean_exit;
+        }
+        /* The first key exchange has been performed,
+           switch to active crypt/comp/mac mode */
+        session->state |= LIBSSH2_STATE_NEWKEYS;
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Received NEWKEYS message");
+
+        /* This will actually end up being just packet_type(1)
+           for this packet type anyway */
+        LIBSSH2_FREE(session, exchange_state->tmp);
+
+        if (!session->session_id) {
+            session->session_id = LIBSSH2_ALLOC(session, digest_len);
+            if (!session->session_id) {
+                ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                     "Unable to allocate buffer for SHA digest");
+                goto clean_exit;
+            }
+            memcpy(session->session_id, exchange_state->h_sig_comp,
+                   digest_len);
+            session->session_id_len = digest_len;
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX, "session_id calculated");
+        }
+
+        /* Cleanup any existing cipher */
+        if (session->local.crypt->dtor) {
+            session->local.crypt->dtor(session,
+                                       &session->local.crypt_abstract);
+        }
+
+        /* Calculate IV/Secret/Key for each direction */
+        if (session->local.crypt->init) {
+            unsigned char *iv = NULL, *secret = NULL;
+            int free_iv = 0, free_secret = 0;
+
+            iv = kex_sha2_derive(session, exchange_state, digest_len,
+                                 session->local.crypt->iv_len, "A");
+            if (!iv) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            secret = kex_sha2_derive(session, exchange_state, digest_len,
+                                     session->local.crypt->secret_len, "C");
+            if (!secret) {
+                LIBSSH2_FREE(session, iv);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            if (session->local.crypt->
+                init(session, session->local.crypt, iv, &free_iv, secret,
+                     &free_secret, 1, &session->local.crypt_abstract)) {
+                LIBSSH2_FREE(session, iv);
+                LIBSSH2_FREE(session, secret);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+
+            if (free_iv) {
+                memset(iv, 0, session->local.crypt->iv_len);
+                LIBSSH2_FREE(session, iv);
+            }
+
+            if (free_secret) {
+                memset(secret, 0, session->local.crypt->secret_len);
+                LIBSSH2_FREE(session, secret);
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Client to Server IV and Key calculated");
+
+        if (session->remote.crypt->dtor) {
+            /* Cleanup any existing cipher */
+            session->remote.crypt->dtor(session,
+                                        &session->remote.crypt_abstract);
+        }
+
+        if (session->remote.crypt->init) {
+            unsigned char *iv = NULL, *secret = NULL;
+            int free_iv = 0, free_secret = 0;
+
+            iv = kex_sha2_derive(session, exchange_state, digest_len,
+                                 session->remote.crypt->iv_len, "B");
+            if (!iv) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            secret = kex_sha2_derive(session, exchange_state, digest_len,
+                                     session->remote.crypt->secret_len, "D");
+            if (!secret) {
+                LIBSSH2_FREE(session, iv);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            if (session->remote.crypt->
+                init(session, session->remote.crypt, iv, &free_iv, secret,
+                     &free_secret, 0, &session->remote.crypt_abstract)) {
+                LIBSSH2_FREE(session, iv);
+                LIBSSH2_FREE(session, secret);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+
+            if (free_iv) {
+                memset(iv, 0, session->remote.crypt->iv_len);
+                LIBSSH2_FREE(session, iv);
+            }
+
+            if (free_secret) {
+                memset(secret, 0, session->remote.crypt->secret_len);
+                LIBSSH2_FREE(session, secret);
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Server to Client IV and Key calculated");
+
+        if (session->local.mac->dtor) {
+            session->local.mac->dtor(session, &session->local.mac_abstract);
+        }
+
+        if (session->local.mac->init) {
+            unsigned char *key = NULL;
+            int free_key = 0;
+
+            key = kex_sha2_derive(session, exchange_state, digest_len,
+                                  session->local.mac->key_len, "E");
+            if (!key) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            rc = session->local.mac->init(session, key, &free_key,
+                                          &session->local.mac_abstract);
+
+            if (free_key) {
+                memset(key, 0, session->local.mac->key_len);
+                LIBSSH2_FREE(session, key);
+            }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Client to Server HMAC Key calculated");
+
+        if (session->remote.mac->dtor) {
+            session->remote.mac->dtor(session, &session->remote.mac_abstract);
+        }
+
+        if (session->remote.mac->init) {
+            unsigned char *key = NULL;
+            int free_key = 0;
+
+            key = kex_sha2_derive(session, exchange_state, digest_len,
+                                  session->remote.mac->key_len, "F");
+            if (!key) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+            rc = session->remote.mac->init(session, key, &free_key,
+                                           &session->remote.mac_abstract);
+
+            if (free_key) {
+                memset(key, 0, session->remote.mac->key_len);
+                LIBSSH2_FREE(session, key);
+            }
+            if (rc) {
+                ret = LIBSSH2_ERROR_ALLOC;
+                goto clean_exit;
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Server to Client HMAC Key calculated");
+
+        /* Initialize compression for each direction */
+
+        /* Cleanup any existing compression */
+        if (session->local.comp && session->local.comp->dtor) {
+            session->local.comp->dtor(session, 1,
+                                      &session->local.comp_abstract);
+        }
+
+        if (session->local.comp && session->local.comp->init) {
+            if (session->local.comp->init(session, 1,
+                                          &session->local.comp_abstract)) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Client to Server compression initialized");
+
+        if (session->remote.comp && session->remote.comp->dtor) {
+            session->remote.comp->dtor(session, 0,
+                                       &session->remote.comp_abstract);
+        }
+
+        if (session->remote.comp && session->remote.comp->init) {
+            if (session->remote.comp->init(session, 0,
+                                           &session->remote.comp_abstract)) {
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Server to Client compression initialized");
+
+    }
+
+  clean_exit:
+    _libssh2_bn_free(exchange_state->k);
+    exchange_state->k = NULL;
+
+    if (exchange_state->ecdh_key) {
+        _libssh2_ecdh_key_free(exchange_state->ecdh_key);
+        exchange_state->ecdh_key = NULL;
+    }
+
+    if (exchange_state->e_packet) {
+        LIBSSH2_FREE(session, exchange_state->e_packet);
+        exchange_state->e_packet = NULL;
+    }
+
+    if (exchange_state->s_packet) {
+        LIBSSH2_FREE(session, exchange_state->s_packet);
+        exchange_state->s_packet = NULL;
+    }
+
+    if (exchange_state->k_value) {
+        memset(exchange_state->k_value, 0, exchange_state->k_value_len);
+        LIBSSH2_FREE(session, exchange_state->k_value);
+        exchange_state->k_value = NULL;
+    }
+
+    exchange_state->state = libssh2_NB_state_idle;
+
+    return ret;
+}
+
+
+
+/* kex_method_ecdh_key_exchange
+ * Common driver of the ecdh-sha2-nistp* and curve25519-sha256 methods
+ */
+static int
+kex_method_ecdh_key_exchange(LIBSSH2_SESSION *session,
+                             key_exchange_state_low_t *key_state,
+                             libssh2_curve_type curve, size_t digest_len,
+                             const char *description)
+{
+    int ret;
+
+    (void) description;
+
+    if (key_state->state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Initiating %s",
+                       description);
+        key_state->state = libssh2_NB_state_created;
+    }
+    ret = ecdh_sha2(session, curve, digest_len, &key_state->exchange_state);
+    if (ret == LIBSSH2_ERROR_EAGAIN) {
+        return ret;
+    }
+
+    key_state->state = libssh2_NB_state_idle;
+
+    return ret;
+}
+
+#if LIBSSH2_CURVE25519
+static int
+kex_method_curve25519_sha256_key_exchange(LIBSSH2_SESSION *session,
+                                          key_exchange_state_low_t
+                                          * key_state)
+{
+    return kex_method_ecdh_key_exchange(session, key_state,
+                                        LIBSSH2_EC_CURVE_25519,
+                                        SHA256_DIGEST_LENGTH,
+                                        "Curve25519 SHA256 Key Exchange");
+}
+#endif /* LIBSSH2_CURVE25519 */
+
+#if LIBSSH2_ECDH
+static int
+kex_method_ecdh_sha2_nistp256_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    return kex_method_ecdh_key_exchange(session, key_state,
+                                        LIBSSH2_EC_CURVE_NISTP256,
+                                        SHA256_DIGEST_LENGTH,
+                                        "ECDH NIST P-256 Key Exchange");
+}
+
+static int
+kex_method_ecdh_sha2_nistp384_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    return kex_method_ecdh_key_exchange(session, key_state,
+                                        LIBSSH2_EC_CURVE_NISTP384,
+                                        SHA384_DIGEST_LENGTH,
+                                        "ECDH NIST P-384 Key Exchange");
+}
+
+static int
+kex_method_ecdh_sha2_nistp521_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    return kex_method_ecdh_key_exchange(session, key_state,
+                                        LIBSSH2_EC_CURVE_NISTP521,
+                                        SHA512_DIGEST_LENGTH,
+                                        "ECDH NIST P-521 Key Exchange");
+}
+#endif /* LIBSSH2_ECDH */
+
+#endif /* LIBSSH2_ECDH || LIBSSH2_CURVE25519 */
+
+
+#define LIBSSH2_KEX_METHOD_FLAG_REQ_ENC_HOSTKEY     0x0001
+#define LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY    0x0002
+
+static const LIBSSH2_KEX_METHOD kex_method_diffie_helman_group1_sha1 = {
+    "diffie-hellman-group1-sha1",
+    kex_method_diffie_hellman_group1_sha1_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD kex_method_diffie_helman_group14_sha1 = {
+    "diffie-hellman-group14-sha1",
+    kex_method_diffie_hellman_group14_sha1_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD
+kex_method_diffie_helman_group_exchange_sha1 = {
+    "diffie-hellman-group-exchange-sha1",
+    kex_method_diffie_hellman_group_exchange_sha1_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD
+kex_method_diffie_helman_group_exchange_sha256 = {
+    "diffie-hellman-group-exchange-sha256",
+    kex_method_diffie_hellman_group_exchange_sha256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+#if LIBSSH2_CURVE25519
+static const LIBSSH2_KEX_METHOD kex_method_curve25519_sha256 = {
+    "curve25519-sha256",
+    kex_method_curve25519_sha256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+/* pre-RFC 8731 name of curve25519-sha256 */
+static const LIBSSH2_KEX_METHOD kex_method_curve25519_sha256_libssh = {
+    "curve25519-sha256@libssh.org",
+    kex_method_curve25519_sha256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+#endif
+
+#if LIBSSH2_ECDH
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp256 = {
+    "ecdh-sha2-nistp256",
+    kex_method_ecdh_sha2_nistp256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp384 = {
+    "ecdh-sha2-nistp384",
+    kex_method_ecdh_sha2_nistp384_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp521 = {
+    "ecdh-sha2-nistp521",
+    kex_method_ecdh_sha2_nistp521_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+#endif
+
+static const LIBSSH2_KEX_METHOD *libssh2_kex_methods[] = {
+#if LIBSSH2_CURVE25519
+    &kex_method_curve25519_sha256,
+    &kex_method_curve25519_sha256_libssh,
+#endif
+#if LIBSSH2_ECDH
+    &kex_method_ecdh_sha2_nistp256,
+    &kex_method_ecdh_sha2_nistp384,
+    &kex_method_ecdh_sha2_nistp521,
+#endif
+    &kex_method_diffie_helman_group_exchange_sha256,
+    &kex_method_diffie_helman_group_exchange_sha1,
+    &kex_method_diffie_helman_group14_sha1,
+    &kex_method_diffie_helman_group1_sha1,
+    NULL
+};
+
+typedef struct _LIBSSH2_COMMON_METHOD
+{
+    const char *name;
+} LIBSSH2_COMMON_METHOD;
+
+/* kex_method_strlen
+ * Calculate the length of a particular method list's resulting string
+ * Includes SUM(strlen() of each individual method plus 1 (for coma)) - 1 (because the last coma isn't used)
+ * Another sign of bad coding practices gone mad.  Pretend you don't see this.
+ */
+static size_t
+kex_method_strlen(LIBSSH2_COMMON_METHOD ** method)
+{
+    size_t len = 0;
+
+    if (!method || !*method) {
+        return 0;
+    }
+
+    while (*method && (*method)->name) {
+        len += strlen((*method)->name) + 1;
+        method++;
+    }
+
+    return len - 1;
+}
+
+
+
+/* kex_method_list
+ * Generate formatted preference list in buf
+ */
+static size_t
+kex_method_list(unsigned char *buf, size_t list_strlen,
+                LIBSSH2_COMMON_METHOD ** method)
+{
+    _libssh2_htonu32(buf, list_strlen);
+    buf += 4;
+
+    if (!method || !*method) {
+        return 4;
+    }
+
+    while (*method && (*method)->name) {
+        int mlen = strlen((*method)->name);
+        memcpy(buf, (*method)->name, mlen);
+        buf += mlen;
+        *(buf++) = ',';
+        method++;
+    }
+
+    return list_strlen + 4;
+}
+
+
+
+#define LIBSSH2_METHOD_PREFS_LEN(prefvar, defaultvar)           \
+    ((prefvar) ? strlen(prefvar) :                              \
+     kex_method_strlen((LIBSSH2_COMMON_METHOD**)(defaultvar)))
+
+#define LIBSSH2_METHOD_PREFS_STR(buf, prefvarlen, prefvar, defaultvar)  \
+    if (prefvar) {                                                      \
+        _libssh2_htonu32((buf), (prefvarlen));                          \
+        buf += 4;                                                       \
+        memcpy((buf), (prefvar), (prefvarlen));                         \
+        buf += (prefvarlen);                                            \
+    } else {                                                            \
+        buf += kex_method_list((buf), (prefvarlen),                     \
+                               (LIBSSH2_COMMON_METHOD**)(defaultvar));  \
+    }
+
+/* kexinit
+ * Send SSH_MSG_KEXINIT packet
+ */
+static int kexinit(LIBSSH2_SESSION * session)
+{
+    /* 62 = packet_type(1) + cookie(16) + first_packet_follows(1) +
+       reserved(4) + length longs(40) */
+    size_t data_len = 62;
+    size_t kex_len, hostkey_len = 0;
+    size_t crypt_cs_len, crypt_sc_len;
+    size_t comp_cs_len, comp_sc_len;
+    size_t mac_cs_len, mac_sc_len;
+    size_t lang_cs_len, lang_sc_len;
+    unsigned char *data, *s;
+    int rc;
+
+    if (session->kexinit_state == libssh2_NB_state_idle) {
+        kex_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->kex_prefs, libssh2_kex_methods);
+        hostkey_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->hostkey_prefs,
+                                     libssh2_hostkey_methods());
+        crypt_cs_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->local.crypt_prefs,
+                                     libssh2_crypt_methods());
+        crypt_sc_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->remote.crypt_prefs,
+                                     libssh2_crypt_methods());
+        mac_cs_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->local.mac_prefs,
+                                     _libssh2_mac_methods());
+        mac_sc_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->remote.mac_prefs,
+                                     _libssh2_mac_methods());
+        comp_cs_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->local.comp_prefs,
+                                     _libssh2_comp_methods(session));
+        comp_sc_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->remote.comp_prefs,
+                                     _libssh2_comp_methods(session));
+        lang_cs_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->local.lang_prefs, NULL);
+        lang_sc_len =
+            LIBSSH2_METHOD_PREFS_LEN(session->remote.lang_prefs, NULL);
+
+        data_len += kex_len + hostkey_len + crypt_cs_len + crypt_sc_len +
+            comp_cs_len + comp_sc_len + mac_cs_len + mac_sc_len +
+            lang_cs_len + lang_sc_len;
+
+        s = data = LIBSSH2_ALLOC(session, data_len);
+        if (!data) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory");
+        }
+
+        *(s++) = SSH_MSG_KEXINIT;
+
+        _libssh2_random(s, 16);
+        s += 16;
+
+        /* Ennumerating through these lists twice is probably (certainly?)
+           inefficient from a CPU standpoint, but it saves multiple
+           malloc/realloc calls */
+        LIBSSH2_METHOD_PREFS_STR(s, kex_len, session->kex_prefs,
+                                 libssh2_kex_methods);
+        LIBSSH2_METHOD_PREFS_STR(s, hostkey_len, session->hostkey_prefs,
                                  libssh2_hostkey_methods());
         LIBSSH2_METHOD_PREFS_STR(s, crypt_cs_len, session->local.crypt_prefs,
                                  libssh2_crypt_methods());
@@ -2218,9 +3040,17 @@ static int kex_agree_mac(LIBSSH2_SESSION * session,
                          unsigned long mac_len)
 {
     const LIBSSH2_MAC_METHOD **macp = _libssh2_mac_methods();
+    const LIBSSH2_MAC_METHOD *override;
     unsigned char *s;
     (void) session;
 
+    /* AEAD ciphers carry their own tag; the MAC name-list is ignored */
+    override = _libssh2_mac_override(endpoint->crypt);
+    if (override) {
+        endpoint->mac = override;
+        return 0;
+    }
+
     if (endpoint->mac_prefs) {
         s = (unsigned char *) endpoint->mac_prefs;
 
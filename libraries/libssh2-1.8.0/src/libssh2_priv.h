@@ -154,7 +154,12 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
  * padding length, payload, padding, and MAC.)."
  */
 #define MAX_SSH_PACKET_LEN 35000
+#if LIBSSH2_ECDH
+/* ecdh-sha2-nistp521 uses SHA-512 for its exchange hash */
+#define MAX_SHA_DIGEST_LEN SHA512_DIGEST_LENGTH
+#else
 #define MAX_SHA_DIGEST_LEN SHA256_DIGEST_LENGTH
+#endif
 
 #define LIBSSH2_ALLOC(session, count) \
   session->alloc((count), &(session)->abstract)
@@ -262,6 +267,9 @@ typedef struct kmdhgGPshakex_state_t
     void *exchange_hash;
     packet_require_state_t req_state;
     libssh2_nonblocking_states burn_state;
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519
+    _libssh2_ecdh_key *ecdh_key;    /* ephemeral key of ecdh/curve25519 */
+#endif
 } kmdhgGPshakex_state_t;
 
 typedef struct key_exchange_state_low_t
@@ -328,10 +336,16 @@ struct _LIBSSH2_PACKET
     /* the raw unencrypted payload */
     unsigned char *data;
     size_t data_len;
+    size_t data_size; /* allocated size of data, see
+                         _libssh2_packet_pool_free() */
 
     /* Where to start reading data from,
      * used for channel data that's been partially consumed */
     size_t data_head;
+
+    /* transport sequence number it arrived with, which orders a channel's
+       data and extended data packets against each other */
+    uint32_t seqno;
 };
 
 typedef struct _libssh2_channel_data
@@ -346,10 +360,52 @@ typedef struct _libssh2_channel_data
     char close, eof, extended_data_ignore_mode;
 } libssh2_channel_data;
 
+/* Scratch space for a channel request (setenv, pty-req, window-change,
+   x11-req, exec/shell/subsystem), only allocated while it is in flight */
+struct channel_request_data
+{
+    unsigned char *packet;
+    size_t packet_len;
+    unsigned char local_channel[4];
+    packet_requirev_state_t packet_requirev_state;
+};
+
 struct _LIBSSH2_CHANNEL
 {
     struct list_node node;
 
+    /* The fields used for every packet come first, to keep them together */
+    libssh2_channel_data local, remote;
+    /* Amount of bytes to be refunded to receive window (but not yet sent) */
+    uint32_t adjust_queue;
+    /* Data immediately available for reading */
+    uint32_t read_avail;
+
+    /* Received data packets waiting to be read, oldest first: the standard
+       stream (and extended data in merge mode), and the extended streams */
+    struct list_head data_queue;
+    struct list_head ext_data_queue;
+
+    LIBSSH2_SESSION *session;
+
+    /* State variables used in libssh2_channel_read_ex() */
+    libssh2_nonblocking_states read_state;
+
+    /* State variables used in libssh2_channel_write_ex() */
+    libssh2_nonblocking_states write_state;
+    unsigned char write_packet[13];
+    size_t write_packet_len;
+    size_t write_bufwrite;
+
+    /* State variables used in libssh2_channel_receive_window_adjust() */
+    libssh2_nonblocking_states adjust_state;
+    unsigned char adjust_adjust[9];     /* packet_type(1) + channel(4) + adjustment(4) */
+
+    /* State variables used in libssh2_channel_flush_ex() */
+    libssh2_nonblocking_states flush_state;
+    size_t flush_refund_bytes;
+    size_t flush_flush_bytes;
+
     unsigned char *channel_type;
     unsigned channel_type_len;
 
@@ -359,65 +415,25 @@ struct _LIBSSH2_CHANNEL
     /* channel's program exit signal (without the SIG prefix) */
     char *exit_signal;
 
-    libssh2_channel_data local, remote;
-    /* Amount of bytes to be refunded to receive window (but not yet sent) */
-    uint32_t adjust_queue;
-    /* Data immediately available for reading */
-    uint32_t read_avail;
-
-    LIBSSH2_SESSION *session;
-
     void *abstract;
       LIBSSH2_CHANNEL_CLOSE_FUNC((*close_cb));
 
     /* State variables used in libssh2_channel_setenv_ex() */
     libssh2_nonblocking_states setenv_state;
-    unsigned char *setenv_packet;
-    size_t setenv_packet_len;
-    unsigned char setenv_local_channel[4];
-    packet_requirev_state_t setenv_packet_requirev_state;
+    struct channel_request_data *setenv;
 
     /* State variables used in libssh2_channel_request_pty_ex()
        libssh2_channel_request_pty_size_ex() */
     libssh2_nonblocking_states reqPTY_state;
-    unsigned char reqPTY_packet[41 + 256];
-    size_t reqPTY_packet_len;
-    unsigned char reqPTY_local_channel[4];
-    packet_requirev_state_t reqPTY_packet_requirev_state;
+    struct channel_request_data *reqPTY;
 
     /* State variables used in libssh2_channel_x11_req_ex() */
     libssh2_nonblocking_states reqX11_state;
-    unsigned char *reqX11_packet;
-    size_t reqX11_packet_len;
-    unsigned char reqX11_local_channel[4];
-    packet_requirev_state_t reqX11_packet_requirev_state;
+    struct channel_request_data *reqX11;
 
     /* State variables used in libssh2_channel_process_startup() */
     libssh2_nonblocking_states process_state;
-    unsigned char *process_packet;
-    size_t process_packet_len;
-    unsigned char process_local_channel[4];
-    packet_requirev_state_t process_packet_requirev_state;
-
-    /* State variables used in libssh2_channel_flush_ex() */
-    libssh2_nonblocking_states flush_state;
-    size_t flush_refund_bytes;
-    size_t flush_flush_bytes;
-
-    /* State variables used in libssh2_channel_receive_window_adjust() */
-    libssh2_nonblocking_states adjust_state;
-    unsigned char adjust_adjust[9];     /* packet_type(1) + channel(4) + adjustment(4) */
-
-    /* State variables used in libssh2_channel_read_ex() */
-    libssh2_nonblocking_states read_state;
-
-    uint32_t read_local_id;
-
-    /* State variables used in libssh2_channel_write_ex() */
-    libssh2_nonblocking_states write_state;
-    unsigned char write_packet[13];
-    size_t write_packet_len;
-    size_t write_bufwrite;
+    struct channel_request_data *process;
 
     /* State variables used in libssh2_channel_close() */
     libssh2_nonblocking_states close_state;
@@ -484,10 +500,34 @@ typedef struct _libssh2_endpoint_data
 
 #define PACKETBUFSIZE (1024*16)
 
+/* Size classes of the packet pool, and the most it keeps around for reuse
+   per session, in bytes */
+#define LIBSSH2_PACKET_POOL_CLASSES 6
+#ifndef LIBSSH2_PACKET_POOL_MAX
+#define LIBSSH2_PACKET_POOL_MAX (256 * 1024)
+#endif
+
+/* Inbound packet payloads and their LIBSSH2_PACKET nodes are allocated and
+   released at the packet rate; released ones are kept in per size class
+   free lists, linked through their first bytes, to be handed out again */
+struct packet_pool
+{
+    void *free[LIBSSH2_PACKET_POOL_CLASSES];
+    size_t retained;        /* bytes currently held in the free lists */
+
+    /* statistics, see libssh2_session_packet_pool_stats() */
+    unsigned long allocs;   /* allocations asked for */
+    unsigned long reused;   /* ... of which were served from a free list */
+    unsigned long dropped;  /* releases given back to LIBSSH2_FREE as the
+                               cap was reached */
+    size_t peak;            /* highest 'retained' seen */
+};
+
 struct transportpacket
 {
     /* ------------- for incoming data --------------- */
-    unsigned char buf[PACKETBUFSIZE];
+    unsigned char *buf;     /* PACKETBUFSIZE bytes from the packet pool,
+                               only held while it has data in it */
     unsigned char init[5];  /* first 5 bytes of the incoming data stream,
                                still encrypted */
     size_t writeidx;        /* at what array index we do the next write into
@@ -504,13 +544,21 @@ struct transportpacket
                                number of bytes. A full package is
                                packet_length + padding_length + 4 +
                                mac_length. */
-    unsigned char *payload; /* this is a pointer to a LIBSSH2_ALLOC()
-                               area to which we write decrypted data */
+    unsigned char *payload; /* this is a pointer to a packet pool
+                               area the packet is collected in and then
+                               decrypted in place */
+    size_t payload_size;    /* allocated size of payload */
     unsigned char *wptr;    /* write pointer into the payload to where we
-                               are currently writing decrypted data */
+                               are currently writing received data */
+    int large;              /* non-zero while packets too large for buf
+                               keep arriving: only the first block of a
+                               packet is read into buf then, the rest goes
+                               straight into its payload */
 
     /* ------------- for outgoing data --------------- */
-    unsigned char outbuf[MAX_SSH_PACKET_LEN]; /* area for the outgoing data */
+    unsigned char *outbuf;  /* area for the outgoing data, MAX_SSH_PACKET_LEN
+                               bytes from the packet pool, only held while a
+                               packet is being sent */
 
     int ototal_num;         /* size of outbuf in number of bytes */
     const unsigned char *odata; /* original pointer to the data */
@@ -549,6 +597,40 @@ struct _LIBSSH2_PUBLICKEY
 
 #define LIBSSH2_SCP_RESPONSE_BUFLEN     256
 
+/* SCP receive state, see scp_recv() */
+struct scp_recv_data
+{
+    unsigned char *command;
+    size_t command_len;
+    unsigned char response[LIBSSH2_SCP_RESPONSE_BUFLEN];
+    size_t response_len;
+    long mode;
+#if defined(HAVE_LONGLONG) && defined(HAVE_STRTOLL)
+    /* we have the type and we can parse such numbers */
+    long long size;
+#define scpsize_strtol strtoll
+#elif defined(HAVE_STRTOI64)
+    __int64 size;
+#define scpsize_strtol _strtoi64
+#else
+    long size;
+#define scpsize_strtol strtol
+#endif
+    long mtime;
+    long atime;
+    LIBSSH2_CHANNEL *channel;
+};
+
+/* SCP send state, see scp_send() */
+struct scp_send_data
+{
+    unsigned char *command;
+    size_t command_len;
+    unsigned char response[LIBSSH2_SCP_RESPONSE_BUFLEN];
+    size_t response_len;
+    LIBSSH2_CHANNEL *channel;
+};
+
 struct flags {
     int sigpipe;  /* LIBSSH2_FLAG_SIGPIPE */
     int compress; /* LIBSSH2_FLAG_COMPRESS */
@@ -624,6 +706,15 @@ struct _LIBSSH2_SESSION
 
     uint32_t next_channel;
 
+    /* Channels (including un-accepted forwarded ones) indexed by local
+       channel id, and the ids that may safely be handed out again. Both
+       arrays hold channel_slots_size entries and cover every id below
+       next_channel */
+    LIBSSH2_CHANNEL **channel_slots;
+    uint32_t *channel_free_ids;
+    uint32_t channel_slots_size;
+    uint32_t channel_free_count;
+
     struct list_head listeners; /* list of LIBSSH2_LISTENER structs */
 
     /* Actual I/O socket */
@@ -640,6 +731,7 @@ struct _LIBSSH2_SESSION
 
     /* struct members for packet-level reading */
     struct transportpacket packet;
+    struct packet_pool packet_pool;
 #ifdef LIBSSH2DEBUG
     int showmask;               /* what debug/trace messages to display */
     libssh2_trace_handler_func tracehandler; /* callback to display trace messages */
@@ -787,35 +879,14 @@ struct _LIBSSH2_SESSION
     int sftpInit_sent; /* number of bytes from the buffer that have been
                           sent */
 
-    /* State variables used in libssh2_scp_recv() / libssh_scp_recv2() */
+    /* State variables used in libssh2_scp_recv() / libssh_scp_recv2(), the
+       rest of them only allocated while a transfer is being set up */
     libssh2_nonblocking_states scpRecv_state;
-    unsigned char *scpRecv_command;
-    size_t scpRecv_command_len;
-    unsigned char scpRecv_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
-    size_t scpRecv_response_len;
-    long scpRecv_mode;
-#if defined(HAVE_LONGLONG) && defined(HAVE_STRTOLL)
-    /* we have the type and we can parse such numbers */
-    long long scpRecv_size;
-#define scpsize_strtol strtoll
-#elif defined(HAVE_STRTOI64)
-    __int64 scpRecv_size;
-#define scpsize_strtol _strtoi64
-#else
-    long scpRecv_size;
-#define scpsize_strtol strtol
-#endif
-    long scpRecv_mtime;
-    long scpRecv_atime;
-    LIBSSH2_CHANNEL *scpRecv_channel;
+    struct scp_recv_data *scpRecv;
 
     /* State variables used in libssh2_scp_send_ex() */
     libssh2_nonblocking_states scpSend_state;
-    unsigned char *scpSend_command;
-    size_t scpSend_command_len;
-    unsigned char scpSend_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
-    size_t scpSend_response_len;
-    LIBSSH2_CHANNEL *scpSend_channel;
+    struct scp_send_data *scpSend;
 
     /* Keepalive variables used by keepalive.c. */
     int keepalive_interval;
@@ -881,6 +952,10 @@ struct _LIBSSH2_HOSTKEY_METHOD
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
 };
 
+/* The cipher authenticates the packet itself (AEAD); no MAC is negotiated
+   and the packet_length field is kept apart from the encrypted body */
+#define LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC 0x0001
+
 struct _LIBSSH2_CRYPT_METHOD
 {
     const char *name;
@@ -897,9 +972,24 @@ struct _LIBSSH2_CRYPT_METHOD
                  const LIBSSH2_CRYPT_METHOD * method, unsigned char *iv,
                  int *free_iv, unsigned char *secret, int *free_secret,
                  int encrypt, void **abstract);
-    int (*crypt) (LIBSSH2_SESSION * session, unsigned char *block,
-                  size_t blocksize, void **abstract);
+    /* Encrypts or decrypts 'len' bytes in place. 'len' is a whole number of
+       blocksize blocks; the transport passes entire packets (or the part
+       received so far) in one call so the backend can process it in bulk.
+
+       LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC methods are always handed one whole
+       packet minus its packet_length field, so 'len' is the packet_length
+       value itself. The field, as it goes on the wire, sits in the four
+       bytes before 'buf'; the authentication tag lives right after the
+       data and is written when encrypting, verified when decrypting. */
+    int (*crypt) (LIBSSH2_SESSION * session, unsigned char *buf,
+                  size_t len, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
+    /* Only for LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC methods that also encrypt
+       the packet_length field (NULL otherwise): recovers the length of the
+       next incoming packet from its first four bytes, leaving them as they
+       are for crypt() to authenticate */
+    int (*get_len) (LIBSSH2_SESSION * session, uint32_t *len,
+                    const unsigned char *buf, void **abstract);
 
       _libssh2_cipher_type(algo);
 };
@@ -919,6 +1009,7 @@ struct _LIBSSH2_COMP_METHOD
     int (*decomp) (LIBSSH2_SESSION *session,
                    unsigned char **dest,
                    size_t *dest_len,
+                   size_t *dest_size,
                    size_t payload_limit,
                    const unsigned char *src,
                    size_t src_len,
@@ -983,6 +1074,10 @@ _libssh2_debug(LIBSSH2_SESSION * session, int context, const char *format, ...)
 #define SSH_MSG_KEX_DH_GEX_INIT                     32
 #define SSH_MSG_KEX_DH_GEX_REPLY                    33
 
+/* ecdh-sha2-nistp* and curve25519-sha256 */
+#define SSH_MSG_KEX_ECDH_INIT                       30
+#define SSH_MSG_KEX_ECDH_REPLY                      31
+
 /* User Authentication */
 #define SSH_MSG_USERAUTH_REQUEST                    50
 #define SSH_MSG_USERAUTH_FAILURE                    51
@@ -1047,6 +1142,13 @@ int _libssh2_pem_parse_memory(LIBSSH2_SESSION * session,
                               const char *headerend,
                               const char *filedata, size_t filedata_len,
                               unsigned char **data, unsigned int *datalen);
+int _libssh2_openssh_pem_parse(LIBSSH2_SESSION * session,
+                               FILE * fp, unsigned char **data,
+                               size_t *datalen);
+int _libssh2_openssh_pem_parse_memory(LIBSSH2_SESSION * session,
+                                      const char *filedata,
+                                      size_t filedata_len,
+                                      unsigned char **data, size_t *datalen);
 int _libssh2_pem_decode_sequence(unsigned char **data, unsigned int *datalen);
 int _libssh2_pem_decode_integer(unsigned char **data, unsigned int *datalen,
                                 unsigned char **i, unsigned int *ilen);
@@ -58,12 +58,23 @@ static LIBSSH2_MAC_METHOD mac_method_none = {
     "none",
     0,
     0,
+    0,
     NULL,
     mac_none_MAC,
     NULL
 };
 #endif /* LIBSSH2_MAC_NONE */
 
+/* HMAC working area: the negotiated integrity key and a context that has
+ * been keyed with it
+ */
+struct mac_hmac_ctx
+{
+    unsigned char *key;
+    int keyed;
+    libssh2_hmac_ctx ctx;
+};
+
 /* mac_method_common_init
  * Initialize simple mac methods
  */
@@ -71,9 +82,22 @@ static int
 mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
                        int *free_key, void **abstract)
 {
-    *abstract = key;
+    struct mac_hmac_ctx *hmac;
+
+    hmac = LIBSSH2_ALLOC(session, sizeof(struct mac_hmac_ctx));
+    if (!hmac) {
+        *abstract = NULL;
+        *free_key = 1;
+        return -1;
+    }
+
+    /* The hash algorithm is only known to the method's hash callback, so
+       the key is scheduled there on the first packet */
+    hmac->key = key;
+    hmac->keyed = 0;
+
+    *abstract = hmac;
     *free_key = 0;
-    (void) session;
 
     return 0;
 }
@@ -86,8 +110,16 @@ mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
 static int
 mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
-    if (*abstract) {
-        LIBSSH2_FREE(session, *abstract);
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
+
+    if (hmac) {
+        if (hmac->keyed) {
+            libssh2_hmac_cleanup(&hmac->ctx);
+        }
+        if (hmac->key) {
+            LIBSSH2_FREE(session, hmac->key);
+        }
+        LIBSSH2_FREE(session, hmac);
     }
     *abstract = NULL;
 
@@ -96,6 +128,66 @@ mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
 
 
 
+/* MAC_HMAC_START
+ * Start the HMAC of a packet in hmac->ctx. Where the backend can restart a
+ * finished context with the same key, the inner and outer pads are hashed
+ * once for the first packet and every later packet reuses that state, so
+ * the raw key is wiped as soon as it has been scheduled.
+ */
+#ifdef libssh2_hmac_reinit
+#define MAC_HMAC_START(session, hmac, hmac_init, key_len)               \
+    do {                                                                \
+        if ((hmac)->keyed) {                                            \
+            libssh2_hmac_reinit((hmac)->ctx);                           \
+        }                                                               \
+        else {                                                          \
+            libssh2_hmac_ctx_init((hmac)->ctx);                         \
+            hmac_init(&(hmac)->ctx, (hmac)->key, key_len);              \
+            (hmac)->keyed = 1;                                          \
+            memset((hmac)->key, 0, key_len);                            \
+            LIBSSH2_FREE(session, (hmac)->key);                         \
+            (hmac)->key = NULL;                                         \
+        }                                                               \
+    } while (0)
+#else
+#define MAC_HMAC_START(session, hmac, hmac_init, key_len)               \
+    do {                                                                \
+        (void) (session);                                               \
+        libssh2_hmac_ctx_init((hmac)->ctx);                             \
+        hmac_init(&(hmac)->ctx, (hmac)->key, key_len);                  \
+        (hmac)->keyed = 1;                                              \
+    } while (0)
+#endif
+
+/* mac_method_hmac_finish
+ * Feed the sequence number and packet to a started HMAC and store the MAC
+ */
+static int
+mac_method_hmac_finish(struct mac_hmac_ctx *hmac, unsigned char *buf,
+                       uint32_t seqno, const unsigned char *packet,
+                       uint32_t packet_len, const unsigned char *addtl,
+                       uint32_t addtl_len)
+{
+    unsigned char seqno_buf[4];
+
+    _libssh2_htonu32(seqno_buf, seqno);
+
+    libssh2_hmac_update(hmac->ctx, seqno_buf, 4);
+    libssh2_hmac_update(hmac->ctx, packet, packet_len);
+    if (addtl && addtl_len) {
+        libssh2_hmac_update(hmac->ctx, addtl, addtl_len);
+    }
+    libssh2_hmac_final(hmac->ctx, buf);
+#ifndef libssh2_hmac_reinit
+    libssh2_hmac_cleanup(&hmac->ctx);
+    hmac->keyed = 0;
+#endif
+
+    return 0;
+}
+
+
+
 #if LIBSSH2_HMAC_SHA512
 /* mac_method_hmac_sha512_hash
  * Calculate hash using full sha512 value
@@ -108,23 +200,16 @@ mac_method_hmac_sha2_512_hash(LIBSSH2_SESSION * session,
                           const unsigned char *addtl,
                           uint32_t addtl_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
 
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha512_init(&ctx, *abstract, 64);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!hmac) {
+        return -1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
 
-    return 0;
+    MAC_HMAC_START(session, hmac, libssh2_hmac_sha512_init, 64);
+
+    return mac_method_hmac_finish(hmac, buf, seqno, packet, packet_len,
+                                  addtl, addtl_len);
 }
 
 
@@ -133,6 +218,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512 = {
     "hmac-sha2-512",
     64,
     64,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_sha2_512_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512_etm = {
+    "hmac-sha2-512-etm@openssh.com",
+    64,
+    64,
+    1,
     mac_method_common_init,
     mac_method_hmac_sha2_512_hash,
     mac_method_common_dtor,
@@ -153,23 +249,16 @@ mac_method_hmac_sha2_256_hash(LIBSSH2_SESSION * session,
                           const unsigned char *addtl,
                           uint32_t addtl_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
 
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha256_init(&ctx, *abstract, 32);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!hmac) {
+        return -1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
 
-    return 0;
+    MAC_HMAC_START(session, hmac, libssh2_hmac_sha256_init, 32);
+
+    return mac_method_hmac_finish(hmac, buf, seqno, packet, packet_len,
+                                  addtl, addtl_len);
 }
 
 
@@ -178,6 +267,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256 = {
     "hmac-sha2-256",
     32,
     32,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_sha2_256_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256_etm = {
+    "hmac-sha2-256-etm@openssh.com",
+    32,
+    32,
+    1,
     mac_method_common_init,
     mac_method_hmac_sha2_256_hash,
     mac_method_common_dtor,
@@ -198,23 +298,16 @@ mac_method_hmac_sha1_hash(LIBSSH2_SESSION * session,
                           const unsigned char *addtl,
                           uint32_t addtl_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
 
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha1_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!hmac) {
+        return -1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
 
-    return 0;
+    MAC_HMAC_START(session, hmac, libssh2_hmac_sha1_init, 20);
+
+    return mac_method_hmac_finish(hmac, buf, seqno, packet, packet_len,
+                                  addtl, addtl_len);
 }
 
 
@@ -223,6 +316,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1 = {
     "hmac-sha1",
     20,
     20,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_sha1_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_etm = {
+    "hmac-sha1-etm@openssh.com",
+    20,
+    20,
+    1,
     mac_method_common_init,
     mac_method_hmac_sha1_hash,
     mac_method_common_dtor,
@@ -254,6 +358,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_96 = {
     "hmac-sha1-96",
     12,
     20,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_sha1_96_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_96_etm = {
+    "hmac-sha1-96-etm@openssh.com",
+    12,
+    20,
+    1,
     mac_method_common_init,
     mac_method_hmac_sha1_96_hash,
     mac_method_common_dtor,
@@ -271,23 +386,16 @@ mac_method_hmac_md5_hash(LIBSSH2_SESSION * session, unsigned char *buf,
                          const unsigned char *addtl,
                          uint32_t addtl_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_md5_init(&ctx, *abstract, 16);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!hmac) {
+        return -1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
 
-    return 0;
+    MAC_HMAC_START(session, hmac, libssh2_hmac_md5_init, 16);
+
+    return mac_method_hmac_finish(hmac, buf, seqno, packet, packet_len,
+                                  addtl, addtl_len);
 }
 
 
@@ -296,6 +404,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5 = {
     "hmac-md5",
     16,
     16,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_md5_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_md5_etm = {
+    "hmac-md5-etm@openssh.com",
+    16,
+    16,
+    1,
     mac_method_common_init,
     mac_method_hmac_md5_hash,
     mac_method_common_dtor,
@@ -325,6 +444,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5_96 = {
     "hmac-md5-96",
     12,
     16,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_md5_96_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_md5_96_etm = {
+    "hmac-md5-96-etm@openssh.com",
+    12,
+    16,
+    1,
     mac_method_common_init,
     mac_method_hmac_md5_96_hash,
     mac_method_common_dtor,
@@ -344,23 +474,16 @@ mac_method_hmac_ripemd160_hash(LIBSSH2_SESSION * session,
                                uint32_t addtl_len,
                                void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
+    struct mac_hmac_ctx *hmac = (struct mac_hmac_ctx *) (*abstract);
 
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_ripemd160_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!hmac) {
+        return -1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
 
-    return 0;
+    MAC_HMAC_START(session, hmac, libssh2_hmac_ripemd160_init, 20);
+
+    return mac_method_hmac_finish(hmac, buf, seqno, packet, packet_len,
+                                  addtl, addtl_len);
 }
 
 
@@ -369,6 +492,17 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160 = {
     "hmac-ripemd160",
     20,
     20,
+    0,
+    mac_method_common_init,
+    mac_method_hmac_ripemd160_hash,
+    mac_method_common_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160_etm = {
+    "hmac-ripemd160-etm@openssh.com",
+    20,
+    20,
+    1,
     mac_method_common_init,
     mac_method_hmac_ripemd160_hash,
     mac_method_common_dtor,
@@ -378,13 +512,521 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160_openssh_com = {
     "hmac-ripemd160@openssh.com",
     20,
     20,
+    0,
     mac_method_common_init,
     mac_method_hmac_ripemd160_hash,
     mac_method_common_dtor,
 };
 #endif /* LIBSSH2_HMAC_RIPEMD */
 
+#if LIBSSH2_UMAC
+/* UMAC (RFC 4418) as OpenSSH uses it for umac-64@openssh.com and
+ * umac-128@openssh.com. NH compresses each 1024 byte chunk of the packet,
+ * a polynomial hash over GF(2^64 - 59) chains the chunks of longer packets
+ * and an inner-product hash modulo 2^36 - 5 reduces the result to 32 bits.
+ * umac-64 runs two such streams with offset keys, umac-128 four. The tag
+ * is XORed with an AES pad derived from the packet sequence number, which
+ * serves as the nonce; the sequence number itself is not hashed.
+ */
+#define UMAC_KEY_LEN       16
+#define UMAC_L1_KEY_LEN    1024 /* bytes NH compresses at a time */
+#define UMAC_L1_KEY_SHIFT  16   /* NH key offset between streams */
+#define UMAC_NH_BLOCK      32   /* bytes NH consumes per step */
+#define UMAC_MAX_STREAMS   4
+
+#define UMAC_M36  ((((libssh2_uint64_t) 0xf) << 32) | 0xffffffffUL)
+#define UMAC_P36  ((((libssh2_uint64_t) 0xf) << 32) | 0xfffffffbUL)
+#define UMAC_P64  ((((libssh2_uint64_t) 0xffffffffUL) << 32) | 0xffffffc5UL)
+#define UMAC_POLY_KEY_MASK \
+    ((((libssh2_uint64_t) 0x01ffffffUL) << 32) | 0x01ffffffUL)
+
+struct umac_ctx
+{
+    int streams;
+
+    /* keys, derived once per key exchange */
+    uint32_t nh_key[(UMAC_L1_KEY_LEN +
+                     UMAC_L1_KEY_SHIFT * (UMAC_MAX_STREAMS - 1)) / 4];
+    libssh2_uint64_t poly_key[UMAC_MAX_STREAMS];
+    libssh2_uint64_t ip_key[UMAC_MAX_STREAMS * 4];
+    uint32_t ip_trans[UMAC_MAX_STREAMS];
+
+    /* the pad for an even/odd pair of umac-64 nonces comes from one AES
+       block, so the last one is kept */
+    _libssh2_cipher_ctx pdf;
+    unsigned char pdf_nonce[8];
+    unsigned char pdf_cache[16];
+    int pdf_valid;
+
+    /* state of the packet being hashed */
+    libssh2_uint64_t nh_sum[UMAC_MAX_STREAMS];
+    libssh2_uint64_t poly_accum[UMAC_MAX_STREAMS];
+    uint32_t nh_done;           /* bytes of the current chunk through NH */
+    uint32_t nh_buf_len;
+    unsigned char nh_buf[UMAC_NH_BLOCK];
+    int chunks;                 /* chunks already folded into poly_accum */
+};
+
+/* umac_kdf
+ * Fill out with len bytes of key material number index
+ */
+static int
+umac_kdf(_libssh2_cipher_ctx *aes, int index, unsigned char *out,
+         size_t len)
+{
+    unsigned char block[16];
+    unsigned char counter = 1;
+    size_t n;
+
+    while (len) {
+        memset(block, 0, sizeof(block));
+        block[7] = (unsigned char) index;
+        block[15] = counter++;
+        if (_libssh2_cipher_crypt(aes, _libssh2_cipher_aes128ecb, 1,
+                                  block, sizeof(block))) {
+            return -1;
+        }
+        n = len < sizeof(block) ? len : sizeof(block);
+        memcpy(out, block, n);
+        out += n;
+        len -= n;
+    }
+    memset(block, 0, sizeof(block));
+
+    return 0;
+}
+
+static void
+umac_reset(struct umac_ctx *ctx)
+{
+    int i;
+
+    for(i = 0; i < ctx->streams; i++) {
+        ctx->nh_sum[i] = 0;
+        /* the polynomial hash starts from a non-zero word */
+        ctx->poly_accum[i] = 1;
+    }
+    ctx->nh_done = 0;
+    ctx->nh_buf_len = 0;
+    ctx->chunks = 0;
+}
+
+static uint32_t
+umac_load_le32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* umac_nh
+ * Run NH over nblocks 32 byte blocks continuing the current chunk. The
+ * message words are added to the key words modulo 2^32 and multiplied
+ * pairwise into the 64-bit sum of each stream.
+ */
+static void
+umac_nh(struct umac_ctx *ctx, const unsigned char *data, uint32_t nblocks)
+{
+    const uint32_t *k = ctx->nh_key + ctx->nh_done / 4;
+    uint32_t d[8];
+    int i, s;
+
+    ctx->nh_done += nblocks * UMAC_NH_BLOCK;
+
+    while (nblocks--) {
+        for(i = 0; i < 8; i++) {
+            d[i] = umac_load_le32(data + 4 * i);
+        }
+        for(s = 0; s < ctx->streams; s++) {
+            const uint32_t *ks = k + 4 * s;
+
+            ctx->nh_sum[s] +=
+                (libssh2_uint64_t) (uint32_t) (ks[0] + d[0]) *
+                (uint32_t) (ks[4] + d[4]) +
+                (libssh2_uint64_t) (uint32_t) (ks[1] + d[1]) *
+                (uint32_t) (ks[5] + d[5]) +
+                (libssh2_uint64_t) (uint32_t) (ks[2] + d[2]) *
+                (uint32_t) (ks[6] + d[6]) +
+                (libssh2_uint64_t) (uint32_t) (ks[3] + d[3]) *
+                (uint32_t) (ks[7] + d[7]);
+        }
+        k += 8;
+        data += UMAC_NH_BLOCK;
+    }
+}
+
+/* umac_poly64
+ * cur * key + data, reduced far enough modulo 2^64 - 59 to fit 64 bits.
+ * The key is masked to 25 bits per half so the partial products cannot
+ * overflow.
+ */
+static libssh2_uint64_t
+umac_poly64(libssh2_uint64_t cur, libssh2_uint64_t key,
+            libssh2_uint64_t data)
+{
+    uint32_t key_hi = (uint32_t) (key >> 32);
+    uint32_t key_lo = (uint32_t) key;
+    uint32_t cur_hi = (uint32_t) (cur >> 32);
+    uint32_t cur_lo = (uint32_t) cur;
+    libssh2_uint64_t x, t, res;
+
+    x = (libssh2_uint64_t) key_hi * cur_lo +
+        (libssh2_uint64_t) cur_hi * key_lo;
+
+    res = ((libssh2_uint64_t) key_hi * cur_hi + (uint32_t) (x >> 32)) * 59 +
+        (libssh2_uint64_t) key_lo * cur_lo;
+
+    t = x << 32;
+    res += t;
+    if (res < t)
+        res += 59;
+
+    res += data;
+    if (res < data)
+        res += 59;
+
+    return res;
+}
+
+/* umac_chunk_done
+ * Fold the NH value of a finished chunk of len message bytes into the
+ * polynomial hash of every stream
+ */
+static void
+umac_chunk_done(struct umac_ctx *ctx, uint32_t len)
+{
+    libssh2_uint64_t m;
+    int s;
+
+    for(s = 0; s < ctx->streams; s++) {
+        m = ctx->nh_sum[s] + ((libssh2_uint64_t) len << 3);
+        /* values that are not below 2^64 - 59 are split in two */
+        if ((uint32_t) (m >> 32) == 0xffffffffUL) {
+            ctx->poly_accum[s] = umac_poly64(ctx->poly_accum[s],
+                                             ctx->poly_key[s],
+                                             UMAC_P64 - 1);
+            m -= 59;
+        }
+        ctx->poly_accum[s] = umac_poly64(ctx->poly_accum[s],
+                                         ctx->poly_key[s], m);
+        ctx->nh_sum[s] = 0;
+    }
+    ctx->nh_done = 0;
+    ctx->chunks++;
+}
+
+static void
+umac_update(struct umac_ctx *ctx, const unsigned char *data, size_t len)
+{
+    uint32_t n;
+
+    while (len) {
+        /* a full chunk is only folded once more data shows the packet
+           goes on: a packet of a single chunk is hashed differently */
+        if (ctx->nh_done == UMAC_L1_KEY_LEN) {
+            umac_chunk_done(ctx, UMAC_L1_KEY_LEN);
+        }
+
+        if (ctx->nh_buf_len || len < UMAC_NH_BLOCK) {
+            n = UMAC_NH_BLOCK - ctx->nh_buf_len;
+            if (n > len)
+                n = (uint32_t) len;
+            memcpy(ctx->nh_buf + ctx->nh_buf_len, data, n);
+            ctx->nh_buf_len += n;
+            data += n;
+            len -= n;
+            if (ctx->nh_buf_len == UMAC_NH_BLOCK) {
+                umac_nh(ctx, ctx->nh_buf, 1);
+                ctx->nh_buf_len = 0;
+            }
+            continue;
+        }
+
+        n = (UMAC_L1_KEY_LEN - ctx->nh_done) / UMAC_NH_BLOCK;
+        if (n > len / UMAC_NH_BLOCK)
+            n = (uint32_t) (len / UMAC_NH_BLOCK);
+        umac_nh(ctx, data, n);
+        data += n * UMAC_NH_BLOCK;
+        len -= n * UMAC_NH_BLOCK;
+    }
+}
+
+/* umac_ip
+ * Inner-product hash of a 64-bit value, reduced modulo 2^36 - 5
+ */
+static uint32_t
+umac_ip(const libssh2_uint64_t *key, libssh2_uint64_t v, uint32_t trans)
+{
+    libssh2_uint64_t t;
+
+    t = key[0] * (uint16_t) (v >> 48) + key[1] * (uint16_t) (v >> 32) +
+        key[2] * (uint16_t) (v >> 16) + key[3] * (uint16_t) v;
+    t = (t & UMAC_M36) + 5 * (t >> 36);
+    if (t >= UMAC_P36)
+        t -= UMAC_P36;
+
+    return (uint32_t) t ^ trans;
+}
+
+static int
+umac_final(struct umac_ctx *ctx, unsigned char *tag, uint32_t seqno)
+{
+    unsigned char nonce[16];
+    uint32_t len = ctx->nh_done + ctx->nh_buf_len;
+    libssh2_uint64_t v;
+    int ndx = 0;
+    int s;
+
+    /* the last chunk is zero padded to whole NH blocks; an empty packet
+       is hashed as one block of zeros */
+    if (ctx->nh_buf_len || !len) {
+        memset(ctx->nh_buf + ctx->nh_buf_len, 0,
+               UMAC_NH_BLOCK - ctx->nh_buf_len);
+        umac_nh(ctx, ctx->nh_buf, 1);
+        ctx->nh_buf_len = 0;
+    }
+
+    if (!ctx->chunks) {
+        for(s = 0; s < ctx->streams; s++) {
+            v = ctx->nh_sum[s] + ((libssh2_uint64_t) len << 3);
+            _libssh2_htonu32(tag + 4 * s,
+                             umac_ip(ctx->ip_key + 4 * s, v,
+                                     ctx->ip_trans[s]));
+        }
+    }
+    else {
+        umac_chunk_done(ctx, len);
+        for(s = 0; s < ctx->streams; s++) {
+            v = ctx->poly_accum[s];
+            if (v >= UMAC_P64)
+                v -= UMAC_P64;
+            _libssh2_htonu32(tag + 4 * s,
+                             umac_ip(ctx->ip_key + 4 * s, v,
+                                     ctx->ip_trans[s]));
+        }
+    }
+    umac_reset(ctx);
+
+    /* umac-64 takes its 8 byte pad from either half of the AES block of
+       the nonce with the low bit cleared */
+    memset(nonce, 0, sizeof(nonce));
+    _libssh2_htonu32(nonce + 4, seqno);
+    if (ctx->streams == 2) {
+        ndx = nonce[7] & 1;
+        nonce[7] &= ~1;
+    }
+    if (!ctx->pdf_valid || memcmp(ctx->pdf_nonce, nonce, 8)) {
+        memcpy(ctx->pdf_cache, nonce, sizeof(nonce));
+        if (_libssh2_cipher_crypt(&ctx->pdf, _libssh2_cipher_aes128ecb, 1,
+                                  ctx->pdf_cache, sizeof(ctx->pdf_cache))) {
+            ctx->pdf_valid = 0;
+            return -1;
+        }
+        memcpy(ctx->pdf_nonce, nonce, 8);
+        ctx->pdf_valid = 1;
+    }
+    for(s = 0; s < 4 * ctx->streams; s++) {
+        tag[s] ^= ctx->pdf_cache[8 * ndx + s];
+    }
+
+    return 0;
+}
+
+/* mac_method_umac_init
+ * Derive the UMAC keys and the pad generator from the integrity key
+ */
+static int
+mac_method_umac_init(LIBSSH2_SESSION * session, unsigned char *key,
+                     int *free_key, void **abstract, int streams)
+{
+    struct umac_ctx *ctx;
+    _libssh2_cipher_ctx aes;
+    unsigned char zero_iv[16];
+    unsigned char buf[UMAC_L1_KEY_LEN +
+                      UMAC_L1_KEY_SHIFT * (UMAC_MAX_STREAMS - 1)];
+    size_t nh_key_len = UMAC_L1_KEY_LEN + UMAC_L1_KEY_SHIFT * (streams - 1);
+    int i, j;
+    int rc = 0;
+
+    /* the key is expanded here and not needed afterwards */
+    *free_key = 1;
+    *abstract = NULL;
+
+    ctx = LIBSSH2_ALLOC(session, sizeof(struct umac_ctx));
+    if (!ctx) {
+        return -1;
+    }
+    memset(ctx, 0, sizeof(struct umac_ctx));
+    ctx->streams = streams;
+
+    memset(zero_iv, 0, sizeof(zero_iv));
+    if (_libssh2_cipher_init(&aes, _libssh2_cipher_aes128ecb, zero_iv, key,
+                             1)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    /* NH key, as big-endian words */
+    rc |= umac_kdf(&aes, 1, buf, nh_key_len);
+    for(i = 0; i < (int) nh_key_len / 4; i++) {
+        ctx->nh_key[i] = _libssh2_ntohu32(buf + 4 * i);
+    }
+
+    /* polynomial hash keys, 8 bytes out of every 24 */
+    rc |= umac_kdf(&aes, 2, buf, 24 * streams);
+    for(i = 0; i < streams; i++) {
+        ctx->poly_key[i] = _libssh2_ntohu64(buf + 24 * i) &
+            UMAC_POLY_KEY_MASK;
+    }
+
+    /* inner-product keys, the last four of every eight words */
+    rc |= umac_kdf(&aes, 3, buf, 64 * streams);
+    for(i = 0; i < streams; i++) {
+        for(j = 0; j < 4; j++) {
+            ctx->ip_key[4 * i + j] =
+                _libssh2_ntohu64(buf + 64 * i + 32 + 8 * j) % UMAC_P36;
+        }
+    }
+
+    rc |= umac_kdf(&aes, 4, buf, 4 * streams);
+    for(i = 0; i < streams; i++) {
+        ctx->ip_trans[i] = _libssh2_ntohu32(buf + 4 * i);
+    }
+
+    rc |= umac_kdf(&aes, 0, buf, UMAC_KEY_LEN);
+    _libssh2_cipher_dtor(&aes);
+    if (!rc && _libssh2_cipher_init(&ctx->pdf, _libssh2_cipher_aes128ecb,
+                                    zero_iv, buf, 1)) {
+        rc = -1;
+    }
+    memset(buf, 0, sizeof(buf));
+
+    if (rc) {
+        memset(ctx, 0, sizeof(struct umac_ctx));
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    umac_reset(ctx);
+    *abstract = ctx;
+
+    return 0;
+}
+
+static int
+mac_method_umac_64_init(LIBSSH2_SESSION * session, unsigned char *key,
+                        int *free_key, void **abstract)
+{
+    return mac_method_umac_init(session, key, free_key, abstract, 2);
+}
+
+static int
+mac_method_umac_128_init(LIBSSH2_SESSION * session, unsigned char *key,
+                         int *free_key, void **abstract)
+{
+    return mac_method_umac_init(session, key, free_key, abstract, 4);
+}
+
+/* mac_method_umac_hash
+ * Calculate the UMAC tag of a packet, with its sequence number as nonce
+ */
+static int
+mac_method_umac_hash(LIBSSH2_SESSION * session,
+                     unsigned char *buf, uint32_t seqno,
+                     const unsigned char *packet,
+                     uint32_t packet_len,
+                     const unsigned char *addtl,
+                     uint32_t addtl_len, void **abstract)
+{
+    struct umac_ctx *ctx = (struct umac_ctx *) (*abstract);
+    (void) session;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    umac_update(ctx, packet, packet_len);
+    if (addtl && addtl_len) {
+        umac_update(ctx, addtl, addtl_len);
+    }
+
+    return umac_final(ctx, buf, seqno);
+}
+
+/* mac_method_umac_dtor
+ * Cleanup UMAC methods
+ */
+static int
+mac_method_umac_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct umac_ctx *ctx = (struct umac_ctx *) (*abstract);
+
+    if (ctx) {
+        _libssh2_cipher_dtor(&ctx->pdf);
+        memset(ctx, 0, sizeof(struct umac_ctx));
+        LIBSSH2_FREE(session, ctx);
+    }
+    *abstract = NULL;
+
+    return 0;
+}
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_64 = {
+    "umac-64@openssh.com",
+    8,
+    UMAC_KEY_LEN,
+    0,
+    mac_method_umac_64_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_64_etm = {
+    "umac-64-etm@openssh.com",
+    8,
+    UMAC_KEY_LEN,
+    1,
+    mac_method_umac_64_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_128 = {
+    "umac-128@openssh.com",
+    16,
+    UMAC_KEY_LEN,
+    0,
+    mac_method_umac_128_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_128_etm = {
+    "umac-128-etm@openssh.com",
+    16,
+    UMAC_KEY_LEN,
+    1,
+    mac_method_umac_128_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+};
+#endif /* LIBSSH2_UMAC */
+
 static const LIBSSH2_MAC_METHOD *mac_methods[] = {
+#if LIBSSH2_UMAC
+    &mac_method_umac_64_etm,
+    &mac_method_umac_128_etm,
+#endif /* LIBSSH2_UMAC */
+#if LIBSSH2_HMAC_SHA256
+    &mac_method_hmac_sha2_256_etm,
+#endif
+#if LIBSSH2_HMAC_SHA512
+    &mac_method_hmac_sha2_512_etm,
+#endif
+    &mac_method_hmac_sha1_etm,
+#if LIBSSH2_UMAC
+    &mac_method_umac_64,
+    &mac_method_umac_128,
+#endif /* LIBSSH2_UMAC */
 #if LIBSSH2_HMAC_SHA256
     &mac_method_hmac_sha2_256,
 #endif
@@ -393,13 +1035,17 @@ static const LIBSSH2_MAC_METHOD *mac_methods[] = {
 #endif
     &mac_method_hmac_sha1,
     &mac_method_hmac_sha1_96,
+    &mac_method_hmac_sha1_96_etm,
 #if LIBSSH2_MD5
     &mac_method_hmac_md5,
+    &mac_method_hmac_md5_etm,
     &mac_method_hmac_md5_96,
+    &mac_method_hmac_md5_96_etm,
 #endif
 #if LIBSSH2_HMAC_RIPEMD
     &mac_method_hmac_ripemd160,
     &mac_method_hmac_ripemd160_openssh_com,
+    &mac_method_hmac_ripemd160_etm,
 #endif /* LIBSSH2_HMAC_RIPEMD */
 #ifdef LIBSSH2_MAC_NONE
     &mac_method_none,
@@ -412,3 +1058,28 @@ _libssh2_mac_methods(void)
 {
     return mac_methods;
 }
+
+/* Stands in for the negotiated MAC when the cipher authenticates packets
+ * itself; it only tells the transport how long the trailing tag is
+ */
+static const LIBSSH2_MAC_METHOD mac_method_integrated = {
+    "INTEGRATED-AEAD",
+    16,
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL,
+};
+
+/* _libssh2_mac_override
+ * Returns the MAC method an AEAD cipher forces, or NULL if the MAC is to be
+ * negotiated as usual
+ */
+const LIBSSH2_MAC_METHOD *
+_libssh2_mac_override(const LIBSSH2_CRYPT_METHOD *crypt)
+{
+    if (crypt && (crypt->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC))
+        return &mac_method_integrated;
+    return NULL;
+}
@@ -50,6 +50,10 @@ struct _LIBSSH2_MAC_METHOD
     /* integrity key length */
     int key_len;
 
+    /* 1 for the -etm@openssh.com variants: the packet_length field is sent
+       in the clear and the MAC covers the encrypted packet */
+    int etm;
+
     /* Message Authentication Code Hashing algo */
     int (*init) (LIBSSH2_SESSION * session, unsigned char *key, int *free_key,
                  void **abstract);
@@ -63,5 +67,6 @@ struct _LIBSSH2_MAC_METHOD
 typedef struct _LIBSSH2_MAC_METHOD LIBSSH2_MAC_METHOD;
 
 const LIBSSH2_MAC_METHOD **_libssh2_mac_methods(void);
+const LIBSSH2_MAC_METHOD *_libssh2_mac_override(const LIBSSH2_CRYPT_METHOD *crypt);
 
 #endif /* __LIBSSH2_MAC_H */
@@ -233,6 +233,27 @@ void _libssh2_store_str(unsigned char **buf, const char *str, size_t len)
     }
 }
 
+/* _libssh2_get_string
+ * Reads an SSH string at *buf without going past end and advances *buf.
+ * Returns non-zero if the buffer is too short.
+ */
+int _libssh2_get_string(const unsigned char **buf, const unsigned char *end,
+                        const unsigned char **str, size_t *len)
+{
+    size_t str_len;
+
+    if(end - *buf < 4)
+        return -1;
+    str_len = _libssh2_ntohu32(*buf);
+    if((size_t)(end - *buf) - 4 < str_len)
+        return -1;
+
+    *str = *buf + 4;
+    *len = str_len;
+    *buf += 4 + str_len;
+    return 0;
+}
+
 /* Base64 Conversion */
 
 static const short base64_reverse_table[256] = {
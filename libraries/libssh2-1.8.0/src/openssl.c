@@ -43,6 +43,7 @@
 #ifdef LIBSSH2_OPENSSL /* compile only if we build with openssl */
 
 #include <string.h>
+#include "ed25519.h"
 
 #ifndef EVP_MAX_BLOCK_LENGTH
 #define EVP_MAX_BLOCK_LENGTH 32
@@ -235,35 +236,105 @@ _libssh2_cipher_init(_libssh2_cipher_ctx * h,
                      _libssh2_cipher_type(algo),
                      unsigned char *iv, unsigned char *secret, int encrypt)
 {
+    EVP_CIPHER_CTX *ctx;
+
 #ifdef HAVE_OPAQUE_STRUCTS
     *h = EVP_CIPHER_CTX_new();
-    return !EVP_CipherInit(*h, algo(), secret, iv, encrypt);
+    ctx = *h;
 #else
     EVP_CIPHER_CTX_init(h);
-    return !EVP_CipherInit(h, algo(), secret, iv, encrypt);
+    ctx = h;
+#endif
+
+#if LIBSSH2_AES_GCM
+    if (EVP_CIPHER_mode(algo()) == EVP_CIPH_GCM_MODE) {
+        /* RFC 5647: the whole 12 byte IV is the fixed field plus the
+           invocation counter, which OpenSSL bumps for every IV_GEN */
+        return !EVP_CipherInit(ctx, algo(), secret, NULL, encrypt) ||
+            !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IV_FIXED, -1, iv);
+    }
 #endif
+
+    return !EVP_CipherInit(ctx, algo(), secret, iv, encrypt);
 }
 
+/* Transforms any number of whole blocks in place: EVP ciphers accept
+   identical input and output buffers, so no bounce buffer is needed */
 int
 _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                       _libssh2_cipher_type(algo),
                       int encrypt, unsigned char *block, size_t blocksize)
 {
-    unsigned char buf[EVP_MAX_BLOCK_LENGTH];
     int ret;
     (void) algo;
     (void) encrypt;
 
 #ifdef HAVE_OPAQUE_STRUCTS
-    ret = EVP_Cipher(*ctx, buf, block, blocksize);
+    ret = EVP_Cipher(*ctx, block, block, blocksize);
 #else
-    ret = EVP_Cipher(ctx, buf, block, blocksize);
+    ret = EVP_Cipher(ctx, block, block, blocksize);
 #endif
-    if (ret == 1) {
-        memcpy(block, buf, blocksize);
-    }
-    return ret == 1 ? 0 : 1;
+    /* OpenSSL 3 returns the number of bytes processed rather than 1 */
+    return ret > 0 ? 0 : 1;
+}
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_cipher_crypt_aead(_libssh2_cipher_ctx * h,
+                           int encrypt,
+                           const unsigned char *aad, size_t aad_len,
+                           unsigned char *buf, size_t len,
+                           unsigned char *tag, size_t tag_len)
+{
+    unsigned char lastiv[1];
+#ifdef HAVE_OPAQUE_STRUCTS
+    EVP_CIPHER_CTX *ctx = *h;
+#else
+    EVP_CIPHER_CTX *ctx = h;
+#endif
+
+    /* next nonce; GCM ciphers are "custom" so EVP_Cipher() returns the
+       number of bytes processed, or -1 */
+    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_IV_GEN, 1, lastiv))
+        return 1;
+    if (!encrypt &&
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int)tag_len, tag))
+        return 1;
+    if (EVP_Cipher(ctx, NULL, aad, aad_len) < 0 ||
+        EVP_Cipher(ctx, buf, buf, len) < 0)
+        return 1;
+    /* finalising checks the tag when decrypting */
+    if (EVP_Cipher(ctx, NULL, NULL, 0) < 0)
+        return 1;
+    if (encrypt &&
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int)tag_len, tag))
+        return 1;
+
+    return 0;
+}
+#endif /* LIBSSH2_AES_GCM */
+
+#if LIBSSH2_CHACHA20_POLY1305
+int
+_libssh2_cipher_crypt_iv(_libssh2_cipher_ctx * h,
+                         const unsigned char *key,
+                         const unsigned char *iv,
+                         unsigned char *buf, size_t len)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    EVP_CIPHER_CTX *ctx = *h;
+#else
+    EVP_CIPHER_CTX *ctx = h;
+#endif
+
+    /* the key has to be passed again: before 1.1.0f EVP_chacha20 ignores an
+       IV given on its own */
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, -1))
+        return 1;
+    /* OpenSSL 3 returns the number of bytes processed rather than 1 */
+    return EVP_Cipher(ctx, buf, buf, len) > 0 ? 0 : 1;
 }
+#endif /* LIBSSH2_CHACHA20_POLY1305 */
 
 #if LIBSSH2_AES_CTR && !defined(HAVE_EVP_AES_128_CTR)
 
@@ -346,7 +417,7 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
     size_t i = 0;
     int outlen = 0;
 
-    if (inl != 16) /* libssh2 only ever encrypt one block */
+    if (inl % AES_BLOCK_SIZE) /* libssh2 only ever encrypts whole blocks */
         return 0;
 
     if (c == NULL) {
@@ -360,18 +431,20 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
   the ciphertext block C1.  The counter X is then incremented
 */
 
-    if (EVP_EncryptUpdate(c->aes_ctx, b1, &outlen, c->ctr, AES_BLOCK_SIZE) != 1) {
-        return 0;
-    }
+    for (; inl; inl -= AES_BLOCK_SIZE) {
+        if (EVP_EncryptUpdate(c->aes_ctx, b1, &outlen, c->ctr, AES_BLOCK_SIZE) != 1) {
+            return 0;
+        }
 
-    for (i = 0; i < 16; i++)
-        *out++ = *in++ ^ b1[i];
+        for (i = 0; i < 16; i++)
+            *out++ = *in++ ^ b1[i];
 
-    i = 15;
-    while (c->ctr[i]++ == 0xFF) {
-        if (i == 0)
-            break;
-        i--;
+        i = 15;
+        while (c->ctr[i]++ == 0xFF) {
+            if (i == 0)
+                break;
+            i--;
+        }
     }
 
     return 1;
@@ -786,6 +859,50 @@ _libssh2_sha256(const unsigned char *message, unsigned long len,
     return 1; /* error */
 }
 
+int
+_libssh2_sha384_init(libssh2_sha384_ctx *ctx)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    *ctx = EVP_MD_CTX_new();
+
+    if (*ctx == NULL)
+        return 0;
+
+    if (EVP_DigestInit(*ctx, EVP_get_digestbyname("sha384")))
+        return 1;
+
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+
+    return 0;
+#else
+    EVP_MD_CTX_init(ctx);
+    return EVP_DigestInit(ctx, EVP_get_digestbyname("sha384"));
+#endif
+}
+
+int
+_libssh2_sha512_init(libssh2_sha512_ctx *ctx)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    *ctx = EVP_MD_CTX_new();
+
+    if (*ctx == NULL)
+        return 0;
+
+    if (EVP_DigestInit(*ctx, EVP_get_digestbyname("sha512")))
+        return 1;
+
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+
+    return 0;
+#else
+    EVP_MD_CTX_init(ctx);
+    return EVP_DigestInit(ctx, EVP_get_digestbyname("sha512"));
+#endif
+}
+
 int
 _libssh2_md5_init(libssh2_md5_ctx *ctx)
 {
@@ -1036,6 +1153,810 @@ gen_publickey_from_dsa_evp(LIBSSH2_SESSION *session,
 }
 #endif /* LIBSSH_DSA */
 
+#if LIBSSH2_ECDH || LIBSSH2_ECDSA
+static int
+_libssh2_curve_nid(libssh2_curve_type curve)
+{
+    switch (curve) {
+    case LIBSSH2_EC_CURVE_NISTP256:
+        return NID_X9_62_prime256v1;
+    case LIBSSH2_EC_CURVE_NISTP384:
+        return NID_secp384r1;
+    case LIBSSH2_EC_CURVE_NISTP521:
+        return NID_secp521r1;
+    default:
+        return NID_undef;
+    }
+}
+#endif /* LIBSSH2_ECDH || LIBSSH2_ECDSA */
+
+#if LIBSSH2_ECDSA || LIBSSH2_ED25519_EVP
+/*
+ * Private keys in OpenSSH's own file format, which ssh-keygen uses for all
+ * ed25519 keys and, since OpenSSH 7.8, for new keys of any type. Only the
+ * key types that have no PEM form known to OpenSSL are handled here.
+ */
+static EVP_PKEY *
+openssh_private_key_to_evp(const unsigned char *data, size_t data_len)
+{
+    const unsigned char *s = data, *end = data + data_len;
+    const unsigned char *type;
+    size_t type_len;
+
+    if (_libssh2_get_string(&s, end, &type, &type_len)) {
+        return NULL;
+    }
+
+#if LIBSSH2_ED25519_EVP
+    if (type_len == 11 && memcmp(type, "ssh-ed25519", 11) == 0) {
+        const unsigned char *pub, *priv;
+        size_t pub_len, priv_len;
+
+        /* priv is the 32 byte seed followed by the public key */
+        if (_libssh2_get_string(&s, end, &pub, &pub_len) ||
+            _libssh2_get_string(&s, end, &priv, &priv_len) ||
+            pub_len != 32 || priv_len != 64) {
+            return NULL;
+        }
+        return EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL,
+                                            priv, 32);
+    }
+#endif /* LIBSSH2_ED25519_EVP */
+
+#if LIBSSH2_ECDSA
+    if (type_len == 19 && memcmp(type, "ecdsa-sha2-nistp", 16) == 0) {
+        const unsigned char *curve_name, *point, *d;
+        size_t curve_name_len, point_len, d_len;
+        EC_KEY *ec = NULL;
+        EC_POINT *pub = NULL;
+        BIGNUM *priv = NULL;
+        EVP_PKEY *pk = NULL;
+        int nid;
+
+        if (_libssh2_get_string(&s, end, &curve_name, &curve_name_len) ||
+            _libssh2_get_string(&s, end, &point, &point_len) ||
+            _libssh2_get_string(&s, end, &d, &d_len) ||
+            curve_name_len != 8 || memcmp(curve_name, type + 11, 8) != 0) {
+            return NULL;
+        }
+
+        if (memcmp(type + 16, "256", 3) == 0)
+            nid = _libssh2_curve_nid(LIBSSH2_EC_CURVE_NISTP256);
+        else if (memcmp(type + 16, "384", 3) == 0)
+            nid = _libssh2_curve_nid(LIBSSH2_EC_CURVE_NISTP384);
+        else if (memcmp(type + 16, "521", 3) == 0)
+            nid = _libssh2_curve_nid(LIBSSH2_EC_CURVE_NISTP521);
+        else
+            return NULL;
+
+        ec = EC_KEY_new_by_curve_name(nid);
+        if (ec) {
+            pub = EC_POINT_new(EC_KEY_get0_group(ec));
+            priv = BN_bin2bn(d, d_len, NULL);
+        }
+        if (pub && priv &&
+            EC_POINT_oct2point(EC_KEY_get0_group(ec), pub, point, point_len,
+                               NULL) == 1 &&
+            EC_KEY_set_public_key(ec, pub) &&
+            EC_KEY_set_private_key(ec, priv) &&
+            EC_KEY_check_key(ec)) {
+            pk = EVP_PKEY_new();
+            if (pk && EVP_PKEY_assign_EC_KEY(pk, ec)) {
+                ec = NULL;
+            }
+            else {
+                EVP_PKEY_free(pk);
+                pk = NULL;
+            }
+        }
+
+        EC_POINT_free(pub);
+        BN_clear_free(priv);
+        EC_KEY_free(ec);
+        return pk;
+    }
+#endif /* LIBSSH2_ECDSA */
+
+    return NULL;
+}
+
+static EVP_PKEY *
+read_openssh_private_key_from_memory(LIBSSH2_SESSION * session,
+                                     const char *filedata,
+                                     size_t filedata_len)
+{
+    unsigned char *data;
+    size_t data_len;
+    EVP_PKEY *pk;
+
+    if (_libssh2_openssh_pem_parse_memory(session, filedata, filedata_len,
+                                          &data, &data_len)) {
+        return NULL;
+    }
+
+    pk = openssh_private_key_to_evp(data, data_len);
+
+    memset(data, 0, data_len);
+    LIBSSH2_FREE(session, data);
+    return pk;
+}
+
+static EVP_PKEY *
+read_openssh_private_key_from_file(LIBSSH2_SESSION * session,
+                                   const char *filename)
+{
+    unsigned char *data;
+    size_t data_len;
+    EVP_PKEY *pk;
+    FILE *fp;
+    int rc;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        return NULL;
+    }
+    rc = _libssh2_openssh_pem_parse(session, fp, &data, &data_len);
+    fclose(fp);
+    if (rc) {
+        return NULL;
+    }
+
+    pk = openssh_private_key_to_evp(data, data_len);
+
+    memset(data, 0, data_len);
+    LIBSSH2_FREE(session, data);
+    return pk;
+}
+#endif /* LIBSSH2_ECDSA || LIBSSH2_ED25519_EVP */
+
+#if LIBSSH2_ECDSA
+int
+_libssh2_ecdsa_new_public(libssh2_ecdsa_ctx ** ecdsactx,
+                          libssh2_curve_type curve,
+                          const unsigned char *point,
+                          size_t point_len)
+{
+    EC_KEY *ec;
+    EC_POINT *pub = NULL;
+    int ret = -1;
+
+    ec = EC_KEY_new_by_curve_name(_libssh2_curve_nid(curve));
+    if (ec) {
+        pub = EC_POINT_new(EC_KEY_get0_group(ec));
+    }
+    /* EC_POINT_oct2point rejects points that are not on the curve */
+    if (pub &&
+        EC_POINT_oct2point(EC_KEY_get0_group(ec), pub, point, point_len,
+                           NULL) == 1 &&
+        EC_KEY_set_public_key(ec, pub)) {
+        *ecdsactx = ec;
+        ec = NULL;
+        ret = 0;
+    }
+
+    EC_POINT_free(pub);
+    EC_KEY_free(ec);
+    return ret;
+}
+
+static int
+ecdsa_new_private_from_evp(libssh2_ecdsa_ctx ** ecdsactx, EVP_PKEY *pk)
+{
+    if (!pk) {
+        return -1;
+    }
+    *ecdsactx = EVP_PKEY_get1_EC_KEY(pk);
+    EVP_PKEY_free(pk);
+
+    return (*ecdsactx) ? 0 : -1;
+}
+
+int
+_libssh2_ecdsa_new_private_frommemory(libssh2_ecdsa_ctx ** ecdsactx,
+                                      LIBSSH2_SESSION * session,
+                                      const char *filedata,
+                                      size_t filedata_len,
+                                      unsigned const char *passphrase)
+{
+    pem_read_bio_func read_ec =
+        (pem_read_bio_func) &PEM_read_bio_ECPrivateKey;
+
+    _libssh2_init_if_needed();
+
+    if (!read_private_key_from_memory((void **) ecdsactx, read_ec,
+                                      filedata, filedata_len, passphrase)) {
+        return 0;
+    }
+
+    return ecdsa_new_private_from_evp(ecdsactx,
+                                      read_openssh_private_key_from_memory(
+                                          session, filedata, filedata_len));
+}
+
+int
+_libssh2_ecdsa_new_private(libssh2_ecdsa_ctx ** ecdsactx,
+                           LIBSSH2_SESSION * session,
+                           const char *filename,
+                           unsigned const char *passphrase)
+{
+    pem_read_bio_func read_ec =
+        (pem_read_bio_func) &PEM_read_bio_ECPrivateKey;
+
+    _libssh2_init_if_needed ();
+
+    if (!read_private_key_from_file((void **) ecdsactx, read_ec,
+                                    filename, passphrase)) {
+        return 0;
+    }
+
+    return ecdsa_new_private_from_evp(ecdsactx,
+                                      read_openssh_private_key_from_file(
+                                          session, filename));
+}
+
+int
+_libssh2_ecdsa_get_curve_type(libssh2_ecdsa_ctx * ecdsactx,
+                              libssh2_curve_type *curve)
+{
+    switch (EC_GROUP_get_curve_name(EC_KEY_get0_group(ecdsactx))) {
+    case NID_X9_62_prime256v1:
+        *curve = LIBSSH2_EC_CURVE_NISTP256;
+        return 0;
+    case NID_secp384r1:
+        *curve = LIBSSH2_EC_CURVE_NISTP384;
+        return 0;
+    case NID_secp521r1:
+        *curve = LIBSSH2_EC_CURVE_NISTP521;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int
+_libssh2_ecdsa_verify(libssh2_ecdsa_ctx * ecdsactx,
+                      const unsigned char *r, size_t r_len,
+                      const unsigned char *s, size_t s_len,
+                      const unsigned char *hash, size_t hash_len)
+{
+    ECDSA_SIG *sig;
+    BIGNUM *r_bn, *s_bn;
+    int ret;
+
+    sig = ECDSA_SIG_new();
+    if (!sig) {
+        return -1;
+    }
+    r_bn = BN_bin2bn(r, r_len, NULL);
+    s_bn = BN_bin2bn(s, s_len, NULL);
+    if (!r_bn || !s_bn) {
+        BN_free(r_bn);
+        BN_free(s_bn);
+        ECDSA_SIG_free(sig);
+        return -1;
+    }
+#ifdef HAVE_OPAQUE_STRUCTS
+    ECDSA_SIG_set0(sig, r_bn, s_bn);
+#else
+    BN_free(sig->r);
+    BN_free(sig->s);
+    sig->r = r_bn;
+    sig->s = s_bn;
+#endif
+
+    ret = ECDSA_do_verify(hash, hash_len, sig, ecdsactx);
+    ECDSA_SIG_free(sig);
+
+    return (ret == 1) ? 0 : -1;
+}
+
+int
+_libssh2_ecdsa_sign(LIBSSH2_SESSION * session,
+                    libssh2_ecdsa_ctx * ecdsactx,
+                    const unsigned char *hash, size_t hash_len,
+                    unsigned char **signature, size_t *signature_len)
+{
+    ECDSA_SIG *sig;
+    const BIGNUM *r;
+    const BIGNUM *s;
+    int r_bytes, s_bytes;
+    unsigned char *p;
+
+    sig = ECDSA_do_sign(hash, hash_len, ecdsactx);
+    if (!sig) {
+        return -1;
+    }
+
+#ifdef HAVE_OPAQUE_STRUCTS
+    ECDSA_SIG_get0(sig, &r, &s);
+#else
+    r = sig->r;
+    s = sig->s;
+#endif
+    r_bytes = BN_num_bytes(r) + 1;
+    s_bytes = BN_num_bytes(s) + 1;
+
+    /* Signature blob is mpint r + mpint s. */
+    *signature = LIBSSH2_ALLOC(session, 4 + r_bytes + 4 + s_bytes);
+    if (!*signature) {
+        ECDSA_SIG_free(sig);
+        return -1;
+    }
+
+    p = write_bn(*signature, r, r_bytes);
+    p = write_bn(p, s, s_bytes);
+    *signature_len = (size_t)(p - *signature);
+
+    ECDSA_SIG_free(sig);
+    return 0;
+}
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519_EVP
+int
+_libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519ctx,
+                            const unsigned char *key, size_t key_len)
+{
+    if (key_len != 32) {
+        return -1;
+    }
+
+    *ed25519ctx = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+                                              key, key_len);
+
+    return (*ed25519ctx) ? 0 : -1;
+}
+
+static int
+ed25519_new_private_from_evp(libssh2_ed25519_ctx ** ed25519ctx,
+                             EVP_PKEY *pk)
+{
+    if (pk && EVP_PKEY_id(pk) != EVP_PKEY_ED25519) {
+        EVP_PKEY_free(pk);
+        pk = NULL;
+    }
+    *ed25519ctx = pk;
+
+    return (*ed25519ctx) ? 0 : -1;
+}
+
+int
+_libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519ctx,
+                                        LIBSSH2_SESSION * session,
+                                        const char *filedata,
+                                        size_t filedata_len,
+                                        unsigned const char *passphrase)
+{
+    pem_read_bio_func read_pkey =
+        (pem_read_bio_func) &PEM_read_bio_PrivateKey;
+    EVP_PKEY *pk;
+
+    _libssh2_init_if_needed();
+
+    /* PKCS#8 as written by OpenSSL, or else OpenSSH's format */
+    if (read_private_key_from_memory((void **) &pk, read_pkey,
+                                     filedata, filedata_len, passphrase)) {
+        pk = read_openssh_private_key_from_memory(session, filedata,
+                                                  filedata_len);
+    }
+
+    return ed25519_new_private_from_evp(ed25519ctx, pk);
+}
+
+int
+_libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519ctx,
+                             LIBSSH2_SESSION * session,
+                             const char *filename,
+                             unsigned const char *passphrase)
+{
+    pem_read_bio_func read_pkey =
+        (pem_read_bio_func) &PEM_read_bio_PrivateKey;
+    EVP_PKEY *pk;
+
+    _libssh2_init_if_needed ();
+
+    /* PKCS#8 as written by OpenSSL, or else OpenSSH's format */
+    if (read_private_key_from_file((void **) &pk, read_pkey,
+                                   filename, passphrase)) {
+        pk = read_openssh_private_key_from_file(session, filename);
+    }
+
+    return ed25519_new_private_from_evp(ed25519ctx, pk);
+}
+
+int
+_libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519ctx,
+                        const unsigned char *s, size_t s_len,
+                        const unsigned char *m, size_t m_len)
+{
+    EVP_MD_CTX *md_ctx;
+    int ret = -1;
+
+    md_ctx = EVP_MD_CTX_new();
+    if (!md_ctx) {
+        return -1;
+    }
+
+    /* Ed25519 hashes internally; the message goes in whole */
+    if (EVP_DigestVerifyInit(md_ctx, NULL, NULL, NULL, ed25519ctx) == 1 &&
+        EVP_DigestVerify(md_ctx, s, s_len, m, m_len) == 1) {
+        ret = 0;
+    }
+
+    EVP_MD_CTX_free(md_ctx);
+    return ret;
+}
+
+int
+_libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                      libssh2_ed25519_ctx * ed25519ctx,
+                      const unsigned char *m, size_t m_len,
+                      unsigned char **signature, size_t *signature_len)
+{
+    EVP_MD_CTX *md_ctx;
+    unsigned char *sig;
+    size_t sig_len = 64;
+    int ret = -1;
+
+    sig = LIBSSH2_ALLOC(session, sig_len);
+    if (!sig) {
+        return -1;
+    }
+
+    md_ctx = EVP_MD_CTX_new();
+    if (md_ctx &&
+        EVP_DigestSignInit(md_ctx, NULL, NULL, NULL, ed25519ctx) == 1 &&
+        EVP_DigestSign(md_ctx, sig, &sig_len, m, m_len) == 1) {
+        ret = 0;
+    }
+    EVP_MD_CTX_free(md_ctx);
+
+    if (ret) {
+        LIBSSH2_FREE(session, sig);
+        return -1;
+    }
+
+    *signature = sig;
+    *signature_len = sig_len;
+    return 0;
+}
+#else /* !LIBSSH2_ED25519_EVP */
+int
+_libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519ctx,
+                            const unsigned char *key, size_t key_len)
+{
+    libssh2_ed25519_ctx *ctx;
+
+    if (key_len != LIBSSH2_ED25519_KEY_LEN) {
+        return -1;
+    }
+
+    ctx = OPENSSL_malloc(sizeof(*ctx));
+    if (!ctx) {
+        return -1;
+    }
+    memcpy(ctx->public_key, key, key_len);
+    memset(ctx->seed, 0, sizeof(ctx->seed));
+    ctx->has_private = 0;
+
+    *ed25519ctx = ctx;
+    return 0;
+}
+
+/*
+ * This libcrypto can't read ed25519 keys, so only OpenSSH's own format is
+ * understood. Its private half is the 32 byte seed followed by the public
+ * key.
+ */
+static int
+ed25519_new_private_from_openssh(libssh2_ed25519_ctx ** ed25519ctx,
+                                 const unsigned char *data, size_t data_len)
+{
+    const unsigned char *s = data, *end = data + data_len;
+    const unsigned char *type, *pub, *priv;
+    size_t type_len, pub_len, priv_len;
+    libssh2_ed25519_ctx *ctx;
+
+    if (_libssh2_get_string(&s, end, &type, &type_len) ||
+        type_len != 11 || memcmp(type, "ssh-ed25519", 11) != 0 ||
+        _libssh2_get_string(&s, end, &pub, &pub_len) ||
+        _libssh2_get_string(&s, end, &priv, &priv_len) ||
+        pub_len != LIBSSH2_ED25519_KEY_LEN ||
+        priv_len != 2 * LIBSSH2_ED25519_KEY_LEN ||
+        memcmp(priv + LIBSSH2_ED25519_KEY_LEN, pub, pub_len) != 0) {
+        return -1;
+    }
+
+    ctx = OPENSSL_malloc(sizeof(*ctx));
+    if (!ctx) {
+        return -1;
+    }
+    memcpy(ctx->public_key, pub, pub_len);
+    memcpy(ctx->seed, priv, LIBSSH2_ED25519_KEY_LEN);
+    ctx->has_private = 1;
+
+    *ed25519ctx = ctx;
+    return 0;
+}
+
+int
+_libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519ctx,
+                                        LIBSSH2_SESSION * session,
+                                        const char *filedata,
+                                        size_t filedata_len,
+                                        unsigned const char *passphrase)
+{
+    unsigned char *data;
+    size_t data_len;
+    int rc;
+
+    (void) passphrase;
+
+    if (_libssh2_openssh_pem_parse_memory(session, filedata, filedata_len,
+                                          &data, &data_len)) {
+        return -1;
+    }
+
+    rc = ed25519_new_private_from_openssh(ed25519ctx, data, data_len);
+
+    memset(data, 0, data_len);
+    LIBSSH2_FREE(session, data);
+    return rc;
+}
+
+int
+_libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519ctx,
+                             LIBSSH2_SESSION * session,
+                             const char *filename,
+                             unsigned const char *passphrase)
+{
+    unsigned char *data;
+    size_t data_len;
+    FILE *fp;
+    int rc;
+
+    (void) passphrase;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        return -1;
+    }
+    rc = _libssh2_openssh_pem_parse(session, fp, &data, &data_len);
+    fclose(fp);
+    if (rc) {
+        return -1;
+    }
+
+    rc = ed25519_new_private_from_openssh(ed25519ctx, data, data_len);
+
+    memset(data, 0, data_len);
+    LIBSSH2_FREE(session, data);
+    return rc;
+}
+
+int
+_libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519ctx,
+                        const unsigned char *s, size_t s_len,
+                        const unsigned char *m, size_t m_len)
+{
+    if (s_len != LIBSSH2_ED25519_SIG_LEN) {
+        return -1;
+    }
+
+    return _libssh2_ed25519_ref_verify(s, m, m_len, ed25519ctx->public_key);
+}
+
+int
+_libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                      libssh2_ed25519_ctx * ed25519ctx,
+                      const unsigned char *m, size_t m_len,
+                      unsigned char **signature, size_t *signature_len)
+{
+    unsigned char *sig;
+
+    if (!ed25519ctx->has_private) {
+        return -1;
+    }
+
+    sig = LIBSSH2_ALLOC(session, LIBSSH2_ED25519_SIG_LEN);
+    if (!sig) {
+        return -1;
+    }
+
+    if (_libssh2_ed25519_ref_sign(sig, m, m_len, ed25519ctx->seed,
+                                  ed25519ctx->public_key)) {
+        LIBSSH2_FREE(session, sig);
+        return -1;
+    }
+
+    *signature = sig;
+    *signature_len = LIBSSH2_ED25519_SIG_LEN;
+    return 0;
+}
+
+void
+_libssh2_ed25519_free(libssh2_ed25519_ctx *ed25519ctx)
+{
+    if (ed25519ctx) {
+        OPENSSL_cleanse(ed25519ctx, sizeof(*ed25519ctx));
+        OPENSSL_free(ed25519ctx);
+    }
+}
+#endif /* LIBSSH2_ED25519_EVP */
+
+#if LIBSSH2_ECDSA
+static int
+gen_publickey_from_ec_evp(LIBSSH2_SESSION *session,
+                          unsigned char **method,
+                          size_t *method_len,
+                          unsigned char **pubkeydata,
+                          size_t *pubkeydata_len,
+                          EVP_PKEY *pk)
+{
+    EC_KEY*        ec = NULL;
+    const EC_GROUP* group;
+    const char*    name;
+    unsigned char* key = NULL;
+    unsigned char* method_buf = NULL;
+    unsigned char* p;
+    size_t  point_len;
+
+    _libssh2_debug(session,
+                   LIBSSH2_TRACE_AUTH,
+                   "Computing public key from EC private key envelop");
+
+    ec = EVP_PKEY_get1_EC_KEY(pk);
+    if (ec == NULL) {
+        goto __alloc_error;
+    }
+    group = EC_KEY_get0_group(ec);
+
+    switch (EC_GROUP_get_curve_name(group)) {
+    case NID_X9_62_prime256v1:
+        name = "ecdsa-sha2-nistp256";
+        break;
+    case NID_secp384r1:
+        name = "ecdsa-sha2-nistp384";
+        break;
+    case NID_secp521r1:
+        name = "ecdsa-sha2-nistp521";
+        break;
+    default:
+        EC_KEY_free(ec);
+        return _libssh2_error(session,
+                              LIBSSH2_ERROR_FILE,
+                              "Unable to extract public key "
+                              "from private key file: "
+                              "Unsupported elliptic curve");
+    }
+
+    point_len = EC_POINT_point2oct(group, EC_KEY_get0_public_key(ec),
+                                   POINT_CONVERSION_UNCOMPRESSED,
+                                   NULL, 0, NULL);
+
+    method_buf = LIBSSH2_ALLOC(session, 19);  /* ecdsa-sha2-nistpNNN. */
+    if (method_buf == NULL) {
+        goto __alloc_error;
+    }
+
+    /* Key form is "ecdsa-sha2-nistpNNN" + "nistpNNN" + Q. */
+    key = LIBSSH2_ALLOC(session, 4 + 19 + 4 + 8 + 4 + point_len);
+    if (key == NULL) {
+        goto __alloc_error;
+    }
+
+    p = key;
+    _libssh2_store_str(&p, name, 19);
+    _libssh2_store_str(&p, name + 11, 8);
+    _libssh2_store_u32(&p, point_len);
+    if (EC_POINT_point2oct(group, EC_KEY_get0_public_key(ec),
+                           POINT_CONVERSION_UNCOMPRESSED,
+                           p, point_len, NULL) != point_len) {
+        goto __alloc_error;
+    }
+    p += point_len;
+    EC_KEY_free(ec);
+
+    memcpy(method_buf, name, 19);
+    *method         = method_buf;
+    *method_len     = 19;
+    *pubkeydata     = key;
+    *pubkeydata_len = (size_t)(p - key);
+    return 0;
+
+  __alloc_error:
+    if (ec != NULL) {
+        EC_KEY_free(ec);
+    }
+    if (key != NULL) {
+        LIBSSH2_FREE(session, key);
+    }
+    if (method_buf != NULL) {
+        LIBSSH2_FREE(session, method_buf);
+    }
+
+    return _libssh2_error(session,
+                          LIBSSH2_ERROR_ALLOC,
+                          "Unable to allocate memory for private key data");
+}
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+static int
+gen_publickey_from_ed25519(LIBSSH2_SESSION *session,
+                           unsigned char **method,
+                           size_t *method_len,
+                           unsigned char **pubkeydata,
+                           size_t *pubkeydata_len,
+                           const unsigned char *raw)
+{
+    unsigned char* key = NULL;
+    unsigned char* method_buf = NULL;
+    unsigned char* p;
+
+    _libssh2_debug(session,
+                   LIBSSH2_TRACE_AUTH,
+                   "Computing public key from ED25519 private key envelop");
+
+    method_buf = LIBSSH2_ALLOC(session, 11);  /* ssh-ed25519. */
+    if (method_buf == NULL) {
+        goto __alloc_error;
+    }
+
+    /* Key form is "ssh-ed25519" + 32 byte public key. */
+    key = LIBSSH2_ALLOC(session, 4 + 11 + 4 + LIBSSH2_ED25519_KEY_LEN);
+    if (key == NULL) {
+        goto __alloc_error;
+    }
+
+    p = key;
+    _libssh2_store_str(&p, "ssh-ed25519", 11);
+    _libssh2_store_str(&p, (const char *) raw, LIBSSH2_ED25519_KEY_LEN);
+
+    memcpy(method_buf, "ssh-ed25519", 11);
+    *method         = method_buf;
+    *method_len     = 11;
+    *pubkeydata     = key;
+    *pubkeydata_len = (size_t)(p - key);
+    return 0;
+
+  __alloc_error:
+    if (method_buf != NULL) {
+        LIBSSH2_FREE(session, method_buf);
+    }
+
+    return _libssh2_error(session,
+                          LIBSSH2_ERROR_ALLOC,
+                          "Unable to allocate memory for private key data");
+}
+#endif /* LIBSSH2_ED25519 */
+
+#if LIBSSH2_ED25519_EVP
+static int
+gen_publickey_from_ed25519_evp(LIBSSH2_SESSION *session,
+                               unsigned char **method,
+                               size_t *method_len,
+                               unsigned char **pubkeydata,
+                               size_t *pubkeydata_len,
+                               EVP_PKEY *pk)
+{
+    unsigned char  raw[LIBSSH2_ED25519_KEY_LEN];
+    size_t         raw_len = sizeof(raw);
+
+    if (EVP_PKEY_get_raw_public_key(pk, raw, &raw_len) != 1 ||
+        raw_len != sizeof(raw)) {
+        return _libssh2_error(session,
+                              LIBSSH2_ERROR_FILE,
+                              "Unable to extract public key "
+                              "from private key file: "
+                              "Invalid ED25519 key");
+    }
+
+    return gen_publickey_from_ed25519(session, method, method_len,
+                                      pubkeydata, pubkeydata_len, raw);
+}
+#endif /* LIBSSH2_ED25519_EVP */
+
 int
 _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
                           unsigned char **method,
@@ -1074,6 +1995,28 @@ _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
     pk = PEM_read_bio_PrivateKey(bp, NULL, NULL, (void*)passphrase);
     BIO_free(bp);
 
+#if LIBSSH2_ECDSA || LIBSSH2_ED25519_EVP
+    if (pk == NULL) {
+        pk = read_openssh_private_key_from_file(session, privatekey);
+    }
+#endif
+
+#if !LIBSSH2_ED25519_EVP
+    if (pk == NULL) {
+        libssh2_ed25519_ctx *ed25519ctx;
+
+        if (_libssh2_ed25519_new_private(&ed25519ctx, session, privatekey,
+                                         (const unsigned char *) passphrase)
+            == 0) {
+            st = gen_publickey_from_ed25519(session, method, method_len,
+                                            pubkeydata, pubkeydata_len,
+                                            ed25519ctx->public_key);
+            _libssh2_ed25519_free(ed25519ctx);
+            return st;
+        }
+    }
+#endif
+
     if (pk == NULL) {
         return _libssh2_error(session,
                               LIBSSH2_ERROR_FILE,
@@ -1102,6 +2045,20 @@ _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
         break;
 #endif /* LIBSSH_DSA */
 
+#if LIBSSH2_ECDSA
+    case EVP_PKEY_EC :
+        st = gen_publickey_from_ec_evp(
+            session, method, method_len, pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519_EVP
+    case EVP_PKEY_ED25519 :
+        st = gen_publickey_from_ed25519_evp(
+            session, method, method_len, pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ED25519_EVP */
+
     default :
         st = _libssh2_error(session,
                             LIBSSH2_ERROR_FILE,
@@ -1150,6 +2107,29 @@ _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
     pk = PEM_read_bio_PrivateKey(bp, NULL, NULL, (void*)passphrase);
     BIO_free(bp);
 
+#if LIBSSH2_ECDSA || LIBSSH2_ED25519_EVP
+    if (pk == NULL) {
+        pk = read_openssh_private_key_from_memory(session, privatekeydata,
+                                                  privatekeydata_len);
+    }
+#endif
+
+#if !LIBSSH2_ED25519_EVP
+    if (pk == NULL) {
+        libssh2_ed25519_ctx *ed25519ctx;
+
+        if (_libssh2_ed25519_new_private_frommemory(
+                &ed25519ctx, session, privatekeydata, privatekeydata_len,
+                (const unsigned char *) passphrase) == 0) {
+            st = gen_publickey_from_ed25519(session, method, method_len,
+                                            pubkeydata, pubkeydata_len,
+                                            ed25519ctx->public_key);
+            _libssh2_ed25519_free(ed25519ctx);
+            return st;
+        }
+    }
+#endif
+
     if (pk == NULL) {
         return _libssh2_error(session,
                               LIBSSH2_ERROR_FILE,
@@ -1176,6 +2156,18 @@ _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
                                         pubkeydata, pubkeydata_len, pk);
         break;
 #endif /* LIBSSH_DSA */
+#if LIBSSH2_ECDSA
+    case EVP_PKEY_EC :
+        st = gen_publickey_from_ec_evp(session, method, method_len,
+                                       pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ECDSA */
+#if LIBSSH2_ED25519_EVP
+    case EVP_PKEY_ED25519 :
+        st = gen_publickey_from_ed25519_evp(session, method, method_len,
+                                            pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ED25519_EVP */
     default :
         st = _libssh2_error(session,
                             LIBSSH2_ERROR_FILE,
@@ -1189,4 +2181,148 @@ _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
     return st;
 }
 
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519
+
+int
+_libssh2_ecdh_new(LIBSSH2_SESSION * session,
+                  libssh2_curve_type curve,
+                  _libssh2_ecdh_key ** key,
+                  unsigned char **public_key,
+                  size_t *public_key_len)
+{
+    EVP_PKEY *pkey = NULL;
+    unsigned char *point = NULL;
+    size_t point_len = 0;
+
+    *key = NULL;
+    *public_key = NULL;
+    *public_key_len = 0;
+
+#if LIBSSH2_CURVE25519
+    if (curve == LIBSSH2_EC_CURVE_25519) {
+        /* 1.1.0 lacks the EVP_PKEY_X25519 alias; the NID is the type */
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(NID_X25519, NULL);
+        unsigned char *encoded = NULL;
+
+        if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+            EVP_PKEY_keygen(pctx, &pkey) <= 0) {
+            EVP_PKEY_CTX_free(pctx);
+            return -1;
+        }
+        EVP_PKEY_CTX_free(pctx);
+
+        point_len = EVP_PKEY_get1_tls_encodedpoint(pkey, &encoded);
+        if (point_len != 32) {
+            OPENSSL_free(encoded);
+            EVP_PKEY_free(pkey);
+            return -1;
+        }
+        point = LIBSSH2_ALLOC(session, point_len);
+        if (point)
+            memcpy(point, encoded, point_len);
+        OPENSSL_free(encoded);
+    }
+#endif /* LIBSSH2_CURVE25519 */
+#if LIBSSH2_ECDH
+    if (curve != LIBSSH2_EC_CURVE_25519) {
+        EC_KEY *ec = EC_KEY_new_by_curve_name(_libssh2_curve_nid(curve));
+        const EC_GROUP *group;
+        const EC_POINT *pub;
+
+        if (!ec || !EC_KEY_generate_key(ec)) {
+            EC_KEY_free(ec);
+            return -1;
+        }
+        group = EC_KEY_get0_group(ec);
+        pub = EC_KEY_get0_public_key(ec);
+
+        pkey = EVP_PKEY_new();
+        if (!pkey || !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+            EVP_PKEY_free(pkey);
+            EC_KEY_free(ec);
+            return -1;
+        }
+
+        point_len = EC_POINT_point2oct(group, pub,
+                                       POINT_CONVERSION_UNCOMPRESSED,
+                                       NULL, 0, NULL);
+        point = point_len ? LIBSSH2_ALLOC(session, point_len) : NULL;
+        if (point &&
+            EC_POINT_point2oct(group, pub, POINT_CONVERSION_UNCOMPRESSED,
+                               point, point_len, NULL) != point_len) {
+            LIBSSH2_FREE(session, point);
+            point = NULL;
+        }
+    }
+#endif /* LIBSSH2_ECDH */
+
+    if (!point) {
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+
+    *key = pkey;
+    *public_key = point;
+    *public_key_len = point_len;
+    return 0;
+}
+
+int
+_libssh2_ecdh_gen_k(_libssh2_bn * k,
+                    _libssh2_ecdh_key * key,
+                    const unsigned char *peer_public_key,
+                    size_t peer_public_key_len)
+{
+    /* x-coordinate of a P-521 point at most */
+    unsigned char secret[66];
+    int secret_len = -1;
+
+#if LIBSSH2_CURVE25519
+    if (EVP_PKEY_id(key) == NID_X25519) {
+        EVP_PKEY *peer = EVP_PKEY_new();
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(key, NULL);
+        size_t len = sizeof(secret);
+
+        /* the X25519 derivation refuses an all-zero shared secret */
+        if (peer && pctx && peer_public_key_len == 32 &&
+            EVP_PKEY_set_type(peer, NID_X25519) &&
+            EVP_PKEY_set1_tls_encodedpoint(peer, peer_public_key,
+                                           peer_public_key_len) &&
+            EVP_PKEY_derive_init(pctx) > 0 &&
+            EVP_PKEY_derive_set_peer(pctx, peer) > 0 &&
+            EVP_PKEY_derive(pctx, secret, &len) > 0)
+            secret_len = (int)len;
+
+        EVP_PKEY_CTX_free(pctx);
+        EVP_PKEY_free(peer);
+    }
+#endif /* LIBSSH2_CURVE25519 */
+#if LIBSSH2_ECDH
+    if (EVP_PKEY_id(key) == EVP_PKEY_EC) {
+        EC_KEY *ec = EVP_PKEY_get1_EC_KEY(key);
+        const EC_GROUP *group = ec ? EC_KEY_get0_group(ec) : NULL;
+        EC_POINT *peer = group ? EC_POINT_new(group) : NULL;
+
+        /* EC_POINT_oct2point rejects points that are not on the curve */
+        if (peer &&
+            EC_POINT_oct2point(group, peer, peer_public_key,
+                               peer_public_key_len, NULL) == 1)
+            secret_len = ECDH_compute_key(secret,
+                                          (EC_GROUP_get_degree(group) + 7)
+                                          / 8, peer, ec, NULL);
+
+        EC_POINT_free(peer);
+        EC_KEY_free(ec);
+    }
+#endif /* LIBSSH2_ECDH */
+
+    if (secret_len > 0)
+        BN_bin2bn(secret, secret_len, k);
+    OPENSSL_cleanse(secret, sizeof(secret));
+
+    return (secret_len > 0) ? 0 : -1;
+}
+
+#endif /* LIBSSH2_ECDH || LIBSSH2_CURVE25519 */
+
 #endif /* LIBSSH2_OPENSSL */
@@ -52,12 +52,23 @@
 #include <openssl/bn.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#include <openssl/ecdh.h>
+#endif
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
     !defined(LIBRESSL_VERSION_NUMBER)
 # define HAVE_OPAQUE_STRUCTS 1
 #endif
 
+/* The native multi-block AES-CTR ciphers exist since OpenSSL 1.0.1; don't
+   depend on the configure link probe, which misses them with a static
+   libcrypto, to avoid falling back to the one-block-at-a-time emulation */
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L && !defined(HAVE_EVP_AES_128_CTR)
+# define HAVE_EVP_AES_128_CTR 1
+#endif
+
 #ifdef OPENSSL_NO_RSA
 # define LIBSSH2_RSA 0
 #else
@@ -93,6 +104,61 @@
 # define LIBSSH2_AES 0
 #endif
 
+/* GCM with a fixed/invocation-counter IV (EVP_CTRL_GCM_IV_GEN) */
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L && !defined(OPENSSL_NO_AES)
+# define LIBSSH2_AES_GCM 1
+#else
+# define LIBSSH2_AES_GCM 0
+#endif
+
+/* ChaCha20 for chacha20-poly1305@openssh.com; Poly1305 is done in crypt.c
+   as libcrypto does not export its implementation */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+# define LIBSSH2_CHACHA20_POLY1305 1
+#else
+# define LIBSSH2_CHACHA20_POLY1305 0
+#endif
+
+/* umac-64@openssh.com and umac-128@openssh.com; the UMAC kernels live in
+   mac.c and only need AES-128 in ECB mode from the backend */
+#if OPENSSL_VERSION_NUMBER >= 0x00907000L && !defined(OPENSSL_NO_AES)
+# define LIBSSH2_UMAC 1
+#else
+# define LIBSSH2_UMAC 0
+#endif
+
+/* Elliptic curve Diffie-Hellman over the NIST prime curves (RFC 5656) */
+#ifdef OPENSSL_NO_EC
+# define LIBSSH2_ECDH 0
+#else
+# define LIBSSH2_ECDH 1
+#endif
+
+/* ecdsa-sha2-nistp256/384/521 host and user keys (RFC 5656) */
+#ifdef OPENSSL_NO_EC
+# define LIBSSH2_ECDSA 0
+#else
+# define LIBSSH2_ECDSA 1
+#endif
+
+/* ssh-ed25519 keys (RFC 8709). libcrypto has Ed25519 since 1.1.1; older
+   releases use the portable implementation in ed25519.c */
+#define LIBSSH2_ED25519 1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_NO_EC) && \
+    !defined(LIBRESSL_VERSION_NUMBER)
+# define LIBSSH2_ED25519_EVP 1
+#else
+# define LIBSSH2_ED25519_EVP 0
+#endif
+
+/* X25519 for curve25519-sha256 (RFC 8731) */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_EC) && \
+    !defined(LIBRESSL_VERSION_NUMBER)
+# define LIBSSH2_CURVE25519 1
+#else
+# define LIBSSH2_CURVE25519 0
+#endif
+
 #ifdef OPENSSL_NO_BF
 # define LIBSSH2_BLOWFISH 0
 #else
@@ -167,6 +233,46 @@ int _libssh2_sha256(const unsigned char *message, unsigned long len,
                   unsigned char *out);
 #define libssh2_sha256(x,y,z) _libssh2_sha256(x,y,z)
 
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha384_ctx EVP_MD_CTX *
+#else
+#define libssh2_sha384_ctx EVP_MD_CTX
+#endif
+
+/* returns 0 in case of failure */
+int _libssh2_sha384_init(libssh2_sha384_ctx *ctx);
+#define libssh2_sha384_init(x) _libssh2_sha384_init(x)
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha384_update(ctx, data, len) EVP_DigestUpdate(ctx, data, len)
+#define libssh2_sha384_final(ctx, out) do { \
+                                           EVP_DigestFinal(ctx, out, NULL); \
+                                           EVP_MD_CTX_free(ctx); \
+                                       } while(0)
+#else
+#define libssh2_sha384_update(ctx, data, len) EVP_DigestUpdate(&(ctx), data, len)
+#define libssh2_sha384_final(ctx, out) EVP_DigestFinal(&(ctx), out, NULL)
+#endif
+
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha512_ctx EVP_MD_CTX *
+#else
+#define libssh2_sha512_ctx EVP_MD_CTX
+#endif
+
+/* returns 0 in case of failure */
+int _libssh2_sha512_init(libssh2_sha512_ctx *ctx);
+#define libssh2_sha512_init(x) _libssh2_sha512_init(x)
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha512_update(ctx, data, len) EVP_DigestUpdate(ctx, data, len)
+#define libssh2_sha512_final(ctx, out) do { \
+                                           EVP_DigestFinal(ctx, out, NULL); \
+                                           EVP_MD_CTX_free(ctx); \
+                                       } while(0)
+#else
+#define libssh2_sha512_update(ctx, data, len) EVP_DigestUpdate(&(ctx), data, len)
+#define libssh2_sha512_final(ctx, out) EVP_DigestFinal(&(ctx), out, NULL)
+#endif
+
 #ifdef HAVE_OPAQUE_STRUCTS
 #define libssh2_md5_ctx EVP_MD_CTX *
 #else
@@ -205,6 +311,7 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
   HMAC_Update(ctx, data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(ctx, data, NULL)
 #define libssh2_hmac_cleanup(ctx) HMAC_CTX_free(*(ctx))
+#define libssh2_hmac_reinit(ctx) HMAC_Init_ex(ctx, NULL, 0, NULL, NULL)
 #else
 #define libssh2_hmac_ctx HMAC_CTX
 #define libssh2_hmac_ctx_init(ctx) \
@@ -224,6 +331,8 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
   HMAC_Update(&(ctx), data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(&(ctx), data, NULL)
 #define libssh2_hmac_cleanup(ctx) HMAC_cleanup(ctx)
+#define libssh2_hmac_reinit(ctx) \
+  HMAC_Init_ex(&(ctx), NULL, 0, NULL, NULL)
 #endif
 
 #define libssh2_crypto_init() \
@@ -242,6 +351,23 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 
 #define _libssh2_dsa_free(dsactx) DSA_free(dsactx)
 
+#if LIBSSH2_ECDSA
+#define libssh2_ecdsa_ctx EC_KEY
+
+#define _libssh2_ecdsa_free(ecdsactx) EC_KEY_free(ecdsactx)
+#endif
+
+#if LIBSSH2_ED25519_EVP
+#define libssh2_ed25519_ctx EVP_PKEY
+
+#define _libssh2_ed25519_free(ed25519ctx) EVP_PKEY_free(ed25519ctx)
+#else
+struct _libssh2_ed25519_key;    /* see ed25519.h */
+#define libssh2_ed25519_ctx struct _libssh2_ed25519_key
+
+void _libssh2_ed25519_free(libssh2_ed25519_ctx *ed25519ctx);
+#endif
+
 #define _libssh2_cipher_type(name) const EVP_CIPHER *(*name)(void)
 #ifdef HAVE_OPAQUE_STRUCTS
 #define _libssh2_cipher_ctx EVP_CIPHER_CTX *
@@ -261,13 +387,17 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define _libssh2_cipher_aes192ctr _libssh2_EVP_aes_192_ctr
 #define _libssh2_cipher_aes256ctr _libssh2_EVP_aes_256_ctr
 #endif
+#define _libssh2_cipher_aes128gcm EVP_aes_128_gcm
+#define _libssh2_cipher_aes256gcm EVP_aes_256_gcm
+#define _libssh2_cipher_chacha20 EVP_chacha20
+#define _libssh2_cipher_aes128ecb EVP_aes_128_ecb
 #define _libssh2_cipher_blowfish EVP_bf_cbc
 #define _libssh2_cipher_arcfour EVP_rc4
 #define _libssh2_cipher_cast5 EVP_cast5_cbc
 #define _libssh2_cipher_3des EVP_des_ede3_cbc
 
 #ifdef HAVE_OPAQUE_STRUCTS
-#define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_reset(*(ctx))
+#define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_free(*(ctx))
 #else
 #define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_cleanup(ctx)
 #endif
@@ -287,6 +417,11 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define _libssh2_bn_bits(bn) BN_num_bits(bn)
 #define _libssh2_bn_free(bn) BN_clear_free(bn)
 
+#if LIBSSH2_ECDH || LIBSSH2_CURVE25519
+#define _libssh2_ecdh_key EVP_PKEY
+#define _libssh2_ecdh_key_free(key) EVP_PKEY_free(key)
+#endif
+
 const EVP_CIPHER *_libssh2_EVP_aes_128_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_192_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_256_ctr(void);
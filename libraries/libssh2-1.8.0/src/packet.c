@@ -176,7 +176,13 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                     channel->remote.packet_size =
                         LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
-                    channel->local.id = _libssh2_channel_nextid(session);
+                    if (_libssh2_channel_nextid(session, &channel->local.id)) {
+                        LIBSSH2_FREE(session, channel->channel_type);
+                        LIBSSH2_FREE(session, channel);
+                        failure_code = SSH_OPEN_RESOURCE_SHORTAGE;
+                        listen_state->state = libssh2_NB_state_sent;
+                        break;
+                    }
                     channel->local.window_size_initial =
                         listen_state->initial_window_size;
                     channel->local.window_size =
@@ -219,6 +225,8 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                     if (listen_state->channel) {
                         _libssh2_list_add(&listn->queue,
                                           &listen_state->channel->node);
+                        session->channel_slots[listen_state->channel->local.id]
+                            = listen_state->channel;
                         listn->queue_size++;
                     }
 
@@ -326,7 +334,12 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
             channel->remote.window_size = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
             channel->remote.packet_size = LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
-            channel->local.id = _libssh2_channel_nextid(session);
+            if (_libssh2_channel_nextid(session, &channel->local.id)) {
+                LIBSSH2_FREE(session, channel->channel_type);
+                LIBSSH2_FREE(session, channel);
+                failure_code = SSH_OPEN_RESOURCE_SHORTAGE;
+                goto x11_exit;
+            }
             channel->local.window_size_initial =
                 x11open_state->initial_window_size;
             channel->local.window_size = x11open_state->initial_window_size;
@@ -364,6 +377,7 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
 
             /* Link the channel into the session */
             _libssh2_list_add(&session->channels, &channel->node);
+            session->channel_slots[channel->local.id] = channel;
 
             /*
              * Pass control to the callback, they may turn right around and
@@ -399,6 +413,131 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
     return 0;
 }
 
+/*
+ * The packet pool
+ *
+ * Inbound packets each come with a payload allocation and a LIBSSH2_PACKET
+ * node, and most of them are released again as soon as a channel read has
+ * consumed them. Instead of going back to LIBSSH2_FREE they are kept in
+ * per size class free lists and handed out again, up to
+ * LIBSSH2_PACKET_POOL_MAX bytes per session.
+ *
+ * Everything in the pool comes from LIBSSH2_ALLOC and is given back with
+ * LIBSSH2_FREE, so a pooled buffer may still be passed to LIBSSH2_FREE by
+ * code that doesn't know about the pool; it is then just not reused.
+ */
+static const size_t packet_pool_class[LIBSSH2_PACKET_POOL_CLASSES] = {
+    64, 256, 1024, 4096, 16384, LIBSSH2_PACKET_MAXPAYLOAD
+};
+
+static int
+packet_pool_class_of(size_t size)
+{
+    int i;
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES; i++)
+        if (size <= packet_pool_class[i])
+            return i;
+
+    return -1;
+}
+
+/*
+ * _libssh2_packet_pool_alloc
+ *
+ * Allocate at least *size bytes. *size is updated to the size actually
+ * allocated, which is what has to be passed to _libssh2_packet_pool_free().
+ */
+void *
+_libssh2_packet_pool_alloc(LIBSSH2_SESSION * session, size_t *size)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    int i = packet_pool_class_of(*size);
+    void *ptr;
+
+    pool->allocs++;
+
+    if (i < 0)
+        /* larger than any class, not pooled */
+        return LIBSSH2_ALLOC(session, *size);
+
+    *size = packet_pool_class[i];
+
+    ptr = pool->free[i];
+    if (ptr) {
+        memcpy(&pool->free[i], ptr, sizeof(void *));
+        pool->retained -= *size;
+        pool->reused++;
+        return ptr;
+    }
+
+    return LIBSSH2_ALLOC(session, *size);
+}
+
+/*
+ * _libssh2_packet_pool_free
+ *
+ * Release a buffer from _libssh2_packet_pool_alloc(). 'size' is the size
+ * that function returned, or the size originally asked for.
+ */
+void
+_libssh2_packet_pool_free(LIBSSH2_SESSION * session, void *ptr, size_t size)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    int i = packet_pool_class_of(size);
+
+    if (i < 0) {
+        LIBSSH2_FREE(session, ptr);
+        return;
+    }
+
+    size = packet_pool_class[i];
+    if (pool->retained + size > LIBSSH2_PACKET_POOL_MAX) {
+        pool->dropped++;
+        LIBSSH2_FREE(session, ptr);
+        return;
+    }
+
+    memcpy(ptr, &pool->free[i], sizeof(void *));
+    pool->free[i] = ptr;
+    pool->retained += size;
+    if (pool->retained > pool->peak)
+        pool->peak = pool->retained;
+}
+
+/*
+ * _libssh2_packet_pool_clear
+ *
+ * Free everything the pool holds, when the session is parked or goes away
+ */
+void
+_libssh2_packet_pool_clear(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    void *ptr;
+    int i;
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES; i++) {
+        while ((ptr = pool->free[i])) {
+            memcpy(&pool->free[i], ptr, sizeof(void *));
+            LIBSSH2_FREE(session, ptr);
+        }
+    }
+    pool->retained = 0;
+}
+
+/*
+ * _libssh2_packet_free
+ *
+ * Give a queued packet that is done with, and its payload, back to the pool
+ */
+void
+_libssh2_packet_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet)
+{
+    _libssh2_packet_pool_free(session, packet->data, packet->data_size);
+    _libssh2_packet_pool_free(session, packet, sizeof(LIBSSH2_PACKET));
+}
+
 /*
  * _libssh2_packet_add
  *
@@ -408,12 +547,13 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
  * The input pointer 'data' is pointing to allocated data that this function
  * is asked to deal with so on failure OR success, it must be freed fine.
  * The only exception is when the return code is LIBSSH2_ERROR_EAGAIN.
+ * 'datasize' is its size as allocated from the packet pool.
  *
  * This function will always be called with 'datalen' greater than zero.
  */
 int
 _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                    size_t datalen, int macstate)
+                    size_t datalen, size_t datasize, int macstate)
 {
     int rc = 0;
     char *message=NULL;
@@ -962,20 +1102,34 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
     }
 
     if (session->packAdd_state == libssh2_NB_state_sent) {
+        size_t packet_size = sizeof(LIBSSH2_PACKET);
         LIBSSH2_PACKET *packetp =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+            _libssh2_packet_pool_alloc(session, &packet_size);
         if (!packetp) {
             _libssh2_debug(session, LIBSSH2_ERROR_ALLOC,
                            "memory for packet");
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_pool_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return LIBSSH2_ERROR_ALLOC;
         }
         packetp->data = data;
         packetp->data_len = datalen;
+        packetp->data_size = datasize;
         packetp->data_head = data_head;
-
-        _libssh2_list_add(&session->packets, &packetp->node);
+        packetp->seqno = session->remote.seqno;
+
+        /* Channel data is queued on its channel, so that reading it does
+           not have to step over what other channels have pending; the
+           session queue is left with the control messages */
+        if (msg == SSH_MSG_CHANNEL_DATA ||
+            (msg == SSH_MSG_CHANNEL_EXTENDED_DATA &&
+             channelp->remote.extended_data_ignore_mode ==
+             LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))
+            _libssh2_list_add(&channelp->data_queue, &packetp->node);
+        else if (msg == SSH_MSG_CHANNEL_EXTENDED_DATA)
+            _libssh2_list_add(&channelp->ext_data_queue, &packetp->node);
+        else
+            _libssh2_list_add(&session->packets, &packetp->node);
 
         session->packAdd_state = libssh2_NB_state_sent1;
     }
@@ -1049,7 +1203,8 @@ _libssh2_packet_ask(LIBSSH2_SESSION * session, unsigned char packet_type,
             /* unlink struct from session->packets */
             _libssh2_list_remove(&packet->node);
 
-            LIBSSH2_FREE(session, packet);
+            _libssh2_packet_pool_free(session, packet,
+                                      sizeof(LIBSSH2_PACKET));
 
             return 0;
         }
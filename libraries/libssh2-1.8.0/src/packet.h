@@ -71,6 +71,11 @@ int _libssh2_packet_burn(LIBSSH2_SESSION * session,
 int _libssh2_packet_write(LIBSSH2_SESSION * session, unsigned char *data,
                           unsigned long data_len);
 int _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                        size_t datalen, int macstate);
+                        size_t datalen, size_t datasize, int macstate);
+void *_libssh2_packet_pool_alloc(LIBSSH2_SESSION * session, size_t *size);
+void _libssh2_packet_pool_free(LIBSSH2_SESSION * session, void *ptr,
+                               size_t size);
+void _libssh2_packet_pool_clear(LIBSSH2_SESSION * session);
+void _libssh2_packet_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet);
 
 #endif /* LIBSSH2_PACKET_H */
@@ -262,13 +262,14 @@ shell_quotearg(const char *path, unsigned char *buf,
 }
 
 /*
- * scp_recv
+ * scp_recv_step
  *
  * Open a channel and request a remote file via SCP
  *
  */
 static LIBSSH2_CHANNEL *
-scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
+scp_recv_step(LIBSSH2_SESSION * session, const char *path,
+              libssh2_struct_stat * sb)
 {
     int cmd_len;
     int rc;
@@ -276,35 +277,35 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
     const char *tmp_err_msg;
 
     if (session->scpRecv_state == libssh2_NB_state_idle) {
-        session->scpRecv_mode = 0;
-        session->scpRecv_size = 0;
-        session->scpRecv_mtime = 0;
-        session->scpRecv_atime = 0;
+        session->scpRecv->mode = 0;
+        session->scpRecv->size = 0;
+        session->scpRecv->mtime = 0;
+        session->scpRecv->atime = 0;
 
-        session->scpRecv_command_len =
+        session->scpRecv->command_len =
             _libssh2_shell_quotedsize(path) + sizeof("scp -f ") + (sb?1:0);
 
-        session->scpRecv_command =
-            LIBSSH2_ALLOC(session, session->scpRecv_command_len);
+        session->scpRecv->command =
+            LIBSSH2_ALLOC(session, session->scpRecv->command_len);
 
-        if (!session->scpRecv_command) {
+        if (!session->scpRecv->command) {
             _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                            "Unable to allocate a command buffer for "
                            "SCP session");
             return NULL;
         }
 
-        snprintf((char *)session->scpRecv_command,
-                 session->scpRecv_command_len,
+        snprintf((char *)session->scpRecv->command,
+                 session->scpRecv->command_len,
                  "scp -%sf ", sb?"p":"");
 
-        cmd_len = strlen((char *)session->scpRecv_command);
+        cmd_len = strlen((char *)session->scpRecv->command);
         cmd_len += shell_quotearg(path,
-                                  &session->scpRecv_command[cmd_len],
-                                  session->scpRecv_command_len - cmd_len);
+                                  &session->scpRecv->command[cmd_len],
+                                  session->scpRecv->command_len - cmd_len);
 
-        session->scpRecv_command[cmd_len] = '\0';
-        session->scpRecv_command_len = cmd_len + 1;
+        session->scpRecv->command[cmd_len] = '\0';
+        session->scpRecv->command_len = cmd_len + 1;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                        "Opening channel for SCP receive");
@@ -314,17 +315,17 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
     if (session->scpRecv_state == libssh2_NB_state_created) {
         /* Allocate a channel */
-        session->scpRecv_channel =
+        session->scpRecv->channel =
             _libssh2_channel_open(session, "session",
                                   sizeof("session") - 1,
                                   LIBSSH2_CHANNEL_WINDOW_DEFAULT,
                                   LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL,
                                   0);
-        if (!session->scpRecv_channel) {
+        if (!session->scpRecv->channel) {
             if (libssh2_session_last_errno(session) !=
                 LIBSSH2_ERROR_EAGAIN) {
-                LIBSSH2_FREE(session, session->scpRecv_command);
-                session->scpRecv_command = NULL;
+                LIBSSH2_FREE(session, session->scpRecv->command);
+                session->scpRecv->command = NULL;
                 session->scpRecv_state = libssh2_NB_state_idle;
             }
             else {
@@ -339,32 +340,33 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
     if (session->scpRecv_state == libssh2_NB_state_sent) {
         /* Request SCP for the desired file */
-        rc = _libssh2_channel_process_startup(session->scpRecv_channel, "exec",
-                                              sizeof("exec") - 1,
-                                              (char *) session->scpRecv_command,
-                                              session->scpRecv_command_len);
+        rc = _libssh2_channel_process_startup(session->scpRecv->channel,
+                                              "exec", sizeof("exec") - 1,
+                                              (char *)
+                                              session->scpRecv->command,
+                                              session->scpRecv->command_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block requesting SCP startup");
             return NULL;
         } else if (rc) {
-            LIBSSH2_FREE(session, session->scpRecv_command);
-            session->scpRecv_command = NULL;
+            LIBSSH2_FREE(session, session->scpRecv->command);
+            session->scpRecv->command = NULL;
             goto scp_recv_error;
         }
-        LIBSSH2_FREE(session, session->scpRecv_command);
-        session->scpRecv_command = NULL;
+        LIBSSH2_FREE(session, session->scpRecv->command);
+        session->scpRecv->command = NULL;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sending initial wakeup");
         /* SCP ACK */
-        session->scpRecv_response[0] = '\0';
+        session->scpRecv->response[0] = '\0';
 
         session->scpRecv_state = libssh2_NB_state_sent1;
     }
 
     if (session->scpRecv_state == libssh2_NB_state_sent1) {
-        rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                    session->scpRecv_response, 1);
+        rc = _libssh2_channel_write(session->scpRecv->channel, 0,
+                                    session->scpRecv->response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block sending initial wakeup");
@@ -374,22 +376,22 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
         }
 
         /* Parse SCP response */
-        session->scpRecv_response_len = 0;
+        session->scpRecv->response_len = 0;
 
         session->scpRecv_state = libssh2_NB_state_sent2;
     }
 
     if ((session->scpRecv_state == libssh2_NB_state_sent2)
         || (session->scpRecv_state == libssh2_NB_state_sent3)) {
-        while (sb && (session->scpRecv_response_len <
+        while (sb && (session->scpRecv->response_len <
                       LIBSSH2_SCP_RESPONSE_BUFLEN)) {
             unsigned char *s, *p;
 
             if (session->scpRecv_state == libssh2_NB_state_sent2) {
-                rc = _libssh2_channel_read(session->scpRecv_channel, 0,
-                                           (char *) session->
-                                           scpRecv_response +
-                                           session->scpRecv_response_len, 1);
+                rc = _libssh2_channel_read(session->scpRecv->channel, 0,
+                                           (char *) session->scpRecv->
+                                           response +
+                                           session->scpRecv->response_len, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting for SCP response");
@@ -403,9 +405,9 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 else if(rc == 0)
                     goto scp_recv_empty_channel;
 
-                session->scpRecv_response_len++;
+                session->scpRecv->response_len++;
 
-                if (session->scpRecv_response[0] != 'T') {
+                if (session->scpRecv->response[0] != 'T') {
                     size_t err_len;
                     char *err_msg;
 
@@ -416,8 +418,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                        The following string MUST be newline terminated
                     */
                     err_len =
-                        _libssh2_channel_packet_data_len(session->
-                                                         scpRecv_channel, 0);
+                        _libssh2_channel_packet_data_len(session->scpRecv->
+                                                         channel, 0);
                     err_msg = LIBSSH2_ALLOC(session, err_len + 1);
                     if (!err_msg) {
                         _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -426,7 +428,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     }
 
                     /* Read the remote error message */
-                    (void)_libssh2_channel_read(session->scpRecv_channel, 0,
+                    (void)_libssh2_channel_read(session->scpRecv->channel, 0,
                                                 err_msg, err_len);
                     /* If it failed for any reason, we ignore it anyway. */
 
@@ -434,8 +436,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     err_msg[err_len]=0;
 
                     _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                                   "got %02x %s", session->scpRecv_response[0],
-                                   err_msg);
+                                   "got %02x %s",
+                                   session->scpRecv->response[0], err_msg);
 
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Failed to recv file");
@@ -444,32 +446,32 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len > 1) &&
-                    ((session->
-                      scpRecv_response[session->scpRecv_response_len - 1] <
+                if ((session->scpRecv->response_len > 1) &&
+                    ((session->scpRecv->
+                      response[session->scpRecv->response_len - 1] <
                       '0')
-                     || (session->
-                         scpRecv_response[session->scpRecv_response_len - 1] >
+                     || (session->scpRecv->
+                         response[session->scpRecv->response_len - 1] >
                          '9'))
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                    && (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         ' ')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                    && (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         '\r')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                    && (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         '\n')) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid data in SCP response");
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len < 9)
-                    || (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                if ((session->scpRecv->response_len < 9)
+                    || (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         '\n')) {
-                    if (session->scpRecv_response_len ==
+                    if (session->scpRecv->response_len ==
                         LIBSSH2_SCP_RESPONSE_BUFLEN) {
                         /* You had your chance */
                         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
@@ -483,17 +485,17 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 /* We're guaranteed not to go under response_len == 0 by the
                    logic above */
-                while ((session->
-                        scpRecv_response[session->scpRecv_response_len - 1] ==
+                while ((session->scpRecv->
+                        response[session->scpRecv->response_len - 1] ==
                         '\r')
-                       || (session->
-                           scpRecv_response[session->scpRecv_response_len -
+                       || (session->scpRecv->
+                           response[session->scpRecv->response_len -
                                             1] == '\n'))
-                    session->scpRecv_response_len--;
-                session->scpRecv_response[session->scpRecv_response_len] =
+                    session->scpRecv->response_len--;
+                session->scpRecv->response[session->scpRecv->response_len] =
                     '\0';
 
-                if (session->scpRecv_response_len < 8) {
+                if (session->scpRecv->response_len < 8) {
                     /* EOL came too soon */
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, "
@@ -501,7 +503,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
 
-                s = session->scpRecv_response + 1;
+                s = session->scpRecv->response + 1;
 
                 p = (unsigned char *) strchr((char *) s, ' ');
                 if (!p || ((p - s) <= 0)) {
@@ -514,7 +516,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *(p++) = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_mtime = strtol((char *) s, NULL, 10);
+                session->scpRecv->mtime = strtol((char *) s, NULL, 10);
 
                 s = (unsigned char *) strchr((char *) p, ' ');
                 if (!s || ((s - p) <= 0)) {
@@ -536,17 +538,17 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *p = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_atime = strtol((char *) s, NULL, 10);
+                session->scpRecv->atime = strtol((char *) s, NULL, 10);
 
                 /* SCP ACK */
-                session->scpRecv_response[0] = '\0';
+                session->scpRecv->response[0] = '\0';
 
                 session->scpRecv_state = libssh2_NB_state_sent3;
             }
 
             if (session->scpRecv_state == libssh2_NB_state_sent3) {
-                rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                            session->scpRecv_response, 1);
+                rc = _libssh2_channel_write(session->scpRecv->channel, 0,
+                                            session->scpRecv->response, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting to send SCP ACK");
@@ -557,7 +559,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                                "mtime = %ld, atime = %ld",
-                               session->scpRecv_mtime, session->scpRecv_atime);
+                               session->scpRecv->mtime,
+                               session->scpRecv->atime);
 
                 /* We *should* check that atime.usec is valid, but why let
                    that stop use? */
@@ -569,21 +572,21 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
     }
 
     if (session->scpRecv_state == libssh2_NB_state_sent4) {
-        session->scpRecv_response_len = 0;
+        session->scpRecv->response_len = 0;
 
         session->scpRecv_state = libssh2_NB_state_sent5;
     }
 
     if ((session->scpRecv_state == libssh2_NB_state_sent5)
         || (session->scpRecv_state == libssh2_NB_state_sent6)) {
-        while (session->scpRecv_response_len < LIBSSH2_SCP_RESPONSE_BUFLEN) {
+        while (session->scpRecv->response_len < LIBSSH2_SCP_RESPONSE_BUFLEN) {
             char *s, *p, *e = NULL;
 
             if (session->scpRecv_state == libssh2_NB_state_sent5) {
-                rc = _libssh2_channel_read(session->scpRecv_channel, 0,
-                                           (char *) session->
-                                           scpRecv_response +
-                                           session->scpRecv_response_len, 1);
+                rc = _libssh2_channel_read(session->scpRecv->channel, 0,
+                                           (char *) session->scpRecv->
+                                           response +
+                                           session->scpRecv->response_len, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting for SCP response");
@@ -597,35 +600,35 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 else if(rc == 0)
                     goto scp_recv_empty_channel;
 
-                session->scpRecv_response_len++;
+                session->scpRecv->response_len++;
 
-                if (session->scpRecv_response[0] != 'C') {
+                if (session->scpRecv->response[0] != 'C') {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server");
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len > 1) &&
-                    (session->
-                     scpRecv_response[session->scpRecv_response_len - 1] !=
+                if ((session->scpRecv->response_len > 1) &&
+                    (session->scpRecv->
+                     response[session->scpRecv->response_len - 1] !=
                      '\r')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                    && (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         '\n')
                     &&
-                    (session->
-                     scpRecv_response[session->scpRecv_response_len - 1]
+                    (session->scpRecv->
+                     response[session->scpRecv->response_len - 1]
                      < 32)) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid data in SCP response");
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len < 7)
-                    || (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                if ((session->scpRecv->response_len < 7)
+                    || (session->scpRecv->
+                        response[session->scpRecv->response_len - 1] !=
                         '\n')) {
-                    if (session->scpRecv_response_len ==
+                    if (session->scpRecv->response_len ==
                         LIBSSH2_SCP_RESPONSE_BUFLEN) {
                         /* You had your chance */
                         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
@@ -639,25 +642,25 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 /* We're guaranteed not to go under response_len == 0 by the
                    logic above */
-                while ((session->
-                        scpRecv_response[session->scpRecv_response_len - 1] ==
+                while ((session->scpRecv->
+                        response[session->scpRecv->response_len - 1] ==
                         '\r')
-                       || (session->
-                           scpRecv_response[session->scpRecv_response_len -
+                       || (session->scpRecv->
+                           response[session->scpRecv->response_len -
                                             1] == '\n')) {
-                    session->scpRecv_response_len--;
+                    session->scpRecv->response_len--;
                 }
-                session->scpRecv_response[session->scpRecv_response_len] =
+                session->scpRecv->response[session->scpRecv->response_len] =
                     '\0';
 
-                if (session->scpRecv_response_len < 6) {
+                if (session->scpRecv->response_len < 6) {
                     /* EOL came too soon */
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, too short");
                     goto scp_recv_error;
                 }
 
-                s = (char *) session->scpRecv_response + 1;
+                s = (char *) session->scpRecv->response + 1;
 
                 p = strchr(s, ' ');
                 if (!p || ((p - s) <= 0)) {
@@ -670,7 +673,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 *(p++) = '\0';
                 /* Make sure we don't get fooled by leftover values */
 
-                session->scpRecv_mode = strtol(s, &e, 8);
+                session->scpRecv->mode = strtol(s, &e, 8);
                 if (e && *e) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, invalid mode");
@@ -687,7 +690,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *s = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_size = scpsize_strtol(p, &e, 10);
+                session->scpRecv->size = scpsize_strtol(p, &e, 10);
                 if (e && *e) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, invalid size");
@@ -695,14 +698,14 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 }
 
                 /* SCP ACK */
-                session->scpRecv_response[0] = '\0';
+                session->scpRecv->response[0] = '\0';
 
                 session->scpRecv_state = libssh2_NB_state_sent6;
             }
 
             if (session->scpRecv_state == libssh2_NB_state_sent6) {
-                rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                            session->scpRecv_response, 1);
+                rc = _libssh2_channel_write(session->scpRecv->channel, 0,
+                                            session->scpRecv->response, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block sending SCP ACK");
@@ -711,8 +714,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                               "mode = 0%lo size = %ld", session->scpRecv_mode,
-                               session->scpRecv_size);
+                               "mode = 0%lo size = %ld",
+                               session->scpRecv->mode, session->scpRecv->size);
 
                 /* We *should* check that basename is valid, but why let that
                    stop us? */
@@ -726,36 +729,69 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
     if (sb) {
         memset(sb, 0, sizeof(libssh2_struct_stat));
 
-        sb->st_mtime = session->scpRecv_mtime;
-        sb->st_atime = session->scpRecv_atime;
-        sb->st_size = session->scpRecv_size;
-        sb->st_mode = (unsigned short)session->scpRecv_mode;
+        sb->st_mtime = session->scpRecv->mtime;
+        sb->st_atime = session->scpRecv->atime;
+        sb->st_size = session->scpRecv->size;
+        sb->st_mode = (unsigned short)session->scpRecv->mode;
     }
 
     session->scpRecv_state = libssh2_NB_state_idle;
-    return session->scpRecv_channel;
+    return session->scpRecv->channel;
 
   scp_recv_empty_channel:
     /* the code only jumps here as a result of a zero read from channel_read()
        so we check EOF status to avoid getting stuck in a loop */
-    if(libssh2_channel_eof(session->scpRecv_channel))
+    if(libssh2_channel_eof(session->scpRecv->channel))
         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                        "Unexpected channel close");
     else
-        return session->scpRecv_channel;
+        return session->scpRecv->channel;
     /* fall-through */
   scp_recv_error:
     tmp_err_code = session->err_code;
     tmp_err_msg = session->err_msg;
-    while (libssh2_channel_free(session->scpRecv_channel) ==
+    while (libssh2_channel_free(session->scpRecv->channel) ==
            LIBSSH2_ERROR_EAGAIN);
     session->err_code = tmp_err_code;
     session->err_msg = tmp_err_msg;
-    session->scpRecv_channel = NULL;
+    session->scpRecv->channel = NULL;
     session->scpRecv_state = libssh2_NB_state_idle;
     return NULL;
 }
 
+/*
+ * scp_recv
+ *
+ * Run scp_recv_step() with its state allocated for as long as the transfer
+ * is being set up, so that idle sessions don't carry it around
+ */
+static LIBSSH2_CHANNEL *
+scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
+{
+    LIBSSH2_CHANNEL *channel;
+
+    if (!session->scpRecv) {
+        session->scpRecv = LIBSSH2_CALLOC(session,
+                                          sizeof(struct scp_recv_data));
+        if (!session->scpRecv) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate SCP receive state");
+            return NULL;
+        }
+    }
+
+    channel = scp_recv_step(session, path, sb);
+
+    if (session->scpRecv_state == libssh2_NB_state_idle) {
+        if (session->scpRecv->command)
+            LIBSSH2_FREE(session, session->scpRecv->command);
+        LIBSSH2_FREE(session, session->scpRecv);
+        session->scpRecv = NULL;
+    }
+
+    return channel;
+}
+
 /*
  * libssh2_scp_recv
  *
@@ -807,14 +843,14 @@ libssh2_scp_recv2(LIBSSH2_SESSION *session, const char *path, libssh2_struct_sta
 }
 
 /*
- * scp_send()
+ * scp_send_step()
  *
  * Send a file using SCP
  *
  */
 static LIBSSH2_CHANNEL *
-scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
-         libssh2_int64_t size, time_t mtime, time_t atime)
+scp_send_step(LIBSSH2_SESSION * session, const char *path, int mode,
+              libssh2_int64_t size, time_t mtime, time_t atime)
 {
     int cmd_len;
     int rc;
@@ -822,31 +858,31 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
     const char *tmp_err_msg;
 
     if (session->scpSend_state == libssh2_NB_state_idle) {
-        session->scpSend_command_len =
+        session->scpSend->command_len =
             _libssh2_shell_quotedsize(path) + sizeof("scp -t ") +
             ((mtime || atime)?1:0);
 
-        session->scpSend_command =
-            LIBSSH2_ALLOC(session, session->scpSend_command_len);
+        session->scpSend->command =
+            LIBSSH2_ALLOC(session, session->scpSend->command_len);
 
-        if (!session->scpSend_command) {
+        if (!session->scpSend->command) {
             _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                            "Unable to allocate a command buffer for "
                            "SCP session");
             return NULL;
         }
 
-        snprintf((char *)session->scpSend_command,
-                 session->scpSend_command_len,
+        snprintf((char *)session->scpSend->command,
+                 session->scpSend->command_len,
                  "scp -%st ", (mtime || atime)?"p":"");
 
-        cmd_len = strlen((char *)session->scpSend_command);
+        cmd_len = strlen((char *)session->scpSend->command);
         cmd_len += shell_quotearg(path,
-                                  &session->scpSend_command[cmd_len],
-                                  session->scpSend_command_len - cmd_len);
+                                  &session->scpSend->command[cmd_len],
+                                  session->scpSend->command_len - cmd_len);
 
-        session->scpSend_command[cmd_len] = '\0';
-        session->scpSend_command_len = cmd_len + 1;
+        session->scpSend->command[cmd_len] = '\0';
+        session->scpSend->command_len = cmd_len + 1;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                        "Opening channel for SCP send");
@@ -856,16 +892,16 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
     }
 
     if (session->scpSend_state == libssh2_NB_state_created) {
-        session->scpSend_channel =
+        session->scpSend->channel =
             _libssh2_channel_open(session, "session", sizeof("session") - 1,
                                   LIBSSH2_CHANNEL_WINDOW_DEFAULT,
                                   LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0);
-        if (!session->scpSend_channel) {
+        if (!session->scpSend->channel) {
             if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
                 /* previous call set libssh2_session_last_error(), pass it
                    through */
-                LIBSSH2_FREE(session, session->scpSend_command);
-                session->scpSend_command = NULL;
+                LIBSSH2_FREE(session, session->scpSend->command);
+                session->scpSend->command = NULL;
                 session->scpSend_state = libssh2_NB_state_idle;
             }
             else {
@@ -880,10 +916,11 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
 
     if (session->scpSend_state == libssh2_NB_state_sent) {
         /* Request SCP for the desired file */
-        rc = _libssh2_channel_process_startup(session->scpSend_channel, "exec",
-                                              sizeof("exec") - 1,
-                                              (char *) session->scpSend_command,
-                                              session->scpSend_command_len);
+        rc = _libssh2_channel_process_startup(session->scpSend->channel,
+                                              "exec", sizeof("exec") - 1,
+                                              (char *)
+                                              session->scpSend->command,
+                                              session->scpSend->command_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block requesting SCP startup");
@@ -892,22 +929,22 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if (rc) {
             /* previous call set libssh2_session_last_error(), pass it
                through */
-            LIBSSH2_FREE(session, session->scpSend_command);
-            session->scpSend_command = NULL;
+            LIBSSH2_FREE(session, session->scpSend->command);
+            session->scpSend->command = NULL;
             _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                            "Unknown error while getting error string");
             goto scp_send_error;
         }
-        LIBSSH2_FREE(session, session->scpSend_command);
-        session->scpSend_command = NULL;
+        LIBSSH2_FREE(session, session->scpSend->command);
+        session->scpSend->command = NULL;
 
         session->scpSend_state = libssh2_NB_state_sent1;
     }
 
     if (session->scpSend_state == libssh2_NB_state_sent1) {
         /* Wait for ACK */
-        rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                   (char *) session->scpSend_response, 1);
+        rc = _libssh2_channel_read(session->scpSend->channel, 0,
+                                   (char *) session->scpSend->response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block waiting for response from remote");
@@ -920,19 +957,19 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if(!rc)
             /* remain in the same state */
             goto scp_send_empty_channel;
-        else if (session->scpSend_response[0] != 0) {
+        else if (session->scpSend->response[0] != 0) {
             _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                            "Invalid ACK response from remote");
             goto scp_send_error;
         }
         if (mtime || atime) {
             /* Send mtime and atime to be used for file */
-            session->scpSend_response_len =
-                snprintf((char *) session->scpSend_response,
+            session->scpSend->response_len =
+                snprintf((char *) session->scpSend->response,
                          LIBSSH2_SCP_RESPONSE_BUFLEN, "T%ld 0 %ld 0\n",
                          (long)mtime, (long)atime);
             _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sent %s",
-                           session->scpSend_response);
+                           session->scpSend->response);
         }
 
         session->scpSend_state = libssh2_NB_state_sent2;
@@ -941,14 +978,14 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
     /* Send mtime and atime to be used for file */
     if (mtime || atime) {
         if (session->scpSend_state == libssh2_NB_state_sent2) {
-            rc = _libssh2_channel_write(session->scpSend_channel, 0,
-                                        session->scpSend_response,
-                                        session->scpSend_response_len);
+            rc = _libssh2_channel_write(session->scpSend->channel, 0,
+                                        session->scpSend->response,
+                                        session->scpSend->response_len);
             if (rc == LIBSSH2_ERROR_EAGAIN) {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                "Would block sending time data for SCP file");
                 return NULL;
-            } else if (rc != (int)session->scpSend_response_len) {
+            } else if (rc != (int)session->scpSend->response_len) {
                 _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                "Unable to send time data for SCP file");
                 goto scp_send_error;
@@ -959,8 +996,8 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
 
         if (session->scpSend_state == libssh2_NB_state_sent3) {
             /* Wait for ACK */
-            rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                       (char *) session->scpSend_response, 1);
+            rc = _libssh2_channel_read(session->scpSend->channel, 0,
+                                       (char *) session->scpSend->response, 1);
             if (rc == LIBSSH2_ERROR_EAGAIN) {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                "Would block waiting for response");
@@ -973,7 +1010,7 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
             else if(!rc)
                 /* remain in the same state */
                 goto scp_send_empty_channel;
-            else if (session->scpSend_response[0] != 0) {
+            else if (session->scpSend->response[0] != 0) {
                 _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                "Invalid SCP ACK response");
                 goto scp_send_error;
@@ -995,26 +1032,26 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else
             base = path;
 
-        session->scpSend_response_len =
-            snprintf((char *) session->scpSend_response,
+        session->scpSend->response_len =
+            snprintf((char *) session->scpSend->response,
                      LIBSSH2_SCP_RESPONSE_BUFLEN, "C0%o %"
                      LIBSSH2_INT64_T_FORMAT " %s\n", mode,
                      size, base);
         _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sent %s",
-                       session->scpSend_response);
+                       session->scpSend->response);
 
         session->scpSend_state = libssh2_NB_state_sent5;
     }
 
     if (session->scpSend_state == libssh2_NB_state_sent5) {
-        rc = _libssh2_channel_write(session->scpSend_channel, 0,
-                                    session->scpSend_response,
-                                    session->scpSend_response_len);
+        rc = _libssh2_channel_write(session->scpSend->channel, 0,
+                                    session->scpSend->response,
+                                    session->scpSend->response_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block send core file data for SCP file");
             return NULL;
-        } else if (rc != (int)session->scpSend_response_len) {
+        } else if (rc != (int)session->scpSend->response_len) {
             _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                            "Unable to send core file data for SCP file");
             goto scp_send_error;
@@ -1025,8 +1062,8 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
 
     if (session->scpSend_state == libssh2_NB_state_sent6) {
         /* Wait for ACK */
-        rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                   (char *) session->scpSend_response, 1);
+        rc = _libssh2_channel_read(session->scpSend->channel, 0,
+                                   (char *) session->scpSend->response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block waiting for response");
@@ -1040,12 +1077,12 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if (rc == 0)
             goto scp_send_empty_channel;
 
-        else if (session->scpSend_response[0] != 0) {
+        else if (session->scpSend->response[0] != 0) {
             size_t err_len;
             char *err_msg;
 
             err_len =
-                _libssh2_channel_packet_data_len(session->scpSend_channel, 0);
+                _libssh2_channel_packet_data_len(session->scpSend->channel, 0);
             err_msg = LIBSSH2_ALLOC(session, err_len + 1);
             if (!err_msg) {
                 _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -1054,12 +1091,12 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
             }
 
             /* Read the remote error message */
-            rc = _libssh2_channel_read(session->scpSend_channel, 0,
+            rc = _libssh2_channel_read(session->scpSend->channel, 0,
                                        err_msg, err_len);
             if (rc > 0) {
                 err_msg[err_len]=0;
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                               "got %02x %s", session->scpSend_response[0],
+                               "got %02x %s", session->scpSend->response[0],
                                err_msg);
             }
             LIBSSH2_FREE(session, err_msg);
@@ -1070,30 +1107,64 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
     }
 
     session->scpSend_state = libssh2_NB_state_idle;
-    return session->scpSend_channel;
+    return session->scpSend->channel;
 
   scp_send_empty_channel:
     /* the code only jumps here as a result of a zero read from channel_read()
        so we check EOF status to avoid getting stuck in a loop */
-    if(libssh2_channel_eof(session->scpSend_channel)) {
+    if(libssh2_channel_eof(session->scpSend->channel)) {
         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                        "Unexpected channel close");
     }
     else
-        return session->scpSend_channel;
+        return session->scpSend->channel;
     /* fall-through */
   scp_send_error:
     tmp_err_code = session->err_code;
     tmp_err_msg = session->err_msg;
-    while (libssh2_channel_free(session->scpSend_channel) ==
+    while (libssh2_channel_free(session->scpSend->channel) ==
            LIBSSH2_ERROR_EAGAIN);
     session->err_code = tmp_err_code;
     session->err_msg = tmp_err_msg;
-    session->scpSend_channel = NULL;
+    session->scpSend->channel = NULL;
     session->scpSend_state = libssh2_NB_state_idle;
     return NULL;
 }
 
+/*
+ * scp_send()
+ *
+ * Run scp_send_step() with its state allocated for as long as the transfer
+ * is being set up
+ */
+static LIBSSH2_CHANNEL *
+scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
+         libssh2_int64_t size, time_t mtime, time_t atime)
+{
+    LIBSSH2_CHANNEL *channel;
+
+    if (!session->scpSend) {
+        session->scpSend = LIBSSH2_CALLOC(session,
+                                          sizeof(struct scp_send_data));
+        if (!session->scpSend) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate SCP send state");
+            return NULL;
+        }
+    }
+
+    channel = scp_send_step(session, path, mode, size, mtime, atime);
+
+    if (session->scpSend_state == libssh2_NB_state_idle) {
+        if (session->scpSend->command)
+            LIBSSH2_FREE(session, session->scpSend->command);
+        LIBSSH2_FREE(session, session->scpSend);
+        session->scpSend = NULL;
+    }
+
+    return channel;
+}
+
 /*
  * libssh2_scp_send_ex
  *
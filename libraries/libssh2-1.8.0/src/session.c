@@ -55,6 +55,7 @@
 #include "transport.h"
 #include "session.h"
 #include "channel.h"
+#include "packet.h"
 #include "mac.h"
 #include "misc.h"
 
@@ -1018,11 +1019,17 @@ session_free(LIBSSH2_SESSION *session)
     if (session->pkeyInit_data) {
         LIBSSH2_FREE(session, session->pkeyInit_data);
     }
-    if (session->scpRecv_command) {
-        LIBSSH2_FREE(session, session->scpRecv_command);
+    if (session->scpRecv) {
+        if (session->scpRecv->command) {
+            LIBSSH2_FREE(session, session->scpRecv->command);
+        }
+        LIBSSH2_FREE(session, session->scpRecv);
     }
-    if (session->scpSend_command) {
-        LIBSSH2_FREE(session, session->scpSend_command);
+    if (session->scpSend) {
+        if (session->scpSend->command) {
+            LIBSSH2_FREE(session, session->scpSend->command);
+        }
+        LIBSSH2_FREE(session, session->scpSend);
     }
     if (session->sftpInit_sftp) {
         LIBSSH2_FREE(session, session->sftpInit_sftp);
@@ -1030,7 +1037,14 @@ session_free(LIBSSH2_SESSION *session)
 
     /* Free payload buffer */
     if (session->packet.total_num) {
-        LIBSSH2_FREE(session, session->packet.payload);
+        _libssh2_packet_pool_free(session, session->packet.payload,
+                                  session->packet.payload_size);
+    }
+    if (session->packet.buf) {
+        LIBSSH2_FREE(session, session->packet.buf);
+    }
+    if (session->packet.outbuf) {
+        LIBSSH2_FREE(session, session->packet.outbuf);
     }
 
     /* Cleanup all remaining packets */
@@ -1048,6 +1062,14 @@ session_free(LIBSSH2_SESSION *session)
     _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
          "Extra packets left %d", packets_left);
 
+    _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
+                   "Packet pool: %lu allocations, %lu reused, %lu dropped, "
+                   "%lu bytes retained at most",
+                   session->packet_pool.allocs, session->packet_pool.reused,
+                   session->packet_pool.dropped,
+                   (unsigned long) session->packet_pool.peak);
+    _libssh2_packet_pool_clear(session);
+
     if(session->socket_prev_blockstate) {
         /* if the socket was previously blocking, put it back so */
         rc = session_nonblock(session->socket_fd, 0);
@@ -1061,6 +1083,13 @@ session_free(LIBSSH2_SESSION *session)
         LIBSSH2_FREE(session, session->server_hostkey);
     }
 
+    if (session->channel_slots) {
+        LIBSSH2_FREE(session, session->channel_slots);
+    }
+    if (session->channel_free_ids) {
+        LIBSSH2_FREE(session, session->channel_free_ids);
+    }
+
     /* error string */
     if (session->err_msg && ((session->err_flags & LIBSSH2_ERR_FLAG_DUP) != 0)) {
         LIBSSH2_FREE(session, (char *)session->err_msg);
@@ -1403,29 +1432,25 @@ libssh2_session_get_timeout(LIBSSH2_SESSION * session)
 LIBSSH2_API int
 libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
-    LIBSSH2_SESSION *session;
     LIBSSH2_PACKET *packet;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while (packet) {
-        if ( channel->local.id == _libssh2_ntohu32(packet->data + 1)) {
-            if ( extended == 1 &&
-                 (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA
-                  || packet->data[0] == SSH_MSG_CHANNEL_DATA )) {
-                return 1;
-            } else if ( extended == 0 &&
-                        packet->data[0] == SSH_MSG_CHANNEL_DATA) {
+    if (extended == 1) {
+        /* data of any type */
+        if (_libssh2_list_first(&channel->data_queue) ||
+            _libssh2_list_first(&channel->ext_data_queue))
+            return 1;
+    } else if (extended == 0) {
+        /* standard data only; merged extended data is queued with it */
+        for(packet = _libssh2_list_first(&channel->data_queue); packet;
+            packet = _libssh2_list_next(&packet->node)) {
+            if (packet->data[0] == SSH_MSG_CHANNEL_DATA)
                 return 1;
-            }
-            /* else - no data of any type is ready to be read */
         }
-        packet = _libssh2_list_next(&packet->node);
     }
+    /* else - no data of any type is ready to be read */
 
     return 0;
 }
@@ -1792,3 +1817,33 @@ libssh2_session_banner_get(LIBSSH2_SESSION *session)
 
     return (const char *) session->remote.banner;
 }
+
+/* libssh2_session_packet_pool_stats
+ * Report how the packet buffer pool has done; any pointer may be NULL
+ */
+LIBSSH2_API void
+libssh2_session_packet_pool_stats(LIBSSH2_SESSION *session,
+                                  unsigned long *allocs,
+                                  unsigned long *reused,
+                                  unsigned long *dropped,
+                                  size_t *peak)
+{
+    if (allocs)
+        *allocs = session->packet_pool.allocs;
+    if (reused)
+        *reused = session->packet_pool.reused;
+    if (dropped)
+        *dropped = session->packet_pool.dropped;
+    if (peak)
+        *peak = session->packet_pool.peak;
+}
+
+/* libssh2_session_packet_pool_clear
+ * Free the buffers the packet pool keeps for reuse, for sessions about to
+ * sit idle
+ */
+LIBSSH2_API void
+libssh2_session_packet_pool_clear(LIBSSH2_SESSION *session)
+{
+    _libssh2_packet_pool_clear(session);
+}
@@ -49,6 +49,7 @@
 #include <assert.h>
 
 #include "transport.h"
+#include "packet.h"
 #include "mac.h"
 
 #define MAX_BLOCKSIZE 32    /* MUST fit biggest crypto block size we use/get */
@@ -122,38 +123,26 @@ debugdump(LIBSSH2_SESSION * session,
 #endif
 
 
-/* decrypt() decrypts 'len' bytes from 'source' to 'dest'.
+/* decrypt() decrypts 'len' bytes at 'buf' in place.
  *
  * returns 0 on success and negative on failure
  */
 
 static int
-decrypt(LIBSSH2_SESSION * session, unsigned char *source,
-        unsigned char *dest, int len)
+decrypt(LIBSSH2_SESSION * session, unsigned char *buf, size_t len)
 {
-    struct transportpacket *p = &session->packet;
-    int blocksize = session->remote.crypt->blocksize;
-
     /* if we get called with a len that isn't an even number of blocksizes
        we risk losing those extra bytes */
-    assert((len % blocksize) == 0);
+    assert((len % session->remote.crypt->blocksize) == 0);
 
-    while (len >= blocksize) {
-        if (session->remote.crypt->crypt(session, source, blocksize,
-                                         &session->remote.crypt_abstract)) {
-            LIBSSH2_FREE(session, p->payload);
-            return LIBSSH2_ERROR_DECRYPT;
-        }
+    if (!len)
+        return LIBSSH2_ERROR_NONE;
 
-        /* if the crypt() function would write to a given address it
-           wouldn't have to memcpy() and we could avoid this memcpy()
-           too */
-        memcpy(dest, source, blocksize);
+    /* the whole span in one go, letting the backend pipeline the blocks */
+    if (session->remote.crypt->crypt(session, buf, len,
+                                     &session->remote.crypt_abstract))
+        return LIBSSH2_ERROR_DECRYPT;
 
-        len -= blocksize;       /* less bytes left */
-        dest += blocksize;      /* advance write pointer */
-        source += blocksize;    /* advance read pointer */
-    }
     return LIBSSH2_ERROR_NONE;         /* all is fine */
 }
 
@@ -173,7 +162,70 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
         session->fullpacket_macstate = LIBSSH2_MAC_CONFIRMED;
         session->fullpacket_payload_len = p->packet_length - 1;
 
-        if (encrypted) {
+        if (encrypted && ((session->remote.crypt->flags &
+                           LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC) ||
+                          session->remote.mac->etm)) {
+            /* The payload buffer holds the packet as received, from the
+               packet_length field to the tag or MAC. */
+            if (session->remote.mac->etm) {
+                /* Encrypt-then-MAC: the MAC covers the packet as it came
+                   in, so a forged or corrupted one is turned down before
+                   any of it gets decrypted */
+                if (session->remote.mac->hash(session, macbuf,
+                                              session->remote.seqno,
+                                              p->payload,
+                                              4 + p->packet_length,
+                                              NULL, 0,
+                                              &session->remote.mac_abstract)
+                    || memcmp(macbuf, p->payload + 4 + p->packet_length,
+                              session->remote.mac->mac_len)) {
+                    if (!session->macerror) {
+                        _libssh2_packet_pool_free(session, p->payload,
+                                                  p->payload_size);
+                        return LIBSSH2_ERROR_INVALID_MAC;
+                    }
+                    /* the callback gets to judge the decrypted packet */
+                    session->fullpacket_macstate = LIBSSH2_MAC_INVALID;
+                }
+            }
+
+            /* Decrypt the body in one go, AEAD ciphers authenticating it
+               as well; a bad tag is fatal as nothing in the packet, not
+               even the padding length, can be trusted. */
+            rc = session->remote.crypt->crypt(session, p->payload + 4,
+                                              p->packet_length,
+                                              &session->remote.crypt_abstract);
+            if (rc) {
+                _libssh2_packet_pool_free(session, p->payload,
+                                          p->payload_size);
+                return LIBSSH2_ERROR_DECRYPT;
+            }
+
+            p->padding_length = p->payload[4];
+            if ((uint32_t) p->padding_length + 2 > p->packet_length) {
+                _libssh2_packet_pool_free(session, p->payload,
+                                          p->payload_size);
+                return LIBSSH2_ERROR_DECRYPT;
+            }
+
+            /* drop the length fields so that the payload starts at the
+               message type, as it does for the other ciphers */
+            memmove(p->payload, p->payload + 5,
+                    session->fullpacket_payload_len);
+        }
+        else if (encrypted) {
+            /* The first block was decrypted as it came in, to learn the
+               packet length. The rest up to the MAC is decrypted in place
+               now, in a single call. */
+            size_t done = session->remote.crypt->blocksize - 5;
+
+            rc = decrypt(session, p->payload + done,
+                         session->fullpacket_payload_len - done);
+            if (rc) {
+                _libssh2_packet_pool_free(session, p->payload,
+                                          p->payload_size);
+                return rc;
+            }
 
             /* Calculate MAC hash */
             session->remote.mac->hash(session, macbuf,  /* store hash here */
@@ -215,17 +267,20 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 
             unsigned char *data;
             size_t data_len;
+            size_t data_size;
             rc = session->remote.comp->decomp(session,
-                                              &data, &data_len,
+                                              &data, &data_len, &data_size,
                                               LIBSSH2_PACKET_MAXDECOMP,
                                               p->payload,
                                               session->fullpacket_payload_len,
                                               &session->remote.comp_abstract);
-            LIBSSH2_FREE(session, p->payload);
+            _libssh2_packet_pool_free(session, p->payload,
+                                      p->payload_size);
             if(rc)
                 return rc;
 
             p->payload = data;
+            p->payload_size = data_size;
             session->fullpacket_payload_len = data_len;
         }
 
@@ -240,6 +295,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     if (session->fullpacket_state == libssh2_NB_state_created) {
         rc = _libssh2_packet_add(session, p->payload,
                                  session->fullpacket_payload_len,
+                                 p->payload_size,
                                  session->fullpacket_macstate);
         if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
@@ -256,31 +312,23 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 
 
 /*
- * _libssh2_transport_read
+ * transport_read
  *
- * Collect a packet into the input queue.
- *
- * Returns packet type added to input queue (0 if nothing added), or a
- * negative error number.
- */
-
-/*
  * This function reads the binary stream as specified in chapter 6 of RFC4253
  * "The Secure Shell (SSH) Transport Layer Protocol"
- *
- * DOES NOT call _libssh2_error() for ANY error case.
  */
-int _libssh2_transport_read(LIBSSH2_SESSION * session)
+static int transport_read(LIBSSH2_SESSION * session)
 {
     int rc;
     struct transportpacket *p = &session->packet;
     int remainbuf;
     int remainpack;
     int numbytes;
-    int numdecrypt;
     unsigned char block[MAX_BLOCKSIZE];
     int blocksize;
     int encrypted = 1;
+    int etm = 0;
+    int header;
     size_t total_num;
 
     /* default clear the bit */
@@ -329,14 +377,21 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
         if (session->state & LIBSSH2_STATE_NEWKEYS) {
             blocksize = session->remote.crypt->blocksize;
+            /* AEAD ciphers and -etm MACs authenticate the packet as it is
+               received: it is collected whole and fullpacket() decrypts it
+               only once it has been verified */
+            etm = ((session->remote.crypt->flags &
+                    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC) ||
+                   session->remote.mac->etm) ? 1 : 0;
         } else {
             encrypted = 0;      /* not encrypted */
+            etm = 0;
             blocksize = 5;      /* not strictly true, but we can use 5 here to
                                    make the checks below work fine still */
         }
 
         /* read/use a whole big chunk into a temporary area stored in
-           the LIBSSH2_SESSION struct. We will decrypt data from that
+           the LIBSSH2_SESSION struct. Packet data is copied from that
            buffer into the packet buffer so this temp one doesn't have
            to be able to keep a whole SSH packet, just be large enough
            so that we can read big chunks from the network layer. */
@@ -348,10 +403,24 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
         /* if remainbuf turns negative we have a bad internal error */
         assert(remainbuf >= 0);
 
-        if (remainbuf < blocksize) {
+        if (!p->total_num && (remainbuf < blocksize)) {
             /* If we have less than a blocksize left, it is too
                little data to deal with, read more */
             ssize_t nread;
+            /* Read a big chunk that may hold several small packets. While
+               large ones arrive only the next packet's first block is
+               read though: the rest of it is better received straight
+               into its payload. */
+            int readlen = p->large ? blocksize - remainbuf :
+                PACKETBUFSIZE - remainbuf;
+
+            if (!p->buf) {
+                size_t bufsize = PACKETBUFSIZE;
+
+                p->buf = _libssh2_packet_pool_alloc(session, &bufsize);
+                if (!p->buf)
+                    return LIBSSH2_ERROR_ALLOC;
+            }
 
             /* move any remainder to the start of the buffer so
                that we can do a full refill */
@@ -364,10 +433,9 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 p->readidx = p->writeidx = 0;
             }
 
-            /* now read a big chunk from the network into the temp buffer */
+            /* now read from the network into the temp buffer */
             nread =
-                LIBSSH2_RECV(session, &p->buf[remainbuf],
-                              PACKETBUFSIZE - remainbuf,
+                LIBSSH2_RECV(session, &p->buf[remainbuf], readlen,
                               LIBSSH2_SOCKET_RECV_FLAGS(session));
             if (nread <= 0) {
                 /* check if this is due to EAGAIN and return the special
@@ -379,12 +447,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                                "Error recving %d bytes (got %d)",
-                               PACKETBUFSIZE - remainbuf, -nread);
+                               readlen, -nread);
                 return LIBSSH2_ERROR_SOCKET_RECV;
             }
             _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                            "Recved %d/%d bytes to %p+%d", nread,
-                           PACKETBUFSIZE - remainbuf, p->buf, remainbuf);
+                           readlen, p->buf, remainbuf);
 
             debugdump(session, "libssh2_transport_read() raw",
                       &p->buf[remainbuf], nread);
@@ -413,19 +481,21 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 return LIBSSH2_ERROR_EAGAIN;
             }
 
-            if (encrypted) {
-                rc = decrypt(session, &p->buf[p->readidx], block, blocksize);
+            memcpy(block, &p->buf[p->readidx], blocksize);
+            if (encrypted && !etm) {
+                /* only the first block is decrypted here, the rest of
+                   the packet follows in fullpacket() */
+                rc = decrypt(session, block, blocksize);
                 if (rc != LIBSSH2_ERROR_NONE) {
                     return rc;
                 }
                 /* save the first 5 bytes of the decrypted package, to be
                    used in the hash calculation later down. */
-                memcpy(p->init, &p->buf[p->readidx], 5);
-            } else {
-                /* the data is plain, just copy it verbatim to
-                   the working block buffer */
-                memcpy(block, &p->buf[p->readidx], blocksize);
+                memcpy(p->init, block, 5);
             }
+            /* else only the packet_length field is looked at for now, the
+               rest is decrypted in fullpacket() once the tag or MAC is here
+               too; plain data is used verbatim */
 
             /* advance the read pointer */
             p->readidx += blocksize;
@@ -433,17 +503,44 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             /* we now have the initial blocksize bytes decrypted,
              * and we can extract packet and padding length from it
              */
-            p->packet_length = _libssh2_ntohu32(block);
+            if (etm && session->remote.crypt->get_len) {
+                if (session->remote.crypt->get_len(session,
+                                                   &p->packet_length, block,
+                                                   &session->remote.
+                                                   crypt_abstract))
+                    return LIBSSH2_ERROR_DECRYPT;
+            }
+            else
+                p->packet_length = _libssh2_ntohu32(block);
             if (p->packet_length < 1)
                 return LIBSSH2_ERROR_DECRYPT;
 
             p->padding_length = block[4];
 
-            /* total_num is the number of bytes following the initial
-               (5 bytes) packet length and padding length fields */
-            total_num =
-                p->packet_length - 1 +
-                (encrypted ? session->remote.mac->mac_len : 0);
+            if (etm) {
+                /* the encrypted part must be whole blocks */
+                if (p->packet_length % blocksize)
+                    return LIBSSH2_ERROR_DECRYPT;
+
+                /* keep the whole block as it came in, the tag or MAC covers
+                   the packet_length field too */
+                header = 0;
+                total_num = 4 + p->packet_length +
+                    session->remote.mac->mac_len;
+            }
+            else {
+                /* the whole packet must be whole blocks */
+                if (encrypted && ((p->packet_length + 4) % blocksize))
+                    return LIBSSH2_ERROR_DECRYPT;
+
+                header = 5;
+
+                /* total_num is the number of bytes following the initial
+                   (5 bytes) packet length and padding length fields */
+                total_num =
+                    p->packet_length - 1 +
+                    (encrypted ? session->remote.mac->mac_len : 0);
+            }
 
             /* RFC4253 section 6.1 Maximum Packet Length says:
              *
@@ -459,7 +556,9 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
             /* Get a packet handle put data into. We get one to
                hold all data, including padding and MAC. */
-            p->payload = LIBSSH2_ALLOC(session, total_num);
+            p->payload_size = total_num;
+            p->payload = _libssh2_packet_pool_alloc(session,
+                                                    &p->payload_size);
             if (!p->payload) {
                 return LIBSSH2_ERROR_ALLOC;
             }
@@ -467,12 +566,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             /* init write pointer to start of payload buffer */
             p->wptr = p->payload;
 
-            if (blocksize > 5) {
-                /* copy the data from index 5 to the end of
+            if (blocksize > header) {
+                /* copy the data from index 'header' to the end of
                    the blocksize from the temporary buffer to
                    the start of the decrypted buffer */
-                memcpy(p->wptr, &block[5], blocksize - 5);
-                p->wptr += blocksize - 5;       /* advance write pointer */
+                memcpy(p->wptr, &block[header], blocksize - header);
+                p->wptr += blocksize - header;  /* advance write pointer */
             }
 
             /* init the data_num field to the number of bytes of
@@ -493,58 +592,8 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             numbytes = remainpack;
         }
 
-        if (encrypted) {
-            /* At the end of the incoming stream, there is a MAC,
-               and we don't want to decrypt that since we need it
-               "raw". We MUST however decrypt the padding data
-               since it is used for the hash later on. */
-            int skip = session->remote.mac->mac_len;
-
-            /* if what we have plus numbytes is bigger than the
-               total minus the skip margin, we should lower the
-               amount to decrypt even more */
-            if ((p->data_num + numbytes) > (p->total_num - skip)) {
-                numdecrypt = (p->total_num - skip) - p->data_num;
-            } else {
-                int frac;
-                numdecrypt = numbytes;
-                frac = numdecrypt % blocksize;
-                if (frac) {
-                    /* not an aligned amount of blocks,
-                       align it */
-                    numdecrypt -= frac;
-                    /* and make it no unencrypted data
-                       after it */
-                    numbytes = 0;
-                }
-            }
-        } else {
-            /* unencrypted data should not be decrypted at all */
-            numdecrypt = 0;
-        }
-
-        /* if there are bytes to decrypt, do that */
-        if (numdecrypt > 0) {
-            /* now decrypt the lot */
-            rc = decrypt(session, &p->buf[p->readidx], p->wptr, numdecrypt);
-            if (rc != LIBSSH2_ERROR_NONE) {
-                p->total_num = 0;   /* no packet buffer available */
-                return rc;
-            }
-
-            /* advance the read pointer */
-            p->readidx += numdecrypt;
-            /* advance write pointer */
-            p->wptr += numdecrypt;
-            /* increase data_num */
-            p->data_num += numdecrypt;
-
-            /* bytes left to take care of without decryption */
-            numbytes -= numdecrypt;
-        }
-
-        /* if there are bytes to copy that aren't decrypted, simply
-           copy them as-is to the target buffer */
+        /* The packet is collected as it arrives; fullpacket() decrypts it
+           in place once it is complete */
         if (numbytes > 0) {
             memcpy(p->wptr, &p->buf[p->readidx], numbytes);
 
@@ -554,14 +603,50 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             p->wptr += numbytes;
             /* increase data_num */
             p->data_num += numbytes;
+
+            remainpack -= numbytes;
         }
 
-        /* now check how much data there's left to read to finish the
-           current packet */
-        remainpack = p->total_num - p->data_num;
+        if (remainpack) {
+            /* The buffered data is used up: the rest of the packet is
+               received straight into the packet buffer, so the bulk of a
+               large packet is never copied */
+            ssize_t nread;
+
+            nread = LIBSSH2_RECV(session, p->wptr, remainpack,
+                                 LIBSSH2_SOCKET_RECV_FLAGS(session));
+            if (nread <= 0) {
+                if ((nread < 0) && (nread == -EAGAIN)) {
+                    session->socket_block_directions |=
+                        LIBSSH2_SESSION_BLOCK_INBOUND;
+                    return LIBSSH2_ERROR_EAGAIN;
+                }
+                _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                               "Error recving %d bytes (got %d)",
+                               remainpack, -nread);
+                return LIBSSH2_ERROR_SOCKET_RECV;
+            }
+            _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                           "Recved %d/%d bytes to %p+%d", nread,
+                           remainpack, p->payload, p->data_num);
+
+            debugdump(session, "libssh2_transport_read() raw",
+                      p->wptr, nread);
+            /* advance write pointer */
+            p->wptr += nread;
+            /* increase data_num */
+            p->data_num += nread;
+
+            remainpack -= nread;
+        }
 
         if (!remainpack) {
-            /* we have a full packet */
+            /* we have a full packet. Bulk transfers mix in the odd small
+               packet, so the large mode only ends after a few in a row. */
+            if (p->total_num > PACKETBUFSIZE)
+                p->large = 4;
+            else if (p->large)
+                p->large--;
           libssh2_transport_read_point1:
             rc = fullpacket(session, encrypted);
             if (rc == LIBSSH2_ERROR_EAGAIN) {
@@ -592,6 +677,33 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     return LIBSSH2_ERROR_SOCKET_RECV; /* we never reach this point */
 }
 
+/*
+ * _libssh2_transport_read
+ *
+ * Collect a packet into the input queue.
+ *
+ * Returns packet type added to input queue (0 if nothing added), or a
+ * negative error number.
+ *
+ * DOES NOT call _libssh2_error() for ANY error case.
+ */
+int _libssh2_transport_read(LIBSSH2_SESSION * session)
+{
+    struct transportpacket *p = &session->packet;
+    int rc = transport_read(session);
+
+    /* the read buffer is freed once it has been used up, so that idle
+       sessions don't keep one each. It bypasses the packet pool on the way
+       out, as the pool lives as long as the session does. */
+    if (p->buf && p->readidx == p->writeidx) {
+        LIBSSH2_FREE(session, p->buf);
+        p->buf = NULL;
+        p->readidx = p->writeidx = 0;
+    }
+
+    return rc;
+}
+
 static int
 send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
               size_t data_len, ssize_t *ret)
@@ -659,7 +771,7 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
 }
 
 /*
- * libssh2_transport_send
+ * transport_send
  *
  * Send a packet, encrypting it and adding a MAC code if necessary
  * Returns 0 on success, non-zero on failure.
@@ -676,9 +788,9 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
  *
  * This function DOES NOT call _libssh2_error() on any errors.
  */
-int _libssh2_transport_send(LIBSSH2_SESSION *session,
-                            const unsigned char *data, size_t data_len,
-                            const unsigned char *data2, size_t data2_len)
+static int transport_send(LIBSSH2_SESSION *session,
+                          const unsigned char *data, size_t data_len,
+                          const unsigned char *data2, size_t data2_len)
 {
     int blocksize =
         (session->state & LIBSSH2_STATE_NEWKEYS) ?
@@ -693,6 +805,8 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     struct transportpacket *p = &session->packet;
     int encrypted;
     int compressed;
+    int aead;
+    int etm;
     ssize_t ret;
     int rc;
     const unsigned char *orgdata = data;
@@ -732,7 +846,18 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
         /* set by send_existing if data was sent */
         return rc;
 
+    if (!p->outbuf) {
+        size_t bufsize = MAX_SSH_PACKET_LEN;
+
+        p->outbuf = _libssh2_packet_pool_alloc(session, &bufsize);
+        if (!p->outbuf)
+            return LIBSSH2_ERROR_ALLOC;
+    }
+
     encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
+    aead = encrypted &&
+        (session->local.crypt->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC);
+    etm = encrypted && session->local.mac->etm;
 
     compressed =
         session->local.comp != NULL &&
@@ -799,8 +924,11 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     /* at this point we have it all except the padding */
 
     /* first figure out our minimum padding amount to make it an even
-       block size */
-    padding_length = blocksize - (packet_length % blocksize);
+       block size. AEAD ciphers and -etm MACs leave the packet_length field
+       out of the encrypted span (RFC 5647 section 7.2), so it is not
+       counted. */
+    padding_length = blocksize -
+        ((aead || etm ? packet_length - 4 : packet_length) % blocksize);
 
     /* if the padding becomes too small we add another blocksize worth
        of it (taken from the original libssh2 where it didn't have any
@@ -834,9 +962,30 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     /* fill the padding area with random junk */
     _libssh2_random(p->outbuf + 5 + data_len, padding_length);
 
-    if (encrypted) {
-        size_t i;
+    if (aead) {
+        /* Encrypt everything after the packet_length field, which is only
+           authenticated; the cipher appends its tag at index
+           packet_length, where the MAC would otherwise go. */
+        if (session->local.crypt->crypt(session, p->outbuf + 4,
+                                        packet_length - 4,
+                                        &session->local.crypt_abstract))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
+    }
+    else if (etm) {
+        /* Encrypt everything after the packet_length field, then MAC the
+           packet as it goes on the wire. The MAC goes at index
+           packet_length as usual. */
+        if (session->local.crypt->crypt(session, p->outbuf + 4,
+                                        packet_length - 4,
+                                        &session->local.crypt_abstract))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
 
+        session->local.mac->hash(session, p->outbuf + packet_length,
+                                 session->local.seqno, p->outbuf,
+                                 packet_length, NULL, 0,
+                                 &session->local.mac_abstract);
+    }
+    else if (encrypted) {
         /* Calculate MAC hash. Put the output at index packet_length,
            since that size includes the whole packet. The MAC is
            calculated on the entire unencrypted packet, including all
@@ -846,15 +995,12 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                                  packet_length, NULL, 0,
                                  &session->local.mac_abstract);
 
-        /* Encrypt the whole packet data, one block size at a time.
-           The MAC field is not encrypted. */
-        for(i = 0; i < packet_length; i += session->local.crypt->blocksize) {
-            unsigned char *ptr = &p->outbuf[i];
-            if (session->local.crypt->crypt(session, ptr,
-                                            session->local.crypt->blocksize,
-                                            &session->local.crypt_abstract))
-                return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
-        }
+        /* Encrypt the whole packet data in a single call; packet_length
+           is a multiple of the block size. The MAC field is not
+           encrypted. */
+        if (session->local.crypt->crypt(session, p->outbuf, packet_length,
+                                        &session->local.crypt_abstract))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
     }
 
     session->local.seqno++;
@@ -889,3 +1035,25 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     return LIBSSH2_ERROR_NONE;         /* all is good */
 }
+
+/*
+ * _libssh2_transport_send
+ *
+ * See transport_send() above. The output buffer is only held for as long
+ * as part of a packet is left to send.
+ */
+int _libssh2_transport_send(LIBSSH2_SESSION *session,
+                            const unsigned char *data, size_t data_len,
+                            const unsigned char *data2, size_t data2_len)
+{
+    struct transportpacket *p = &session->packet;
+    int rc = transport_send(session, data, data_len, data2, data2_len);
+
+    /* like the read buffer, not given back to the packet pool */
+    if (p->outbuf && !p->olen) {
+        LIBSSH2_FREE(session, p->outbuf);
+        p->outbuf = NULL;
+    }
+
+    return rc;
+}
@@ -56,6 +56,13 @@
 
 #define LIBSSH2_AES 1
 #define LIBSSH2_AES_CTR 0
+#define LIBSSH2_AES_GCM 0
+#define LIBSSH2_CHACHA20_POLY1305 0
+#define LIBSSH2_UMAC 0
+#define LIBSSH2_ECDH 0
+#define LIBSSH2_CURVE25519 0
+#define LIBSSH2_ECDSA 0
+#define LIBSSH2_ED25519 0
 #define LIBSSH2_BLOWFISH 0
 #define LIBSSH2_RC4 1
 #define LIBSSH2_CAST 0
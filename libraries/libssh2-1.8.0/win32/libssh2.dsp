@@ -275,6 +275,10 @@ SOURCE=..\src\crypt.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\ed25519.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\global.c
 # End Source File
 # Begin Source File
@@ -367,6 +371,10 @@ SOURCE=..\src\crypto.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\ed25519.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\libssh2_config.h
 # End Source File
 # Begin Source File
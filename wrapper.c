@@ -22,281 +22,3465 @@
 #endif
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <libssh2.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Maximum number of idle authenticated sessions kept in the pool */
+#define SSH_SESSION_POOL_DEFAULT_SIZE 256
+/* Seconds an idle pooled session is kept before being disconnected */
+#define SSH_SESSION_POOL_DEFAULT_IDLE_TIMEOUT 300
+
+/* Number of native worker threads used by execute_on_hosts unless told otherwise */
+#define SSH_FAN_OUT_DEFAULT_CONCURRENCY 64
+#define SSH_FAN_OUT_WORKER_STACK_SIZE (512 * 1024)
+
+/* Streamed output is read in chunks of up to one SSH packet, handed to Python in batches */
+#define SSH_STREAM_CHUNK_SIZE (32 * 1024)
+#define SSH_STREAM_BATCH_CHUNKS 64
+
+/* Seconds allowed for resolving a host and establishing the TCP connection to it */
+#define SSH_CONNECT_DEFAULT_TIMEOUT 10
+/* Happy eyeballs (RFC 8305): delay before racing the next address while earlier attempts are pending */
+#define SSH_CONNECT_ATTEMPT_DELAY_MS 250
+#define SSH_CONNECT_MAX_ADDRESSES 16
+/* Resolver threads have no descriptor to wait on - non-blocking callers check on them this often */
+#define SSH_DNS_POLL_INTERVAL_MS 20
+/* resolve_ssh_host() status while the resolution is still in progress */
+#define SSH_DNS_PENDING -2
+
+/* Seconds resolved addresses are kept - getaddrinfo does not expose the records' TTL */
+#define SSH_DNS_CACHE_DEFAULT_TTL 60
+#define SSH_DNS_CACHE_BUCKETS 1024
+
+/* Command output buffers grow geometrically and always keep this much room for the next read */
+#define OUTPUT_BUFFER_MIN_FREE (32 * 1024)
+/* read_channel_output() status when an output buffer could not grow */
+#define OUTPUT_BUFFER_NO_MEMORY -2
 
 // TODO: accept tuple only
 
-void form_response_string(char** response_string, char* response_chunk, long response_chunk_size)
+/* Authenticated SSH connection, either in use by a call or idle in the pool */
+typedef struct ssh_connection
 {
-	unsigned long response_size = strlen(*response_string);
+	char* host;
+	int port;
+	char* username;
+	/* Credential the session was authenticated with - part of the pool key */
+	char* password;
+	char* key_path;
 
-	*response_string = realloc(*response_string, response_size = (response_size + response_chunk_size + 1));
+	int socket;
+	LIBSSH2_SESSION* session;
+	/* Set once the SSH handshake completed */
+	int established;
 
-	memcpy(*response_string + strlen(*response_string), response_chunk, response_chunk_size);
-	memset(*response_string + response_size - 1, 0, 1);
+	/* Set when the connection was taken from the pool rather than freshly opened */
+	int reused;
+	time_t last_used;
+
+	/* Bytes pulled off the socket by libssh2, see ssh_connection_recv */
+	unsigned long received_bytes;
+
+	struct ssh_connection* next;
+} ssh_connection;
+
+/* Pool of idle authenticated connections, most recently used first */
+static ssh_connection* ssh_session_pool = NULL;
+static long ssh_session_pool_size = 0;
+static long ssh_session_pool_max_size = SSH_SESSION_POOL_DEFAULT_SIZE;
+static long ssh_session_pool_idle_timeout = SSH_SESSION_POOL_DEFAULT_IDLE_TIMEOUT;
+static pthread_mutex_t ssh_session_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+typedef struct ssh_resolved_address
+{
+	struct sockaddr_storage address;
+	socklen_t length;
+} ssh_resolved_address;
+
+
+/* Resolution of one host name, shared by every connection to it */
+typedef struct ssh_dns_cache_entry
+{
+	char* host;
+	/* IPv6 and IPv4 addresses interleaved; none when resolution failed, error_message telling why */
+	ssh_resolved_address* addresses;
+	int address_count;
+	const char* error_message;
+	/* Set while a resolver thread works on the entry - lookups of the same host wait for it */
+	int resolving;
+	/* Resolutions completed so far - tells a lookup when the one it waits for is done */
+	unsigned long resolutions;
+	time_t resolved_at;
+
+	struct ssh_dns_cache_entry* next;
+} ssh_dns_cache_entry;
+
+static ssh_dns_cache_entry* ssh_dns_cache[SSH_DNS_CACHE_BUCKETS];
+static long ssh_dns_cache_ttl = SSH_DNS_CACHE_DEFAULT_TTL;
+static pthread_mutex_t ssh_dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Broadcast whenever a resolver thread finishes */
+static pthread_cond_t ssh_dns_cache_resolved = PTHREAD_COND_INITIALIZER;
+
+static long ssh_connect_timeout = SSH_CONNECT_DEFAULT_TIMEOUT;
+
+
+/* Socket options applied to every new connection before it connects; zero keeps the kernel default */
+typedef struct ssh_socket_profile
+{
+	/* Small exec, window-adjust and keystroke packets go out without Nagle's delay */
+	int no_delay;
+	int send_buffer_size;
+	int receive_buffer_size;
+
+	/* Keepalive is enabled when keepalive_idle (seconds) is set */
+	int keepalive_idle;
+	int keepalive_interval;
+	int keepalive_count;
+
+	/* Milliseconds unacknowledged data may stay in flight before the connection is dropped */
+	int user_timeout;
+	char congestion_control[16];
+} ssh_socket_profile;
+
+/* Guarded by ssh_dns_cache_lock, like the other connection settings */
+static ssh_socket_profile ssh_default_socket_profile = {1, 0, 0, 0, 0, 0, 0, ""};
+
+
+/* Non-blocking connection attempts racing through a host's addresses */
+typedef struct ssh_connect_race
+{
+	/* Set until the host's addresses are known */
+	char* host;
+	unsigned long awaited_resolution;
+
+	ssh_resolved_address* addresses;
+	int address_count;
+	int next_address;
+	int port;
+	ssh_socket_profile socket_profile;
+
+	/* Pending attempts, oldest first */
+	int sockets[SSH_CONNECT_MAX_ADDRESSES];
+	int socket_count;
+
+	long long next_attempt_time;
+	long long deadline;
+} ssh_connect_race;
+
+
+/* Length-tracked, binary-safe accumulator for command output */
+typedef struct output_buffer
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+} output_buffer;
+
+
+/* Per-call settings shared by the command runners */
+typedef struct ssh_execution_options
+{
+	/* Number of concurrent channels per session; 1 runs commands one after another */
+	int max_channels;
+	/* Have the server's stderr delivered as part of stdout */
+	int merge_stderr;
+	/* Run all commands through one remote sh over a single channel, see run_ssh_commands_batched */
+	int batch;
+} ssh_execution_options;
+
+
+/* Output of a single remote command, collected without touching Python objects */
+typedef struct ssh_command_result
+{
+	output_buffer stdout_output;
+	output_buffer stderr_output;
+	int exit_code;
+	char* exit_signal;
+} ssh_command_result;
+
+
+/*
+ * Makes room for at least OUTPUT_BUFFER_MIN_FREE more bytes, doubling the
+ * capacity so that accumulating n bytes costs O(n). Returns the free tail,
+ * which libssh2 reads into directly; *available receives its size. Returns
+ * NULL, leaving the buffer as it was, if it can not grow.
+ */
+static char* output_buffer_reserve(output_buffer* buffer, size_t* available)
+{
+	if (buffer->capacity - buffer->size < OUTPUT_BUFFER_MIN_FREE)
+	{
+		size_t capacity = buffer->capacity ? buffer->capacity : OUTPUT_BUFFER_MIN_FREE;
+
+		while (capacity - buffer->size < OUTPUT_BUFFER_MIN_FREE)
+			capacity *= 2;
+
+		char* data = realloc(buffer->data, capacity);
+
+		if (data == NULL)
+			return NULL;
+
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+
+	*available = buffer->capacity - buffer->size;
+	return buffer->data + buffer->size;
+}
+
+
+/* Gives back the unused tail once a stream is complete - results of many commands may be held at once */
+static void output_buffer_finish(output_buffer* buffer)
+{
+	if (buffer->size == 0)
+	{
+		free(buffer->data);
+		buffer->data = NULL;
+		buffer->capacity = 0;
+	}
+	else if (buffer->size < buffer->capacity)
+	{
+		/* Shrinking may fail like any realloc - the larger block is still valid then */
+		char* data = realloc(buffer->data, buffer->size);
+
+		if (data != NULL)
+		{
+			buffer->data = data;
+			buffer->capacity = buffer->size;
+		}
+	}
+}
+
+
+/* Blocks until the socket is ready in the direction libssh2 is waiting for */
+static void wait_for_ssh_socket(ssh_connection* connection)
+{
+	int directions = libssh2_session_block_directions(connection->session);
+
+	struct pollfd socket_poll;
+	socket_poll.fd = connection->socket;
+	socket_poll.events = 0;
+	socket_poll.revents = 0;
+
+	if (directions & LIBSSH2_SESSION_BLOCK_INBOUND)
+		socket_poll.events |= POLLIN;
+	if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+		socket_poll.events |= POLLOUT;
+
+	/* Nothing to wait for in particular - any incoming packet may unblock a channel */
+	if (socket_poll.events == 0)
+		socket_poll.events = POLLIN;
+
+	while (poll(&socket_poll, 1, -1) < 0 && errno == EINTR);
+}
+
+
+/*
+ * Reads whatever is available on a channel stream into the buffer; returns the
+ * last libssh2_channel_read_ex result, or LIBSSH2_ERROR_ALLOC if the buffer
+ * could not grow.
+ */
+static ssize_t read_channel_stream(LIBSSH2_CHANNEL* ssh_channel, int stream_id, output_buffer* buffer)
+{
+	ssize_t read_bytes;
+
+	do
+	{
+		size_t available;
+		char* tail = output_buffer_reserve(buffer, &available);
+
+		if (tail == NULL)
+			return LIBSSH2_ERROR_ALLOC;
+
+		read_bytes = libssh2_channel_read_ex(ssh_channel, stream_id, tail, available);
+
+		if (read_bytes > 0)
+			buffer->size += read_bytes;
+	}
+	while (read_bytes > 0);
+
+	return read_bytes;
+}
+
+
+/*
+ * Services stdout and stderr of a non-blocking channel together, so a command
+ * flooding one stream can not stall on a full window while the other one is
+ * read. Sets *progress if any output arrived. Returns 1 once both streams
+ * reached EOF, 0 while more output may come, OUTPUT_BUFFER_NO_MEMORY if the
+ * output could not be stored, or -1 on any other error.
+ */
+static int read_channel_output(LIBSSH2_CHANNEL* ssh_channel, ssh_command_result* result, int* progress)
+{
+	size_t received_output = result->stdout_output.size + result->stderr_output.size;
+
+	ssize_t stdout_bytes = read_channel_stream(ssh_channel, 0, &result->stdout_output);
+	ssize_t stderr_bytes = read_channel_stream(ssh_channel, SSH_EXTENDED_DATA_STDERR, &result->stderr_output);
+
+	if (result->stdout_output.size + result->stderr_output.size != received_output)
+		*progress = 1;
+
+	if (stdout_bytes == LIBSSH2_ERROR_ALLOC || stderr_bytes == LIBSSH2_ERROR_ALLOC)
+		return OUTPUT_BUFFER_NO_MEMORY;
+
+	if ((stdout_bytes < 0 && stdout_bytes != LIBSSH2_ERROR_EAGAIN)
+		|| (stderr_bytes < 0 && stderr_bytes != LIBSSH2_ERROR_EAGAIN))
+		return -1;
+
+	if (stdout_bytes == 0 && stderr_bytes == 0)
+	{
+		output_buffer_finish(&result->stdout_output);
+		output_buffer_finish(&result->stderr_output);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static time_t monotonic_time()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+
+static long long monotonic_milliseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static int optional_strings_equal(const char* first, const char* second)
+{
+	if (first == NULL || second == NULL)
+		return first == second;
+	return strcmp(first, second) == 0;
+}
+
+
+static char* optional_strdup(const char* string)
+{
+	return string ? strdup(string) : NULL;
+}
+
+
+static void close_ssh_connection(ssh_connection* connection)
+{
+	if (connection->session)
+	{
+		if (connection->established)
+			libssh2_session_disconnect(connection->session, "Normal Shutdown");
+
+		libssh2_session_free(connection->session);
+	}
+
+	if (connection->socket >= 0)
+		close(connection->socket);
+
+	free(connection->host);
+	free(connection->username);
+	free(connection->password);
+	free(connection->key_path);
+	free(connection);
+}
+
+
+/*
+ * Cheap liveness probe for an idle connection: the peer closing the socket or
+ * a pending socket error means the session can not be reused. Pending data is
+ * fine - it is usually a keepalive or global request libssh2 will consume.
+ */
+static int ssh_connection_is_alive(ssh_connection* connection)
+{
+	struct pollfd socket_poll;
+	socket_poll.fd = connection->socket;
+	socket_poll.events = POLLIN;
+	socket_poll.revents = 0;
+
+	if (poll(&socket_poll, 1, 0) < 0)
+		return 0;
+
+	if (socket_poll.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return 0;
+
+	if (socket_poll.revents & POLLIN)
+	{
+		char peek_byte;
+		ssize_t peeked = recv(connection->socket, &peek_byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+		if (peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * libssh2 receive callback: the default recv() behaviour, plus a byte count
+ * that tells the channel multiplexing loop whether libssh2 received anything.
+ */
+static ssize_t ssh_connection_recv(libssh2_socket_t socket, void* buffer, size_t length, int flags, void** abstract)
+{
+	ssize_t received = recv(socket, buffer, length, flags);
+
+	if (received < 0)
+		return -errno;
+
+	((ssh_connection*) *abstract)->received_bytes += received;
+	return received;
+}
+
+
+/* Returns NULL if out of memory */
+static ssh_connection* new_ssh_connection(const char* ssh_host, int ssh_port, const char* ssh_username,
+	const char* ssh_password, const char* ssh_key_path)
+{
+	ssh_connection* connection = calloc(1, sizeof(ssh_connection));
+
+	if (connection == NULL)
+		return NULL;
+
+	connection->socket = -1;
+	connection->host = strdup(ssh_host);
+	connection->port = ssh_port;
+	connection->username = strdup(ssh_username);
+	connection->password = optional_strdup(ssh_password);
+	connection->key_path = optional_strdup(ssh_key_path);
+
+	if (connection->host == NULL || connection->username == NULL
+		|| (ssh_password && connection->password == NULL) || (ssh_key_path && connection->key_path == NULL))
+	{
+		close_ssh_connection(connection);
+		return NULL;
+	}
+
+	return connection;
+}
+
+
+/*
+ * Resolves a host to its TCP addresses, alternating address families starting
+ * with the one getaddrinfo prefers, so that a broken IPv6 (or IPv4) path costs
+ * one attempt delay rather than the whole connect timeout. Returns the count,
+ * 0 when the host does not resolve or -1 when out of memory.
+ */
+static int resolve_addresses(const char* host, ssh_resolved_address** addresses)
+{
+	/* gethostbyname is neither reentrant nor dual-stack */
+	struct addrinfo address_hints;
+	memset(&address_hints, 0, sizeof(struct addrinfo));
+	address_hints.ai_family = AF_UNSPEC;
+	address_hints.ai_socktype = SOCK_STREAM;
+	address_hints.ai_protocol = IPPROTO_TCP;
+	address_hints.ai_flags = AI_ADDRCONFIG;
+
+	struct addrinfo* remote_host = NULL;
+	*addresses = NULL;
+
+	if (getaddrinfo(host, NULL, &address_hints, &remote_host) != 0 || remote_host == NULL)
+		return 0;
+
+	struct addrinfo* families[2][SSH_CONNECT_MAX_ADDRESSES];
+	int family_counts[2] = {0, 0};
+	int preferred_family = remote_host->ai_family;
+
+	for (struct addrinfo* address = remote_host; address; address = address->ai_next)
+	{
+		if ((address->ai_family != AF_INET && address->ai_family != AF_INET6) || address->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		int family = address->ai_family == preferred_family ? 0 : 1;
+
+		if (family_counts[family] < SSH_CONNECT_MAX_ADDRESSES)
+			families[family][family_counts[family]++] = address;
+	}
+
+	int address_count = 0;
+	*addresses = calloc(SSH_CONNECT_MAX_ADDRESSES, sizeof(ssh_resolved_address));
+
+	if (*addresses == NULL)
+	{
+		freeaddrinfo(remote_host);
+		return -1;
+	}
+
+	for (int i = 0; address_count < SSH_CONNECT_MAX_ADDRESSES && (i < family_counts[0] || i < family_counts[1]); i++)
+	{
+		for (int family = 0; family < 2 && address_count < SSH_CONNECT_MAX_ADDRESSES; family++)
+		{
+			if (i >= family_counts[family])
+				continue;
+
+			memcpy(&(*addresses)[address_count].address, families[family][i]->ai_addr, families[family][i]->ai_addrlen);
+			(*addresses)[address_count].length = families[family][i]->ai_addrlen;
+			address_count++;
+		}
+	}
+
+	freeaddrinfo(remote_host);
+
+	return address_count;
+}
+
+
+static void free_ssh_dns_cache_entry(ssh_dns_cache_entry* entry)
+{
+	free(entry->host);
+	free(entry->addresses);
+	free(entry);
+}
+
+
+/*
+ * Walks the host's bucket, dropping the entries on the way that are no use to
+ * anyone any more: expired, not being resolved, and older than a lookup that
+ * waited for them could still be around to take their result.
+ */
+static ssh_dns_cache_entry** find_ssh_dns_cache_entry(const char* host)
+{
+	unsigned long hash = 5381;
+	for (const char* character = host; *character; character++)
+		hash = hash * 33 + (unsigned char) *character;
+
+	time_t now = monotonic_time();
+	ssh_dns_cache_entry** link = &ssh_dns_cache[hash % SSH_DNS_CACHE_BUCKETS];
+
+	while (*link)
+	{
+		ssh_dns_cache_entry* entry = *link;
+
+		if (!entry->resolving && now - entry->resolved_at > ssh_dns_cache_ttl + ssh_connect_timeout)
+		{
+			*link = entry->next;
+			free_ssh_dns_cache_entry(entry);
+			continue;
+		}
+
+		if (strcmp(entry->host, host) == 0)
+			break;
+
+		link = &entry->next;
+	}
+
+	return link;
+}
+
+
+/* Failed resolutions are only shared with the lookups that waited for them, never cached */
+static int ssh_dns_cache_entry_expired(ssh_dns_cache_entry* entry, time_t now)
+{
+	return entry->address_count == 0 || now - entry->resolved_at >= ssh_dns_cache_ttl;
+}
+
+
+/* Resolver thread: resolves one host and publishes the result in the cache */
+static void* ssh_dns_resolver(void* argument)
+{
+	char* host = (char*) argument;
+	ssh_resolved_address* addresses;
+	int address_count = resolve_addresses(host, &addresses);
+
+	pthread_mutex_lock(&ssh_dns_cache_lock);
+
+	ssh_dns_cache_entry* entry = *find_ssh_dns_cache_entry(host);
+
+	free(entry->addresses);
+	entry->addresses = addresses;
+	entry->address_count = address_count > 0 ? address_count : 0;
+	entry->error_message = address_count < 0 ? "Out of memory resolving host" : "Failed to resolve host";
+	entry->resolving = 0;
+	entry->resolutions++;
+	entry->resolved_at = monotonic_time();
+
+	pthread_cond_broadcast(&ssh_dns_cache_resolved);
+	pthread_mutex_unlock(&ssh_dns_cache_lock);
+
+	free(host);
+
+	return NULL;
+}
+
+
+/*
+ * Looks the host up in the cache without waiting, starting a resolver thread
+ * when it is missing or expired. *awaited is 0 for a new lookup; while the
+ * resolution is pending it records which one the lookup waits for, so that
+ * its result is taken even when it failed. Called with ssh_dns_cache_lock
+ * held. Returns the address count with *addresses a copy the caller frees,
+ * -1 with error_message set, or SSH_DNS_PENDING.
+ */
+static int lookup_ssh_host(const char* host, unsigned long* awaited, ssh_resolved_address** addresses, const char** error_message)
+{
+	ssh_dns_cache_entry** link = find_ssh_dns_cache_entry(host);
+	ssh_dns_cache_entry* entry = *link;
+
+	if (entry && !entry->resolving && ((*awaited && entry->resolutions >= *awaited) || !ssh_dns_cache_entry_expired(entry, monotonic_time())))
+	{
+		*awaited = 0;
+
+		if (entry->address_count == 0)
+		{
+			*error_message = entry->error_message;
+			return -1;
+		}
+
+		*addresses = malloc(entry->address_count * sizeof(ssh_resolved_address));
+
+		if (*addresses == NULL)
+		{
+			*error_message = "Out of memory resolving host";
+			return -1;
+		}
+
+		memcpy(*addresses, entry->addresses, entry->address_count * sizeof(ssh_resolved_address));
+		return entry->address_count;
+	}
+
+	if (entry == NULL)
+	{
+		/* Resolving entries are never evicted - resolver threads find them again by name */
+		entry = calloc(1, sizeof(ssh_dns_cache_entry));
+
+		if (entry)
+			entry->host = strdup(host);
+
+		if (entry == NULL || entry->host == NULL)
+		{
+			free(entry);
+			*error_message = "Out of memory resolving host";
+			return -1;
+		}
+
+		*link = entry;
+	}
+
+	*awaited = entry->resolutions + 1;
+
+	if (!entry->resolving)
+	{
+		pthread_t resolver;
+		char* resolver_host = strdup(host);
+
+		if (resolver_host == NULL)
+		{
+			*error_message = "Out of memory resolving host";
+			return -1;
+		}
+
+		entry->resolving = 1;
+
+		if (pthread_create(&resolver, NULL, ssh_dns_resolver, resolver_host) == 0)
+		{
+			pthread_detach(resolver);
+		}
+		else
+		{
+			/* Could not start a thread - resolve on this one, without the deadline */
+			pthread_mutex_unlock(&ssh_dns_cache_lock);
+			ssh_dns_resolver(resolver_host);
+			pthread_mutex_lock(&ssh_dns_cache_lock);
+			return lookup_ssh_host(host, awaited, addresses, error_message);
+		}
+	}
+
+	return SSH_DNS_PENDING;
+}
+
+
+/*
+ * Looks the host up in the cache, resolving it in a resolver thread when
+ * missing or expired. Concurrent lookups of one host share one resolution.
+ * With a deadline, waits for the resolution and gives up at the deadline even
+ * if the resolver is still stuck; without one (0), returns SSH_DNS_PENDING
+ * instead of waiting - call again with the same *awaited to check on it.
+ * Returns as lookup_ssh_host(). Must be called without the GIL held when
+ * waiting.
+ */
+static int resolve_ssh_host(const char* host, unsigned long* awaited, long long deadline, ssh_resolved_address** addresses, const char** error_message)
+{
+	int address_count;
+
+	pthread_mutex_lock(&ssh_dns_cache_lock);
+
+	for (;;)
+	{
+		address_count = lookup_ssh_host(host, awaited, addresses, error_message);
+
+		if (address_count != SSH_DNS_PENDING || deadline == 0)
+			break;
+
+		long long remaining = deadline - monotonic_milliseconds();
+
+		if (remaining <= 0)
+		{
+			*error_message = "Timed out resolving host";
+			address_count = -1;
+			break;
+		}
+
+		/* Condition variables wait on the realtime clock */
+		struct timespec wait_until;
+		clock_gettime(CLOCK_REALTIME, &wait_until);
+		wait_until.tv_sec += remaining / 1000;
+		wait_until.tv_nsec += (remaining % 1000) * 1000000;
+		if (wait_until.tv_nsec >= 1000000000)
+		{
+			wait_until.tv_sec++;
+			wait_until.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&ssh_dns_cache_resolved, &ssh_dns_cache_lock, &wait_until);
+	}
+
+	pthread_mutex_unlock(&ssh_dns_cache_lock);
+
+	return address_count;
+}
+
+
+/*
+ * Buffer sizes have to be set before connecting for the window scale to take
+ * them into account. Options the platform lacks are skipped, and failures are
+ * ignored - a profile tunes the connection, it is never a reason to fail it.
+ */
+static void apply_ssh_socket_profile(int socket_descriptor, const ssh_socket_profile* profile)
+{
+	int enabled = 1;
+
+	if (profile->no_delay)
+		setsockopt(socket_descriptor, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(int));
+
+	if (profile->send_buffer_size)
+		setsockopt(socket_descriptor, SOL_SOCKET, SO_SNDBUF, &profile->send_buffer_size, sizeof(int));
+
+	if (profile->receive_buffer_size)
+		setsockopt(socket_descriptor, SOL_SOCKET, SO_RCVBUF, &profile->receive_buffer_size, sizeof(int));
+
+	if (profile->keepalive_idle)
+	{
+		setsockopt(socket_descriptor, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(int));
+
+#if defined(TCP_KEEPIDLE)
+		setsockopt(socket_descriptor, IPPROTO_TCP, TCP_KEEPIDLE, &profile->keepalive_idle, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+		/* Darwin's name for TCP_KEEPIDLE */
+		setsockopt(socket_descriptor, IPPROTO_TCP, TCP_KEEPALIVE, &profile->keepalive_idle, sizeof(int));
+#endif
+
+#ifdef TCP_KEEPINTVL
+		if (profile->keepalive_interval)
+			setsockopt(socket_descriptor, IPPROTO_TCP, TCP_KEEPINTVL, &profile->keepalive_interval, sizeof(int));
+#endif
+
+#ifdef TCP_KEEPCNT
+		if (profile->keepalive_count)
+			setsockopt(socket_descriptor, IPPROTO_TCP, TCP_KEEPCNT, &profile->keepalive_count, sizeof(int));
+#endif
+	}
+
+#ifdef TCP_USER_TIMEOUT
+	if (profile->user_timeout)
+		setsockopt(socket_descriptor, IPPROTO_TCP, TCP_USER_TIMEOUT, &profile->user_timeout, sizeof(int));
+#endif
+
+#ifdef TCP_CONGESTION
+	if (profile->congestion_control[0])
+		setsockopt(socket_descriptor, IPPROTO_TCP, TCP_CONGESTION, profile->congestion_control, (socklen_t) strlen(profile->congestion_control));
+#endif
+}
+
+
+/* Prepares the race and its deadline; the host is resolved by the first step. Returns 0, or -1 with error_message set */
+static int start_ssh_connect_race(ssh_connect_race* race, const char* host, int port, const char** error_message)
+{
+	memset(race, 0, sizeof(ssh_connect_race));
+	race->port = port;
+	race->host = strdup(host);
+
+	if (race->host == NULL)
+	{
+		*error_message = "Out of memory resolving host";
+		return -1;
+	}
+
+	pthread_mutex_lock(&ssh_dns_cache_lock);
+	race->socket_profile = ssh_default_socket_profile;
+	race->deadline = monotonic_milliseconds() + ssh_connect_timeout * 1000;
+	pthread_mutex_unlock(&ssh_dns_cache_lock);
+
+	return 0;
+}
+
+
+/* Closes the attempts still pending and frees the race's host and addresses */
+static void abandon_ssh_connect_race(ssh_connect_race* race)
+{
+	for (int i = 0; i < race->socket_count; i++)
+		close(race->sockets[i]);
+
+	race->socket_count = 0;
+
+	free(race->host);
+	race->host = NULL;
+
+	free(race->addresses);
+	race->addresses = NULL;
+	race->address_count = 0;
+}
+
+
+static void remove_ssh_connect_attempt(ssh_connect_race* race, int attempt)
+{
+	memmove(&race->sockets[attempt], &race->sockets[attempt + 1], (race->socket_count - attempt - 1) * sizeof(int));
+	race->socket_count--;
+}
+
+
+/*
+ * When the race has to be stepped again even if none of its sockets became
+ * writable: the resolver and the attempts older than the newest one have no
+ * descriptor a caller waits on, so they are checked on regularly.
+ */
+static long long ssh_connect_race_wake_up_time(const ssh_connect_race* race)
+{
+	long long wake_up_time = race->deadline;
+	long long now = monotonic_milliseconds();
+
+	if (race->host && now + SSH_DNS_POLL_INTERVAL_MS < wake_up_time)
+		wake_up_time = now + SSH_DNS_POLL_INTERVAL_MS;
+
+	if (race->socket_count > 1 && now + SSH_CONNECT_ATTEMPT_DELAY_MS < wake_up_time)
+		wake_up_time = now + SSH_CONNECT_ATTEMPT_DELAY_MS;
+
+	if (race->next_address < race->address_count && race->next_attempt_time < wake_up_time)
+		wake_up_time = race->next_attempt_time;
+
+	return wake_up_time;
+}
+
+
+/*
+ * Advances the race: once the host is resolved, the next address is tried as
+ * soon as the previous attempt failed or has been pending for
+ * SSH_CONNECT_ATTEMPT_DELAY_MS, and the first attempt to connect wins. Waits
+ * until then or the deadline when wait is set. Returns the connected
+ * non-blocking socket, -1 with error_message set, or -2 when nothing
+ * connected yet and wait is not set.
+ */
+static int step_ssh_connect_race(ssh_connect_race* race, int wait, const char** error_message)
+{
+	if (race->host)
+	{
+		int address_count = resolve_ssh_host(race->host, &race->awaited_resolution, wait ? race->deadline : 0, &race->addresses, error_message);
+
+		if (address_count == SSH_DNS_PENDING)
+		{
+			if (monotonic_milliseconds() < race->deadline)
+				return -2;
+
+			*error_message = "Timed out resolving host";
+			return -1;
+		}
+
+		if (address_count < 0)
+			return -1;
+
+		race->address_count = address_count;
+		free(race->host);
+		race->host = NULL;
+	}
+
+	for (;;)
+	{
+		long long now = monotonic_milliseconds();
+
+		if (now >= race->deadline)
+		{
+			*error_message = "Timed out connecting to host";
+			return -1;
+		}
+
+		while (race->next_address < race->address_count && (race->socket_count == 0 || now >= race->next_attempt_time))
+		{
+			ssh_resolved_address* address = &race->addresses[race->next_address++];
+			struct sockaddr* socket_address = (struct sockaddr*) &address->address;
+
+			if (socket_address->sa_family == AF_INET6)
+				((struct sockaddr_in6*) socket_address)->sin6_port = htons(race->port);
+			else
+				((struct sockaddr_in*) socket_address)->sin_port = htons(race->port);
+
+			DEBUG_OUTPUT(stdout, "=> Connecting to server (address %d)...\n", race->next_address);
+			int attempt_socket = socket(socket_address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+			if (attempt_socket < 0)
+				continue;
+
+			fcntl(attempt_socket, F_SETFL, fcntl(attempt_socket, F_GETFL, 0) | O_NONBLOCK);
+			apply_ssh_socket_profile(attempt_socket, &race->socket_profile);
+
+			if (connect(attempt_socket, socket_address, address->length) == 0)
+			{
+				abandon_ssh_connect_race(race);
+				return attempt_socket;
+			}
+
+			if (errno != EINPROGRESS)
+			{
+				close(attempt_socket);
+				continue;
+			}
+
+			race->sockets[race->socket_count++] = attempt_socket;
+			race->next_attempt_time = now + SSH_CONNECT_ATTEMPT_DELAY_MS;
+			break;
+		}
+
+		if (race->socket_count == 0)
+		{
+			*error_message = "Failed to connect to host";
+			return -1;
+		}
+
+		struct pollfd socket_polls[SSH_CONNECT_MAX_ADDRESSES];
+		for (int i = 0; i < race->socket_count; i++)
+		{
+			socket_polls[i].fd = race->sockets[i];
+			socket_polls[i].events = POLLOUT;
+			socket_polls[i].revents = 0;
+		}
+
+		long long wake_up_time = race->deadline;
+		if (race->next_address < race->address_count && race->next_attempt_time < wake_up_time)
+			wake_up_time = race->next_attempt_time;
+
+		if (poll(socket_polls, race->socket_count, wait ? (int) (wake_up_time - now) : 0) < 0 && errno != EINTR)
+		{
+			*error_message = "Failed to connect to host";
+			return -1;
+		}
+
+		int failed_attempts = 0;
+
+		for (int i = race->socket_count - 1; i >= 0; i--)
+		{
+			if (socket_polls[i].revents == 0)
+				continue;
+
+			int attempt_socket = race->sockets[i];
+			int socket_error = 0;
+			socklen_t socket_error_size = sizeof(socket_error);
+			remove_ssh_connect_attempt(race, i);
+
+			if (getsockopt(attempt_socket, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_size) == 0 && socket_error == 0)
+			{
+				abandon_ssh_connect_race(race);
+				return attempt_socket;
+			}
+
+			close(attempt_socket);
+			failed_attempts++;
+		}
+
+		/* A failed attempt makes way for the next address right away */
+		if (failed_attempts)
+			race->next_attempt_time = now;
+		else if (!wait)
+			return -2;
+	}
+}
+
+
+/* Resolves the connection's host and connects to it within the connect timeout; returns 0, or -1 with error_message set */
+static int connect_ssh_socket(ssh_connection* connection, const char** error_message)
+{
+	ssh_connect_race race;
+
+	if (start_ssh_connect_race(&race, connection->host, connection->port, error_message) != 0)
+		return -1;
+
+	int connected_socket = step_ssh_connect_race(&race, 1, error_message);
+	abandon_ssh_connect_race(&race);
+
+	if (connected_socket < 0)
+		return -1;
+
+	/* libssh2 is driven in blocking mode from here */
+	fcntl(connected_socket, F_SETFL, fcntl(connected_socket, F_GETFL, 0) & ~O_NONBLOCK);
+	connection->socket = connected_socket;
+
+	return 0;
+}
+
+
+/* Creates the connection's libssh2 session with the settings used for every connection */
+static void create_ssh_session(ssh_connection* connection, int blocking)
+{
+	DEBUG_OUTPUT(stdout, "=> Initializing libssh2 session...\n");
+	LIBSSH2_SESSION* ssh_session = libssh2_session_init_ex(NULL, NULL, NULL, connection);
+	libssh2_session_callback_set(ssh_session, LIBSSH2_CALLBACK_RECV, (void*) ssh_connection_recv);
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	DEBUG_OUTPUT(stdout, "=> Setting blocking mode...\n");
+	libssh2_session_set_blocking(ssh_session, blocking);
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	DEBUG_OUTPUT(stdout, "=> Setting maximum supported timeout for SSH session...\n");
+	/* We have to disable timeout, as processing in practice may take some time */
+	libssh2_session_set_timeout(ssh_session, 0);
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	DEBUG_OUTPUT(stdout, "=> Enabling SSH protocol compression...\n");
+	/* Setting SSH compression to speed up big data transfers */
+	/* _SC - server-client, _CS - client-server */
+	libssh2_session_method_pref(ssh_session, LIBSSH2_METHOD_COMP_SC, "zlib");
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	connection->session = ssh_session;
+}
+
+
+typedef enum ssh_authentication_method
+{
+	SSH_AUTHENTICATION_UNSUPPORTED,
+	SSH_AUTHENTICATION_PASSWORD,
+	SSH_AUTHENTICATION_PUBLICKEY
+} ssh_authentication_method;
+
+
+/* Picks how to authenticate from the server's method list and the credentials at hand */
+static ssh_authentication_method choose_authentication_method(ssh_connection* connection, const char* user_authentication_methods)
+{
+	if (strstr(user_authentication_methods, "password") && connection->password && strlen(connection->password) != 0)
+		return SSH_AUTHENTICATION_PASSWORD;
+
+	if (strstr(user_authentication_methods, "publickey") && connection->key_path && strlen(connection->key_path) != 0)
+		return SSH_AUTHENTICATION_PUBLICKEY;
+
+	return SSH_AUTHENTICATION_UNSUPPORTED;
+}
+
+
+/* Returns the libssh2 result, so it may be repeated on LIBSSH2_ERROR_EAGAIN with a non-blocking session */
+static int authenticate_ssh_connection(ssh_connection* connection, ssh_authentication_method method)
+{
+	if (method == SSH_AUTHENTICATION_PASSWORD)
+		return libssh2_userauth_password(connection->session, connection->username, connection->password);
+
+	return libssh2_userauth_publickey_fromfile(connection->session, connection->username, NULL, connection->key_path, "");
+}
+
+
+static const char* authentication_error_message(ssh_authentication_method method)
+{
+	return method == SSH_AUTHENTICATION_PASSWORD
+		? "Authentication by password failed"
+		: "Authentication by public key failed";
+}
+
+
+/* Must be called without the GIL held; returns NULL and sets error_message on failure */
+static ssh_connection* open_ssh_connection(const char* ssh_host, int ssh_port, const char* ssh_username,
+	const char* ssh_password, const char* ssh_key_path, const char** error_message)
+{
+	ssh_connection* connection = new_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path);
+
+	if (connection == NULL)
+	{
+		*error_message = "Out of memory connecting to host";
+		return NULL;
+	}
+
+	if (connect_ssh_socket(connection, error_message) != 0)
+	{
+		close_ssh_connection(connection);
+		return NULL;
+	}
+
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	create_ssh_session(connection, 1);
+
+	DEBUG_OUTPUT(stdout, "=> Performing SSH handshake...\n");
+	if (libssh2_session_handshake(connection->session, connection->socket))
+	{
+		*error_message = "Failure establishing SSH session";
+		close_ssh_connection(connection);
+		return NULL;
+	}
+	connection->established = 1;
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	DEBUG_OUTPUT(stdout, "=> Getting available authentication methods...\n");
+	const char* user_authentication_methods = libssh2_userauth_list(connection->session, ssh_username, (unsigned int) strlen(ssh_username));
+	DEBUG_OUTPUT(stdout, "\t%s\n", user_authentication_methods);
+
+	ssh_authentication_method method = user_authentication_methods
+		? choose_authentication_method(connection, user_authentication_methods)
+		: SSH_AUTHENTICATION_UNSUPPORTED;
+
+	if (method == SSH_AUTHENTICATION_UNSUPPORTED)
+	{
+		*error_message = "No supported authentication methods found";
+		close_ssh_connection(connection);
+		return NULL;
+	}
+
+	DEBUG_OUTPUT(stdout, "=> Authenticating...\n");
+	if (authenticate_ssh_connection(connection, method))
+	{
+		*error_message = authentication_error_message(method);
+		close_ssh_connection(connection);
+		return NULL;
+	}
+	DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+	return connection;
+}
+
+
+/*
+ * Takes a matching idle session out of the pool, or returns NULL if there is
+ * none. Expired and dead pooled sessions met on the way are evicted.
+ * Must be called without the GIL held.
+ */
+static ssh_connection* take_pooled_ssh_connection(const char* ssh_host, int ssh_port, const char* ssh_username,
+	const char* ssh_password, const char* ssh_key_path)
+{
+	ssh_connection* found_connection = NULL;
+	ssh_connection* evicted_connections = NULL;
+	time_t now = monotonic_time();
+
+	pthread_mutex_lock(&ssh_session_pool_lock);
+
+	ssh_connection** link = &ssh_session_pool;
+	while (*link)
+	{
+		ssh_connection* connection = *link;
+
+		if (now - connection->last_used > ssh_session_pool_idle_timeout)
+		{
+			*link = connection->next;
+			ssh_session_pool_size--;
+			connection->next = evicted_connections;
+			evicted_connections = connection;
+			continue;
+		}
+
+		if (found_connection == NULL
+			&& connection->port == ssh_port
+			&& strcmp(connection->host, ssh_host) == 0
+			&& strcmp(connection->username, ssh_username) == 0
+			&& optional_strings_equal(connection->password, ssh_password)
+			&& optional_strings_equal(connection->key_path, ssh_key_path))
+		{
+			*link = connection->next;
+			ssh_session_pool_size--;
+
+			if (ssh_connection_is_alive(connection))
+			{
+				found_connection = connection;
+			}
+			else
+			{
+				connection->next = evicted_connections;
+				evicted_connections = connection;
+			}
+			continue;
+		}
+
+		link = &connection->next;
+	}
+
+	pthread_mutex_unlock(&ssh_session_pool_lock);
+
+	/* Disconnecting may block on the network, so it is done outside of the lock */
+	while (evicted_connections)
+	{
+		ssh_connection* next_connection = evicted_connections->next;
+		DEBUG_OUTPUT(stdout, "=> Evicting pooled session to %s\n", evicted_connections->host);
+		close_ssh_connection(evicted_connections);
+		evicted_connections = next_connection;
+	}
+
+	if (found_connection)
+	{
+		DEBUG_OUTPUT(stdout, "=> Reusing pooled session to %s\n", ssh_host);
+		found_connection->next = NULL;
+		found_connection->reused = 1;
+	}
+
+	return found_connection;
+}
+
+
+/* Takes a matching idle session out of the pool, or opens a new one. Must be called without the GIL held. */
+static ssh_connection* acquire_ssh_connection(const char* ssh_host, int ssh_port, const char* ssh_username,
+	const char* ssh_password, const char* ssh_key_path, const char** error_message)
+{
+	ssh_connection* connection = take_pooled_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path);
+
+	if (connection)
+		return connection;
+
+	return open_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path, error_message);
+}
+
+
+/*
+ * Returns a connection to the pool, evicting the least recently used idle
+ * session if the pool is over capacity. Connections in an unknown state
+ * (reusable == 0) are closed instead. Must be called without the GIL held.
+ */
+static void release_ssh_connection(ssh_connection* connection, int reusable)
+{
+	ssh_connection* evicted_connection = NULL;
+
+	if (reusable)
+	{
+		/* The packet buffers libssh2 keeps for reuse are dead weight while the session waits in the pool */
+		libssh2_session_packet_pool_clear(connection->session);
+
+		pthread_mutex_lock(&ssh_session_pool_lock);
+
+		if (ssh_session_pool_max_size > 0)
+		{
+			connection->last_used = monotonic_time();
+			connection->reused = 0;
+			connection->next = ssh_session_pool;
+			ssh_session_pool = connection;
+			ssh_session_pool_size++;
+			connection = NULL;
+
+			if (ssh_session_pool_size > ssh_session_pool_max_size)
+			{
+				ssh_connection** link = &ssh_session_pool;
+				while ((*link)->next)
+					link = &(*link)->next;
+
+				evicted_connection = *link;
+				*link = NULL;
+				ssh_session_pool_size--;
+			}
+		}
+
+		pthread_mutex_unlock(&ssh_session_pool_lock);
+	}
+
+	if (connection)
+		close_ssh_connection(connection);
+
+	if (evicted_connection)
+		close_ssh_connection(evicted_connection);
+}
+
+
+/* Disconnects idle pooled sessions; with expired_only set, only the ones past the idle timeout */
+static void drain_ssh_session_pool(int expired_only)
+{
+	ssh_connection* evicted_connections = NULL;
+	time_t now = monotonic_time();
+
+	pthread_mutex_lock(&ssh_session_pool_lock);
+
+	ssh_connection** link = &ssh_session_pool;
+	while (*link)
+	{
+		ssh_connection* connection = *link;
+
+		if (!expired_only || now - connection->last_used > ssh_session_pool_idle_timeout)
+		{
+			*link = connection->next;
+			ssh_session_pool_size--;
+			connection->next = evicted_connections;
+			evicted_connections = connection;
+			continue;
+		}
+
+		link = &connection->next;
+	}
+
+	pthread_mutex_unlock(&ssh_session_pool_lock);
+
+	while (evicted_connections)
+	{
+		ssh_connection* next_connection = evicted_connections->next;
+		close_ssh_connection(evicted_connections);
+		evicted_connections = next_connection;
+	}
+}
+
+
+PyObject* get_build_information(PyObject* self)
+{
+	Py_Initialize();
+
+	PyTupleObject* py_response = PyTuple_New(5);
+	PyTuple_SetItem(py_response, 0, PyString_FromString(REMOTE_SSH_MANAGER_VERSION));
+
+#ifdef __clang__
+	// TODO: use strncat!
+	char compiler_version_string[512];
+	memset(compiler_version_string, 0, sizeof(compiler_version_string));
+	strcat(compiler_version_string, "clang, version ");
+	strcat(compiler_version_string, __clang_version__);
+
+	const char* compiled_architecture = "64-bit";
+
+	char openssl_version_string[128];
+	memset(openssl_version_string, 0, sizeof(openssl_version_string));
+	strcat(openssl_version_string, REMOTE_SSH_MANAGER_OPENSSL_VERSION);
+
+	char libssh2_version_string[128];
+	memset(libssh2_version_string, 0, sizeof(libssh2_version_string));
+	strcat(libssh2_version_string, REMOTE_SSH_MANAGER_LIBSSH2_VERSION);
+#endif
+
+	PyTuple_SetItem(py_response, 1, PyString_FromString(compiler_version_string));
+	PyTuple_SetItem(py_response, 2, PyString_FromString(compiled_architecture));
+	PyTuple_SetItem(py_response, 3, PyString_FromString(openssl_version_string));
+	PyTuple_SetItem(py_response, 4, PyString_FromString(libssh2_version_string));
+
+	return py_response;
+}
+
+
+static void free_ssh_command_results(ssh_command_result* results, Py_ssize_t command_count)
+{
+	if (results == NULL)
+		return;
+
+	for (Py_ssize_t i = 0; i < command_count; i++)
+	{
+		free(results[i].stdout_output.data);
+		free(results[i].stderr_output.data);
+		free(results[i].exit_signal);
+	}
+
+	free(results);
+}
+
+
+/* Returned by a command runner when the very first channel could not be opened */
+#define SSH_COMMANDS_STALE_SESSION 1
+
+
+/*
+ * Runs the commands one after another, each over its own blocking channel.
+ * Returns 0 on success, SSH_COMMANDS_STALE_SESSION if the session could not
+ * open its first channel, or -1; error_message is set on failure.
+ */
+static int run_ssh_commands_sequentially(ssh_connection* connection, char** commands, Py_ssize_t command_count,
+	const ssh_execution_options* options, ssh_command_result* results, const char** error_message)
+{
+	for (Py_ssize_t i = 0; i < command_count; i++)
+	{
+		DEBUG_OUTPUT(stdout, "=> Command: %s\n", commands[i]);
+
+		LIBSSH2_CHANNEL* ssh_channel = libssh2_channel_open_session(connection->session);
+
+		if (ssh_channel == NULL)
+		{
+			*error_message = "Failed to initiate SSH session";
+			return i == 0 ? SSH_COMMANDS_STALE_SESSION : -1;
+		}
+
+		libssh2_channel_set_blocking(ssh_channel, 1);
+
+		if (options->merge_stderr)
+			libssh2_channel_handle_extended_data2(ssh_channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
+
+		DEBUG_OUTPUT(stdout, "=> Executing...\n");
+		if (libssh2_channel_exec(ssh_channel, commands[i]) != 0)
+		{
+			/* TODO: continue? */
+			libssh2_channel_free(ssh_channel);
+			*error_message = "Error during command execution";
+			return -1;
+		}
+		DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+		DEBUG_OUTPUT(stdout, "=> Reading stdout and stderr...\n");
+
+		/* Both streams are drained from the same transport reads, which needs a non-blocking session */
+		libssh2_session_set_blocking(connection->session, 0);
+
+		int read_status;
+		int progress;
+		unsigned long received_bytes;
+
+		do
+		{
+			progress = 0;
+			received_bytes = connection->received_bytes;
+			read_status = read_channel_output(ssh_channel, &results[i], &progress);
+
+			/* Only sleep if nothing was received that could still be sitting in the packet queue */
+			if (read_status == 0 && !progress && connection->received_bytes == received_bytes)
+				wait_for_ssh_socket(connection);
+		}
+		while (read_status == 0);
+
+		libssh2_session_set_blocking(connection->session, 1);
+
+		if (read_status < 0)
+		{
+			libssh2_channel_free(ssh_channel);
+			*error_message = read_status == OUTPUT_BUFFER_NO_MEMORY ? "Out of memory reading command output" : "Error reading command output";
+			return -1;
+		}
+
+		DEBUG_OUTPUT(stdout, "\tOUTPUT: %.*s\n", (int) results[i].stdout_output.size, results[i].stdout_output.data);
+		DEBUG_OUTPUT(stdout, "\tERRORS: %.*s\n", (int) results[i].stderr_output.size, results[i].stderr_output.data);
+
+		char* exit_signal = NULL;
+
+		if (libssh2_channel_close(ssh_channel) == 0)
+		{
+			results[i].exit_code = libssh2_channel_get_exit_status(ssh_channel);
+			libssh2_channel_get_exit_signal(ssh_channel, &exit_signal, NULL, NULL, NULL, NULL, NULL);
+		}
+
+		if (exit_signal)
+		{
+			results[i].exit_signal = strdup(exit_signal);
+			libssh2_free(connection->session, exit_signal);
+		}
+
+		libssh2_channel_free(ssh_channel);
+	}
+
+	return 0;
+}
+
+
+/* Life cycle of a command running over its own non-blocking channel */
+typedef enum ssh_channel_state
+{
+	SSH_CHANNEL_EXECUTING,
+	SSH_CHANNEL_READING,
+	SSH_CHANNEL_CLOSING,
+	SSH_CHANNEL_FREEING
+} ssh_channel_state;
+
+typedef struct ssh_channel_slot
+{
+	LIBSSH2_CHANNEL* channel;
+	Py_ssize_t command_index;
+	ssh_channel_state state;
+} ssh_channel_slot;
+
+
+/*
+ * Advances a command's non-blocking channel as far as it goes without waiting:
+ * exec, read both streams, close and free. Sets *progress if anything changed.
+ * Returns 1 once the channel is freed, 0 while it is waiting on the socket,
+ * or -1 with error_message set.
+ */
+static int step_ssh_channel(LIBSSH2_SESSION* ssh_session, ssh_channel_slot* slot, const char* command,
+	ssh_command_result* result, int* progress, const char** error_message)
+{
+	LIBSSH2_CHANNEL* ssh_channel = slot->channel;
+	int rc;
+
+	if (slot->state == SSH_CHANNEL_EXECUTING)
+	{
+		rc = libssh2_channel_exec(ssh_channel, command);
+
+		if (rc == LIBSSH2_ERROR_EAGAIN)
+			return 0;
+
+		if (rc != 0)
+		{
+			*error_message = "Error during command execution";
+			return -1;
+		}
+
+		slot->state = SSH_CHANNEL_READING;
+		*progress = 1;
+	}
+
+	if (slot->state == SSH_CHANNEL_READING)
+	{
+		rc = read_channel_output(ssh_channel, result, progress);
+
+		if (rc < 0)
+		{
+			*error_message = rc == OUTPUT_BUFFER_NO_MEMORY ? "Out of memory reading command output" : "Error reading command output";
+			return -1;
+		}
+
+		if (rc == 0)
+			return 0;
+
+		/* Both streams reached EOF */
+		slot->state = SSH_CHANNEL_CLOSING;
+		*progress = 1;
+	}
+
+	if (slot->state == SSH_CHANNEL_CLOSING)
+	{
+		rc = libssh2_channel_close(ssh_channel);
+
+		if (rc == LIBSSH2_ERROR_EAGAIN)
+			return 0;
+
+		if (rc == 0)
+		{
+			char* exit_signal = NULL;
+
+			result->exit_code = libssh2_channel_get_exit_status(ssh_channel);
+			libssh2_channel_get_exit_signal(ssh_channel, &exit_signal, NULL, NULL, NULL, NULL, NULL);
+
+			if (exit_signal)
+			{
+				result->exit_signal = strdup(exit_signal);
+				libssh2_free(ssh_session, exit_signal);
+			}
+		}
+
+		slot->state = SSH_CHANNEL_FREEING;
+		*progress = 1;
+	}
+
+	if (libssh2_channel_free(ssh_channel) == LIBSSH2_ERROR_EAGAIN)
+		return 0;
+
+	slot->channel = NULL;
+	*progress = 1;
+
+	return 1;
+}
+
+
+/*
+ * Runs up to options->max_channels commands at a time over concurrent non-blocking
+ * channels of the same session, so their round trips overlap. If the server
+ * refuses a channel while others are open (sshd MaxSessions), the limit is
+ * lowered to what the server accepted. Results are stored in input order.
+ * Returns like run_ssh_commands_sequentially.
+ */
+static int run_ssh_commands_multiplexed(ssh_connection* connection, char** commands, Py_ssize_t command_count,
+	const ssh_execution_options* options, ssh_command_result* results, const char** error_message)
+{
+	LIBSSH2_SESSION* ssh_session = connection->session;
+	int max_channels = options->max_channels;
+	ssh_channel_slot* slots = calloc(max_channels, sizeof(ssh_channel_slot));
+
+	if (slots == NULL)
+	{
+		*error_message = "Out of memory running commands";
+		return -1;
+	}
+
+	int channel_limit = max_channels;
+	int open_channels = 0;
+	Py_ssize_t next_command = 0;
+	Py_ssize_t finished_commands = 0;
+	int status = 0;
+
+	libssh2_session_set_blocking(ssh_session, 0);
+
+	while (finished_commands < command_count && status == 0)
+	{
+		int progress = 0;
+		unsigned long received_bytes = connection->received_bytes;
+
+		/* libssh2 keeps a single channel-open state per session, so channels are opened one at a time */
+		if (next_command < command_count && open_channels < channel_limit)
+		{
+			LIBSSH2_CHANNEL* ssh_channel = libssh2_channel_open_session(ssh_session);
+
+			if (ssh_channel)
+			{
+				int slot = 0;
+				while (slots[slot].channel)
+					slot++;
+
+				DEBUG_OUTPUT(stdout, "=> Command: %s\n", commands[next_command]);
+
+				if (options->merge_stderr)
+					libssh2_channel_handle_extended_data2(ssh_channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
+
+				slots[slot].channel = ssh_channel;
+				slots[slot].command_index = next_command++;
+				slots[slot].state = SSH_CHANNEL_EXECUTING;
+				open_channels++;
+				progress = 1;
+			}
+			else if (libssh2_session_last_errno(ssh_session) != LIBSSH2_ERROR_EAGAIN)
+			{
+				if (libssh2_session_last_errno(ssh_session) == LIBSSH2_ERROR_CHANNEL_FAILURE && open_channels > 0)
+				{
+					DEBUG_OUTPUT(stdout, "=> Server refused channel, limiting to %d\n", open_channels);
+					channel_limit = open_channels;
+					progress = 1;
+				}
+				else
+				{
+					*error_message = "Failed to initiate SSH session";
+					status = next_command == 0 ? SSH_COMMANDS_STALE_SESSION : -1;
+					break;
+				}
+			}
+		}
+
+		for (int slot = 0; slot < max_channels && status == 0; slot++)
+		{
+			if (slots[slot].channel == NULL)
+				continue;
+
+			Py_ssize_t command_index = slots[slot].command_index;
+			int rc = step_ssh_channel(ssh_session, &slots[slot], commands[command_index], &results[command_index], &progress, error_message);
+
+			if (rc < 0)
+			{
+				status = -1;
+			}
+			else if (rc == 1)
+			{
+				open_channels--;
+				finished_commands++;
+			}
+		}
+
+		/*
+		 * Every libssh2 call drains the socket into the session's packet queue,
+		 * possibly on behalf of another channel. Sleeping is only safe after a
+		 * full pass in which nothing changed and nothing new was received.
+		 */
+		if (status == 0 && !progress && connection->received_bytes == received_bytes)
+			wait_for_ssh_socket(connection);
+	}
+
+	/* On failure the connection is discarded, and libssh2_session_free releases leftover channels */
+	libssh2_session_set_blocking(ssh_session, 1);
+	free(slots);
+
+	return status;
+}
+
+
+/* Framing markers are this prefix followed by 32 random hex digits */
+#define SSH_BATCH_MARKER_PREFIX "RSM-"
+#define SSH_BATCH_MARKER_SIZE (sizeof(SSH_BATCH_MARKER_PREFIX) - 1 + 32)
+
+
+/* A marker no command output contains in practice, fresh for every batch */
+static void generate_batch_marker(char* marker)
+{
+	unsigned char random_bytes[16];
+	int random_source = open("/dev/urandom", O_RDONLY);
+
+	if (random_source < 0 || read(random_source, random_bytes, sizeof(random_bytes)) != sizeof(random_bytes))
+	{
+		unsigned long long seed = (unsigned long long) monotonic_milliseconds() ^ ((unsigned long long) getpid() << 32) ^ (unsigned long long) (size_t) marker;
+		for (size_t i = 0; i < sizeof(random_bytes); i++)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			random_bytes[i] = (unsigned char) (seed >> 56);
+		}
+	}
+
+	if (random_source >= 0)
+		close(random_source);
+
+	strcpy(marker, SSH_BATCH_MARKER_PREFIX);
+	for (size_t i = 0; i < sizeof(random_bytes); i++)
+		sprintf(marker + sizeof(SSH_BATCH_MARKER_PREFIX) - 1 + i * 2, "%02x", random_bytes[i]);
+}
+
+
+/*
+ * Script fed to the remote sh: each command runs in a subshell, so cd, exit
+ * and the like stay contained, with stdin from /dev/null so that it can not
+ * eat the rest of the script. After it, a newline and "<marker> <index>" is
+ * written to stderr, and the same plus " <exit code>" to stdout; the newline
+ * makes the marker line-anchored whether or not the output ended with one.
+ * Returns NULL if out of memory.
+ */
+static char* build_batch_script(char** commands, Py_ssize_t command_count, const char* marker, int merge_stderr, size_t* script_length)
+{
+	size_t script_capacity = 64;
+	for (Py_ssize_t i = 0; i < command_count; i++)
+		script_capacity += strlen(commands[i]) * 4 + SSH_BATCH_MARKER_SIZE * 2 + 160;
+
+	char* script = malloc(script_capacity);
+	size_t length = 0;
+
+	if (script == NULL)
+		return NULL;
+
+	for (Py_ssize_t i = 0; i < command_count; i++)
+	{
+		length += sprintf(script + length, "( eval '");
+
+		/* Single-quoted for eval; an embedded quote becomes '\'' */
+		for (const char* character = commands[i]; *character; character++)
+		{
+			if (*character == '\'')
+			{
+				memcpy(script + length, "'\\''", 4);
+				length += 4;
+			}
+			else
+			{
+				script[length++] = *character;
+			}
+		}
+
+		length += sprintf(script + length, "' ) </dev/null%s\n__rsm_status=$?\n", merge_stderr ? " 2>&1" : "");
+
+		/* Merged stderr shares the stdout pipe, which keeps it in order with the markers */
+		if (!merge_stderr)
+			length += sprintf(script + length, "printf '\\n%s %ld\\n' >&2\n", marker, (long) i);
+
+		length += sprintf(script + length, "printf '\\n%s %ld %%d\\n' \"$__rsm_status\"\n", marker, (long) i);
+	}
+
+	length += sprintf(script + length, "exit 0\n");
+	*script_length = length;
+
+	return script;
+}
+
+
+/*
+ * Cuts a batch's stream into per-command outputs. frame_exit_codes says if the
+ * markers on this stream carry exit codes. Returns the number of commands
+ * whose marker was found, or -1 if out of memory.
+ */
+static Py_ssize_t split_batch_output(const output_buffer* stream, const char* marker, int frame_exit_codes,
+	ssh_command_result* results, Py_ssize_t command_count, int stream_id)
+{
+	char frame_start[SSH_BATCH_MARKER_SIZE + 3];
+	size_t frame_start_length = (size_t) sprintf(frame_start, "\n%s ", marker);
+	size_t position = 0;
+	Py_ssize_t i = 0;
+
+	for (; i < command_count; i++)
+	{
+		const char* data = stream->data + position;
+		size_t remaining = stream->size - position;
+		const char* frame = stream->data ? memmem(data, remaining, frame_start, frame_start_length) : NULL;
+
+		if (frame == NULL)
+			break;
+
+		output_buffer* output = stream_id == SSH_EXTENDED_DATA_STDERR ? &results[i].stderr_output : &results[i].stdout_output;
+		size_t output_size = frame - data;
+
+		if (output_size)
+		{
+			output->data = malloc(output_size);
+
+			if (output->data == NULL)
+				return -1;
+
+			memcpy(output->data, data, output_size);
+			output->size = output->capacity = output_size;
+		}
+
+		const char* frame_end = memchr(frame + 1, '\n', stream->data + stream->size - (frame + 1));
+
+		if (frame_end == NULL)
+			break;
+
+		if (frame_exit_codes)
+		{
+			long command_index;
+			int exit_code;
+
+			if (sscanf(frame + frame_start_length, "%ld %d", &command_index, &exit_code) != 2 || command_index != i)
+				break;
+
+			results[i].exit_code = exit_code;
+		}
+
+		position = frame_end + 1 - stream->data;
+	}
+
+	return i;
+}
+
+
+/*
+ * Sends all commands as one script to a remote sh over a single channel and
+ * splits the output back up by the framing markers, saving the open, exec and
+ * close round trips of a channel per command. Commands run under sh rather
+ * than the user's login shell, and a command killed by a signal reports the
+ * shell's 128 + signal exit code instead of an exit signal.
+ * Returns like run_ssh_commands_sequentially.
+ */
+static int run_ssh_commands_batched(ssh_connection* connection, char** commands, Py_ssize_t command_count,
+	const ssh_execution_options* options, ssh_command_result* results, const char** error_message)
+{
+	char marker[SSH_BATCH_MARKER_SIZE + 1];
+	generate_batch_marker(marker);
+
+	size_t script_length;
+	char* script = build_batch_script(commands, command_count, marker, options->merge_stderr, &script_length);
+
+	if (script == NULL)
+	{
+		*error_message = "Out of memory running commands";
+		return -1;
+	}
+
+	DEBUG_OUTPUT(stdout, "=> Batch script:\n%s", script);
+
+	LIBSSH2_CHANNEL* ssh_channel = libssh2_channel_open_session(connection->session);
+
+	if (ssh_channel == NULL)
+	{
+		free(script);
+		*error_message = "Failed to initiate SSH session";
+		return SSH_COMMANDS_STALE_SESSION;
+	}
+
+	/* The script goes over stdin - a command line could hit the server's or the login shell's limits */
+	if (libssh2_channel_exec(ssh_channel, "sh") != 0)
+	{
+		free(script);
+		libssh2_channel_free(ssh_channel);
+		*error_message = "Error during command execution";
+		return -1;
+	}
+
+	/* Writing the script and reading its output are interleaved, so neither side's window can stall the other */
+	libssh2_session_set_blocking(connection->session, 0);
+
+	ssh_command_result batch_output;
+	memset(&batch_output, 0, sizeof(ssh_command_result));
+
+	size_t written = 0;
+	int eof_sent = 0;
+	int read_status;
+	int progress;
+	unsigned long received_bytes;
+
+	do
+	{
+		progress = 0;
+		received_bytes = connection->received_bytes;
+
+		if (written < script_length)
+		{
+			ssize_t rc = libssh2_channel_write(ssh_channel, script + written, script_length - written);
+
+			if (rc > 0)
+			{
+				written += rc;
+				progress = 1;
+			}
+			else if (rc != LIBSSH2_ERROR_EAGAIN)
+			{
+				read_status = -1;
+				break;
+			}
+		}
+		else if (!eof_sent)
+		{
+			int rc = libssh2_channel_send_eof(ssh_channel);
+
+			if (rc == 0)
+			{
+				eof_sent = 1;
+				progress = 1;
+			}
+			else if (rc != LIBSSH2_ERROR_EAGAIN)
+			{
+				read_status = -1;
+				break;
+			}
+		}
+
+		read_status = read_channel_output(ssh_channel, &batch_output, &progress);
+
+		if (read_status == 0 && !progress && connection->received_bytes == received_bytes)
+			wait_for_ssh_socket(connection);
+	}
+	while (read_status == 0);
+
+	libssh2_session_set_blocking(connection->session, 1);
+	free(script);
+
+	if (read_status > 0)
+	{
+		libssh2_channel_close(ssh_channel);
+
+		Py_ssize_t framed_commands = split_batch_output(&batch_output.stdout_output, marker, 1, results, command_count, 0);
+
+		if (framed_commands == command_count && !options->merge_stderr)
+			framed_commands = split_batch_output(&batch_output.stderr_output, marker, 0, results, command_count, SSH_EXTENDED_DATA_STDERR);
+
+		if (framed_commands < 0)
+		{
+			*error_message = "Out of memory reading command output";
+			read_status = -1;
+		}
+		else if (framed_commands < command_count)
+		{
+			*error_message = "Batch shell exited before all commands finished";
+			read_status = -1;
+		}
+	}
+	else
+	{
+		*error_message = read_status == OUTPUT_BUFFER_NO_MEMORY ? "Out of memory reading command output" : "Error reading command output";
+	}
+
+	libssh2_channel_free(ssh_channel);
+	free(batch_output.stdout_output.data);
+	free(batch_output.stderr_output.data);
+	free(batch_output.exit_signal);
+
+	return read_status > 0 ? 0 : -1;
+}
+
+
+/* Runs the commands the way the options ask for; returns like run_ssh_commands_sequentially */
+static int run_ssh_commands(ssh_connection* connection, char** commands, Py_ssize_t command_count,
+	const ssh_execution_options* options, ssh_command_result* results, const char** error_message)
+{
+	if (options->batch)
+		return run_ssh_commands_batched(connection, commands, command_count, options, results, error_message);
+
+	if (options->max_channels > 1)
+		return run_ssh_commands_multiplexed(connection, commands, command_count, options, results, error_message);
+
+	return run_ssh_commands_sequentially(connection, commands, command_count, options, results, error_message);
+}
+
+
+/*
+ * Runs the commands over a pooled connection to the host - one channel at a
+ * time, up to options->max_channels concurrent channels when it is above one,
+ * or all through a single channel in batch mode.
+ * Works on C data only, so it is called with the GIL released - either from
+ * the calling Python thread or from a fan-out worker thread.
+ * Returns 0 on success, or -1 with error_message set.
+ */
+static int execute_ssh_commands(const char* ssh_host, int ssh_port, const char* ssh_username,
+	const char* ssh_password, const char* ssh_key_path, char** commands, Py_ssize_t command_count,
+	const ssh_execution_options* options, ssh_command_result* results, const char** error_message)
+{
+	ssh_connection* connection = acquire_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path, error_message);
+
+	if (connection == NULL)
+		return -1;
+
+	int status = run_ssh_commands(connection, commands, command_count, options, results, error_message);
+
+	if (status == SSH_COMMANDS_STALE_SESSION && connection->reused)
+	{
+		/* Pooled session went stale while idle (e.g. server-side timeout) - reconnect once */
+		DEBUG_OUTPUT(stdout, "=> Pooled session is stale, reconnecting...\n");
+		release_ssh_connection(connection, 0);
+		connection = open_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path, error_message);
+
+		if (connection == NULL)
+			return -1;
+
+		status = run_ssh_commands(connection, commands, command_count, options, results, error_message);
+	}
+
+	if (status != 0)
+	{
+		release_ssh_connection(connection, 0);
+		return -1;
+	}
+
+	/* Keep the authenticated session around for the next call to the same host */
+	release_ssh_connection(connection, 1);
+
+	return 0;
+}
+
+
+/* Converts command results into the (stdout, stderr, exit code, exit signal) tuples returned to Python */
+static PyObject* build_command_responses(ssh_command_result* results, Py_ssize_t command_count)
+{
+	PyObject* py_response = PyTuple_New(command_count);
+
+	for (Py_ssize_t i = 0; i < command_count; i++)
+	{
+		PyObject* py_command_response = PyTuple_New(4);
+
+		/* Sized copies: output may contain NUL bytes */
+		PyTuple_SetItem(py_command_response, 0, PyString_FromStringAndSize(results[i].stdout_output.data, results[i].stdout_output.size));
+		PyTuple_SetItem(py_command_response, 1, PyString_FromStringAndSize(results[i].stderr_output.data, results[i].stderr_output.size));
+		PyTuple_SetItem(py_command_response, 2, PyInt_FromLong(results[i].exit_code));
+
+		PyObject* py_string_exit_signal = NULL;
+		if (results[i].exit_signal)
+		{
+			py_string_exit_signal = PyString_FromString(results[i].exit_signal);
+		}
+		else
+		{
+			Py_INCREF(Py_None);
+			py_string_exit_signal = Py_None;
+		}
+		PyTuple_SetItem(py_command_response, 3, py_string_exit_signal);
+
+		PyTuple_SetItem(py_response, i, py_command_response);
+	}
+
+	return py_response;
+}
+
+
+/*
+ * Pins a list of strings for use without the GIL: the returned tuple keeps
+ * them alive even if the caller's list is modified from another thread.
+ * Returns NULL if the argument is not a list or tuple of strings, or with
+ * MemoryError set if out of memory.
+ */
+static PyObject* get_string_sequence(PyObject* py_string_list, char*** strings, Py_ssize_t* string_count)
+{
+	if (!PyList_Check(py_string_list) && !PyTuple_Check(py_string_list))
+		return (PyObject*) NULL;
+
+	PyObject* py_string_tuple = PySequence_Tuple(py_string_list);
+
+	if (py_string_tuple == NULL)
+	{
+		PyErr_Clear();
+		return (PyObject*) NULL;
+	}
+
+	*string_count = PyTuple_Size(py_string_tuple);
+	*strings = malloc((*string_count + 1) * sizeof(char*));
+
+	if (*strings == NULL)
+	{
+		Py_DECREF(py_string_tuple);
+		return PyErr_NoMemory();
+	}
+
+	for (Py_ssize_t i = 0; i < *string_count; i++)
+	{
+		(*strings)[i] = PyString_AsString(PyTuple_GetItem(py_string_tuple, i));
+
+		if ((*strings)[i] == NULL)
+		{
+			free(*strings);
+			Py_DECREF(py_string_tuple);
+			PyErr_Clear();
+			return (PyObject*) NULL;
+		}
+	}
+
+	return py_string_tuple;
+}
+
+
+PyObject* execute_ssh_instructions(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	Py_Initialize();
+
+	static char* arguments[] = {"ssh_host", "ssh_username", "ssh_password", "ssh_key_path", "ssh_commands", "ssh_port", "channels", "merge_stderr", "batch", NULL};
+
+	char* ssh_host;
+	char* ssh_username;
+	char* ssh_password;
+	char* ssh_key_path;
+	PyObject* py_command_list;
+	int ssh_port = 22;
+	ssh_execution_options options = {1, 0, 0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sszzO|iiii", arguments, &ssh_host, &ssh_username, &ssh_password, &ssh_key_path, &py_command_list, &ssh_port, &options.max_channels, &options.merge_stderr, &options.batch)
+		|| options.max_channels < 1)
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	char** commands;
+	Py_ssize_t command_count;
+	PyObject* py_command_tuple = get_string_sequence(py_command_list, &commands, &command_count);
+
+	if (py_command_tuple == NULL)
+	{
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	ssh_command_result* results = calloc(command_count + 1, sizeof(ssh_command_result));
+	const char* error_message = NULL;
+
+	if (results == NULL)
+	{
+		free(commands);
+		Py_DECREF(py_command_tuple);
+		return PyErr_NoMemory();
+	}
+
+	/* The whole run happens without the GIL; Python objects are only built at the end */
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	int status = execute_ssh_commands(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path,
+		commands, command_count, &options, results, &error_message);
+
+	PyEval_RestoreThread(_save);
+
+	PyObject* py_response = NULL;
+
+	if (status == 0)
+		py_response = build_command_responses(results, command_count);
+	else
+		PyErr_SetString(PyExc_Exception, error_message);
+
+	free_ssh_command_results(results, command_count);
+	free(commands);
+	Py_DECREF(py_command_tuple);
+
+	return py_response;
+}
+
+
+/* Shared state of one execute_on_hosts call; workers pull host indexes from next_host */
+typedef struct ssh_fan_out_job
+{
+	char** hosts;
+	Py_ssize_t host_count;
+	Py_ssize_t next_host;
+
+	int ssh_port;
+	const char* ssh_username;
+	const char* ssh_password;
+	const char* ssh_key_path;
+
+	char** commands;
+	Py_ssize_t command_count;
+	ssh_execution_options options;
+
+	/* Per host: results on success, error message otherwise */
+	ssh_command_result** results;
+	const char** error_messages;
+} ssh_fan_out_job;
+
+
+static void* ssh_fan_out_worker(void* argument)
+{
+	ssh_fan_out_job* job = (ssh_fan_out_job*) argument;
+
+	for (;;)
+	{
+		Py_ssize_t host_index = __sync_fetch_and_add(&job->next_host, 1);
+
+		if (host_index >= job->host_count)
+			break;
+
+		ssh_command_result* results = calloc(job->command_count + 1, sizeof(ssh_command_result));
+		const char* error_message = NULL;
+
+		if (results == NULL)
+		{
+			job->error_messages[host_index] = "Out of memory running commands";
+			continue;
+		}
+
+		if (execute_ssh_commands(job->hosts[host_index], job->ssh_port, job->ssh_username, job->ssh_password,
+			job->ssh_key_path, job->commands, job->command_count, &job->options, results, &error_message) == 0)
+		{
+			job->results[host_index] = results;
+		}
+		else
+		{
+			free_ssh_command_results(results, job->command_count);
+			job->error_messages[host_index] = error_message;
+		}
+	}
+
+	return NULL;
 }
 
 
-PyObject* get_build_information(PyObject* self)
+/*
+ * Runs the same commands on many hosts from a pool of native threads, with
+ * the GIL released for the whole batch. Returns {host: command responses},
+ * where a host that failed maps to an Exception instance instead.
+ */
+PyObject* execute_on_hosts(PyObject* self, PyObject* args, PyObject* kwargs)
 {
 	Py_Initialize();
 
-	PyTupleObject* py_response = PyTuple_New(5);
-	PyTuple_SetItem(py_response, 0, PyString_FromString(REMOTE_SSH_MANAGER_VERSION));
+	static char* arguments[] = {"ssh_hosts", "ssh_username", "ssh_password", "ssh_key_path", "ssh_commands", "concurrency", "ssh_port", "channels", "merge_stderr", "batch", NULL};
 
-#ifdef __clang__
-	// TODO: use strncat!
-	char compiler_version_string[512];
-	memset(compiler_version_string, 0, sizeof(compiler_version_string));
-	strcat(compiler_version_string, "clang, version ");
-	strcat(compiler_version_string, __clang_version__);
+	PyObject* py_host_list;
+	char* ssh_username;
+	char* ssh_password;
+	char* ssh_key_path;
+	PyObject* py_command_list;
+	int concurrency = SSH_FAN_OUT_DEFAULT_CONCURRENCY;
+	int ssh_port = 22;
+	ssh_execution_options options = {1, 0, 0};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OszzO|iiiii", arguments, &py_host_list, &ssh_username, &ssh_password, &ssh_key_path, &py_command_list, &concurrency, &ssh_port, &options.max_channels, &options.merge_stderr, &options.batch)
+		|| concurrency < 1 || options.max_channels < 1)
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
 
-	const char* compiled_architecture = "64-bit";
+	ssh_fan_out_job job;
+	memset(&job, 0, sizeof(ssh_fan_out_job));
+	job.ssh_port = ssh_port;
+	job.ssh_username = ssh_username;
+	job.ssh_password = ssh_password;
+	job.ssh_key_path = ssh_key_path;
+	job.options = options;
 
-	char openssl_version_string[128];
-	memset(openssl_version_string, 0, sizeof(openssl_version_string));
-	strcat(openssl_version_string, REMOTE_SSH_MANAGER_OPENSSL_VERSION);
+	PyObject* py_host_tuple = get_string_sequence(py_host_list, &job.hosts, &job.host_count);
 
-	char libssh2_version_string[128];
-	memset(libssh2_version_string, 0, sizeof(libssh2_version_string));
-	strcat(libssh2_version_string, REMOTE_SSH_MANAGER_LIBSSH2_VERSION);
-#endif
+	if (py_host_tuple == NULL)
+	{
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
 
-	PyTuple_SetItem(py_response, 1, PyString_FromString(compiler_version_string));
-	PyTuple_SetItem(py_response, 2, PyString_FromString(compiled_architecture));
-	PyTuple_SetItem(py_response, 3, PyString_FromString(openssl_version_string));
-	PyTuple_SetItem(py_response, 4, PyString_FromString(libssh2_version_string));
+	PyObject* py_command_tuple = get_string_sequence(py_command_list, &job.commands, &job.command_count);
+
+	if (py_command_tuple == NULL)
+	{
+		free(job.hosts);
+		Py_DECREF(py_host_tuple);
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	if (concurrency > job.host_count)
+		concurrency = job.host_count > 0 ? (int) job.host_count : 1;
+
+	job.results = calloc(job.host_count + 1, sizeof(ssh_command_result*));
+	job.error_messages = calloc(job.host_count + 1, sizeof(char*));
+	pthread_t* workers = calloc(concurrency, sizeof(pthread_t));
+
+	if (job.results == NULL || job.error_messages == NULL || workers == NULL)
+	{
+		free(job.results);
+		free(job.error_messages);
+		free(workers);
+		free(job.hosts);
+		free(job.commands);
+		Py_DECREF(py_host_tuple);
+		Py_DECREF(py_command_tuple);
+		return PyErr_NoMemory();
+	}
+
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	/* Workers mostly wait on the network, so a small stack lets a lot of them run at once */
+	pthread_attr_t worker_attributes;
+	pthread_attr_init(&worker_attributes);
+	pthread_attr_setstacksize(&worker_attributes, SSH_FAN_OUT_WORKER_STACK_SIZE);
+
+	int started_workers = 0;
+
+	for (; started_workers < concurrency; started_workers++)
+	{
+		if (pthread_create(&workers[started_workers], &worker_attributes, ssh_fan_out_worker, &job) != 0)
+			break;
+	}
+
+	/* Could not start any thread - do the work on the calling thread */
+	if (started_workers == 0)
+		ssh_fan_out_worker(&job);
+
+	for (int i = 0; i < started_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_attr_destroy(&worker_attributes);
+	free(workers);
+
+	PyEval_RestoreThread(_save);
+
+	PyObject* py_response = PyDict_New();
+
+	for (Py_ssize_t i = 0; i < job.host_count; i++)
+	{
+		PyObject* py_host_response = NULL;
+
+		if (job.results[i])
+		{
+			py_host_response = build_command_responses(job.results[i], job.command_count);
+			free_ssh_command_results(job.results[i], job.command_count);
+		}
+		else
+		{
+			py_host_response = PyObject_CallFunction(PyExc_Exception, "s", job.error_messages[i]);
+		}
+
+		PyDict_SetItem(py_response, PyTuple_GetItem(py_host_tuple, i), py_host_response);
+		Py_DECREF(py_host_response);
+	}
+
+	free(job.results);
+	free(job.error_messages);
+	free(job.commands);
+	free(job.hosts);
+	Py_DECREF(py_command_tuple);
+	Py_DECREF(py_host_tuple);
 
 	return py_response;
 }
 
 
-PyObject* execute_ssh_instructions(PyObject* self, PyObject* args, PyObject* kwargs)
+/* One piece of streamed output; an "exit" chunk carries the exit code and signal instead of data */
+typedef struct ssh_output_chunk
+{
+	Py_ssize_t command_index;
+	const char* stream;
+	char* data;
+	size_t size;
+	int exit_code;
+	char* exit_signal;
+} ssh_output_chunk;
+
+
+/* Iterator returned by stream_ssh_instructions */
+typedef struct ssh_output_stream
+{
+	PyObject_HEAD
+
+	char* host;
+	int port;
+	char* username;
+	char* password;
+	char* key_path;
+
+	PyObject* py_command_tuple;
+	char** commands;
+	Py_ssize_t command_count;
+	int merge_stderr;
+
+	ssh_connection* connection;
+	LIBSSH2_CHANNEL* channel;
+	Py_ssize_t command_index;
+	int finished;
+	/* Set while a batch is read without the GIL, to refuse concurrent next() calls */
+	int busy;
+
+	/* Chunks of the last batch not handed out yet */
+	PyObject* py_pending_chunks;
+	Py_ssize_t pending_position;
+} ssh_output_stream;
+
+
+static void free_ssh_output_chunks(ssh_output_chunk* chunks, int chunk_count)
+{
+	for (int i = 0; i < chunk_count; i++)
+	{
+		free(chunks[i].data);
+		free(chunks[i].exit_signal);
+	}
+}
+
+
+/*
+ * Reads the next batch of output chunks, running commands one after another.
+ * Both streams of a command are polled together and the batch is handed back
+ * as soon as nothing more is immediately available, so callers see output as
+ * it arrives while taking the GIL only once per batch. Called without the GIL.
+ * Returns the number of chunks, 0 once all commands finished, or -1 with
+ * error_message set.
+ */
+static int read_ssh_output_batch(ssh_output_stream* stream, ssh_output_chunk* chunks, const char** error_message)
+{
+	int chunk_count = 0;
+
+	if (stream->connection == NULL)
+	{
+		stream->connection = acquire_ssh_connection(stream->host, stream->port, stream->username, stream->password, stream->key_path, error_message);
+
+		if (stream->connection == NULL)
+			return -1;
+
+		libssh2_session_set_blocking(stream->connection->session, 0);
+	}
+
+	ssh_connection* connection = stream->connection;
+	int rc;
+
+	while (chunk_count < SSH_STREAM_BATCH_CHUNKS)
+	{
+		if (stream->channel == NULL)
+		{
+			if (stream->command_index >= stream->command_count)
+			{
+				/* All commands done - the session goes back to the pool in its usual blocking mode */
+				libssh2_session_set_blocking(connection->session, 1);
+				release_ssh_connection(connection, 1);
+				stream->connection = NULL;
+				stream->finished = 1;
+				break;
+			}
+
+			DEBUG_OUTPUT(stdout, "=> Command: %s\n", stream->commands[stream->command_index]);
+
+			while ((stream->channel = libssh2_channel_open_session(connection->session)) == NULL
+				&& libssh2_session_last_errno(connection->session) == LIBSSH2_ERROR_EAGAIN)
+				wait_for_ssh_socket(connection);
+
+			if (stream->channel == NULL && stream->command_index == 0 && connection->reused)
+			{
+				/* Pooled session went stale while idle (e.g. server-side timeout) - reconnect once */
+				release_ssh_connection(connection, 0);
+				connection = stream->connection = open_ssh_connection(stream->host, stream->port, stream->username,
+					stream->password, stream->key_path, error_message);
+
+				if (connection == NULL)
+					return -1;
+
+				libssh2_session_set_blocking(connection->session, 0);
+				continue;
+			}
+
+			if (stream->channel == NULL)
+			{
+				*error_message = "Failed to initiate SSH session";
+				return -1;
+			}
+
+			if (stream->merge_stderr)
+				libssh2_channel_handle_extended_data2(stream->channel, LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
+
+			while ((rc = libssh2_channel_exec(stream->channel, stream->commands[stream->command_index])) == LIBSSH2_ERROR_EAGAIN)
+				wait_for_ssh_socket(connection);
+
+			if (rc != 0)
+			{
+				*error_message = "Error during command execution";
+				return -1;
+			}
+		}
+
+		ssize_t stdout_bytes = LIBSSH2_ERROR_EAGAIN;
+		ssize_t stderr_bytes = LIBSSH2_ERROR_EAGAIN;
+
+		while (chunk_count < SSH_STREAM_BATCH_CHUNKS)
+		{
+			char* chunk_data = malloc(SSH_STREAM_CHUNK_SIZE);
+
+			if ((stdout_bytes = libssh2_channel_read(stream->channel, chunk_data, SSH_STREAM_CHUNK_SIZE)) > 0)
+			{
+				chunks[chunk_count].stream = "stdout";
+			}
+			else if ((stderr_bytes = libssh2_channel_read_stderr(stream->channel, chunk_data, SSH_STREAM_CHUNK_SIZE)) > 0)
+			{
+				chunks[chunk_count].stream = "stderr";
+			}
+			else
+			{
+				free(chunk_data);
+				break;
+			}
+
+			chunks[chunk_count].command_index = stream->command_index;
+			chunks[chunk_count].data = chunk_data;
+			chunks[chunk_count].size = stdout_bytes > 0 ? stdout_bytes : stderr_bytes;
+			chunks[chunk_count].exit_signal = NULL;
+			chunk_count++;
+		}
+
+		if (chunk_count == SSH_STREAM_BATCH_CHUNKS)
+			break;
+
+		if ((stdout_bytes < 0 && stdout_bytes != LIBSSH2_ERROR_EAGAIN)
+			|| (stderr_bytes < 0 && stderr_bytes != LIBSSH2_ERROR_EAGAIN))
+		{
+			*error_message = "Error reading command output";
+			return -1;
+		}
+
+		if (stdout_bytes == 0 && stderr_bytes == 0)
+		{
+			/* Both streams reached EOF - finish the command with its exit status */
+			char* exit_signal = NULL;
+
+			while ((rc = libssh2_channel_close(stream->channel)) == LIBSSH2_ERROR_EAGAIN)
+				wait_for_ssh_socket(connection);
+
+			chunks[chunk_count].command_index = stream->command_index;
+			chunks[chunk_count].stream = "exit";
+			chunks[chunk_count].data = NULL;
+			chunks[chunk_count].size = 0;
+			chunks[chunk_count].exit_code = 0;
+			chunks[chunk_count].exit_signal = NULL;
+
+			if (rc == 0)
+			{
+				chunks[chunk_count].exit_code = libssh2_channel_get_exit_status(stream->channel);
+				libssh2_channel_get_exit_signal(stream->channel, &exit_signal, NULL, NULL, NULL, NULL, NULL);
+
+				if (exit_signal)
+				{
+					chunks[chunk_count].exit_signal = strdup(exit_signal);
+					libssh2_free(connection->session, exit_signal);
+				}
+			}
+			chunk_count++;
+
+			while (libssh2_channel_free(stream->channel) == LIBSSH2_ERROR_EAGAIN)
+				wait_for_ssh_socket(connection);
+
+			stream->channel = NULL;
+			stream->command_index++;
+
+			/* Deliver the command's end right away rather than after the next command starts */
+			break;
+		}
+
+		/* Nothing more right now: hand out what we have, or wait for the server */
+		if (chunk_count > 0)
+			break;
+
+		wait_for_ssh_socket(connection);
+	}
+
+	return chunk_count;
+}
+
+
+static PyObject* ssh_output_stream_next(ssh_output_stream* stream)
+{
+	if (stream->py_pending_chunks && stream->pending_position < PyList_GET_SIZE(stream->py_pending_chunks))
+	{
+		PyObject* py_chunk = PyList_GET_ITEM(stream->py_pending_chunks, stream->pending_position++);
+		Py_INCREF(py_chunk);
+		return py_chunk;
+	}
+
+	Py_CLEAR(stream->py_pending_chunks);
+
+	if (stream->finished)
+		return (PyObject*) NULL;
+
+	if (stream->busy)
+	{
+		PyErr_SetString(PyExc_Exception, "Stream is already being read by another thread");
+		return (PyObject*) NULL;
+	}
+
+	ssh_output_chunk chunks[SSH_STREAM_BATCH_CHUNKS];
+	const char* error_message = NULL;
+
+	stream->busy = 1;
+
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	int chunk_count = read_ssh_output_batch(stream, chunks, &error_message);
+
+	if (chunk_count < 0)
+	{
+		/* The session is in an unknown state after a failure, so it is not pooled again */
+		if (stream->connection)
+			release_ssh_connection(stream->connection, 0);
+
+		stream->connection = NULL;
+		stream->channel = NULL;
+		stream->finished = 1;
+	}
+
+	PyEval_RestoreThread(_save);
+
+	stream->busy = 0;
+
+	if (chunk_count < 0)
+	{
+		PyErr_SetString(PyExc_Exception, error_message);
+		return (PyObject*) NULL;
+	}
+
+	if (chunk_count == 0)
+		return (PyObject*) NULL;
+
+	stream->py_pending_chunks = PyList_New(chunk_count);
+	stream->pending_position = 0;
+
+	for (int i = 0; i < chunk_count; i++)
+	{
+		PyObject* py_payload = NULL;
+
+		if (chunks[i].data)
+		{
+			py_payload = PyString_FromStringAndSize(chunks[i].data, chunks[i].size);
+		}
+		else if (chunks[i].exit_signal)
+		{
+			py_payload = Py_BuildValue("(is)", chunks[i].exit_code, chunks[i].exit_signal);
+		}
+		else
+		{
+			py_payload = Py_BuildValue("(iO)", chunks[i].exit_code, Py_None);
+		}
+
+		PyList_SET_ITEM(stream->py_pending_chunks, i, Py_BuildValue("(nsN)", chunks[i].command_index, chunks[i].stream, py_payload));
+	}
+
+	free_ssh_output_chunks(chunks, chunk_count);
+
+	return ssh_output_stream_next(stream);
+}
+
+
+static void ssh_output_stream_dealloc(ssh_output_stream* stream)
+{
+	/* Abandoned mid-command: the channel is still busy, so the session is dropped rather than pooled */
+	if (stream->connection)
+	{
+		PyThreadState* _save;
+		_save = PyEval_SaveThread();
+
+		release_ssh_connection(stream->connection, 0);
+
+		PyEval_RestoreThread(_save);
+	}
+
+	free(stream->host);
+	free(stream->username);
+	free(stream->password);
+	free(stream->key_path);
+	free(stream->commands);
+	Py_XDECREF(stream->py_command_tuple);
+	Py_XDECREF(stream->py_pending_chunks);
+
+	PyObject_Del(stream);
+}
+
+
+static PyTypeObject ssh_output_stream_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"remote_ssh_manager.OutputStream",          /* tp_name */
+	sizeof(ssh_output_stream),                  /* tp_basicsize */
+	0,                                          /* tp_itemsize */
+	(destructor) ssh_output_stream_dealloc,     /* tp_dealloc */
+	0,                                          /* tp_print */
+	0,                                          /* tp_getattr */
+	0,                                          /* tp_setattr */
+	0,                                          /* tp_compare */
+	0,                                          /* tp_repr */
+	0,                                          /* tp_as_number */
+	0,                                          /* tp_as_sequence */
+	0,                                          /* tp_as_mapping */
+	0,                                          /* tp_hash */
+	0,                                          /* tp_call */
+	0,                                          /* tp_str */
+	0,                                          /* tp_getattro */
+	0,                                          /* tp_setattro */
+	0,                                          /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+	"Iterator over (command index, stream, data) output chunks", /* tp_doc */
+	0,                                          /* tp_traverse */
+	0,                                          /* tp_clear */
+	0,                                          /* tp_richcompare */
+	0,                                          /* tp_weaklistoffset */
+	PyObject_SelfIter,                          /* tp_iter */
+	(iternextfunc) ssh_output_stream_next,      /* tp_iternext */
+};
+
+
+/*
+ * Streaming variant of execute_ssh_instructions: returns an iterator yielding
+ * (command index, "stdout" or "stderr", data) chunks as they are received,
+ * and (command index, "exit", (exit code, exit signal)) when a command ends.
+ * Output is never accumulated, so memory use stays bounded.
+ */
+PyObject* stream_ssh_instructions(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	Py_Initialize();
+
+	static char* arguments[] = {"ssh_host", "ssh_username", "ssh_password", "ssh_key_path", "ssh_commands", "ssh_port", "merge_stderr", NULL};
+
+	char* ssh_host;
+	char* ssh_username;
+	char* ssh_password;
+	char* ssh_key_path;
+	PyObject* py_command_list;
+	int ssh_port = 22;
+	int merge_stderr = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sszzO|ii", arguments, &ssh_host, &ssh_username, &ssh_password, &ssh_key_path, &py_command_list, &ssh_port, &merge_stderr))
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	char** commands;
+	Py_ssize_t command_count;
+	PyObject* py_command_tuple = get_string_sequence(py_command_list, &commands, &command_count);
+
+	if (py_command_tuple == NULL)
+	{
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	ssh_output_stream* stream = PyObject_New(ssh_output_stream, &ssh_output_stream_type);
+
+	if (stream == NULL)
+	{
+		free(commands);
+		Py_DECREF(py_command_tuple);
+		return (PyObject*) NULL;
+	}
+
+	/* The stream outlives the call, so connection parameters are copied */
+	stream->host = strdup(ssh_host);
+	stream->port = ssh_port;
+	stream->username = strdup(ssh_username);
+	stream->password = optional_strdup(ssh_password);
+	stream->key_path = optional_strdup(ssh_key_path);
+	stream->py_command_tuple = py_command_tuple;
+	stream->commands = commands;
+	stream->command_count = command_count;
+	stream->merge_stderr = merge_stderr;
+	stream->connection = NULL;
+	stream->channel = NULL;
+	stream->command_index = 0;
+	stream->finished = 0;
+	stream->busy = 0;
+	stream->py_pending_chunks = NULL;
+	stream->pending_position = 0;
+
+	if (stream->host == NULL || stream->username == NULL
+		|| (ssh_password && stream->password == NULL) || (ssh_key_path && stream->key_path == NULL))
+	{
+		/* The deallocator frees whatever was copied, along with the commands */
+		Py_DECREF(stream);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject*) stream;
+}
+
+
+/* Progress of a Session object towards an authenticated connection */
+typedef enum ssh_session_state
+{
+	SSH_SESSION_CONNECTING,
+	SSH_SESSION_HANDSHAKING,
+	SSH_SESSION_LISTING_AUTHENTICATION,
+	SSH_SESSION_AUTHENTICATING,
+	SSH_SESSION_READY,
+	SSH_SESSION_FAILED,
+	SSH_SESSION_CLOSED
+} ssh_session_state;
+
+
+/*
+ * Non-blocking session for callers running their own poll loop: every
+ * method returns immediately, fileno() and block_directions() tell what to
+ * wait for, and step() advances resolve, connect, handshake and
+ * authentication. Methods run with the GIL held - they never wait on the
+ * network or the resolver. While connecting, fileno() is the newest
+ * connection attempt (-1 while the host is resolved, when block_directions()
+ * is 0), and timeout() is how long the caller may wait before calling step()
+ * again anyway, so that the resolver and older attempts are checked on,
+ * further addresses join the race and the connect timeout is enforced.
+ */
+typedef struct ssh_session_object
+{
+	PyObject_HEAD
+
+	ssh_connection* connection;
+	ssh_session_state state;
+	ssh_authentication_method authentication_method;
+	const char* error_message;
+	ssh_connect_race connect_race;
+
+	/* Command whose channel open is in flight - libssh2 opens one channel at a time per session */
+	void* opening_command;
+	/* Commands holding a channel; the session only goes back to the pool when there are none */
+	int active_commands;
+	/* Set when a command was abandoned midway, leaving the session in an unknown state */
+	int tainted;
+} ssh_session_object;
+
+
+/* Command started by Session.execute(), advanced by its own step() */
+typedef struct ssh_command_object
+{
+	PyObject_HEAD
+
+	ssh_session_object* session;
+	/* Keeps the command string alive */
+	PyObject* py_command;
+	const char* command;
+
+	/* Set until the channel is open */
+	int opening;
+	int finished;
+	ssh_channel_slot slot;
+	ssh_command_result result;
+} ssh_command_object;
+
+
+static PyTypeObject ssh_session_object_type;
+static PyTypeObject ssh_command_object_type;
+
+
+static PyObject* fail_ssh_session_object(ssh_session_object* session, const char* error_message)
+{
+	session->state = SSH_SESSION_FAILED;
+	session->error_message = error_message;
+
+	PyErr_SetString(PyExc_Exception, error_message);
+	return (PyObject*) NULL;
+}
+
+
+/* Hands the connection back to the pool if it is idle and healthy, or closes it */
+static void close_ssh_session_object(ssh_session_object* session)
+{
+	ssh_connection* connection = session->connection;
+
+	if (connection == NULL)
+		return;
+
+	int reusable = session->state == SSH_SESSION_READY && session->active_commands == 0 && !session->tainted;
+
+	abandon_ssh_connect_race(&session->connect_race);
+
+	/* Pooled sessions are used in blocking mode; a discarded one only gets a best-effort disconnect */
+	if (connection->session)
+		libssh2_session_set_blocking(connection->session, reusable);
+
+	session->connection = NULL;
+	session->state = SSH_SESSION_CLOSED;
+
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	release_ssh_connection(connection, reusable);
+
+	PyEval_RestoreThread(_save);
+}
+
+
+static PyObject* ssh_session_object_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
 {
-	Py_Initialize();
-	/* TODO: Not thread safe!!! */
-	libssh2_init(0);
-
-	static char* arguments[] = {"ssh_host", "ssh_username", "ssh_password", "ssh_key_path", "ssh_commands", NULL};
+	static char* arguments[] = {"ssh_host", "ssh_username", "ssh_password", "ssh_key_path", "ssh_port", NULL};
 
 	char* ssh_host;
 	char* ssh_username;
 	char* ssh_password;
 	char* ssh_key_path;
-	PyObject* py_command_list;
-	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sszzO", arguments, &ssh_host, &ssh_username, &ssh_password, &ssh_key_path, &py_command_list))
+	int ssh_port = 22;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sszz|i", arguments, &ssh_host, &ssh_username, &ssh_password, &ssh_key_path, &ssh_port))
 	{
 		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
 		return (PyObject*) NULL;
 	}
 
+	ssh_session_object* session = (ssh_session_object*) type->tp_alloc(type, 0);
+
+	if (session == NULL)
+		return (PyObject*) NULL;
+
+	const char* error_message = NULL;
+	int connected_socket = -1;
+
+	/* Pool lookups may disconnect expired sessions */
 	PyThreadState* _save;
 	_save = PyEval_SaveThread();
 
-	DEBUG_OUTPUT(stdout, "=> Creating socket...\n");
-	int ssh_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
+	ssh_connection* connection = take_pooled_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path);
+
+	if (connection == NULL)
+	{
+		connection = new_ssh_connection(ssh_host, ssh_port, ssh_username, ssh_password, ssh_key_path);
+
+		if (connection == NULL)
+		{
+			error_message = "Out of memory connecting to host";
+		}
+		else
+		{
+			/* Starts resolving the host - or, with the host cached, the first connection attempt */
+			if (start_ssh_connect_race(&session->connect_race, ssh_host, ssh_port, &error_message) == 0)
+				connected_socket = step_ssh_connect_race(&session->connect_race, 0, &error_message);
+
+			if (connected_socket == -1)
+			{
+				abandon_ssh_connect_race(&session->connect_race);
+				close_ssh_connection(connection);
+				connection = NULL;
+			}
+		}
+	}
+
+	PyEval_RestoreThread(_save);
+
+	if (connection == NULL)
+	{
+		Py_DECREF(session);
+		PyErr_SetString(PyExc_Exception, error_message);
+		return (PyObject*) NULL;
+	}
 
-	struct hostent* remote_host = gethostbyname(ssh_host);
+	session->connection = connection;
 
-	if (remote_host == NULL)
+	if (connection->session)
+	{
+		/* Authenticated session from the pool - ready right away */
+		libssh2_session_set_blocking(connection->session, 0);
+		session->state = SSH_SESSION_READY;
+	}
+	else if (connected_socket >= 0)
+	{
+		connection->socket = connected_socket;
+		create_ssh_session(connection, 0);
+		session->state = SSH_SESSION_HANDSHAKING;
+	}
+	else
 	{
-		/* TODO: error */
+		session->state = SSH_SESSION_CONNECTING;
 	}
 
-	struct sockaddr_in socket_address_in;
-	memset(&socket_address_in, 0, sizeof(struct sockaddr_in));
-	socket_address_in.sin_family = AF_INET;
-	socket_address_in.sin_port = htons(22);
-	socket_address_in.sin_addr.s_addr = *((in_addr_t*) remote_host->h_addr_list[0]);
+	return (PyObject*) session;
+}
+
 
-	DEBUG_OUTPUT(stdout, "=> Connecting to server...\n");
+static void ssh_session_object_dealloc(ssh_session_object* session)
+{
+	close_ssh_session_object(session);
+	Py_TYPE(session)->tp_free((PyObject*) session);
+}
 
-	if (connect(ssh_socket, (struct sockaddr*) &socket_address_in, (socklen_t) sizeof(struct sockaddr_in)) != 0)
+
+static PyObject* ssh_session_object_fileno(ssh_session_object* session)
+{
+	if (session->connection == NULL)
 	{
-		PyErr_SetString(PyExc_Exception, "Failed to connect to host");
+		PyErr_SetString(PyExc_Exception, "Session is closed");
 		return (PyObject*) NULL;
 	}
 
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
+	if (session->state == SSH_SESSION_CONNECTING && session->connect_race.socket_count > 0)
+		return PyInt_FromLong(session->connect_race.sockets[session->connect_race.socket_count - 1]);
 
-	DEBUG_OUTPUT(stdout, "=> Initializing libssh2 session...\n");
-	LIBSSH2_SESSION* ssh_session = libssh2_session_init();
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
+	return PyInt_FromLong(session->connection->socket);
+}
 
-	DEBUG_OUTPUT(stdout, "=> Enabling blocking mode...\n");
-	libssh2_session_set_blocking(ssh_session, 1);
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
 
-	DEBUG_OUTPUT(stdout, "=> Setting maximum supported timeout for SSH session...\n");
-	/* We have to disable timeout, as processing in practice may take some time */
-	libssh2_session_set_timeout(ssh_session, 0);
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
+/* BLOCK_INBOUND and/or BLOCK_OUTBOUND: what the socket has to be ready for before the next step() */
+static PyObject* ssh_session_object_block_directions(ssh_session_object* session)
+{
+	if (session->connection == NULL || session->state == SSH_SESSION_FAILED)
+		return PyInt_FromLong(0);
 
-	DEBUG_OUTPUT(stdout, "=> Enabling SSH protocol compression...\n");
-	/* Setting SSH compression to speed up big data transfers */
-	/* _SC - server-client, _CS - client-server */
-	libssh2_session_method_pref(ssh_session, LIBSSH2_METHOD_COMP_SC, "zlib");
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
+	/* A resolving race has no socket yet - only timeout() applies */
+	if (session->state == SSH_SESSION_CONNECTING)
+		return PyInt_FromLong(session->connect_race.socket_count ? LIBSSH2_SESSION_BLOCK_OUTBOUND : 0);
 
-	DEBUG_OUTPUT(stdout, "=> Performing SSH handshake...\n");
-	if (libssh2_session_handshake(ssh_session, ssh_socket))
+	int directions = libssh2_session_block_directions(session->connection->session);
+
+	/* Idle or between steps - the next thing to happen is the server sending something */
+	return PyInt_FromLong(directions ? directions : LIBSSH2_SESSION_BLOCK_INBOUND);
+}
+
+
+/* Seconds the caller may wait for the socket before step() is due anyway, or None when there is no such limit */
+static PyObject* ssh_session_object_timeout(ssh_session_object* session)
+{
+	if (session->connection == NULL || session->state != SSH_SESSION_CONNECTING)
+		Py_RETURN_NONE;
+
+	long long remaining = ssh_connect_race_wake_up_time(&session->connect_race) - monotonic_milliseconds();
+
+	return PyFloat_FromDouble(remaining > 0 ? remaining / 1000.0 : 0.0);
+}
+
+
+/* Advances resolve, connect, handshake and authentication; returns True once the session is ready */
+static PyObject* ssh_session_object_step(ssh_session_object* session)
+{
+	ssh_connection* connection = session->connection;
+	int rc;
+
+	if (session->state == SSH_SESSION_FAILED)
 	{
-		PyErr_SetString(PyExc_Exception, "Failure establishing SSH session");
+		PyErr_SetString(PyExc_Exception, session->error_message);
 		return (PyObject*) NULL;
 	}
-	DEBUG_OUTPUT(stdout, "\tDONE\n");
 
-	DEBUG_OUTPUT(stdout, "=> Getting available authentication methods...\n");
-	const char* user_authentication_methods = libssh2_userauth_list(ssh_session, ssh_username, (unsigned int) strlen(ssh_username));
-	DEBUG_OUTPUT(stdout, "\t%s\n", user_authentication_methods);
+	if (connection == NULL)
+	{
+		PyErr_SetString(PyExc_Exception, "Session is closed");
+		return (PyObject*) NULL;
+	}
 
-	if (strstr(user_authentication_methods, "password") && strlen(ssh_password) != 0)
+	if (session->state == SSH_SESSION_CONNECTING)
 	{
-		DEBUG_OUTPUT(stdout, "=> Authenticating with password...\n");
-		if (libssh2_userauth_password(ssh_session, ssh_username, ssh_password))
+		const char* error_message = NULL;
+		int connected_socket = step_ssh_connect_race(&session->connect_race, 0, &error_message);
+
+		if (connected_socket == -2)
+			Py_RETURN_FALSE;
+
+		if (connected_socket < 0)
 		{
-			PyErr_SetString(PyExc_Exception, "Authentication by password failed");
-			return (PyObject*) NULL;
+			abandon_ssh_connect_race(&session->connect_race);
+			return fail_ssh_session_object(session, error_message);
 		}
-		DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+		connection->socket = connected_socket;
+		create_ssh_session(connection, 0);
+		session->state = SSH_SESSION_HANDSHAKING;
+	}
+
+	if (session->state == SSH_SESSION_HANDSHAKING)
+	{
+		rc = libssh2_session_handshake(connection->session, connection->socket);
+
+		if (rc == LIBSSH2_ERROR_EAGAIN)
+			Py_RETURN_FALSE;
+
+		if (rc != 0)
+			return fail_ssh_session_object(session, "Failure establishing SSH session");
+
+		connection->established = 1;
+		session->state = SSH_SESSION_LISTING_AUTHENTICATION;
 	}
-	else if (strstr(user_authentication_methods, "publickey") && strlen(ssh_key_path) != 0)
+
+	if (session->state == SSH_SESSION_LISTING_AUTHENTICATION)
 	{
-		DEBUG_OUTPUT(stdout, "=> Authenticating with public key...\n");
-		if (libssh2_userauth_publickey_fromfile(ssh_session, ssh_username, NULL, ssh_key_path, ""))
+		const char* user_authentication_methods = libssh2_userauth_list(connection->session, connection->username, (unsigned int) strlen(connection->username));
+
+		if (user_authentication_methods == NULL)
 		{
-			PyErr_SetString(PyExc_Exception, "Authentication by public key failed");
-			return (PyObject*) NULL;
+			if (libssh2_session_last_errno(connection->session) == LIBSSH2_ERROR_EAGAIN)
+				Py_RETURN_FALSE;
+
+			/* The server accepted the "none" method */
+			if (libssh2_userauth_authenticated(connection->session))
+			{
+				session->state = SSH_SESSION_READY;
+				Py_RETURN_TRUE;
+			}
+
+			return fail_ssh_session_object(session, "No supported authentication methods found");
 		}
-		DEBUG_OUTPUT(stdout, "\tDONE\n");
+
+		session->authentication_method = choose_authentication_method(connection, user_authentication_methods);
+
+		if (session->authentication_method == SSH_AUTHENTICATION_UNSUPPORTED)
+			return fail_ssh_session_object(session, "No supported authentication methods found");
+
+		session->state = SSH_SESSION_AUTHENTICATING;
 	}
-	else
+
+	if (session->state == SSH_SESSION_AUTHENTICATING)
+	{
+		rc = authenticate_ssh_connection(connection, session->authentication_method);
+
+		if (rc == LIBSSH2_ERROR_EAGAIN)
+			Py_RETURN_FALSE;
+
+		if (rc != 0)
+			return fail_ssh_session_object(session, authentication_error_message(session->authentication_method));
+
+		session->state = SSH_SESSION_READY;
+	}
+
+	Py_RETURN_TRUE;
+}
+
+
+static PyObject* ssh_session_object_execute(ssh_session_object* session, PyObject* args)
+{
+	PyObject* py_command;
+	if (!PyArg_ParseTuple(args, "S", &py_command))
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	if (session->state != SSH_SESSION_READY)
 	{
-		PyErr_SetString(PyExc_Exception, "No supported authentication methods found");
+		PyErr_SetString(PyExc_Exception, "Session is not ready");
 		return (PyObject*) NULL;
 	}
 
-	PyEval_RestoreThread(_save);
-	Py_ssize_t command_count = PyList_Size(py_command_list);
+	ssh_command_object* command = PyObject_New(ssh_command_object, &ssh_command_object_type);
 
-	PyObject* py_response = PyTuple_New(command_count);
-	_save = PyEval_SaveThread();
+	if (command == NULL)
+		return (PyObject*) NULL;
 
-	for (unsigned char i = 0; i < command_count; i++)
+	Py_INCREF(session);
+	command->session = session;
+	Py_INCREF(py_command);
+	command->py_command = py_command;
+	command->command = PyString_AsString(py_command);
+	command->opening = 1;
+	command->finished = 0;
+	memset(&command->slot, 0, sizeof(ssh_channel_slot));
+	memset(&command->result, 0, sizeof(ssh_command_result));
+
+	return (PyObject*) command;
+}
+
+
+static PyObject* ssh_session_object_close(ssh_session_object* session)
+{
+	close_ssh_session_object(session);
+	Py_RETURN_NONE;
+}
+
+
+static PyMethodDef ssh_session_object_methods[] = {
+	{"fileno", (PyCFunction) ssh_session_object_fileno, METH_NOARGS},
+	{"block_directions", (PyCFunction) ssh_session_object_block_directions, METH_NOARGS},
+	{"timeout", (PyCFunction) ssh_session_object_timeout, METH_NOARGS},
+	{"step", (PyCFunction) ssh_session_object_step, METH_NOARGS},
+	{"execute", (PyCFunction) ssh_session_object_execute, METH_VARARGS},
+	{"close", (PyCFunction) ssh_session_object_close, METH_NOARGS},
+	{NULL, NULL}
+};
+
+
+static void ssh_command_object_dealloc(ssh_command_object* command)
+{
+	ssh_session_object* session = command->session;
+
+	/*
+	 * Abandoned midway: the channel (or libssh2's session-wide channel open)
+	 * is left to libssh2_session_free, and the session is not pooled again.
+	 */
+	if (session->opening_command == command)
 	{
-		PyEval_RestoreThread(_save);
-		PyObject* py_command_response = PyTuple_New(4);
+		session->opening_command = NULL;
+		session->tainted = 1;
+	}
 
-		DEBUG_OUTPUT(stdout, "=> Command: %s\n", PyString_AsString(PyList_GetItem(py_command_list, i)));
-		_save = PyEval_SaveThread();
+	if (!command->finished && command->slot.channel)
+	{
+		session->active_commands--;
+		session->tainted = 1;
+	}
+
+	free(command->result.stdout_output.data);
+	free(command->result.stderr_output.data);
+	free(command->result.exit_signal);
+	Py_DECREF(command->py_command);
+	Py_DECREF(session);
+
+	PyObject_Del(command);
+}
+
+
+static PyObject* ssh_command_object_fileno(ssh_command_object* command)
+{
+	return ssh_session_object_fileno(command->session);
+}
+
+
+static PyObject* ssh_command_object_block_directions(ssh_command_object* command)
+{
+	return ssh_session_object_block_directions(command->session);
+}
+
+
+/*
+ * Advances the command as far as possible without blocking; returns True
+ * once it finished. All commands of a session share its socket, so each of
+ * them should be stepped whenever that socket is ready.
+ */
+static PyObject* ssh_command_object_step(ssh_command_object* command)
+{
+	ssh_session_object* session = command->session;
+
+	if (command->finished)
+		Py_RETURN_TRUE;
+
+	if (session->state != SSH_SESSION_READY)
+	{
+		PyErr_SetString(PyExc_Exception, session->state == SSH_SESSION_CLOSED ? "Session is closed" : "Session is not ready");
+		return (PyObject*) NULL;
+	}
+
+	LIBSSH2_SESSION* ssh_session = session->connection->session;
+
+	if (command->opening)
+	{
+		/* Another command's channel open is in flight - wait for it to complete */
+		if (session->opening_command && session->opening_command != command)
+			Py_RETURN_FALSE;
 
 		LIBSSH2_CHANNEL* ssh_channel = libssh2_channel_open_session(ssh_session);
 
 		if (ssh_channel == NULL)
 		{
+			if (libssh2_session_last_errno(ssh_session) == LIBSSH2_ERROR_EAGAIN)
+			{
+				session->opening_command = command;
+				Py_RETURN_FALSE;
+			}
+
+			session->opening_command = NULL;
 			PyErr_SetString(PyExc_Exception, "Failed to initiate SSH session");
 			return (PyObject*) NULL;
 		}
 
-		libssh2_channel_set_blocking(ssh_channel, 1);
+		session->opening_command = NULL;
+		session->active_commands++;
 
-		DEBUG_OUTPUT(stdout, "=> Executing...\n");
+		command->opening = 0;
+		command->slot.channel = ssh_channel;
+		command->slot.state = SSH_CHANNEL_EXECUTING;
+	}
 
-		PyEval_RestoreThread(_save);
-		const char* command = PyString_AsString(PyList_GetItem(py_command_list, i));
-		_save = PyEval_SaveThread();
-		int command_response = libssh2_channel_exec(ssh_channel, command);
-		if (command_response != 0)
-		{
-			/* TODO: continue? */
-			PyErr_SetString(PyExc_Exception, "Error during command execution");
-			return (PyObject*) NULL;
-		}
-		DEBUG_OUTPUT(stdout, "\tDONE\n");
+	int progress = 0;
+	const char* error_message = NULL;
+	int rc = step_ssh_channel(ssh_session, &command->slot, command->command, &command->result, &progress, &error_message);
 
-		long response_bytes = 0;
+	if (rc < 0)
+	{
+		PyErr_SetString(PyExc_Exception, error_message);
+		return (PyObject*) NULL;
+	}
 
-		char response_buffer[1024];
+	if (rc == 0)
+		Py_RETURN_FALSE;
 
-		DEBUG_OUTPUT(stdout, "=> Reading stdout...\n");
-		char* response_string_stdout = malloc(1024 + 1);
-		memset(response_string_stdout, 0, 1024 + 1);
-		do
-		{
-			memset(response_buffer, 0, 1024 * sizeof(char));
-			response_bytes = libssh2_channel_read(ssh_channel, response_buffer, 1024);
-			form_response_string(&response_string_stdout, response_buffer, response_bytes);
-		}
-		while (response_bytes > 0);
-		DEBUG_OUTPUT(stdout, "\tOUTPUT: %s\n", response_string_stdout);
+	command->finished = 1;
+	session->active_commands--;
 
-		PyEval_RestoreThread(_save);
-		PyObject* py_string_stdout = PyString_FromString(response_string_stdout);
-		PyTuple_SetItem(py_command_response, 0, py_string_stdout);
-		_save = PyEval_SaveThread();
+	Py_RETURN_TRUE;
+}
 
-		free(response_string_stdout);
 
-		DEBUG_OUTPUT(stdout, "=> Reading stderr...\n");
-		char* response_string_stderr = malloc(1024 + 1);
-		memset(response_string_stderr, 0, 1024 + 1);
-		do
-		{
-			memset(response_buffer, 0, 1024);
-			response_bytes = libssh2_channel_read_stderr(ssh_channel, response_buffer, 1024);
-			form_response_string(&response_string_stderr, response_buffer, response_bytes);
-		}
-		while (response_bytes > 0);
-		DEBUG_OUTPUT(stdout, "\tOUTPUT: %s\n", response_string_stderr);
+/* (stdout, stderr, exit code, exit signal) of a finished command */
+static PyObject* ssh_command_object_result(ssh_command_object* command)
+{
+	if (!command->finished)
+	{
+		PyErr_SetString(PyExc_Exception, "Command has not finished");
+		return (PyObject*) NULL;
+	}
 
-		PyEval_RestoreThread(_save);
-		PyObject* py_string_stderr = PyString_FromString(response_string_stderr);
-		PyTuple_SetItem(py_command_response, 1, py_string_stderr);
-		_save = PyEval_SaveThread();
+	PyObject* py_response = build_command_responses(&command->result, 1);
+	PyObject* py_command_response = PyTuple_GetItem(py_response, 0);
 
-		free(response_string_stderr);
+	Py_INCREF(py_command_response);
+	Py_DECREF(py_response);
 
-		char* exit_signal = NULL;
-		int process_exit_code = 0;
+	return py_command_response;
+}
 
-		if (libssh2_channel_close(ssh_channel) == 0)
-		{
-			process_exit_code = libssh2_channel_get_exit_status(ssh_channel);
-			libssh2_channel_get_exit_signal(ssh_channel, &exit_signal, NULL, NULL, NULL, NULL, NULL);
-		}
 
-		PyEval_RestoreThread(_save);
+static PyMethodDef ssh_command_object_methods[] = {
+	{"fileno", (PyCFunction) ssh_command_object_fileno, METH_NOARGS},
+	{"block_directions", (PyCFunction) ssh_command_object_block_directions, METH_NOARGS},
+	{"step", (PyCFunction) ssh_command_object_step, METH_NOARGS},
+	{"result", (PyCFunction) ssh_command_object_result, METH_NOARGS},
+	{NULL, NULL}
+};
 
-		PyObject* py_int_exit_code = PyInt_FromLong(process_exit_code);
-		PyTuple_SetItem(py_command_response, 2, py_int_exit_code);
 
-		PyObject* py_string_exit_signal = NULL;
-		if (exit_signal)
-			py_string_exit_signal = PyString_FromString(exit_signal);
-		else
-			py_string_exit_signal = Py_None;
-		PyTuple_SetItem(py_command_response, 3, py_string_exit_signal);
+static PyTypeObject ssh_session_object_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"remote_ssh_manager.Session",               /* tp_name */
+	sizeof(ssh_session_object),                 /* tp_basicsize */
+	0,                                          /* tp_itemsize */
+	(destructor) ssh_session_object_dealloc,    /* tp_dealloc */
+	0,                                          /* tp_print */
+	0,                                          /* tp_getattr */
+	0,                                          /* tp_setattr */
+	0,                                          /* tp_compare */
+	0,                                          /* tp_repr */
+	0,                                          /* tp_as_number */
+	0,                                          /* tp_as_sequence */
+	0,                                          /* tp_as_mapping */
+	0,                                          /* tp_hash */
+	0,                                          /* tp_call */
+	0,                                          /* tp_str */
+	0,                                          /* tp_getattro */
+	0,                                          /* tp_setattro */
+	0,                                          /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+	"Non-blocking SSH session driven by step()", /* tp_doc */
+	0,                                          /* tp_traverse */
+	0,                                          /* tp_clear */
+	0,                                          /* tp_richcompare */
+	0,                                          /* tp_weaklistoffset */
+	0,                                          /* tp_iter */
+	0,                                          /* tp_iternext */
+	ssh_session_object_methods,                 /* tp_methods */
+	0,                                          /* tp_members */
+	0,                                          /* tp_getset */
+	0,                                          /* tp_base */
+	0,                                          /* tp_dict */
+	0,                                          /* tp_descr_get */
+	0,                                          /* tp_descr_set */
+	0,                                          /* tp_dictoffset */
+	0,                                          /* tp_init */
+	0,                                          /* tp_alloc */
+	ssh_session_object_new,                     /* tp_new */
+};
 
-		_save = PyEval_SaveThread();
 
-		libssh2_channel_free(ssh_channel);
+static PyTypeObject ssh_command_object_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"remote_ssh_manager.Command",               /* tp_name */
+	sizeof(ssh_command_object),                 /* tp_basicsize */
+	0,                                          /* tp_itemsize */
+	(destructor) ssh_command_object_dealloc,    /* tp_dealloc */
+	0,                                          /* tp_print */
+	0,                                          /* tp_getattr */
+	0,                                          /* tp_setattr */
+	0,                                          /* tp_compare */
+	0,                                          /* tp_repr */
+	0,                                          /* tp_as_number */
+	0,                                          /* tp_as_sequence */
+	0,                                          /* tp_as_mapping */
+	0,                                          /* tp_hash */
+	0,                                          /* tp_call */
+	0,                                          /* tp_str */
+	0,                                          /* tp_getattro */
+	0,                                          /* tp_setattro */
+	0,                                          /* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+	"Command running on a Session, driven by step()", /* tp_doc */
+	0,                                          /* tp_traverse */
+	0,                                          /* tp_clear */
+	0,                                          /* tp_richcompare */
+	0,                                          /* tp_weaklistoffset */
+	0,                                          /* tp_iter */
+	0,                                          /* tp_iternext */
+	ssh_command_object_methods,                 /* tp_methods */
+};
 
-		PyEval_RestoreThread(_save);
-		PyTuple_SetItem(py_response, i, py_command_response);
-		_save = PyEval_SaveThread();
+
+PyObject* configure_session_pool(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static char* arguments[] = {"max_size", "idle_timeout", NULL};
+
+	long max_size = ssh_session_pool_max_size;
+	long idle_timeout = ssh_session_pool_idle_timeout;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ll", arguments, &max_size, &idle_timeout) || max_size < 0 || idle_timeout < 0)
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	ssh_connection* evicted_connections = NULL;
+
+	pthread_mutex_lock(&ssh_session_pool_lock);
+
+	ssh_session_pool_max_size = max_size;
+	ssh_session_pool_idle_timeout = idle_timeout;
+
+	/* Shrinking the pool drops the least recently used idle sessions */
+	ssh_connection** link = &ssh_session_pool;
+	for (long kept = 0; *link && kept < ssh_session_pool_max_size; kept++)
+		link = &(*link)->next;
+
+	evicted_connections = *link;
+	*link = NULL;
+	for (ssh_connection* connection = evicted_connections; connection; connection = connection->next)
+		ssh_session_pool_size--;
+
+	pthread_mutex_unlock(&ssh_session_pool_lock);
+
+	while (evicted_connections)
+	{
+		ssh_connection* next_connection = evicted_connections->next;
+		close_ssh_connection(evicted_connections);
+		evicted_connections = next_connection;
 	}
 
-	/* Does not work on Mac and BSD */
-	//freehostent(remote_host);
+	/* Apply a shortened idle timeout right away */
+	drain_ssh_session_pool(1);
 
 	PyEval_RestoreThread(_save);
-	return py_response;
+
+	Py_RETURN_NONE;
 }
 
+
+/*
+ * Settings for connections opened from now on: connect timeout (covering
+ * name resolution) and DNS cache TTL in seconds, plus the socket profile.
+ * Sizes and timeouts of 0 and an empty congestion_control keep the kernel
+ * defaults; arguments left out keep their current value.
+ */
+PyObject* configure_connections(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static char* arguments[] = {"connect_timeout", "dns_cache_ttl", "tcp_nodelay", "send_buffer_size", "receive_buffer_size",
+		"keepalive_idle", "keepalive_interval", "keepalive_count", "user_timeout", "congestion_control", NULL};
+
+	pthread_mutex_lock(&ssh_dns_cache_lock);
+	long connect_timeout = ssh_connect_timeout;
+	long dns_cache_ttl = ssh_dns_cache_ttl;
+	ssh_socket_profile profile = ssh_default_socket_profile;
+	pthread_mutex_unlock(&ssh_dns_cache_lock);
+
+	char* congestion_control = profile.congestion_control;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|lliiiiiiis", arguments, &connect_timeout, &dns_cache_ttl,
+			&profile.no_delay, &profile.send_buffer_size, &profile.receive_buffer_size, &profile.keepalive_idle,
+			&profile.keepalive_interval, &profile.keepalive_count, &profile.user_timeout, &congestion_control)
+		|| connect_timeout < 1 || dns_cache_ttl < 0 || profile.send_buffer_size < 0 || profile.receive_buffer_size < 0
+		|| profile.keepalive_idle < 0 || profile.keepalive_interval < 0 || profile.keepalive_count < 0 || profile.user_timeout < 0
+		|| strlen(congestion_control) >= sizeof(profile.congestion_control))
+	{
+		PyErr_SetString(PyExc_Exception, "Invalid argument(s) provided");
+		return (PyObject*) NULL;
+	}
+
+	if (congestion_control != profile.congestion_control)
+		strcpy(profile.congestion_control, congestion_control);
+
+	pthread_mutex_lock(&ssh_dns_cache_lock);
+
+	ssh_connect_timeout = connect_timeout;
+	ssh_dns_cache_ttl = dns_cache_ttl;
+	ssh_default_socket_profile = profile;
+
+	pthread_mutex_unlock(&ssh_dns_cache_lock);
+
+	Py_RETURN_NONE;
+}
+
+
+PyObject* clear_session_pool(PyObject* self)
+{
+	PyThreadState* _save;
+	_save = PyEval_SaveThread();
+
+	drain_ssh_session_pool(0);
+
+	PyEval_RestoreThread(_save);
+
+	Py_RETURN_NONE;
+}
+
+
 static PyMethodDef remote_ssh_manager_methods[] = {
 	/* The cast of the function is necessary since PyCFunction values
 	 * only take two PyObject* parameters, and our function with key-value
@@ -304,11 +3488,35 @@ static PyMethodDef remote_ssh_manager_methods[] = {
 	 */
 	{"execute_ssh_instructions", (PyCFunction) execute_ssh_instructions, METH_VARARGS|METH_KEYWORDS},
 	{"get_build_information", (PyCFunction) get_build_information, METH_NOARGS},
+	{"execute_on_hosts", (PyCFunction) execute_on_hosts, METH_VARARGS|METH_KEYWORDS},
+	{"stream_ssh_instructions", (PyCFunction) stream_ssh_instructions, METH_VARARGS|METH_KEYWORDS},
+	{"configure_session_pool", (PyCFunction) configure_session_pool, METH_VARARGS|METH_KEYWORDS},
+	{"clear_session_pool", (PyCFunction) clear_session_pool, METH_NOARGS},
+	{"configure_connections", (PyCFunction) configure_connections, METH_VARARGS|METH_KEYWORDS},
 	{NULL,  NULL}
 };
 
 void initremote_ssh_manager()
 {
+	/* Sessions are shared between calls (and threads), so libssh2 is initialized once per process */
+	libssh2_init(0);
+
+	if (PyType_Ready(&ssh_output_stream_type) < 0
+		|| PyType_Ready(&ssh_session_object_type) < 0
+		|| PyType_Ready(&ssh_command_object_type) < 0)
+		return;
+
 	/* Create the module and add the functions */
-	Py_InitModule("remote_ssh_manager", remote_ssh_manager_methods);
+	PyObject* module = Py_InitModule("remote_ssh_manager", remote_ssh_manager_methods);
+
+	if (module == NULL)
+		return;
+
+	Py_INCREF(&ssh_session_object_type);
+	PyModule_AddObject(module, "Session", (PyObject*) &ssh_session_object_type);
+	Py_INCREF(&ssh_command_object_type);
+	PyModule_AddObject(module, "Command", (PyObject*) &ssh_command_object_type);
+
+	PyModule_AddIntConstant(module, "BLOCK_INBOUND", LIBSSH2_SESSION_BLOCK_INBOUND);
+	PyModule_AddIntConstant(module, "BLOCK_OUTBOUND", LIBSSH2_SESSION_BLOCK_OUTBOUND);
 }